@@ -37,10 +37,14 @@ class Learner {
   virtual KWArgs Init(const KWArgs& kwargs);
   /**
    * \brief train
+   *
+   * in the distributed mode, the scheduler stops the servers and workers once
+   * finished
    */
   void Run() {
     if (!IsDistributed() || !strcmp(getenv("DMLC_ROLE"), "scheduler")) {
       RunScheduler();
+      if (IsDistributed()) Stop();
     } else {
       tracker_->Wait();
     }
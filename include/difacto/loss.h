@@ -9,7 +9,6 @@
 #include <vector>
 #include "./base.h"
 #include "dmlc/data.h"
-#include "dmlc/omp.h"
 #include "./sarray.h"
 namespace difacto {
 /**
@@ -55,15 +54,22 @@ class Loss {
    * @return the objective value
    */
   virtual real_t Evaluate(dmlc::real_t const* label,
-                          const SArray<real_t>& pred) {
-    real_t objv = 0;
-#pragma omp parallel for reduction(+:objv) num_threads(nthreads_)
-    for (size_t i = 0; i < pred.size(); ++i) {
-      real_t y = label[i] > 0 ? 1 : -1;
-      objv += log(1 + exp(- y * pred[i]));
-    }
-    return objv;
-  }
+                          const SArray<real_t>& pred);
+
+  /**
+   * \brief evaluate the directional derivative of the loss
+   *
+   * return <∂ℓ/∂pred, dpred> of the logit loss in default
+   *
+   * @param label label
+   * @param pred prediction
+   * @param dpred the direction of the prediction
+   *
+   * @return the directional derivative
+   */
+  virtual real_t EvaluateDirection(dmlc::real_t const* label,
+                                   const SArray<real_t>& pred,
+                                   const SArray<real_t>& dpred);
 
   /**
    * \brief calculate gradient given the data and model weights. often known as "backward"
@@ -15,6 +15,11 @@ namespace difacto {
 
 /**
  * \brief the store allows workers to get and set and model
+ *
+ * the values of a list of keys are stored consecutively. as in \ref Updater,
+ * the optional offsets give the position of the values of each key, namely
+ * the values of the i-th key are in [offsets[i], offsets[i+1]). empty offsets
+ * mean every key has the same number of values.
  */
 class Store {
  public:
@@ -45,7 +50,7 @@ class Store {
    * @param sync_type
    * @param fea_ids
    * @param vals
-   * @param lens
+   * @param offsets the n+1 offsets of vals, could be empty
    * @param on_complete
    *
    * @return
@@ -53,15 +58,33 @@ class Store {
   virtual int Push(const SArray<feaid_t>& fea_ids,
                    int val_type,
                    const SArray<real_t>& vals,
-                   const SArray<int>& lens,
+                   const SArray<int>& offsets,
                    const std::function<void()>& on_complete = nullptr) = 0;
+  /**
+   * \brief zero-copy push, the ownership of the data is transferred to the store
+   *
+   * the same as \ref Push, but the store may keep vals and offsets and modify
+   * them in place rather than copying them first. so the caller should not
+   * read or write them after calling ZPush, and the copies it holds should
+   * only be released.
+   *
+   * the default implementation falls back to Push
+   */
+  virtual int ZPush(const SArray<feaid_t>& fea_ids,
+                    int val_type,
+                    const SArray<real_t>& vals,
+                    const SArray<int>& offsets,
+                    const std::function<void()>& on_complete = nullptr) {
+    return Push(fea_ids, val_type, vals, offsets, on_complete);
+  }
   /**
    * \brief pull the values for a list of feature ids
    *
    * @param sync_type
    * @param fea_ids
    * @param vals
-   * @param lens
+   * @param offsets the n+1 offsets of vals, could be nullptr. it may be
+   * non-empty if every key has the same number of values
    * @param on_complete
    *
    * @return
@@ -69,7 +92,7 @@ class Store {
   virtual int Pull(const SArray<feaid_t>& fea_ids,
                    int val_type,
                    SArray<real_t>* vals,
-                   SArray<int>* lens,
+                   SArray<int>* offsets,
                    const std::function<void()>& on_complete = nullptr) = 0;
 
   /**
@@ -66,6 +66,20 @@ class Tracker {
    */
   virtual void Issue(const std::vector<std::pair<int, std::string>>& jobs) = 0;
 
+  /**
+   * \brief return the IDs of the executors in a node group
+   *
+   * a job issued to a group is run by only one node of it. to run a job on
+   * every node, issue one job for each of the returned IDs. the default
+   * returns the group itself, which means all nodes of the group share a single
+   * executor, such as \ref LocalTracker.
+   *
+   * \param node_group the node group id, e.g. kWorkerGroup + kServerGroup
+   */
+  virtual std::vector<int> NodeIDs(int node_group) {
+    return {node_group};
+  }
+
   /**
    * \brief return the number of unfinished job
    */
@@ -2,11 +2,15 @@
  *  Copyright (c) 2015 by Contributors
  */
 #include "./bcd_learner.h"
+#include <string.h>
 #include <algorithm>
 #include <cmath>
+#include <thread>
 #include "difacto/node_id.h"
+#include "common/thread_pool.h"
 #include "reader/reader.h"
 #include "loss/bin_class_metric.h"
+#include "loss/fm_loss_delta.h"
 #include "./bcd_updater.h"
 namespace difacto {
 
@@ -16,10 +20,33 @@ KWArgs BCDLearner::Init(const KWArgs& kwargs) {
   auto remain = Learner::Init(kwargs);
   // init param
   remain = param_.InitAllowUnknown(kwargs);
+  nthreads_ = param_.num_threads <= 0 ?
+              std::thread::hardware_concurrency() : param_.num_threads;
+  blk_nthreads_ = nthreads_ > 20 ? 4 : 2;
+  if (param_.numa) {
+    ThreadPool::Get()->BindNodes();
+    num_nodes_ = ThreadPool::Get()->num_nodes();
+    LOG(INFO) << "use " << num_nodes_ << " NUMA nodes";
+  }
   // init updater
-  std::shared_ptr<Updater> updater(new BCDUpdater());
+  auto updater = std::make_shared<BCDUpdater>();
   remain = updater->Init(remain);
-  // init model store
+  V_dim_ = updater->param().V_dim;
+  l1_ = updater->param().l1;
+  // init model store. a push interleaves the gradients with the diagonal
+  // hessians, which the lossy codecs would corrupt
+  CHECK(GetKWArg(remain, "push_codec").empty())
+      << "push_codec is not supported by bcd, which pushes second-order terms";
+  // the replicas of the hot keys lag behind, which breaks the synchronous
+  // updates
+  CHECK_EQ(std::stoi(GetKWArg(remain, "num_hot_keys", "0")), 0)
+      << "num_hot_keys is only supported by sgd";
+  // the same key lists are pushed and pulled in every epoch. a step needs the
+  // gradient of all workers
+  if (IsDistributed()) {
+    remain.insert(remain.begin(), std::make_pair("key_cache_size", "1024"));
+    remain.push_back(std::make_pair("sync_push", "1"));
+  }
   model_store_ = Store::Create();
   model_store_->SetUpdater(updater);
   remain = model_store_->Init(remain);
@@ -27,7 +54,12 @@ KWArgs BCDLearner::Init(const KWArgs& kwargs) {
   tile_store_ = new TileStore();
   remain = tile_store_->Init(remain);
   // init loss
-  loss_ = Loss::Create("logit_delta", DEFAULT_NTHREADS);
+  if (V_dim_ > 0) {
+    remain.push_back(std::make_pair("V_dim", std::to_string(V_dim_)));
+    loss_ = Loss::Create("fm_delta", blk_nthreads_);
+  } else {
+    loss_ = Loss::Create("logit_delta", blk_nthreads_);
+  }
   remain = loss_->Init(remain);
   return remain;
 }
@@ -39,10 +71,14 @@ void BCDLearner::Process(const std::string& args, std::string* rets) {
   std::vector<real_t> job_rets;
   if (type == Job::kPrepareData) {
     PrepareData(&job_rets);
+  } else if (type == Job::kCountNnz) {
+    CountNnz(job_args.feablk_ranges, &job_rets);
   } else if (type == Job::kBuildFeatureMap) {
     BuildFeatureMap(job_args.feablk_ranges);
-  } else if (type == Job::kIterateData) {
-    IterateData(job_args.feablks, &job_rets);
+  } else if (type == Job::kIterateData && IsWorker()) {
+    bool full_pass = param_.full_pass_freq == 0 ||
+                     job_args.epoch % param_.full_pass_freq == 0;
+    IterateData(job_args.feablks, full_pass, &job_rets);
   }
   dmlc::Stream* ss = new dmlc::MemoryStringStream(rets);
   ss->Write(job_rets);
@@ -57,17 +93,37 @@ void BCDLearner::RunScheduler() {
   IssueJobAndWait(NodeID::kWorkerGroup, load, &load_rets);
   LOG(INFO) << "loaded " << load_rets.back() << " examples";
 
-  // partition feature group and build feature map
-  Job build; build.type = Job::kBuildFeatureMap;
+  // partition each feature group into fine-grained bins, and count the nnz of
+  // each bin
+  const int kBinsPerBlock = 100;
+  Job count; count.type = Job::kCountNnz;
   std::vector<std::pair<int, int>> feagrp;
+  std::vector<size_t> bin_os = {0};
   int nfeablk = load_rets.size()-2;
   for (int i = 0; i < nfeablk; ++i) {
     int nblk = static_cast<int>(std::ceil(
         load_rets[i] / load_rets[nfeablk] * param_.block_ratio));
-    if (nblk > 0) feagrp.push_back(std::make_pair(i, nblk));
+    if (nblk == 0) continue;
+    feagrp.push_back(std::make_pair(i, nblk));
+    std::vector<Range> bins;
+    bcd::PartitionFeature(param_.num_feature_group_bits,
+                          {std::make_pair(i, nblk * kBinsPerBlock)}, &bins);
+    count.feablk_ranges.insert(count.feablk_ranges.end(), bins.begin(), bins.end());
+    bin_os.push_back(count.feablk_ranges.size());
+  }
+  std::vector<real_t> nnz;
+  IssueJobAndWait(NodeID::kWorkerGroup, count, &nnz);
+  CHECK_EQ(nnz.size(), count.feablk_ranges.size());
+
+  // merge bins into feature blocks with equal nnz, and build feature map
+  Job build; build.type = Job::kBuildFeatureMap;
+  for (size_t i = 0; i < feagrp.size(); ++i) {
+    std::vector<Range> bins(count.feablk_ranges.begin() + bin_os[i],
+                            count.feablk_ranges.begin() + bin_os[i+1]);
+    bcd::MergeBins(bins, nnz.data() + bin_os[i], feagrp[i].second,
+                   &build.feablk_ranges);
   }
-  bcd::PartitionFeature(
-      param_.num_feature_group_bits, feagrp, &build.feablk_ranges);
+  bcd::SortFeatureBlocks(&build.feablk_ranges);
   LOG(INFO) << "partitioning feature into " << build.feablk_ranges.size() << " blocks";
   IssueJobAndWait(NodeID::kWorkerGroup, build);
 
@@ -78,6 +134,7 @@ void BCDLearner::RunScheduler() {
   for (; epoch_ < param_.max_num_epochs; ++epoch_) {
     std::random_shuffle(feablks.begin(), feablks.end());
     Job iter; iter.type = Job::kIterateData;
+    iter.epoch = epoch_;
     iter.feablks = feablks;
     std::vector<real_t> progress;
     IssueJobAndWait(NodeID::kWorkerGroup + NodeID::kServerGroup, iter, &progress);
@@ -88,7 +145,8 @@ void BCDLearner::RunScheduler() {
     LL << "epoch: " << epoch_
        << ", objv: " << progress[1] / cnt
        << ", auc: " << progress[2] / cnt
-       << ", acc: " << progress[3] / cnt;
+       << ", acc: " << progress[3] / cnt
+       << ", #pushed: " << progress[4];
   }
 }
 
@@ -99,18 +157,21 @@ void BCDLearner::PrepareData(std::vector<real_t>* fea_stats) {
                model_store_->Rank(), model_store_->NumWorkers(),
                param_.data_chunk_size);
   bcd::FeaGroupStats stats(param_.num_feature_group_bits);
-  tile_builder_ = new TileBuilder(tile_store_, DEFAULT_NTHREADS, true);
-  SArray<real_t> feacnts;
+  tile_builder_ = new TileBuilder(tile_store_, nthreads_, true);
+  auto home = [this](int i) { return HomeNode(i); };
+  tile_builder_->set_home(home);
+  std::vector<size_t> nrows;
   while (train.Next()) {
     auto rowblk = train.Value();
     stats.Add(rowblk);
-    tile_builder_->Add(rowblk, &feaids_, &feacnts);
-    pred_.push_back(SArray<real_t>(rowblk.size));
+    tile_builder_->Add(rowblk, &feaids_, &feacnts_);
+    nrows.push_back(rowblk.size);
     ++ntrain_blks_;
   }
+  tile_builder_->Wait();
   // push the feature ids and feature counts to the servers
   int t = model_store_->Push(
-      feaids_, Store::kFeaCount, feacnts, SArray<int>());
+      feaids_, Store::kFeaCount, feacnts_, SArray<int>());
   // report statistics to the scheduler
   stats.Get(fea_stats);
 
@@ -122,17 +183,34 @@ void BCDLearner::PrepareData(std::vector<real_t>* fea_stats) {
     while (val.Next()) {
       auto rowblk = val.Value();
       tile_builder_->Add(rowblk);
-      pred_.push_back(SArray<real_t>(rowblk.size));
+      nrows.push_back(rowblk.size);
       ++nval_blks_;
     }
   }
+  tile_builder_->Wait();
+
+  // allocate the predictions on the home nodes, so they are first touched
+  // there
+  int nblks = nrows.size();
+  pred_.resize(nblks);
+  XV_.resize(nblks);
+  auto alloc = [this, &nrows](int i, int tid) {
+    pred_[i] = SArray<real_t>(nrows[i]);
+    XV_[i] = SArray<real_t>(nrows[i] * V_dim_);
+  };
+  ParallelFor(nblks, nthreads_, alloc, home);
+
+  // one lock per row block, the predictions may be updated by several
+  // feature blocks in parallel if tau > 0
+  std::vector<std::mutex> pred_mu(pred_.size());
+  pred_mu_.swap(pred_mu);
 
   // wait the previous push finished
   model_store_->Wait(t);
 }
 
-void BCDLearner::BuildFeatureMap(const std::vector<Range>& feablk_ranges) {
-  CHECK_NOTNULL(tile_builder_);
+void BCDLearner::CountNnz(const std::vector<Range>& bins,
+                          std::vector<real_t>* nnz) {
   // pull the aggregated feature counts from the servers
   SArray<real_t> feacnt;
   int t = model_store_->Pull(
@@ -141,15 +219,29 @@ void BCDLearner::BuildFeatureMap(const std::vector<Range>& feablk_ranges) {
 
   // remove the filtered features
   SArray<feaid_t> filtered;
+  SArray<real_t> local_cnt;
   size_t n = feaids_.size();
   CHECK_EQ(feacnt.size(), n);
-  int filter = std::static_pointer_cast<BCDUpdater>(
-      model_store_->updater())->param().tail_feature_filter;
+  CHECK_EQ(feacnts_.size(), n);
+  int filter = GetUpdater()->param().tail_feature_filter;
   for (size_t i = 0; i < n; ++i) {
     if (feacnt[i] > filter) {
       filtered.push_back(feaids_[i]);
+      local_cnt.push_back(feacnts_[i]);
     }
   }
+  feaids_ = filtered;
+  feacnts_.clear();
+
+  // the nnz of a bin is the sum of the local counts of features in it. the
+  // results of all workers are then summed by the scheduler
+  bcd::CountBins(feaids_, local_cnt, bins, nnz);
+}
+
+void BCDLearner::BuildFeatureMap(const std::vector<Range>& feablk_ranges) {
+  CHECK_NOTNULL(tile_builder_);
+  // the tail features are already removed by CountNnz
+  SArray<feaid_t> filtered = feaids_;
   feaids_.clear();
 
   // build colmap for each rowblk
@@ -169,6 +261,7 @@ void BCDLearner::BuildFeatureMap(const std::vector<Range>& feablk_ranges) {
 }
 
 void BCDLearner::IterateData(const std::vector<int>& feablks,
+                             bool full_pass,
                              std::vector<real_t>* progress) {
   CHECK(feablks.size());
   // hint for data prefetch
@@ -178,61 +271,219 @@ void BCDLearner::IterateData(const std::vector<int>& feablks,
     }
   }
 
-  size_t nfeablk = feablks.size();
-  int tau = 0;
+  // at most tau+1 blocks are in flight, namely block i starts before waiting
+  // on block i-tau, see BCDLearnerParam::tau
+  int nfeablk = feablks.size();
+  int tau = param_.tau;
   bcd::BlockTracker feablk_tracker(nfeablk);
-  for (size_t i = 0; i < nfeablk; ++i) {
+  size_t num_pushed = 0;
+  for (int i = 0; i < nfeablk; ++i) {
     auto on_complete = [&feablk_tracker, i]() {
       feablk_tracker.Finish(i);
     };
-    int f = feablks[i];
-    IterateFeablk(f, on_complete, (i == nfeablk -1 ? progress : nullptr));
-
+    num_pushed += IterateFeablk(feablks[i], full_pass, on_complete);
     if (i >= tau) feablk_tracker.Wait(i - tau);
   }
-  for (int i = nfeablk - tau; i < nfeablk ; ++i) feablk_tracker.Wait(i);
+  for (int i = std::max(nfeablk - tau, 0); i < nfeablk; ++i) {
+    feablk_tracker.Wait(i);
+  }
+
+  // evaluate the progress once all blocks are finished
+  if (!progress) return;
+  for (int i = 0; i < ntrain_blks_ + nval_blks_; ++i) {
+    Evaluate(i, progress);
+  }
+  progress->resize(5);
+  (*progress)[4] += num_pushed;
 }
 
-void BCDLearner::IterateFeablk(int blk_id,
-                               const std::function<void()>& on_complete,
-                               std::vector<real_t>* progress) {
-  // 1. calculate gradient
+size_t BCDLearner::IterateFeablk(int blk_id, bool full_pass,
+                                 const std::function<void()>& on_complete) {
   auto& feablk = feablks_[blk_id];
-  SArray<int> grad_offset = feablk.model_offset;
-  for (int& o : grad_offset) o += o;  // it's ok to overwrite model_offset_[blk_id]
-  SArray<real_t> grad(
+  bool shrinking = param_.full_pass_freq > 0;
+  if (shrinking) {
+    if (full_pass) {
+      // reactivate all features
+      feablk.active.assign(feablk.feaids.size(), true);
+      feablk.num_active = feablk.feaids.size();
+      feablk.active_feaids = SArray<feaid_t>();
+    } else if (feablk.num_active == 0) {
+      // nothing to do. all workers have the same active set, so they all skip
+      // this block
+      on_complete();
+      return 0;
+    }
+  }
+
+  // 1. calculate gradient
+  // each model entry has a (gradient, hessian) pair
+  SArray<int> grad_offset; grad_offset.CopyFrom(feablk.model_offset);
+  for (int& o : grad_offset) o += o;
+  SArray<real_t> grad = grad_pool_.Get(
       grad_offset.empty() ? feablk.feaids.size() * 2 : grad_offset.back());
-  for (int i = 0; i < ntrain_blks_; ++i) {
-    CalcGrad(i, blk_id, grad_offset, &grad);
+  {
+    // each thread accumulates into its own buffer, merge them at the end
+    int pool_size = std::max(nthreads_ / blk_nthreads_, 1);
+    std::vector<SArray<real_t>> grads(pool_size);
+    grads[0] = grad;
+    for (int p = 1; p < pool_size; ++p) grads[p] = grad_pool_.Get(grad.size());
+    ParallelFor(ntrain_blks_, pool_size,
+                [this, blk_id, &grad_offset, &grads](int i, int tid) {
+                  CalcGrad(i, blk_id, grad_offset, &grads[tid]);
+                }, [this](int i) { return HomeNode(i); });
+    real_t* g = grad.data();
+    ParallelRange(Range(0, grad.size()), nthreads_, [&](const Range& rg) {
+        for (size_t j = rg.begin; j < rg.end; ++j) {
+          for (int p = 1; p < pool_size; ++p) g[j] += grads[p][j];
+        }
+      });
+  }
+
+  // only the active features are pushed and pulled
+  SArray<feaid_t> feaids = feablk.feaids;
+  bool partial = shrinking && feablk.num_active < feaids.size();
+  if (partial) {
+    // the active keys are kept until the active set changes, so that the
+    // stores and the updater can reuse what they cached for them
+    if (feablk.active_feaids.empty()) {
+      SArray<feaid_t> active_feaids;
+      for (size_t i = 0; i < feaids.size(); ++i) {
+        if (feablk.active[i]) active_feaids.push_back(feaids[i]);
+      }
+      feablk.active_feaids = active_feaids;
+    }
+    SArray<real_t> active_grad;
+    SArray<int> active_offset;
+    if (grad_offset.size()) active_offset.push_back(0);
+    for (size_t i = 0; i < feaids.size(); ++i) {
+      if (!feablk.active[i]) continue;
+      int begin = grad_offset.empty() ? i * 2 : grad_offset[i];
+      int end = grad_offset.empty() ? begin + 2 : grad_offset[i+1];
+      for (int j = begin; j < end; ++j) active_grad.push_back(grad[j]);
+      if (grad_offset.size()) active_offset.push_back(active_grad.size());
+    }
+    feaids = feablk.active_feaids;
+    CHECK_EQ(feaids.size(), feablk.num_active);
+    grad = active_grad;
+    grad_offset = active_offset;
   }
 
   // 3. once push is done, pull the changes for the weights
   // this callback will be called when the push is finished
-  auto push_callback = [this, blk_id, progress, on_complete]() {
+  auto push_callback = [this, blk_id, shrinking, partial, feaids, on_complete]() {
     // must use pointer here, since it may be reallocated by model_store_
     SArray<real_t>* delta_w = new SArray<real_t>();
     SArray<int>* delta_w_offset = new SArray<int>();
     // 4. once the pull is done, update the prediction
     // the callback will be called when the pull is finished
-    auto pull_callback = [this, blk_id, delta_w, delta_w_offset, progress, on_complete]() {
-      feablks_[blk_id].model_offset = *delta_w_offset;
-      for (int i = 0; i < ntrain_blks_ + nval_blks_; ++i) {
-        UpdtPred(i, blk_id, *delta_w_offset, *delta_w, progress);
+    auto pull_callback = [this, blk_id, shrinking, partial, feaids,
+                          delta_w, delta_w_offset, on_complete]() {
+      auto& feablk = feablks_[blk_id];
+      if (partial) ExpandDelta(blk_id, delta_w, delta_w_offset);
+      feablk.model_offset = *delta_w_offset;
+      // update delta_
+      bool no_os = delta_w_offset->empty();
+      for (size_t i = 0; i < feablk.delta.size(); ++i) {
+        int p = no_os ? i : (*delta_w_offset)[i];
+        bcd::Delta::Update((*delta_w)[p], &feablk.delta[i]);
+      }
+      bool keep_model = V_dim_ > 0 || shrinking;
+      if (keep_model && feablk.model.empty()) {
+        feablk.model.resize(delta_w->size());
+      }
+      // row blocks have their own predictions, so update them in parallel
+      int pool_size = std::max(nthreads_ / blk_nthreads_, 1);
+      ParallelFor(ntrain_blks_ + nval_blks_, pool_size,
+                  [this, blk_id, delta_w, delta_w_offset](int i, int tid) {
+                    UpdtPred(i, blk_id, *delta_w_offset, *delta_w);
+                  }, [this](int i) { return HomeNode(i); });
+      // keep a local copy of the model, which is needed by V and shrinking
+      if (keep_model) {
+        CHECK_EQ(feablk.model.size(), delta_w->size());
+        for (size_t i = 0; i < delta_w->size(); ++i) {
+          feablk.model[i] += (*delta_w)[i];
+        }
       }
       delete delta_w;
       delete delta_w_offset;
-      on_complete();
+      if (!shrinking) {
+        on_complete();
+        return;
+      }
+      // 5. pull the gradients summed over all workers, and shrink the active
+      // set by them
+      SArray<real_t>* sum_grad = new SArray<real_t>();
+      auto shrink_callback = [this, blk_id, sum_grad, on_complete]() {
+        Shrink(*sum_grad, blk_id);
+        delete sum_grad;
+        on_complete();
+      };
+      model_store_->Pull(
+          feaids, Store::kGradient, sum_grad, nullptr, shrink_callback);
     };
     // pull the changes of w from the servers
     model_store_->Pull(
-        feablks_[blk_id].feaids, Store::kWeight, delta_w, delta_w_offset, pull_callback);
+        feaids, Store::kWeight, delta_w, delta_w_offset, pull_callback);
   };
-  // 2. push gradient to the servers
-  model_store_->Push(
-      feablk.feaids, Store::kGradient, grad, grad_offset, push_callback);
+  // 2. push gradient to the servers, the gradient is handed over to the store
+  model_store_->ZPush(feaids, Store::kGradient, grad, grad_offset, push_callback);
+  return feaids.size();
+}
+
+void BCDLearner::ExpandDelta(int blk_id, SArray<real_t>* delta_w,
+                             SArray<int>* delta_w_offset) {
+  const auto& feablk = feablks_[blk_id];
+  // the inactive features are not changed, and the model offsets are known
+  // since the last full pass
+  const auto& os = feablk.model_offset;
+  size_t n = feablk.feaids.size();
+  SArray<real_t> delta(os.empty() ? n : os.back(), 0);
+  const auto& pulled_os = *delta_w_offset;
+  size_t k = 0;
+  for (size_t i = 0; i < n; ++i) {
+    if (!feablk.active[i]) continue;
+    int begin = os.empty() ? i : os[i];
+    int len = os.empty() ? 1 : os[i+1] - begin;
+    int src = pulled_os.empty() ? k : pulled_os[k];
+    if (pulled_os.size()) CHECK_EQ(pulled_os[k+1] - src, len);
+    memcpy(delta.data() + begin, delta_w->data() + src, len * sizeof(real_t));
+    ++k;
+  }
+  CHECK_EQ(k, feablk.num_active);
+  *delta_w = delta;
+  delta_w_offset->CopyFrom(os);
 }
 
 
+void BCDLearner::Shrink(const SArray<real_t>& grad, int blk_id) {
+  auto& feablk = feablks_[blk_id];
+  const auto& os = feablk.model_offset;
+  size_t n = feablk.feaids.size();
+  CHECK_EQ(feablk.active.size(), n);
+  CHECK_EQ(grad.size(), feablk.num_active);
+  real_t bound = l1_ * param_.shrink_ratio;
+  size_t num_active = 0, k = 0;
+  for (size_t i = 0; i < n; ++i) {
+    if (!feablk.active[i]) continue;
+    int begin = os.empty() ? i : os[i];
+    int end = os.empty() ? i + 1 : os[i+1];
+    bool zero = true;
+    for (int j = begin; j < end; ++j) {
+      if (feablk.model[j] != 0) { zero = false; break; }
+    }
+    real_t g = grad[k++];
+    if (zero && fabs(g) < bound) {
+      feablk.active[i] = false;
+    } else {
+      ++num_active;
+    }
+  }
+  // a new list is built for the new active set, the old one is never
+  // modified since the stores may have cached it
+  if (num_active != feablk.num_active) feablk.active_feaids = SArray<feaid_t>();
+  feablk.num_active = num_active;
+}
+
 void BCDLearner::CalcGrad(int rowblk_id, int colblk_id,
                           const SArray<int>& grad_offset,
                           SArray<real_t>* grad) {
@@ -242,40 +493,61 @@ void BCDLearner::CalcGrad(int rowblk_id, int colblk_id,
   // build index
   size_t n = tile.colmap.size();
   bool no_os = grad_offset.empty();
-  SArray<int> grad_pos(n);
+  SArray<int> grad_pos(n), V_pos;
   SArray<real_t> delta(n);
   auto& feablk = feablks_[colblk_id];
   int pos_begin = feablk.pos.begin;
   for (size_t i = 0; i < n; ++i) {
     int map = tile.colmap[i];
+    if (map >= 0) {
+      map -= pos_begin; CHECK_GE(map, 0);
+      if (!feablk.active.empty() && !feablk.active[map]) map = -1;
+    }
     if (map < 0) {
       grad_pos[i] = -1;
     } else {
-      map -= pos_begin; CHECK_GE(map, 0);
-      grad_pos[i] = no_os ? map * 2 : grad_offset[map] * 2;
+      grad_pos[i] = no_os ? map * 2 : grad_offset[map];
       delta[i] = feablk.delta[map];
     }
   }
+  bool use_V = V_dim_ > 0 && !no_os;
+  if (use_V) {
+    GetVPos(feablk.model_offset, tile.colmap, pos_begin, &V_pos);
+    for (size_t i = 0; i < n; ++i) if (grad_pos[i] < 0) V_pos[i] = -1;
+  }
+
+  // copy pred and XV, which the feature blocks overlapping with this one may
+  // update, so the lock is not held by the loss
+  SArray<real_t> pred, XV;
+  {
+    std::lock_guard<std::mutex> lk(pred_mu_[rowblk_id]);
+    pred.CopyFrom(pred_[rowblk_id]);
+    if (use_V) XV.CopyFrom(XV_[rowblk_id]);
+  }
+  std::vector<SArray<char>> param = {
+    SArray<char>(pred), SArray<char>(grad_pos), SArray<char>(delta)};
+  if (use_V) {
+    param.push_back(SArray<char>(V_pos));
+    param.push_back(SArray<char>(feablk.model));
+    param.push_back(SArray<char>(XV));
+  }
 
   // calc grad
-  loss_->CalcGrad(tile.data.GetBlock(), {SArray<char>(pred_[rowblk_id]),
-          SArray<char>(grad_pos), SArray<char>(delta)}, grad);
+  loss_->CalcGrad(tile.data.GetBlock(), param, grad);
 }
 
 void BCDLearner::UpdtPred(int rowblk_id, int colblk_id,
                           const SArray<int> delta_w_offset,
-                          const SArray<real_t> delta_w,
-                          std::vector<real_t>* progress) {
+                          const SArray<real_t> delta_w) {
   // load data
   Tile tile;
   tile_store_->Fetch(rowblk_id, colblk_id, &tile);
   size_t n = tile.colmap.size();
 
-  // build index and update delta_
+  // build index
   bool no_os = delta_w_offset.empty();
   SArray<int> w_pos(n);
-  auto& feablk = feablks_[colblk_id];
-  int pos_begin = feablk.pos.begin;
+  int pos_begin = feablks_[colblk_id].pos.begin;
   for (size_t i = 0; i < n; ++i) {
     int map = tile.colmap[i];
     if (map < 0) {
@@ -283,17 +555,80 @@ void BCDLearner::UpdtPred(int rowblk_id, int colblk_id,
     } else {
       map -= pos_begin; CHECK_GE(map, 0);
       w_pos[i] = no_os ? map : delta_w_offset[map];
-      bcd::Delta::Update(delta_w[w_pos[i]], &feablk.delta[map]);
     }
   }
 
+  // the loss runs on the shared pool, and a thread waiting there may run the
+  // CalcGrad or UpdtPred of another feature block on this row block, which
+  // locks the same mutex. so the changes are computed into local buffers
+  // without the lock. for FM, XV starts from zero, then dXV = X * delta_V,
+  // and the term needing the current XV is added by FMLossDelta::AddDelta
+  bool use_V = V_dim_ > 0 && !no_os;
+  SArray<real_t> dpred(pred_[rowblk_id].size()), dXV;
+  std::vector<SArray<char>> param = {SArray<char>(delta_w), SArray<char>(w_pos)};
+  if (use_V) {
+    auto& feablk = feablks_[colblk_id];
+    SArray<int> V_pos;
+    GetVPos(delta_w_offset, tile.colmap, pos_begin, &V_pos);
+    dXV.resize(XV_[rowblk_id].size(), 0);
+    param.push_back(SArray<char>(V_pos));
+    param.push_back(SArray<char>(feablk.model));
+    param.push_back(SArray<char>(dXV));
+  }
+
   // predict
-  loss_->Predict(tile.data.GetBlock(),
-                 {SArray<char>(delta_w), SArray<char>(w_pos)},
-                 &pred_[rowblk_id]);
+  loss_->Predict(tile.data.GetBlock(), param, &dpred);
+  std::lock_guard<std::mutex> lk(pred_mu_[rowblk_id]);
+  if (use_V) {
+    FMLossDelta::AddDelta(dpred, dXV, V_dim_,
+                          &pred_[rowblk_id], &XV_[rowblk_id]);
+  } else {
+    real_t* pred = pred_[rowblk_id].data();
+    for (size_t i = 0; i < dpred.size(); ++i) pred[i] += dpred[i];
+  }
+}
 
-  // evaluate
-  if (!progress) return;
+void BCDLearner::GetVPos(const SArray<int>& model_offset,
+                         const SArray<int>& colmap,
+                         int pos_begin,
+                         SArray<int>* V_pos) const {
+  size_t n = colmap.size();
+  V_pos->resize(n);
+  for (size_t i = 0; i < n; ++i) {
+    int map = colmap[i];
+    if (map < 0) {
+      (*V_pos)[i] = -1;
+    } else {
+      map -= pos_begin;
+      int os = model_offset[map];
+      (*V_pos)[i] = model_offset[map+1] - os > 1 ? os + 1 : -1;
+    }
+  }
+}
+
+void BCDLearner::GetModel(SArray<feaid_t>* feaids,
+                          SArray<real_t>* model,
+                          SArray<int>* offsets) const {
+  feaids->clear(); model->clear(); offsets->clear();
+  for (const auto& feablk : feablks_) {
+    CHECK_EQ(feablk.model.size(), feablk.model_offset.empty() ?
+             feablk.feaids.size() : feablk.model_offset.back());
+    feaids->append(feablk.feaids);
+    if (feablk.model_offset.size()) {
+      if (offsets->empty()) offsets->push_back(0);
+      int begin = model->size();
+      for (size_t i = 1; i < feablk.model_offset.size(); ++i) {
+        offsets->push_back(begin + feablk.model_offset[i]);
+      }
+    }
+    model->append(feablk.model);
+  }
+}
+
+void BCDLearner::Evaluate(int rowblk_id, std::vector<real_t>* progress) {
+  // only the label is needed
+  Tile tile;
+  tile_store_->Fetch(rowblk_id, 0, &tile);
   CHECK_EQ(tile.data.label.size(), pred_[rowblk_id].size());
   BinClassMetric metric(tile.data.label.data(),
                         pred_[rowblk_id].data(),
@@ -303,7 +638,7 @@ void BCDLearner::UpdtPred(int rowblk_id, int colblk_id,
   // value[1] : objv
   // value[2] : auc
   // value[3] : acc
-  // value[4] : ...
+  // value[4] : the number of features pushed, added by IterateData
   auto& val = *progress;
   if (val.empty()) val.resize(4);
   val[0] += tile.data.label.size();
@@ -5,14 +5,17 @@
 #define DIFACTO_BCD_BCD_LEARNER_H_
 #include <vector>
 #include <string>
+#include <mutex>
 #include "difacto/learner.h"
 #include "difacto/store.h"
 #include "data/data_store.h"
 #include "data/tile_store.h"
 #include "data/tile_builder.h"
 #include "common/learner_utils.h"
+#include "common/sarray_pool.h"
 #include "./bcd_param.h"
 #include "./bcd_utils.h"
+#include "./bcd_updater.h"
 #include "loss/logit_loss_delta.h"
 namespace difacto {
 
@@ -32,6 +35,24 @@ class BCDLearner : public Learner {
     epoch_end_callback_.push_back(callback);
   }
 
+  BCDUpdater* GetUpdater() {
+    return CHECK_NOTNULL(std::static_pointer_cast<BCDUpdater>(
+        CHECK_NOTNULL(model_store_)->updater()).get());
+  }
+
+  /**
+   * \brief get the local copy of the model kept by this worker, which is only
+   * available if V_dim > 0 or active set shrinking is enabled
+   *
+   * @param feaids output, the feature IDs
+   * @param model output, w of each feature, followed by its V if any
+   * @param offsets output, the model of the i-th feature is model[offsets[i],
+   * offsets[i+1]). it is empty if V_dim is 0
+   */
+  void GetModel(SArray<feaid_t>* feaids,
+                SArray<real_t>* model,
+                SArray<int>* offsets) const;
+
  protected:
   void RunScheduler() override;
 
@@ -45,9 +66,26 @@ class BCDLearner : public Learner {
   }
   void PrepareData(std::vector<real_t>* fea_stats);
 
+  /**
+   * \brief remove the tail features and count the nnz of each bin
+   *
+   * @param bins the feature ID ranges
+   * @param nnz the number of nonzero entries of the features in each bin
+   */
+  void CountNnz(const std::vector<Range>& bins, std::vector<real_t>* nnz);
+
   void BuildFeatureMap(const std::vector<Range>& feablk_ranges);
 
-  void IterateData(const std::vector<int>& feablks, std::vector<real_t>* progress);
+  /**
+   * \brief iterate the feature blocks once
+   *
+   * @param feablks the order of the feature blocks
+   * @param full_pass if false, only the active features are visited
+   * @param progress the evaluation results, see \ref Evaluate, followed by
+   * the number of features pushed
+   */
+  void IterateData(const std::vector<int>& feablks, bool full_pass,
+                   std::vector<real_t>* progress);
 
   /**
    * \brief iterate a feature block
@@ -67,13 +105,38 @@ class BCDLearner : public Learner {
    * 2. we used callbacks to avoid to be blocked by the push and pull.
    *
    * NOTE: once cannot iterate on the same block before it is actually finished.
+   * Different blocks, however, can be in flight at the same time, see \ref
+   * BCDLearnerParam::tau
    *
    * @param blk_id
+   * @param full_pass if false, the inactive features are skipped, namely
+   * neither pushed nor pulled
    * @param on_complete will be called when actually finished
+   * @return the number of features pushed
+   */
+  size_t IterateFeablk(int blk_id, bool full_pass,
+                       const std::function<void()>& on_complete);
+
+  /**
+   * \brief expand the changes of the active features pulled from the servers
+   * into the whole feature block, the inactive features get 0
    */
-  void IterateFeablk(int blk_id,
-                     const std::function<void()>& on_complete,
-                     std::vector<real_t>* progress);
+  void ExpandDelta(int blk_id, SArray<real_t>* delta_w,
+                   SArray<int>* delta_w_offset);
+
+  /**
+   * \brief update the active set of a feature block
+   *
+   * a feature becomes inactive if its model is zero and the optimality
+   * condition is satisfied by a margin, namely |grad| < shrink_ratio * l1.
+   * the gradient is summed over all workers by the servers, so every worker
+   * gets the same active set
+   *
+   * @param grad the gradients of w of the active features, pulled from the
+   * servers
+   * @param blk_id the feature block
+   */
+  void Shrink(const SArray<real_t>& grad, int blk_id);
 
   void CalcGrad(int rowblk_id, int colblk_id,
                 const SArray<int>& grad_offset,
@@ -81,11 +144,41 @@ class BCDLearner : public Learner {
 
   void UpdtPred(int rowblk_id, int colblk_id,
                 const SArray<int> delta_w_offset,
-                const SArray<real_t> delta_w,
-                std::vector<real_t>* progress);
+                const SArray<real_t> delta_w);
+
+  /**
+   * \brief get the positions of V in the model of a feature block
+   *
+   * @param model_offset the model offsets of the feature block
+   * @param colmap the column map of a tile
+   * @param pos_begin the position of the first feature of the feature block
+   * @param V_pos output, -1 means no embedding
+   */
+  void GetVPos(const SArray<int>& model_offset,
+               const SArray<int>& colmap,
+               int pos_begin,
+               SArray<int>* V_pos) const;
+
+  /**
+   * \brief the NUMA node where the data of a row block is placed and processed
+   */
+  int HomeNode(int rowblk_id) const { return rowblk_id % num_nodes_; }
+
+  /**
+   * \brief add the objective, auc and accuracy of a row block into progress
+   */
+  void Evaluate(int rowblk_id, std::vector<real_t>* progress);
 
   /** \brief the current epoch */
   int epoch_ = 0;
+  /** \brief number of threads, and number of threads used by one row block */
+  int nthreads_, blk_nthreads_;
+  /** \brief the number of NUMA nodes used, 1 means NUMA is disabled */
+  int num_nodes_ = 1;
+  /** \brief the embedding dimension */
+  int V_dim_ = 0;
+  /** \brief the l1 regularizer, used by the active set shrinking */
+  real_t l1_ = 0;
   int ntrain_blks_ = 0;
   int nval_blks_ = 0;
 
@@ -105,13 +198,37 @@ class BCDLearner : public Learner {
     SArray<feaid_t> feaids;
     Range pos;
     SArray<real_t> delta;
+    /** \brief model[model_offset[i]] is the w of the i-th feature, followed by V */
     SArray<int> model_offset;
+    /**
+     * \brief a local copy of the model, only used if V_dim > 0 or active set
+     * shrinking is enabled
+     */
+    SArray<real_t> model;
+    /** \brief the active set, empty means all features are active */
+    std::vector<bool> active;
+    /** \brief the number of active features */
+    size_t num_active = 0;
+    /**
+     * \brief the IDs of the active features, empty if not built yet. it is
+     * rebuilt once the active set changes, so it is the same array as long
+     * as the active set is
+     */
+    SArray<feaid_t> active_feaids;
   };
   std::vector<FeaBlk> feablks_;
 
   SArray<feaid_t> feaids_;
+  /** \brief the local feature counts, only used before building feature map */
+  SArray<real_t> feacnts_;
 
   std::vector<SArray<real_t>> pred_;
+  /** \brief XV = X * V for each row block, only used if V_dim > 0 */
+  std::vector<SArray<real_t>> XV_;
+  /** \brief locks for pred_, one per row block */
+  std::vector<std::mutex> pred_mu_;
+  /** \brief the buffers of the gradients of the feature blocks */
+  SArrayPool<real_t> grad_pool_;
 
   std::vector<std::function<void(
       int epoch, const std::vector<real_t> & prog)>> epoch_end_callback_;
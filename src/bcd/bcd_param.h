@@ -33,6 +33,34 @@ struct BCDLearnerParam : public dmlc::Parameter<BCDLearnerParam> {
   float neg_sampling;
   /** \brief the size of data in MB read each time for processing, in default 256 MB */
   int data_chunk_size;
+  /**
+   * \brief the maximal delay, namely at most tau+1 feature blocks are
+   * processed concurrently. default is 0, i.e. sequential
+   */
+  int tau;
+  /**
+   * \brief the number of threads, default is 0, namely the number of cores.
+   * the row blocks, the losses, the sparse kernels and the reductions, such as
+   * the objective and the metrics, draw them from the process-wide pool (see
+   * \ref ThreadPool::Get)
+   */
+  int num_threads;
+  /**
+   * \brief active set shrinking. visit all features every full_pass_freq
+   * epochs, while the other epochs only visit the active features. default is
+   * 0, i.e. no shrinking
+   */
+  int full_pass_freq;
+  /**
+   * \brief a zero feature becomes inactive if its gradient is within
+   * [-shrink_ratio * l1, shrink_ratio * l1]. default is .9
+   */
+  float shrink_ratio;
+  /**
+   * \brief bind threads to the NUMA nodes, and place the data and the
+   * computation of each row block on a node. default is 0
+   */
+  int numa;
 
   DMLC_DECLARE_PARAMETER(BCDLearnerParam) {
     DMLC_DECLARE_FIELD(data_format).set_default("libsvm");
@@ -47,6 +75,11 @@ struct BCDLearnerParam : public dmlc::Parameter<BCDLearnerParam> {
     DMLC_DECLARE_FIELD(random_block).set_default(1);
     DMLC_DECLARE_FIELD(num_feature_group_bits).set_default(0);
     DMLC_DECLARE_FIELD(block_ratio).set_default(4);
+    DMLC_DECLARE_FIELD(tau).set_range(0, 1000).set_default(0);
+    DMLC_DECLARE_FIELD(num_threads).set_default(0);
+    DMLC_DECLARE_FIELD(full_pass_freq).set_range(0, 1000).set_default(0);
+    DMLC_DECLARE_FIELD(shrink_ratio).set_range(0, 1).set_default(.9);
+    DMLC_DECLARE_FIELD(numa).set_default(0);
   }
 };
 }  // namespace difacto
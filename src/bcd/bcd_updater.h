@@ -7,18 +7,27 @@
 #include <vector>
 #include <algorithm>
 #include <limits>
+#include <mutex>
 #include "difacto/updater.h"
 #include "dmlc/parameter.h"
 #include "dmlc/io.h"
 #include "difacto/store.h"
 #include "common/find_position.h"
+#include "common/key_cache.h"
 #include "common/kv_match.h"
 #include "common/kv_union.h"
 #include "./bcd_utils.h"
 namespace difacto {
 
 struct BCDUpdaterParam : public dmlc::Parameter<BCDUpdaterParam> {
-  int V_dim = 0;
+  /** \brief the embedding dimension, 0 means no embedding */
+  int V_dim;
+  /** \brief features with occurence <= threshold have no embedding */
+  int V_threshold;
+  /** \brief the l2 regularizer for :math:`V` */
+  float V_l2;
+  /** \brief initialize the embeddings into [-x, +x] */
+  float V_init_range;
   int tail_feature_filter;
 
   /** \brief the l1 regularizer for :math:`w`: :math:`\lambda_1 |w|_1` */
@@ -33,12 +42,16 @@ struct BCDUpdaterParam : public dmlc::Parameter<BCDUpdaterParam> {
     DMLC_DECLARE_FIELD(l1).set_default(1);
     DMLC_DECLARE_FIELD(l2).set_default(.01);
     DMLC_DECLARE_FIELD(lr).set_default(.9);
+    DMLC_DECLARE_FIELD(V_dim).set_default(0);
+    DMLC_DECLARE_FIELD(V_threshold).set_default(0);
+    DMLC_DECLARE_FIELD(V_l2).set_default(.01);
+    DMLC_DECLARE_FIELD(V_init_range).set_default(.01);
   }
 };
 
 class BCDUpdater : public Updater {
  public:
-  BCDUpdater() { }
+  BCDUpdater() : pos_cache_(kPosCacheSize) { }
   virtual ~BCDUpdater() { }
 
   KWArgs Init(const KWArgs& kwargs) override {
@@ -47,6 +60,21 @@ class BCDUpdater : public Updater {
 
   const BCDUpdaterParam& param() const { return param_; }
 
+  /**
+   * \brief get the model of a list of features
+   *
+   * @param feaids the feature IDs
+   * @param values output, w of each feature, followed by its V if any
+   * @param offsets output, the model of the i-th feature is values[offsets[i],
+   * offsets[i+1]). it is empty if V_dim is 0
+   */
+  void GetWeights(const SArray<feaid_t>& feaids,
+                  SArray<real_t>* values,
+                  SArray<int>* offsets) {
+    if (weights_.empty()) InitWeights();
+    CopyModel(weights_, feaids, values, offsets);
+  }
+
   void Load(dmlc::Stream* fi, bool* has_aux) override {}
 
   void Save(bool save_aux, dmlc::Stream *fo) const override {
@@ -60,24 +88,17 @@ class BCDUpdater : public Updater {
       values->resize(feaids.size());
       KVMatch(feaids_, feacnt_, feaids, values);
     } else if (value_type == Store::kWeight) {
+      // the workers only get the changes of the model
       if (weights_.empty()) InitWeights();
-      values->resize(feaids.size() * (param_.V_dim+1));
-      if (param_.V_dim == 0) {
-        KVMatch(feaids_, w_delta_, feaids, values);
-      } else {
-        offsets->resize(feaids.size());
-        SArray<int> pos; FindPosition(feaids_, feaids, &pos);
-        int *os = offsets->data(); os[0] = 0;
-        real_t* val = values->data();
-        for (size_t i = 0; i < pos.size(); ++i) {
-          CHECK_NE(pos[i], -1);
-          int start = offsets_[pos[i]+1];
-          int len = offsets_[pos[i]+1] - start;
-          os[1] = os[0] + len;
-          memcpy(val, w_delta_.data() + start, len * sizeof(real_t));
-          val += len; ++os;
-        }
-        values->resize(os[1]);
+      CopyModel(w_delta_, feaids, values, offsets);
+    } else if (value_type == Store::kGradient) {
+      // the last gradients of w, used by the active set shrinking
+      if (weights_.empty()) InitWeights();
+      SArray<int> pos = Position(feaids);
+      values->resize(feaids.size());
+      for (size_t i = 0; i < pos.size(); ++i) {
+        CHECK_NE(pos[i], -1);
+        (*values)[i] = grads_[pos[i]];
       }
     } else {
       LOG(FATAL) << "...";
@@ -90,11 +111,13 @@ class BCDUpdater : public Updater {
               const SArray<real_t>& values,
               const SArray<int>& offsets) override {
     if (value_type == Store::kFeaCount) {
-      feaids_ = feaids;
-      feacnt_ = values;
+      // every worker pushes the counts of its own features
+      KVUnion(feaids, values, &feaids_, &feacnt_);
+      std::lock_guard<std::mutex> lk(pos_mu_);
+      pos_cache_.Clear();
     } else if (value_type == Store::kGradient) {
       if (weights_.empty()) InitWeights();
-      SArray<int> pos; FindPosition(feaids_, feaids, &pos);
+      SArray<int> pos = Position(feaids);
       if (offsets.empty()) {
         int k = 2;
         CHECK_EQ(values.size(), feaids.size()*k);
@@ -103,7 +126,7 @@ class BCDUpdater : public Updater {
           UpdateWeight(pos[i], values.data()+i*k, k);
         }
       } else {
-        CHECK_EQ(offsets.size(), feaids.size());
+        CHECK_EQ(offsets.size(), feaids.size()+1);
         CHECK_EQ(offsets.back(), static_cast<int>(values.size()));
         for (size_t i = 0; i < pos.size(); ++i) {
           CHECK_NE(pos[i], -1);
@@ -116,30 +139,115 @@ class BCDUpdater : public Updater {
   }
 
  private:
+  /**
+   * \brief return the positions of feaids in feaids_
+   *
+   * the workers push and pull the same feature blocks in every iteration, so
+   * the positions are cached for each key list. the lists of the old active
+   * sets are not used again, and they are evicted once kPosCacheSize lists
+   * are cached
+   */
+  SArray<int> Position(const SArray<feaid_t>& feaids) {
+    std::lock_guard<std::mutex> lk(pos_mu_);
+    SArray<int>* pos = pos_cache_.Find(feaids);
+    if (pos == nullptr) {
+      SArray<int> new_pos; FindPosition(feaids_, feaids, &new_pos);
+      pos = pos_cache_.Insert(feaids, new_pos);
+    }
+    return *pos;
+  }
+
+  /**
+   * \brief copy the entries of feaids from model, which is either weights_
+   * or w_delta_
+   */
+  void CopyModel(const SArray<real_t>& model,
+                 const SArray<feaid_t>& feaids,
+                 SArray<real_t>* values,
+                 SArray<int>* offsets) {
+    if (offsets_.empty()) {
+      values->resize(feaids.size());
+      KVMatch(feaids_, model, feaids, values);
+      return;
+    }
+    // offsets[i] is the start position of the i-th feature's model
+    offsets->resize(feaids.size()+1);
+    values->resize(feaids.size() * (param_.V_dim+1));
+    SArray<int> pos = Position(feaids);
+    int *os = offsets->data(); os[0] = 0;
+    real_t* val = values->data();
+    for (size_t i = 0; i < pos.size(); ++i) {
+      CHECK_NE(pos[i], -1);
+      int start = offsets_[pos[i]];
+      int len = offsets_[pos[i]+1] - start;
+      os[1] = os[0] + len;
+      memcpy(val, model.data() + start, len * sizeof(real_t));
+      val += len; ++os;
+    }
+    values->resize(os[0]);
+  }
+
   void InitWeights() {
     // remove tail features
     CHECK_EQ(feaids_.size(), feacnt_.size());
     SArray<feaid_t> filtered;
+    SArray<real_t> cnt;
     for (size_t i = 0; i < feaids_.size(); ++i) {
       if (feacnt_[i] > param_.tail_feature_filter) {
         filtered.push_back(feaids_[i]);
+        cnt.push_back(feacnt_[i]);
       }
     }
     feaids_ = filtered;
     feacnt_.clear();
+    {
+      std::lock_guard<std::mutex> lk(pos_mu_);
+      pos_cache_.Clear();
+    }
 
     // init weight
-    CHECK_EQ(param_.V_dim, 0);
-    weights_.resize(feaids_.size());
-    w_delta_.resize(feaids_.size());
-    bcd::Delta::Init(feaids_.size(), &delta_);
+    size_t n = feaids_.size();
+    if (param_.V_dim > 0) {
+      // w followed by V, V is only available if count > V_threshold
+      offsets_.resize(n+1);
+      offsets_[0] = 0;
+      for (size_t i = 0; i < n; ++i) {
+        offsets_[i+1] = offsets_[i] + 1 +
+                        (cnt[i] > param_.V_threshold ? param_.V_dim : 0);
+      }
+      n = offsets_.back();
+    }
+    weights_.resize(n);
+    w_delta_.resize(n);
+    grads_.resize(feaids_.size(), 0);
+    bcd::Delta::Init(n, &delta_);
+    if (param_.V_dim > 0) {
+      // random init V. workers start with all zeros, so the changes are the
+      // initial values
+      unsigned seed = 0;
+      real_t scale = param_.V_init_range * 2;
+      for (size_t i = 0; i + 1 < offsets_.size(); ++i) {
+        for (int j = offsets_[i] + 1; j < offsets_[i+1]; ++j) {
+          weights_[j] = (rand_r(&seed) / static_cast<real_t>(RAND_MAX) - .5) * scale;
+          w_delta_[j] = weights_[j];
+        }
+      }
+    }
   }
 
+  /**
+   * \brief update the model of a feature
+   *
+   * @param idx the feature index
+   * @param grad (gradient, diagonal hessian) pairs for w and then V
+   * @param grad_len the length of grad
+   */
   void UpdateWeight(int idx, real_t const* grad, int grad_len) {
     // update w
     CHECK_GE(grad_len, 2);
 
     real_t g = grad[0];
+    grads_[idx] = g;
     real_t g_pos = g + param_.l1, g_neg = g - param_.l1;
     real_t u = grad[1] / param_.lr + 1e-10;
     int i = offsets_.size() ? offsets_[idx] : idx;
@@ -151,10 +259,25 @@ class BCDUpdater : public Updater {
     } else if (g_neg >= u * w) {
       d = - g_neg / u;
     }
-    d = std::min(delta_[idx], std::max(- delta_[idx], d));
-    bcd::Delta::Update(d, &delta_[idx]);
+    d = std::min(delta_[i], std::max(- delta_[i], d));
+    bcd::Delta::Update(d, &delta_[i]);
     weights_[i] += d;
     w_delta_[i] = d;
+
+    // update V, a diagonal newton step with l2 regularizer
+    if (grad_len <= 2) return;
+    CHECK(offsets_.size());
+    CHECK_EQ(grad_len, (offsets_[idx+1] - i) * 2);
+    for (int k = 1; k < grad_len / 2; ++k) {
+      int j = i + k;
+      real_t v = weights_[j];
+      real_t gv = grad[2*k] + param_.V_l2 * v;
+      real_t uv = grad[2*k+1] / param_.lr + param_.V_l2 + 1e-10;
+      real_t dv = std::min(delta_[j], std::max(- delta_[j], - gv / uv));
+      bcd::Delta::Update(dv, &delta_[j]);
+      weights_[j] += dv;
+      w_delta_[j] = dv;
+    }
   }
 
   BCDUpdaterParam param_;
@@ -162,8 +285,15 @@ class BCDUpdater : public Updater {
   SArray<real_t> feacnt_;
   SArray<real_t> weights_;
   SArray<real_t> w_delta_;
+  /** \brief the last gradient of w of each feature */
+  SArray<real_t> grads_;
   SArray<int> offsets_;
   SArray<real_t> delta_;
+  /** \brief the maximal number of key lists in pos_cache_ */
+  static const size_t kPosCacheSize = 1024;
+  /** \brief the positions in feaids_ of the pushed and pulled key lists */
+  KeyCache<SArray<int>> pos_cache_;
+  std::mutex pos_mu_;
 };
 
 
@@ -13,6 +13,7 @@
 #include "dmlc/data.h"
 #include "difacto/sarray.h"
 #include "dmlc/memory_io.h"
+#include "common/range.h"
 namespace difacto {
 namespace bcd {
 
@@ -22,8 +23,11 @@ struct Job {
   static const int kIterateData = 3;
   static const int kPrepareData = 6;
   static const int kBuildFeatureMap = 7;
+  static const int kCountNnz = 8;
   /** \brief job type */
   int type;
+  /** \brief the current epoch */
+  int epoch = 0;
   /** \brief the order to process feature blocks */
   std::vector<int> feablks;
   /** \brief the ID range of each feature block */
@@ -32,6 +36,7 @@ struct Job {
   void SerializeToString(std::string* str) const {
     dmlc::Stream* ss = new dmlc::MemoryStringStream(str);
     ss->Write(type);
+    ss->Write(epoch);
     ss->Write(feablks);
     ss->Write(feablk_ranges.size());
     for (auto r : feablk_ranges) {
@@ -44,6 +49,7 @@ struct Job {
     auto pstr = str;
     dmlc::Stream* ss = new dmlc::MemoryStringStream(&pstr);
     ss->Read(&type);
+    ss->Read(&epoch);
     ss->Read(&feablks);
     size_t size; ss->Read(&size);
     feablk_ranges.resize(size);
@@ -55,9 +61,24 @@ struct Job {
   }
 };
 
+/**
+ * \brief sort feature blocks by their IDs, the blocks must not overlap
+ */
+inline void SortFeatureBlocks(std::vector<Range>* feablks) {
+  std::sort(feablks->begin(), feablks->end(),
+            [](const Range& a, const Range& b) { return a.begin < b.begin;});
+  for (size_t i = 1; i < feablks->size(); ++i) {
+    CHECK_LE(feablks->at(i-1).end, feablks->at(i).begin);
+  }
+}
+
 /**
  * \brief partition the whole feature space into blocks
  *
+ * the blocks are half-open, [begin, end), as the other ranges. the last ID of
+ * a group is its largest one plus 1, except for the largest feature ID, which
+ * cannot be covered and so must not be used
+ *
  * @param feagrp_nbits number of bit for encoding the feature group
  * @param feagrps a list of (feature_group, num_partitions_this_group)
  * @param feablks a list of feature blocks with the start and end ID
@@ -67,22 +88,79 @@ inline void PartitionFeature(int feagrp_nbits,
                              std::vector<Range>* feablks) {
   CHECK_EQ(feagrp_nbits % 4, 0) << "should be 0, 4, 8, ...";
   feablks->clear();
+  const feaid_t kMax = std::numeric_limits<feaid_t>::max();
   for (auto f : feagrps) {
     int gid = f.first;
+    feaid_t last = ReverseBytes(EncodeFeaGrpID(kMax, gid, feagrp_nbits));
     Range rg(ReverseBytes(EncodeFeaGrpID(0, gid, feagrp_nbits)),
-             ReverseBytes(EncodeFeaGrpID(
-                 std::numeric_limits<feaid_t>::max(), gid, feagrp_nbits)));
+             last == kMax ? last : last + 1);
     for (int i = 0; i < f.second; ++i) {
       feablks->push_back(rg.Segment(i, f.second));
       CHECK(feablks->back().Valid());
     }
   }
-  std::sort(feablks->begin(), feablks->end(),
-            [](const Range& a, const Range& b) { return a.begin < b.begin;});
-  for (size_t i = 1; i < feablks->size(); ++i) {
-    auto& before = feablks->at(i-1), after = feablks->at(i);
-    if (before.end < after.begin) ++before.end;
-    CHECK_LE(before.end, after.begin);
+  SortFeatureBlocks(feablks);
+}
+
+/**
+ * \brief merge consecutive bins into blocks with roughly equal nnz
+ *
+ * the blocks are split at the quantiles of the cumulative nnz. a bin is never
+ * split, so a heavy bin may result in less than nblk blocks
+ *
+ * @param bins consecutive bins, sorted by their IDs
+ * @param nnz the nnz of each bin
+ * @param nblk the number of blocks
+ * @param feablks the merged blocks are appended here
+ */
+inline void MergeBins(const std::vector<Range>& bins,
+                      real_t const* nnz, int nblk,
+                      std::vector<Range>* feablks) {
+  CHECK(bins.size());
+  CHECK_GT(nblk, 0);
+  real_t total = 0;
+  for (size_t i = 0; i < bins.size(); ++i) total += nnz[i];
+  if (total <= 0) {
+    feablks->push_back(Range(bins.front().begin, bins.back().end));
+    return;
+  }
+  size_t begin = 0;
+  real_t cum = 0;
+  int k = 1;
+  for (size_t i = 0; i < bins.size() && k < nblk; ++i) {
+    cum += nnz[i];
+    if (cum < total * k / nblk) continue;
+    feablks->push_back(Range(bins[begin].begin, bins[i].end));
+    begin = i + 1;
+    while (k < nblk && cum >= total * k / nblk) ++k;
+  }
+  if (begin < bins.size()) {
+    feablks->push_back(Range(bins[begin].begin, bins.back().end));
+  }
+}
+
+/**
+ * \brief sum the counts of the features in each bin
+ *
+ * @param feaids the feature IDs, sorted
+ * @param cnts the count of each feature
+ * @param bins the bins, sorted and half-open, see \ref PartitionFeature
+ * @param nnz output, the sum of the counts in each bin
+ */
+inline void CountBins(const SArray<feaid_t>& feaids,
+                      const SArray<real_t>& cnts,
+                      const std::vector<Range>& bins,
+                      std::vector<real_t>* nnz) {
+  CHECK_EQ(feaids.size(), cnts.size());
+  nnz->resize(bins.size());
+  for (size_t i = 0; i < bins.size(); ++i) {
+    size_t begin = std::lower_bound(
+        feaids.begin(), feaids.end(), bins[i].begin) - feaids.begin();
+    size_t end = std::lower_bound(
+        feaids.begin(), feaids.end(), bins[i].end) - feaids.begin();
+    real_t s = 0;
+    for (size_t j = begin; j < end; ++j) s += cnts[j];
+    (*nnz)[i] = s;
   }
 }
 
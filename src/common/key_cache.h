@@ -0,0 +1,91 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#ifndef DIFACTO_COMMON_KEY_CACHE_H_
+#define DIFACTO_COMMON_KEY_CACHE_H_
+#include <deque>
+#include <functional>
+#include <unordered_map>
+#include <utility>
+#include "dmlc/logging.h"
+#include "difacto/base.h"
+#include "difacto/sarray.h"
+namespace difacto {
+
+/**
+ * \brief a FIFO cache of the data derived from key lists, such as the
+ * positions of the keys in another list
+ *
+ * a key list is identified by the address and the length of its data rather
+ * than the keys, so a lookup costs O(1). it is safe because the cache holds a
+ * copy of every cached list, so the memory cannot be reused by another list
+ * before the entry is evicted. however, a key list must not be modified in place
+ * after its first use.
+ *
+ * it is not thread-safe
+ *
+ * \code
+ * KeyCache<SArray<int>> cache;
+ * SArray<int>* pos = cache.Find(keys);
+ * if (!pos) pos = cache.Insert(keys, FindPositionOf(keys));
+ * \endcode
+ */
+template <typename V>
+class KeyCache {
+ public:
+  /**
+   * @param capacity the maximal number of cached lists, 0 means no limit
+   */
+  explicit KeyCache(size_t capacity = 0) : capacity_(capacity) { }
+  ~KeyCache() { }
+
+  /**
+   * \brief return the cached data of a key list, or nullptr if not found
+   */
+  V* Find(const SArray<feaid_t>& keys) {
+    auto it = map_.find(GetID(keys));
+    return it == map_.end() ? nullptr : &it->second.second;
+  }
+
+  /**
+   * \brief cache the data of a key list, which should not be cached before.
+   * the oldest entry is evicted if the cache is full.
+   *
+   * \return the cached copy of data
+   */
+  V* Insert(const SArray<feaid_t>& keys, const V& data) {
+    ID id = GetID(keys);
+    auto ret = map_.insert(std::make_pair(id, std::make_pair(keys, data)));
+    CHECK(ret.second) << "the key list is already cached";
+    order_.push_back(id);
+    if (capacity_ && order_.size() > capacity_) {
+      map_.erase(order_.front());
+      order_.pop_front();
+    }
+    return &ret.first->second.second;
+  }
+
+  /** \brief remove all entries */
+  void Clear() { map_.clear(); order_.clear(); }
+
+  /** \brief the number of cached lists */
+  size_t size() const { return map_.size(); }
+
+ private:
+  typedef std::pair<const feaid_t*, size_t> ID;
+  struct IDHash {
+    size_t operator()(const ID& id) const {
+      return std::hash<const feaid_t*>()(id.first) ^ (id.second * 0x9e3779b97f4a7c15LL);
+    }
+  };
+  static ID GetID(const SArray<feaid_t>& keys) {
+    return std::make_pair(keys.data(), keys.size());
+  }
+
+  size_t capacity_;
+  std::unordered_map<ID, std::pair<SArray<feaid_t>, V>, IDHash> map_;
+  std::deque<ID> order_;
+};
+
+}  // namespace difacto
+#endif  // DIFACTO_COMMON_KEY_CACHE_H_
@@ -11,7 +11,7 @@
 #include "dmlc/memory_io.h"
 namespace difacto {
 /**
- * \brief send jobs to a node group and wait them finished.
+ * \brief send a job to every node in a node group and wait them finished.
  *
  * @param node_group
  * @param job_args
@@ -28,6 +28,8 @@ inline void SendJobAndWait(int node_group,
     monitor = [job_rets](int node_id, const std::string& rets) {
       auto copy = rets; dmlc::Stream* ss = new dmlc::MemoryStringStream(&copy);
       std::vector<real_t> vec; ss->Read(&vec); delete ss;
+      // a node may have nothing to return, such as a server
+      if (vec.empty()) return;
       if (job_rets->empty()) {
         *job_rets = vec;
       } else {
@@ -38,16 +40,32 @@ inline void SendJobAndWait(int node_group,
   }
   tracker->SetMonitor(monitor);
 
-  // sent job
-  std::pair<int, std::string> job;
-  job.first = node_group;
-  job.second = job_args;
-  tracker->Issue({job});
+  // sent the job to every node in the group
+  std::vector<std::pair<int, std::string>> jobs;
+  for (int id : tracker->NodeIDs(node_group)) {
+    jobs.push_back(std::make_pair(id, job_args));
+  }
+  tracker->Issue(jobs);
 
   // wait until finished
   while (tracker->NumRemains() != 0) {
     std::this_thread::sleep_for(std::chrono::milliseconds(10));
   }
 }
+
+/**
+ * \brief return the value of a keyword argument, the last one wins if it is
+ * given more than once
+ *
+ * @param kwargs
+ * @param key
+ * @param def the value returned if the key is not given
+ */
+inline std::string GetKWArg(const KWArgs& kwargs, const std::string& key,
+                            const std::string& def = "") {
+  std::string val = def;
+  for (const auto& kv : kwargs) if (kv.first == key) val = kv.second;
+  return val;
+}
 }  // namespace difacto
 #endif  // DIFACTO_COMMON_LEARNER_UTILS_H_
@@ -0,0 +1,106 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#ifndef DIFACTO_COMMON_NUMA_H_
+#define DIFACTO_COMMON_NUMA_H_
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+namespace difacto {
+
+/**
+ * \brief the NUMA topology of the machine
+ *
+ * it is read from /sys/devices/system/node, so no libnuma is needed. a machine
+ * without the information, or a non-linux one, is treated as a single node
+ * with all cores.
+ */
+class Numa {
+ public:
+  /** \brief the topology of this machine */
+  static const Numa& Get() {
+    static Numa numa;
+    return numa;
+  }
+
+  /** \brief the number of nodes */
+  int num_nodes() const { return static_cast<int>(cpus_.size()); }
+
+  /** \brief the cores of a node */
+  const std::vector<int>& cpus(int node) const { return cpus_[node]; }
+
+  /** \brief the node the calling thread is running on */
+  int CurrentNode() const {
+#ifdef __linux__
+    int cpu = sched_getcpu();
+    if (cpu >= 0 && cpu < static_cast<int>(cpu_node_.size())) return cpu_node_[cpu];
+#endif
+    return 0;
+  }
+
+  /**
+   * \brief bind a thread to the cores of a node
+   * @return false if it is not supported
+   */
+  bool Bind(std::thread* thread, int node) const {
+#ifdef __linux__
+    cpu_set_t set; CPU_ZERO(&set);
+    for (int c : cpus_[node]) CPU_SET(c, &set);
+    return pthread_setaffinity_np(
+        thread->native_handle(), sizeof(set), &set) == 0;
+#else
+    return false;
+#endif
+  }
+
+ private:
+  Numa() {
+    for (int node = 0; ; ++node) {
+      std::ifstream in("/sys/devices/system/node/node" +
+                       std::to_string(node) + "/cpulist");
+      if (!in) break;
+      std::string list; in >> list;
+      auto cpus = ParseList(list);
+      // nodes having memory only
+      if (cpus.empty()) continue;
+      for (int c : cpus) {
+        if (c >= static_cast<int>(cpu_node_.size())) cpu_node_.resize(c + 1, 0);
+        cpu_node_[c] = cpus_.size();
+      }
+      cpus_.push_back(cpus);
+    }
+    if (cpus_.empty()) {
+      cpus_.resize(1);
+      int n = std::max(static_cast<int>(std::thread::hardware_concurrency()), 1);
+      for (int c = 0; c < n; ++c) cpus_[0].push_back(c);
+    }
+  }
+
+  /** \brief parse a list such as 0-3,8,10-11 */
+  static std::vector<int> ParseList(const std::string& list) {
+    std::vector<int> ret;
+    std::stringstream ss(list);
+    std::string rg;
+    while (std::getline(ss, rg, ',')) {
+      if (rg.empty()) continue;
+      size_t dash = rg.find('-');
+      int begin = std::stoi(rg.substr(0, dash));
+      int end = dash == std::string::npos ? begin : std::stoi(rg.substr(dash + 1));
+      for (int c = begin; c <= end; ++c) ret.push_back(c);
+    }
+    return ret;
+  }
+
+  std::vector<std::vector<int>> cpus_;
+  std::vector<int> cpu_node_;
+};
+
+}  // namespace difacto
+#endif  // DIFACTO_COMMON_NUMA_H_
@@ -0,0 +1,40 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#ifndef DIFACTO_COMMON_OFFSETS_H_
+#define DIFACTO_COMMON_OFFSETS_H_
+#include "dmlc/logging.h"
+#include "difacto/sarray.h"
+namespace difacto {
+
+/**
+ * \brief convert the lengths of the values of n keys into the n+1 offsets
+ *
+ * @param lens the lengths, empty means every key has the same length
+ * @param offsets output, empty if lens is empty
+ */
+inline void LensToOffsets(const SArray<int>& lens, SArray<int>* offsets) {
+  offsets->resize(lens.empty() ? 0 : lens.size() + 1);
+  if (lens.empty()) return;
+  (*offsets)[0] = 0;
+  for (size_t i = 0; i < lens.size(); ++i) {
+    (*offsets)[i+1] = (*offsets)[i] + lens[i];
+  }
+}
+
+/**
+ * \brief convert the n+1 offsets of the values of n keys into the n lengths
+ *
+ * @param offsets the offsets, empty means every key has the same length
+ * @param lens output, empty if offsets is empty
+ */
+inline void OffsetsToLens(const SArray<int>& offsets, SArray<int>* lens) {
+  CHECK_NE(offsets.size(), 1);
+  lens->resize(offsets.empty() ? 0 : offsets.size() - 1);
+  for (size_t i = 0; i < lens->size(); ++i) {
+    (*lens)[i] = offsets[i+1] - offsets[i];
+  }
+}
+
+}  // namespace difacto
+#endif  // DIFACTO_COMMON_OFFSETS_H_
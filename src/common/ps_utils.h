@@ -0,0 +1,43 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#ifndef DIFACTO_COMMON_PS_UTILS_H_
+#define DIFACTO_COMMON_PS_UTILS_H_
+#include "difacto/node_id.h"
+#include "dmlc/logging.h"
+#include "ps/ps.h"
+namespace difacto {
+
+/**
+ * \brief convert a difacto node id into the ps-lite one
+ *
+ * the group ids are the same, namely kScheduler, kServerGroup and kWorkerGroup
+ * and their combinations.
+ */
+inline int PSNodeID(int node_id) {
+  if (node_id < 8) return node_id;
+  int rank = node_id / 8 - 1;
+  int group = NodeID::GetGroup(node_id);
+  if (group == NodeID::kServerGroup) {
+    return ps::Postoffice::ServerRankToID(rank);
+  } else {
+    CHECK_EQ(group, NodeID::kWorkerGroup) << "invalid node id " << node_id;
+    return ps::Postoffice::WorkerRankToID(rank);
+  }
+}
+
+/**
+ * \brief convert a ps-lite node id into the difacto one
+ */
+inline int DifactoNodeID(int ps_id) {
+  if (ps_id < 8) return ps_id;
+  int rank = ps::Postoffice::IDtoRank(ps_id);
+  if (ps::Postoffice::ServerRankToID(rank) == ps_id) {
+    return NodeID::Encode(NodeID::kServerGroup, rank);
+  } else {
+    return NodeID::Encode(NodeID::kWorkerGroup, rank);
+  }
+}
+
+}  // namespace difacto
+#endif  // DIFACTO_COMMON_PS_UTILS_H_
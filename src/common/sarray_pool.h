@@ -0,0 +1,109 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#ifndef DIFACTO_COMMON_SARRAY_POOL_H_
+#define DIFACTO_COMMON_SARRAY_POOL_H_
+#include <string.h>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+#include "difacto/sarray.h"
+namespace difacto {
+
+/**
+ * \brief a pool of buffers for SArray
+ *
+ * an array got from the pool returns its buffer to the pool once the last
+ * copy of it is released, so the buffers of the per-batch arrays are reused
+ * rather than allocated again. it is thread safe, and the arrays can outlive
+ * the pool.
+ *
+ * \code
+ * SArrayPool<real_t> pool;
+ * {
+ *   SArray<real_t> a = pool.Get(100);  // allocated
+ * }
+ * SArray<real_t> b = pool.Get(50);  // reuse the buffer of a
+ * \endcode
+ */
+template <typename V>
+class SArrayPool {
+ public:
+  /**
+   * @param max_cached the maximal number of free buffers kept
+   */
+  explicit SArrayPool(size_t max_cached = 16)
+      : free_(std::make_shared<FreeList>()) {
+    free_->max_cached = max_cached;
+  }
+  ~SArrayPool() { }
+
+  /**
+   * \brief get an array
+   * @param size the array length
+   * @param zero fill the array with 0 if true
+   */
+  SArray<V> Get(size_t size, bool zero = true) {
+    SArray<V> arr;
+    if (size == 0) return arr;
+    V* data = nullptr;
+    size_t capacity = 0;
+    {
+      // the smallest free buffer that is large enough
+      std::lock_guard<std::mutex> lk(free_->mu);
+      auto& bufs = free_->bufs;
+      size_t best = bufs.size();
+      for (size_t i = 0; i < bufs.size(); ++i) {
+        if (bufs[i].second >= size &&
+            (best == bufs.size() || bufs[i].second < bufs[best].second)) {
+          best = i;
+        }
+      }
+      if (best < bufs.size()) {
+        data = bufs[best].first;
+        capacity = bufs[best].second;
+        bufs[best] = bufs.back();
+        bufs.pop_back();
+      }
+    }
+    if (data == nullptr) {
+      data = new V[size];
+      capacity = size;
+    }
+    if (zero) memset(data, 0, size * sizeof(V));
+    std::shared_ptr<FreeList> free = free_;
+    arr.reset(data, size, [free, capacity](V* data) {
+        free->Put(data, capacity);
+      });
+    return arr;
+  }
+
+  /** \brief the number of free buffers */
+  size_t num_free() const {
+    std::lock_guard<std::mutex> lk(free_->mu);
+    return free_->bufs.size();
+  }
+
+ private:
+  struct FreeList {
+    ~FreeList() { for (auto& b : bufs) delete [] b.first; }
+    void Put(V* data, size_t capacity) {
+      {
+        std::lock_guard<std::mutex> lk(mu);
+        if (bufs.size() < max_cached) {
+          bufs.push_back(std::make_pair(data, capacity));
+          return;
+        }
+      }
+      delete [] data;
+    }
+    size_t max_cached = 0;
+    std::vector<std::pair<V*, size_t>> bufs;
+    mutable std::mutex mu;
+  };
+  std::shared_ptr<FreeList> free_;
+};
+
+}  // namespace difacto
+#endif  // DIFACTO_COMMON_SARRAY_POOL_H_
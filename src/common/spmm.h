@@ -6,9 +6,9 @@
 #include <cstring>
 #include <vector>
 #include "dmlc/data.h"
-#include "dmlc/omp.h"
 #include "difacto/sarray.h"
 #include "./range.h"
+#include "./thread_pool.h"
 namespace difacto {
 /**
  * \brief multi-thread sparse matrix dense matrix multiplication
@@ -98,27 +98,23 @@ class SpMM {
                     I const* y_pos,
                     int k,
                     int nthreads) {
-#pragma omp parallel num_threads(nthreads)
-    {
-      Range rg = Range(0, D.size).Segment(
-          omp_get_thread_num(), omp_get_num_threads());
-
-      for (size_t i = rg.begin; i < rg.end; ++i) {
-        if (D.offset[i] == D.offset[i+1]) continue;
-        V* y_i = GetPtr(y, y_pos, i, k);
-        if (!y_i) continue;
-        for (size_t j = D.offset[i]; j < D.offset[i+1]; ++j) {
-          V const* x_j = GetPtr(x, x_pos, D.index[j], k);
-          if (!x_j) continue;
-          if (D.value) {
-            V v = D.value[j];
-            for (int l = 0; l < k; ++l) y_i[l] += x_j[l] * v;
-          } else {
-            for (int l = 0; l < k; ++l) y_i[l] += x_j[l];
+    ParallelRange(Range(0, D.size), nthreads, [&](const Range& rg) {
+        for (size_t i = rg.begin; i < rg.end; ++i) {
+          if (D.offset[i] == D.offset[i+1]) continue;
+          V* y_i = GetPtr(y, y_pos, i, k);
+          if (!y_i) continue;
+          for (size_t j = D.offset[i]; j < D.offset[i+1]; ++j) {
+            V const* x_j = GetPtr(x, x_pos, D.index[j], k);
+            if (!x_j) continue;
+            if (D.value) {
+              V v = D.value[j];
+              for (int l = 0; l < k; ++l) y_i[l] += x_j[l] * v;
+            } else {
+              for (int l = 0; l < k; ++l) y_i[l] += x_j[l];
+            }
           }
         }
-      }
-    }
+      });
   }
 
   /**
@@ -133,29 +129,25 @@ class SpMM {
                          int k,
                          size_t ncols,
                          int nthreads) {
-#pragma omp parallel num_threads(nthreads)
-    {
-      Range rg = Range(0, ncols).Segment(
-          omp_get_thread_num(), omp_get_num_threads());
-
-      for (size_t i = 0; i < D.size; ++i) {
-        if (D.offset[i] == D.offset[i+1]) continue;
-        V const* x_i = GetPtr(x, x_pos, i, k);
-        if (!x_i) continue;
-        for (size_t j = D.offset[i]; j < D.offset[i+1]; ++j) {
-          unsigned e = D.index[j];
-          if (!rg.Has(e)) continue;
-          V* y_j = GetPtr(y, y_pos, e, k);
-          if (!y_j) continue;
-          if (D.value) {
-            V v = D.value[j];
-            for (int l = 0; l < k; ++l) y_j[l] += x_i[l] * v;
-          } else {
-            for (int l = 0; l < k; ++l) y_j[l] += x_i[l];
+    ParallelRange(Range(0, ncols), nthreads, [&](const Range& rg) {
+        for (size_t i = 0; i < D.size; ++i) {
+          if (D.offset[i] == D.offset[i+1]) continue;
+          V const* x_i = GetPtr(x, x_pos, i, k);
+          if (!x_i) continue;
+          for (size_t j = D.offset[i]; j < D.offset[i+1]; ++j) {
+            unsigned e = D.index[j];
+            if (!rg.Has(e)) continue;
+            V* y_j = GetPtr(y, y_pos, e, k);
+            if (!y_j) continue;
+            if (D.value) {
+              V v = D.value[j];
+              for (int l = 0; l < k; ++l) y_j[l] += x_i[l] * v;
+            } else {
+              for (int l = 0; l < k; ++l) y_j[l] += x_i[l];
+            }
           }
         }
-      }
-    }
+      });
   }
 
   template <typename V, typename I>
@@ -6,8 +6,8 @@
 #include <cstring>
 #include <vector>
 #include "dmlc/data.h"
-#include "dmlc/omp.h"
 #include "./range.h"
+#include "./thread_pool.h"
 #include "data/row_block.h"
 #include "difacto/base.h"
 namespace difacto {
@@ -45,40 +45,33 @@ class SpMT {
     Y->index.resize(nnz);
     if (X.value) Y->value.resize(nnz);
 
-    // fill Y->offset
-#pragma omp parallel num_threads(nt)
-    {
-      Range range = Range(0, X_ncols).Segment(
-          omp_get_thread_num(), omp_get_num_threads());
-      for (size_t i = 0; i < nnz; ++i) {
-        unsigned k = X.index[i];
-        if (!range.Has(k)) continue;
-        ++Y->offset[k+1];
-      }
-    }
+    // fill Y->offset, each segment of columns is counted by one thread
+    ParallelRange(Range(0, X_ncols), nt, [&](const Range& range) {
+        for (size_t i = 0; i < nnz; ++i) {
+          unsigned k = X.index[i];
+          if (!range.Has(k)) continue;
+          ++Y->offset[k+1];
+        }
+      });
     for (size_t i = 0; i < X_ncols; ++i) {
       Y->offset[i+1] += Y->offset[i];
     }
 
     // fill Y->index and Y->value
-#pragma omp parallel num_threads(nt)
-    {
-      Range range = Range(0, X_ncols).Segment(
-          omp_get_thread_num(), omp_get_num_threads());
-
-      for (size_t i = 0; i < nrows; ++i) {
-        if (X.offset[i] == X.offset[i+1]) continue;
-        for (size_t j = X.offset[i]; j < X.offset[i+1]; ++j) {
-          unsigned k = X.index[j];
-          if (!range.Has(k)) continue;
-          if (X.value) {
-            Y->value[Y->offset[k]] = X.value[j];
+    ParallelRange(Range(0, X_ncols), nt, [&](const Range& range) {
+        for (size_t i = 0; i < nrows; ++i) {
+          if (X.offset[i] == X.offset[i+1]) continue;
+          for (size_t j = X.offset[i]; j < X.offset[i+1]; ++j) {
+            unsigned k = X.index[j];
+            if (!range.Has(k)) continue;
+            if (X.value) {
+              Y->value[Y->offset[k]] = X.value[j];
+            }
+            Y->index[Y->offset[k]] = static_cast<unsigned>(i);
+            ++Y->offset[k];
           }
-          Y->index[Y->offset[k]] = static_cast<unsigned>(i);
-          ++Y->offset[k];
         }
-      }
-    }
+      });
 
     // restore Y->offset
     if (X_ncols > 0) {
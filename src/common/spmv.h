@@ -6,8 +6,8 @@
 #include <cstring>
 #include <vector>
 #include "dmlc/data.h"
-#include "dmlc/omp.h"
 #include "./range.h"
+#include "./thread_pool.h"
 namespace difacto {
 
 /**
@@ -111,26 +111,22 @@ class SpMV {
                     I const* x_pos,
                     I const* y_pos,
                     int nthreads) {
-#pragma omp parallel num_threads(nthreads)
-    {
-      Range rg = Range(0, D.size).Segment(
-          omp_get_thread_num(), omp_get_num_threads());
-
-      for (size_t i = rg.begin; i < rg.end; ++i) {
-        if (D.offset[i] == D.offset[i+1]) continue;
-        V* y_i = GetPtr(y, y_pos, i);
-        if (!y_i) continue;
-        for (size_t j = D.offset[i]; j < D.offset[i+1]; ++j) {
-          V x_j = GetVal(x, x_pos, D.index[j]);
-          if (x_j == 0) continue;
-          if (D.value) {
-            *y_i += x_j * D.value[j];
-          } else {
-            *y_i += x_j;
+    ParallelRange(Range(0, D.size), nthreads, [&](const Range& rg) {
+        for (size_t i = rg.begin; i < rg.end; ++i) {
+          if (D.offset[i] == D.offset[i+1]) continue;
+          V* y_i = GetPtr(y, y_pos, i);
+          if (!y_i) continue;
+          for (size_t j = D.offset[i]; j < D.offset[i+1]; ++j) {
+            V x_j = GetVal(x, x_pos, D.index[j]);
+            if (x_j == 0) continue;
+            if (D.value) {
+              *y_i += x_j * D.value[j];
+            } else {
+              *y_i += x_j;
+            }
           }
         }
-      }
-    }
+      });
   }
 
   /**
@@ -144,30 +140,26 @@ class SpMV {
                          I const* x_pos,
                          I const* y_pos,
                          int nthreads) {
-#pragma omp parallel num_threads(nthreads)
-    {
-      Range rg = Range(0, ncol).Segment(
-          omp_get_thread_num(), omp_get_num_threads());
-
-      for (size_t i = 0; i < D.size; ++i) {
-        if (D.offset[i] == D.offset[i+1]) continue;
-        V x_i = GetVal(x, x_pos, i);
-        if (x_i == 0) continue;
-        for (size_t j = D.offset[i]; j < D.offset[i+1]; ++j) {
-          unsigned k = D.index[j];
-          if (rg.Has(k)) {
-            V* y_j = GetPtr(y, y_pos, k);
-            if (y_j) {
-              if (D.value) {
-                *y_j += x_i * D.value[j];
-              } else {
-                *y_j += x_i;
+    ParallelRange(Range(0, ncol), nthreads, [&](const Range& rg) {
+        for (size_t i = 0; i < D.size; ++i) {
+          if (D.offset[i] == D.offset[i+1]) continue;
+          V x_i = GetVal(x, x_pos, i);
+          if (x_i == 0) continue;
+          for (size_t j = D.offset[i]; j < D.offset[i+1]; ++j) {
+            unsigned k = D.index[j];
+            if (rg.Has(k)) {
+              V* y_j = GetPtr(y, y_pos, k);
+              if (y_j) {
+                if (D.value) {
+                  *y_j += x_i * D.value[j];
+                } else {
+                  *y_j += x_i;
+                }
               }
             }
           }
         }
-      }
-    }
+      });
   }
 
   template <typename V, typename I>
@@ -1,15 +1,135 @@
 #ifndef DIFACTO_COMMON_THREAD_POOL_H_
 #define DIFACTO_COMMON_THREAD_POOL_H_
-#include <list>
+#include <deque>
+#include <algorithm>
 #include <functional>
+#include <memory>
+#include <utility>
 #include <vector>
 #include <thread>
 #include <mutex>
 #include <atomic>
 #include <condition_variable>
+#include "./numa.h"
+#include "./range.h"
 namespace difacto {
+
+/**
+ * \brief a lock-free work-stealing deque of pointers
+ *
+ * only the owner thread can Push and Pop at the bottom, while other threads
+ * Steal from the top. see Lê et al, correct and efficient work-stealing for
+ * weak memory models, PPoPP 2013
+ */
+template <typename T>
+class WorkStealingDeque {
+ public:
+  explicit WorkStealingDeque(int log_capacity = 8) {
+    array_.store(new Array(log_capacity), std::memory_order_relaxed);
+  }
+  ~WorkStealingDeque() { delete array_.load(std::memory_order_relaxed); }
+
+  /** \brief push at the bottom, only called by the owner */
+  void Push(T* x) {
+    int64_t b = bottom_.load(std::memory_order_relaxed);
+    int64_t t = top_.load(std::memory_order_acquire);
+    Array* a = array_.load(std::memory_order_relaxed);
+    if (b - t > a->capacity() - 1) {
+      // thieves may still read the old array, so keep it until destruction
+      garbage_.push_back(std::unique_ptr<Array>(a));
+      a = a->Grow(b, t);
+      array_.store(a, std::memory_order_release);
+    }
+    a->Put(b, x);
+    std::atomic_thread_fence(std::memory_order_release);
+    bottom_.store(b + 1, std::memory_order_relaxed);
+  }
+
+  /** \brief pop from the bottom, only called by the owner */
+  T* Pop() {
+    int64_t b = bottom_.load(std::memory_order_relaxed) - 1;
+    Array* a = array_.load(std::memory_order_relaxed);
+    bottom_.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t t = top_.load(std::memory_order_relaxed);
+    if (t > b) {
+      bottom_.store(b + 1, std::memory_order_relaxed);
+      return nullptr;
+    }
+    T* x = a->Get(b);
+    if (t == b) {
+      // the last one, race against the thieves
+      if (!top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                        std::memory_order_relaxed)) {
+        x = nullptr;
+      }
+      bottom_.store(b + 1, std::memory_order_relaxed);
+    }
+    return x;
+  }
+
+  /**
+   * \brief steal from the top, can be called by any thread
+   * @return nullptr if it is empty or another thread won the race
+   */
+  T* Steal() {
+    int64_t t = top_.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t b = bottom_.load(std::memory_order_acquire);
+    if (t >= b) return nullptr;
+    T* x = array_.load(std::memory_order_acquire)->Get(t);
+    if (!top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                      std::memory_order_relaxed)) {
+      return nullptr;
+    }
+    return x;
+  }
+
+  /** \brief return true if it looks empty, used as a hint only */
+  bool Empty() const {
+    return bottom_.load(std::memory_order_relaxed) <=
+        top_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  /** \brief a circular array */
+  class Array {
+   public:
+    explicit Array(int log_capacity)
+        : log_cap_(log_capacity), mask_((int64_t(1) << log_capacity) - 1),
+          data_(new std::atomic<T*>[mask_ + 1]) { }
+    ~Array() { delete [] data_; }
+    int64_t capacity() const { return mask_ + 1; }
+    T* Get(int64_t i) const { return data_[i & mask_].load(std::memory_order_relaxed); }
+    void Put(int64_t i, T* x) { data_[i & mask_].store(x, std::memory_order_relaxed); }
+    /** \brief return a copy with doubled capacity */
+    Array* Grow(int64_t b, int64_t t) const {
+      Array* a = new Array(log_cap_ + 1);
+      for (int64_t i = t; i < b; ++i) a->Put(i, Get(i));
+      return a;
+    }
+   private:
+    int log_cap_;
+    int64_t mask_;
+    std::atomic<T*>* data_;
+  };
+
+  std::atomic<int64_t> top_{0}, bottom_{0};
+  std::atomic<Array*> array_;
+  std::vector<std::unique_ptr<Array>> garbage_;
+};
+
 /**
- * \brief a pool with multiple threads
+ * \brief a work-stealing pool with multiple threads
+ *
+ * each thread owns a deque. a job added by a thread of the pool goes to its
+ * own deque, otherwise it goes to a shared queue. an idle thread pops its own
+ * deque first, then the shared queue, and at last steals from the others
+ * randomly. threads having nothing to do are parked until new jobs come.
+ *
+ * the threads can be bound to the NUMA nodes by \ref BindNodes. then a job
+ * added with a node is put into the queue of that node, which is visited by
+ * the threads on that node before the others.
  */
 class ThreadPool {
  public:
@@ -24,10 +144,19 @@ class ThreadPool {
     CHECK_GT(num_workers, 0);
     CHECK_LT(num_workers, 100);
     capacity_ = max_capacity;
+    // the threads are evenly partitioned to the nodes
+    int nnodes = Numa::Get().num_nodes();
+    for (int i = 0; i < nnodes + 1; ++i) {
+      queues_.push_back(std::unique_ptr<Queue>(new Queue()));
+    }
     for (int i = 0; i < num_workers; ++i) {
-      workers_.push_back(std::thread([this, i](){
-            RunWorker(i);
-          }));
+      workers_.push_back(std::unique_ptr<Worker>(new Worker()));
+      workers_[i]->node = static_cast<int64_t>(i) * nnodes / num_workers;
+    }
+    for (int i = 0; i < num_workers; ++i) {
+      workers_[i]->thread = std::thread([this, i](){
+          RunWorker(i);
+        });
     }
   }
 
@@ -37,58 +166,459 @@ class ThreadPool {
   ~ThreadPool() {
     Wait();
     done_ = true;
-    add_cond_.notify_all();
-    for (size_t i = 0; i < workers_.size(); ++i) {
-      workers_[i].join();
+    for (auto& w : workers_) {
+      std::lock_guard<std::mutex> lk(w->mu);
+      w->cond.notify_all();
     }
+    for (auto& w : workers_) w->thread.join();
   }
 
   /**
    * \brief add a job to the pool
    * return immmediatly if the current number of unfinished jobs is less than the
-   * max_capacity. otherwise wait until the pool is available
+   * max_capacity. otherwise wait until the pool is available, see \ref
+   * WaitUntil
    * @param job
+   * @param node the preferred NUMA node to run the job, -1 means any. it is
+   * ignored if the threads are not bound
+   */
+  void Add(const std::function<void(int tid)>& job, int node = -1) {
+    // reserve a slot first, so concurrent adders cannot exceed the capacity
+    while (true) {
+      int64_t n = num_pending_;
+      if (n >= capacity_) {
+        WaitUntil([this]() { return num_pending_ < capacity_; });
+      } else if (num_pending_.compare_exchange_weak(n, n + 1)) {
+        break;
+      }
+    }
+    Task* task = new Task(job);
+    node = bound_ && node >= 0 ? node % num_nodes() : -1;
+    int self = Self();
+    if (self >= 0 && (node < 0 || node == workers_[self]->node)) {
+      workers_[self]->deque.Push(task);
+    } else {
+      queues_[node + 1]->Push(task);
+    }
+    Unpark(node);
+    // the waiters may run it
+    ++num_added_;
+    Notify();
+  }
+
+  /**
+   * \brief wait untill all jobs are finished, the calling thread runs the
+   * pending jobs meanwhile
+   */
+  void Wait() { WaitUntil([this]() { return num_pending_ == 0; }); }
+
+  /**
+   * \brief wait until done() returns true, the calling thread runs the pending
+   * jobs meanwhile
+   *
+   * if there is no pending job, the calling thread sleeps until a job is
+   * added, a job is finished, or \ref Notify is called. so done() should only
+   * depend on the jobs of this pool, or the one changing it should call
+   * Notify. done() is called with an internal lock held, it may lock others
+   * but should not call the pool.
+   *
+   * the pending job run by the calling thread can be any job of the pool, not
+   * only the ones it waits for. so the caller must not hold a lock which a job
+   * may take, otherwise the thread deadlocks on itself. std::mutex is not
+   * recursive.
+   */
+  void WaitUntil(const std::function<bool()>& done) {
+    while (!done()) {
+      int64_t added = num_added_;
+      if (RunOne()) continue;
+      std::unique_lock<std::mutex> lk(fin_mu_);
+      ++num_waiters_;
+      fin_cond_.wait(lk, [this, &done, added] {
+          return num_added_ != added || done(); });
+      --num_waiters_;
+    }
+  }
+
+  /**
+   * \brief wake up the threads in \ref WaitUntil to check their conditions
+   * again
    */
-  void Add(const std::function<void(int tid)>& job) {
-    std::unique_lock<std::mutex> lk(mu_);
-    fin_cond_.wait(lk, [this]{ return tasks_.size() < capacity_; });
-    tasks_.push_back(job);
-    add_cond_.notify_one();
+  void Notify() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (num_waiters_ == 0) return;
+    std::lock_guard<std::mutex> lk(fin_mu_);
+    fin_cond_.notify_all();
   }
 
   /**
-   * \brief wait untill all jobs are finished
+   * \brief run a pending job in the calling thread, with tid = -1
+   *
+   * @return false if there is no pending job
+   */
+  bool RunOne() {
+    Task* task = FindTask(Self());
+    if (task == nullptr) return false;
+    Run(task, -1);
+    return true;
+  }
+
+  /**
+   * \brief bind the threads to the cores of their NUMA nodes
+   *
+   * a thread is bound to all cores of a node rather than a single core, so the
+   * threads it creates, which inherit the binding, can still run in parallel.
    */
-  void Wait() {
-    std::unique_lock<std::mutex> lk(mu_);
-    fin_cond_.wait(lk, [this]{ return num_running_==0 && tasks_.empty(); });
+  void BindNodes() {
+    std::lock_guard<std::mutex> lk(bind_mu_);
+    if (bound_) return;
+    for (auto& w : workers_) {
+      if (!Numa::Get().Bind(&w->thread, w->node)) {
+        LOG(WARNING) << "failed to bind threads to NUMA nodes";
+        return;
+      }
+    }
+    bound_ = true;
+  }
+
+  /** \brief the number of NUMA nodes used, 1 if the threads are not bound */
+  int num_nodes() const { return bound_ ? Numa::Get().num_nodes() : 1; }
+
+  /** \brief the number of threads */
+  int size() const { return static_cast<int>(workers_.size()); }
+
+  /**
+   * \brief the process-wide pool shared by all components
+   *
+   * it has one thread less than the cores, since the threads waiting for
+   * their jobs run pending jobs too, see \ref TaskGroup
+   */
+  static ThreadPool* Get() {
+    static ThreadPool pool(std::min(std::max(
+        static_cast<int>(std::thread::hardware_concurrency()) - 1, 1), 99));
+    return &pool;
   }
 
  private:
+  typedef std::function<void(int tid)> Task;
+
+  /** \brief a queue shared by several threads */
+  struct Queue {
+    void Push(Task* task) {
+      std::lock_guard<std::mutex> lk(mu);
+      jobs.push_back(task);
+      size = jobs.size();
+    }
+    Task* Pop() {
+      if (size == 0) return nullptr;
+      std::lock_guard<std::mutex> lk(mu);
+      if (jobs.empty()) return nullptr;
+      Task* task = jobs.front();
+      jobs.pop_front();
+      size = jobs.size();
+      return task;
+    }
+    std::deque<Task*> jobs;
+    std::atomic<size_t> size{0};
+    std::mutex mu;
+  };
+
+  struct Worker {
+    std::thread thread;
+    WorkStealingDeque<Task> deque;
+    /** \brief the NUMA node */
+    int node = 0;
+    /** \brief parking */
+    std::atomic<bool> sleeping{false};
+    bool wake = false;
+    std::mutex mu;
+    std::condition_variable cond;
+  };
+
+  /** \brief the pool and the thread id of the calling thread */
+  static std::pair<ThreadPool*, int>& Current() {
+    static thread_local std::pair<ThreadPool*, int> cur(nullptr, -1);
+    return cur;
+  }
+
+  /** \brief the thread id in this pool, or -1 if it is not a pool thread */
+  int Self() const {
+    const auto& cur = Current();
+    return cur.first == this ? cur.second : -1;
+  }
+
+  /** \brief a thread local xorshift random number */
+  static uint32_t Rand() {
+    static thread_local uint32_t x = static_cast<uint32_t>(
+        std::hash<std::thread::id>()(std::this_thread::get_id())) | 1;
+    x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+    return x;
+  }
+
   void RunWorker(int tid) {
-    std::unique_lock<std::mutex> lk(mu_);
+    Current() = std::make_pair(this, tid);
     while (true) {
-      add_cond_.wait(lk, [this]{ return done_ || !tasks_.empty(); });
-      if (done_) break;
-      // run a job
-      auto task = std::move(tasks_.front());
-      tasks_.pop_front();
-      ++num_running_;
-      lk.unlock();
-      CHECK(task); task(tid);
-      --num_running_;
-      fin_cond_.notify_all();
-      lk.lock();
-    }
-  }
-  std::atomic<int> num_running_{0};
+      Task* task = FindTask(tid);
+      if (task) {
+        Run(task, tid);
+      } else if (!Park(tid)) {
+        break;
+      }
+    }
+  }
+
+  Task* FindTask(int self) {
+    Task* task = nullptr;
+    int node = self >= 0 && bound_ ? workers_[self]->node : -1;
+    if (self >= 0 && (task = workers_[self]->deque.Pop())) return task;
+    if (node >= 0 && (task = queues_[node + 1]->Pop())) return task;
+    if ((task = queues_[0]->Pop())) return task;
+    // steal from the threads on the same node first
+    int n = static_cast<int>(workers_.size());
+    int start = Rand() % n;
+    for (int pass = 0; pass < 2; ++pass) {
+      for (int k = 0; k < n; ++k) {
+        int victim = (start + k) % n;
+        auto& w = workers_[victim];
+        if (victim == self || (w->node == node) != (pass == 0)) continue;
+        if (w->deque.Empty()) continue;
+        if ((task = w->deque.Steal())) return task;
+      }
+    }
+    // the jobs of the other nodes, in case their threads are all busy
+    for (size_t i = 1; i < queues_.size(); ++i) {
+      if ((task = queues_[i]->Pop())) return task;
+    }
+    return nullptr;
+  }
+
+  void Run(Task* task, int tid) {
+    CHECK(*task); (*task)(tid);
+    delete task;
+    --num_pending_;
+    Notify();
+  }
+
+  bool HasWork() const {
+    for (const auto& q : queues_) if (q->size > 0) return true;
+    for (const auto& w : workers_) if (!w->deque.Empty()) return true;
+    return false;
+  }
+
+  /**
+   * \brief sleep until new jobs are added
+   * @return false if the pool is stopped
+   */
+  bool Park(int tid) {
+    auto& w = *workers_[tid];
+    std::unique_lock<std::mutex> lk(w.mu);
+    if (done_) return false;
+    w.sleeping = true;
+    ++num_sleeping_;
+    // either we see the job added before, or the adder sees us sleeping
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!HasWork()) {
+      w.cond.wait(lk, [this, &w]{ return done_ || w.wake; });
+    }
+    w.wake = false;
+    w.sleeping = false;
+    --num_sleeping_;
+    return !done_;
+  }
+
+  /** \brief wake up a parked thread, prefer the ones on the node */
+  void Unpark(int node) {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (num_sleeping_ == 0) return;
+    int n = static_cast<int>(workers_.size());
+    int start = Rand() % n;
+    for (int pass = node < 0 ? 1 : 0; pass < 2; ++pass) {
+      for (int k = 0; k < n; ++k) {
+        auto& w = *workers_[(start + k) % n];
+        if ((pass == 0 && w.node != node) || !w.sleeping) continue;
+        std::lock_guard<std::mutex> lk(w.mu);
+        if (w.sleeping && !w.wake) {
+          w.wake = true;
+          w.cond.notify_one();
+          return;
+        }
+      }
+    }
+  }
+
+  int64_t capacity_;
+  std::vector<std::unique_ptr<Worker>> workers_;
+  /** \brief the shared queue, followed by the queue of each node */
+  std::vector<std::unique_ptr<Queue>> queues_;
+  /** \brief the number of unfinished jobs */
+  std::atomic<int64_t> num_pending_{0};
+  /** \brief the number of jobs ever added, it tells the waiters new jobs */
+  std::atomic<int64_t> num_added_{0};
+  std::atomic<int> num_waiters_{0};
+  std::mutex fin_mu_;
+  std::condition_variable fin_cond_;
+  std::atomic<int> num_sleeping_{0};
   std::atomic<bool> done_{false};
-  size_t capacity_;
-  std::mutex mu_;
-  std::condition_variable fin_cond_, add_cond_;
-  std::vector<std::thread> workers_;
-  std::list<std::function<void(int tid)>> tasks_;
+  std::atomic<bool> bound_{false};
+  std::mutex bind_mu_;
+};
 
+/**
+ * \brief a group of jobs running on a shared pool, which can be waited
+ * separately
+ *
+ * a thread waiting for the group runs the pending jobs of the pool, so groups
+ * can be nested, namely a job can wait for another group, without idling or
+ * exhausting the threads.
+ *
+ * the jobs it runs meanwhile may be of any group, so do not hold a lock across
+ * \ref Run or \ref Wait if the other jobs of the pool may take it, see \ref
+ * ThreadPool::WaitUntil. compute into local buffers and lock only to merge
+ * them, as BCDLearner::UpdtPred does.
+ */
+class TaskGroup {
+ public:
+  /**
+   * @param max_pending the maximal number of unfinished jobs, Run blocks if
+   * it is reached
+   * @param pool the pool to run jobs
+   */
+  explicit TaskGroup(int max_pending = 1000000,
+                     ThreadPool* pool = ThreadPool::Get())
+      : max_pending_(max_pending), pool_(pool) {
+    CHECK_GT(max_pending_, 0);
+  }
+  ~TaskGroup() { Wait(); }
+
+  /**
+   * \brief add a job into this group
+   * @param job the job
+   * @param node the preferred NUMA node, see \ref ThreadPool::Add
+   */
+  void Run(const std::function<void()>& job, int node = -1) {
+    WaitUntil(max_pending_ - 1);
+    ++pending_;
+    // the pool wakes up the waiters once the job is finished
+    pool_->Add([this, job](int tid) { job(); --pending_; }, node);
+  }
+
+  /** \brief wait until all jobs in this group are finished */
+  void Wait() { WaitUntil(0); }
+
+ private:
+  void WaitUntil(int num_pending) {
+    pool_->WaitUntil([this, num_pending] { return pending_ <= num_pending; });
+  }
+  int max_pending_;
+  ThreadPool* pool_;
+  std::atomic<int> pending_{0};
 };
+
+/**
+ * \brief run fn(i, tid) for i = 0, ..., n-1 on the process-wide pool
+ *
+ * at most max_par calls run concurrently, each of them has a distinct tid in
+ * [0, max_par), which can be used to index thread local buffers. the calling
+ * thread joins the work, and it can be nested.
+ *
+ * the calling thread may run other jobs of the pool while waiting, so it must
+ * not hold a lock they may take, see \ref TaskGroup. the same holds for
+ * everything built on it, such as \ref ParallelRange, \ref SpMV and the
+ * losses.
+ */
+inline void ParallelFor(int n, int max_par,
+                        const std::function<void(int i, int tid)>& fn) {
+  if (n <= 0) return;
+  int nrunners = std::max(1, std::min(n, max_par));
+  std::atomic<int> next{0};
+  auto runner = [n, &next, &fn](int tid) {
+    for (int i = next++; i < n; i = next++) fn(i, tid);
+  };
+  TaskGroup group;
+  for (int t = 1; t < nrunners; ++t) group.Run([&runner, t]() { runner(t); });
+  runner(0);
+  group.Wait();
+}
+
+/**
+ * \brief run fn(rg) for each of the nparts segments rg of range on the
+ * process-wide pool
+ *
+ * it replaces "omp parallel" in the kernels, such as \ref SpMV and the losses,
+ * so that they draw threads from the same pool as the learners calling them.
+ */
+inline void ParallelRange(const Range& range, int nparts,
+                          const std::function<void(const Range& rg)>& fn) {
+  if (!range.Valid()) return;
+  nparts = static_cast<int>(std::max<uint64_t>(
+      1, std::min<uint64_t>(nparts, range.Size())));
+  if (nparts == 1) {
+    fn(range);
+    return;
+  }
+  ParallelFor(nparts, nparts, [&range, nparts, &fn](int i, int tid) {
+      fn(range.Segment(i, nparts));
+    });
+}
+
+/**
+ * \brief return the sum of fn(rg) over the nparts segments rg of range, see
+ * \ref ParallelRange
+ *
+ * it replaces "omp parallel for reduction(+:x)". the partial sums are added in
+ * the order of the segments, so the result does not depend on the scheduling.
+ */
+template <typename T>
+inline T ParallelSum(const Range& range, int nparts,
+                     const std::function<T(const Range& rg)>& fn) {
+  if (!range.Valid()) return 0;
+  nparts = static_cast<int>(std::max<uint64_t>(
+      1, std::min<uint64_t>(nparts, range.Size())));
+  std::vector<T> sums(nparts, 0);
+  ParallelFor(nparts, nparts, [&range, nparts, &fn, &sums](int i, int tid) {
+      sums[i] = fn(range.Segment(i, nparts));
+    });
+  T res = 0;
+  for (T s : sums) res += s;
+  return res;
+}
+
+/**
+ * \brief the NUMA-aware version of \ref ParallelFor
+ *
+ * fn(i, tid) is preferred to run on node home(i). the runners are spread over
+ * the nodes, each of them first runs the calls of its own node, and then helps
+ * the other nodes. it is the same as ParallelFor if the threads of the pool
+ * are not bound.
+ */
+inline void ParallelFor(int n, int max_par,
+                        const std::function<void(int i, int tid)>& fn,
+                        const std::function<int(int i)>& home) {
+  int nnodes = ThreadPool::Get()->num_nodes();
+  if (nnodes <= 1 || !home) {
+    ParallelFor(n, max_par, fn);
+    return;
+  }
+  if (n <= 0) return;
+  std::vector<std::vector<int>> calls(nnodes);
+  for (int i = 0; i < n; ++i) calls[home(i) % nnodes].push_back(i);
+  std::vector<std::atomic<int>> next(nnodes);
+  for (auto& x : next) x = 0;
+  auto runner = [nnodes, &calls, &next, &fn](int tid, int node) {
+    for (int k = 0; k < nnodes; ++k) {
+      int d = (node + k) % nnodes;
+      int m = calls[d].size();
+      for (int i = next[d]++; i < m; i = next[d]++) fn(calls[d][i], tid);
+    }
+  };
+  int nrunners = std::max(1, std::min(n, max_par));
+  int node0 = Numa::Get().CurrentNode() % nnodes;
+  TaskGroup group;
+  for (int t = 1; t < nrunners; ++t) {
+    int node = (node0 + t) % nnodes;
+    group.Run([&runner, t, node]() { runner(t, node); }, node);
+  }
+  runner(0, node0);
+  group.Wait();
+}
 }  // namespace difacto
 #endif  // DIFACTO_COMMON_THREAD_POOL_H_
@@ -2,9 +2,9 @@
  * Copyright (c) 2015 by Contributors
  */
 #include "./localizer.h"
-#include "dmlc/omp.h"
 #include "dmlc/logging.h"
 #include "common/parallel_sort.h"
+#include "common/thread_pool.h"
 #include "difacto/sarray.h"
 namespace difacto {
 
@@ -19,11 +19,12 @@ void Localizer::CountUniqIndex(
       << "you need to change Pair.i from unsigned to uint64";
   pair_.resize(idx_size);
 
-#pragma omp parallel for num_threads(nt_)
-  for (size_t i = 0; i < idx_size; ++i) {
-    pair_[i].k = ReverseBytes(blk.index[i] % max_index_);
-    pair_[i].i = i;
-  }
+  ParallelRange(Range(0, idx_size), nt_, [&](const Range& rg) {
+      for (size_t i = rg.begin; i < rg.end; ++i) {
+        pair_[i].k = ReverseBytes(blk.index[i] % max_index_);
+        pair_[i].i = i;
+      }
+    });
 
   ParallelSort(&pair_, nt_,
                [](const Pair& a, const Pair& b) {return a.k < b.k; });
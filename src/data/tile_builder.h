@@ -3,6 +3,7 @@
  */
 #ifndef DIFACTO_DATA_TILE_BUILDER_H_
 #define DIFACTO_DATA_TILE_BUILDER_H_
+#include <functional>
 #include <vector>
 #include <mutex>
 #include "common/kv_union.h"
@@ -23,12 +24,12 @@ class TileBuilder {
     if (nthreads > blk_nthreads) {
       nthreads_ = blk_nthreads;
       int pool_size = nthreads / blk_nthreads;
-      pool_ = new ThreadPool(pool_size, pool_size);
+      group_ = new TaskGroup(pool_size);
     } else {
       nthreads_ = nthreads;
     }
   }
-  ~TileBuilder() { delete pool_; }
+  ~TileBuilder() { delete group_; }
 
   /**
    * \brief add a raw rowblk to the store
@@ -42,18 +43,24 @@ class TileBuilder {
     int id = blk_feaids_.size();
     blk_feaids_.resize(id+1);
     mu_.unlock();
-    if (pool_ == nullptr) {
+    if (group_ == nullptr) {
       Add(id, rowblk, feaids, feacnts);
     } else {
       auto container = new SharedRowBlockContainer<feaid_t>(rowblk);
-      pool_->Add([this, id, container, feaids, feacnts](int tid) {
+      group_->Run([this, id, container, feaids, feacnts]() {
           Add(id, container->GetBlock(), feaids, feacnts);
           delete container;
-        });
+        }, home_ ? home_(id) : -1);
     }
   }
 
-  void Wait() { if (pool_) pool_->Wait(); }
+  void Wait() { if (group_) group_->Wait(); }
+
+  /**
+   * \brief set the home NUMA node of each row block, a row block is built on
+   * its home node so its memory is first touched there
+   */
+  void set_home(const std::function<int(int rowblk_id)>& home) { home_ = home; }
 
   /**
    * \brief build colmap
@@ -178,7 +185,9 @@ class TileBuilder {
   TileStore* store_;
   int nthreads_;
   bool multicol_;
-  ThreadPool* pool_ = nullptr;
+  /** \brief the builds running on the shared pool */
+  TaskGroup* group_ = nullptr;
+  std::function<int(int rowblk_id)> home_;
   std::mutex mu_;
 };
 
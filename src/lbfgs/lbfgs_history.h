@@ -0,0 +1,232 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#ifndef DIFACTO_LBFGS_LBFGS_HISTORY_H_
+#define DIFACTO_LBFGS_LBFGS_HISTORY_H_
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "./lbfgs_utils.h"
+namespace difacto {
+namespace lbfgs {
+
+/**
+ * \brief the (s, y) pairs of the last m iterations
+ *
+ * the pairs are kept in a ring buffer, a new pair is written into the buffer
+ * of the evicted one, so no memory is allocated or moved after it is full.
+ *
+ * the vectors can be stored in bf16 to halve the memory. besides, the older
+ * pairs can be spilled into a mmap'd file, and only the newest ones are kept
+ * in memory. all vectors are read block by block through \ref BlockVec.
+ */
+class History {
+ public:
+  History() { }
+  ~History() { Clear(); }
+
+  /**
+   * \brief init
+   *
+   * @param m the maximal number of pairs
+   * @param n the length of a vector
+   * @param bf16 store the vectors in bf16 rather than fp32
+   * @param spill the number of older pairs stored on disk
+   * @param spill_prefix the file prefix for the spilled pairs
+   */
+  void Init(int m, size_t n, bool bf16, int spill,
+            const std::string& spill_prefix) {
+    Clear();
+    CHECK_GT(m, 0);
+    CHECK_GE(spill, 0);
+    CHECK_LT(spill, m) << "at least one pair should be kept in memory";
+    n_ = n;
+    esize_ = bf16 ? sizeof(uint16_t) : sizeof(real_t);
+    size_t pair_bytes = 2 * n_ * esize_;
+    mem_.Init(m - spill, pair_bytes);
+    mem_data_.resize(mem_.cap * pair_bytes);
+    mem_.data = mem_data_.data();
+    file_.Init(spill, pair_bytes);
+    if (spill == 0 || pair_bytes == 0) return;
+
+    std::string name = spill_prefix + "history_XXXXXX";
+    int fd = mkstemp(&name[0]);
+    CHECK_NE(fd, -1) << "failed to create " << name;
+    unlink(name.c_str());
+    map_size_ = file_.cap * pair_bytes;
+    CHECK_EQ(ftruncate(fd, map_size_), 0) << "failed to resize " << name;
+    void* ptr = mmap(nullptr, map_size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    CHECK(ptr != MAP_FAILED) << "failed to mmap " << name;
+    file_.data = static_cast<char*>(ptr);
+  }
+
+  /** \brief the number of pairs */
+  int size() const { return file_.size + mem_.size; }
+
+  /**
+   * \brief append a new pair s and y = new_grad - old_grad, the oldest one is
+   * evicted if it is full
+   */
+  void Push(const SArray<real_t>& s,
+            const SArray<real_t>& new_grad,
+            const SArray<real_t>& old_grad,
+            int nthreads = DEFAULT_NTHREADS) {
+    CHECK_EQ(s.size(), n_);
+    CHECK_EQ(new_grad.size(), n_);
+    CHECK_EQ(old_grad.size(), n_);
+    char* pair = NewPair();
+    char* sp = pair;
+    char* yp = pair + n_ * esize_;
+    real_t const* x = s.data();
+    real_t const* a = new_grad.data();
+    real_t const* b = old_grad.data();
+    size_t nblk = (n_ + kBlockSize - 1) / kBlockSize;
+    ParallelRange(Range(0, nblk), nthreads, [&](const Range& blks) {
+        std::vector<real_t> y(kBlockSize);
+        for (size_t k = blks.begin; k < blks.end; ++k) {
+          size_t begin = k * kBlockSize, end = std::min(n_, begin + kBlockSize);
+          for (size_t i = begin; i < end; ++i) y[i - begin] = a[i] - b[i];
+          Encode(x + begin, end - begin, sp + begin * esize_);
+          Encode(y.data(), end - begin, yp + begin * esize_);
+        }
+      });
+  }
+
+  /**
+   * \brief get the readers of [s(k-m), ..., s(k-1)] and [y(k-m), ..., y(k-1)]
+   *
+   * the readers are valid until the next Push
+   */
+  void Get(std::vector<BlockVec>* s, std::vector<BlockVec>* y) const {
+    s->clear(); y->clear();
+    for (int i = 0; i < size(); ++i) {
+      char const* pair = i < file_.size ? file_.Pair(i) : mem_.Pair(i - file_.size);
+      s->push_back(Reader(pair));
+      y->push_back(Reader(pair + n_ * esize_));
+    }
+  }
+
+  /** \brief save the pairs, which are stored as they are */
+  void Save(dmlc::Stream* fo) const {
+    uint64_t n = n_, esize = esize_;
+    int size = this->size();
+    fo->Write(n); fo->Write(esize); fo->Write(size);
+    for (int i = 0; i < size; ++i) {
+      fo->Write(i < file_.size ? file_.Pair(i) : mem_.Pair(i - file_.size),
+                mem_.pair_bytes);
+    }
+  }
+
+  /**
+   * \brief load the pairs, the history should be inited with the same length
+   * and format
+   */
+  void Load(dmlc::Stream* fi) {
+    uint64_t n, esize; int size;
+    CHECK(fi->Read(&n) && fi->Read(&esize) && fi->Read(&size))
+        << "invalid checkpoint";
+    CHECK_EQ(n, n_) << "mismatched length";
+    CHECK_EQ(esize, esize_) << "mismatched format, check history_bf16";
+    mem_.head = mem_.size = 0;
+    file_.head = file_.size = 0;
+    for (int i = 0; i < size; ++i) {
+      CHECK_EQ(fi->Read(NewPair(), mem_.pair_bytes), mem_.pair_bytes)
+          << "invalid checkpoint";
+    }
+  }
+
+  /** \brief convert a fp32 into bf16 by rounding to the nearest even */
+  static uint16_t ToBF16(real_t v) {
+    uint32_t u; memcpy(&u, &v, sizeof(u));
+    if ((u & 0x7fffffff) > 0x7f800000) return (u >> 16) | 0x40;  // nan
+    u += 0x7fff + ((u >> 16) & 1);
+    return u >> 16;
+  }
+
+  /** \brief convert a bf16 into fp32 */
+  static real_t FromBF16(uint16_t v) {
+    uint32_t u = static_cast<uint32_t>(v) << 16;
+    real_t f; memcpy(&f, &u, sizeof(f));
+    return f;
+  }
+
+ private:
+  /** \brief a ring of pairs in a continuous memory */
+  struct Ring {
+    void Init(int capacity, size_t bytes) {
+      cap = capacity; pair_bytes = bytes; head = 0; size = 0; data = nullptr;
+    }
+    /** \brief the i-th oldest pair */
+    char* Pair(int i) const {
+      return data + ((head + i) % cap) * pair_bytes;
+    }
+    /** \brief append a pair, return its buffer */
+    char* Push() { CHECK_LT(size, cap); return Pair(size++); }
+    /** \brief remove the oldest pair */
+    void Pop() { CHECK_GT(size, 0); head = (head + 1) % cap; --size; }
+
+    int cap = 0, head = 0, size = 0;
+    size_t pair_bytes = 0;
+    char* data = nullptr;
+  };
+
+  /**
+   * \brief return the buffer for a new pair. if the memory is full, the oldest
+   * pair in memory is moved to disk, or dropped if there is no disk space
+   */
+  char* NewPair() {
+    if (mem_.size == mem_.cap) {
+      char* oldest = mem_.Pair(0);
+      if (file_.cap) {
+        if (file_.size == file_.cap) file_.Pop();
+        memcpy(file_.Push(), oldest, file_.pair_bytes);
+      }
+      mem_.Pop();
+    }
+    return mem_.Push();
+  }
+
+  void Encode(real_t const* src, size_t len, char* dst) const {
+    if (esize_ == sizeof(real_t)) {
+      memcpy(dst, src, len * sizeof(real_t));
+    } else {
+      uint16_t* d = reinterpret_cast<uint16_t*>(dst);
+      for (size_t i = 0; i < len; ++i) d[i] = ToBF16(src[i]);
+    }
+  }
+
+  BlockVec Reader(char const* data) const {
+    size_t esize = esize_;
+    return BlockVec(n_, [data, esize](size_t begin, size_t end, real_t* buf) {
+        if (esize == sizeof(real_t)) {
+          return reinterpret_cast<real_t const*>(data) + begin;
+        }
+        uint16_t const* d = reinterpret_cast<uint16_t const*>(data);
+        for (size_t i = begin; i < end; ++i) buf[i - begin] = FromBF16(d[i]);
+        return static_cast<real_t const*>(buf);
+      });
+  }
+
+  void Clear() {
+    if (file_.data) munmap(file_.data, map_size_);
+    file_.Init(0, 0);
+    mem_.Init(0, 0);
+    mem_data_.clear();
+    mem_data_.shrink_to_fit();
+  }
+
+  size_t n_ = 0;
+  size_t esize_ = sizeof(real_t);
+  Ring mem_, file_;
+  std::vector<char> mem_data_;
+  size_t map_size_ = 0;
+};
+
+}  // namespace lbfgs
+}  // namespace difacto
+#endif  // DIFACTO_LBFGS_LBFGS_HISTORY_H_
@@ -2,9 +2,15 @@
  *  Copyright (c) 2015 by Contributors
  */
 #include "./lbfgs_learner.h"
+#include <algorithm>
+#include <memory>
+#include <utility>
 #include "./lbfgs_utils.h"
+#include "common/offsets.h"
+#include "common/thread_pool.h"
 #include "difacto/node_id.h"
 #include "loss/bin_class_metric.h"
+#include "loss/fm_loss.h"
 #include "reader/reader.h"
 namespace difacto {
 
@@ -48,7 +54,9 @@ void LBFGSLearner::RunScheduler() {
         ", <p,g> = " << p_gf[0];
     alpha = k != 0 ? param_.alpha : (
         param_.init_alpha > 0 ? param_.init_alpha : ntrain / data[2]);
-    std::vector<real_t> status;  // = {f(w+αp), <p, ∂f(w+αp)>}
+    // = {f(w+αp), <∂f(w+αp), s>/α, <∂f(w), s>/α}, where s is the actual
+    // step, which differs from αp if OWL-QN projects some weights
+    std::vector<real_t> status;
     for (int i = 0; i < param_.max_num_linesearchs; ++i) {
       status.clear();
       IssueJobAndWait(NodeID::kWorkerGroup + NodeID::kServerGroup,
@@ -57,8 +65,8 @@ void LBFGSLearner::RunScheduler() {
       new_objv = status[0];
       LOG(INFO) << " - alpha = " << alpha
                 << ", objv = " << status[0] << ", <p,g> = " << status[1];
-      if ((new_objv <= objv + param_.c1 * alpha * p_gf[0]) &&
-          (status[1] >= param_.c2 * p_gf[0])) {
+      if ((new_objv <= objv + param_.c1 * alpha * status[2]) &&
+          (status[1] >= param_.c2 * status[2])) {
         LOG(INFO) << " - wolfe condition is satisifed";
         break;  // satisified
       }
@@ -81,6 +89,12 @@ void LBFGSLearner::RunScheduler() {
     }
     for (const auto& cb : epoch_end_callback_) cb(k, prog);
 
+    if (param_.checkpoint_freq > 0 && (k+1) % param_.checkpoint_freq == 0) {
+      LOG(INFO) << " - saving checkpoint to " << param_.model_out;
+      IssueJobAndWait(NodeID::kServerGroup, Job::kSaveModel,
+                      {static_cast<real_t>(k+1)});
+    }
+
     // check stop critea
     if (k > param_.min_num_epochs) {
       real_t eps = fabs(new_objv - objv) / objv;
@@ -115,13 +129,28 @@ void LBFGSLearner::Process(const std::string& args, std::string* rets) {
   if (type == Job::kPrepareData) {
     PrepareData(&job_rets);
   } else if (type == Job::kInitServer) {
-    GetUpdater()->InitWeight(&job_rets);
+    if (param_.load_epoch > 0) {
+      auto filename = CheckpointName(param_.load_epoch);
+      std::unique_ptr<dmlc::Stream> fi(
+          CHECK_NOTNULL(dmlc::Stream::Create(filename.c_str(), "r")));
+      GetUpdater()->InitWeight(&job_rets, fi.get());
+    } else {
+      GetUpdater()->InitWeight(&job_rets);
+    }
   } else if (type == Job::kInitWorker) {
     job_rets.push_back(InitWorker());
   } else if (type == Job::kPushGradient) {
     directions_.clear();
-    int t = CHECK_NOTNULL(model_store_)->Push(
-        feaids_, Store::kGradient, grads_, model_lens_);
+    if (grads_stale_) {
+      CalcGrad(weights_, model_lens_, &grads_);
+      grads_stale_ = false;
+    }
+    // hand the gradient over to the store, and take a recycled buffer for the
+    // next one
+    int t = CHECK_NOTNULL(model_store_)->ZPush(
+        feaids_, Store::kGradient, grads_, model_offsets_);
+    grads_ = grad_pool_.Get(grads_.size(), false);
+    grads_stale_ = true;
     model_store_->Wait(t);
   } else if (type == Job::kPrepareCalcDirection) {
     GetUpdater()->PrepareCalcDirection(&job_rets);
@@ -130,6 +159,9 @@ void LBFGSLearner::Process(const std::string& args, std::string* rets) {
   } else if (type == Job::kLineSearch) {
     if (IsWorker()) LineSearch(job_args.value[0], &job_rets);
     if (IsServer()) GetUpdater()->LineSearch(job_args.value[0], &job_rets);
+  } else if (type == Job::kSaveModel) {
+    int epoch = static_cast<int>(job_args.value[0]);
+    GetUpdater()->SaveAsync(true, CheckpointName(epoch));
   } else if (type == Job::kEvaluate) {
     lbfgs::Progress prog;
     if (IsWorker()) Evaluate(&prog);
@@ -167,7 +199,7 @@ void LBFGSLearner::PrepareData(std::vector<real_t>* rets) {
 
   tile_builder_->Wait();
   // push the feature ids and feature counts to the servers
-  int t = model_store_->Push(
+  int t = model_store_->ZPush(
       feaids_, Store::kFeaCount, feacnts, SArray<int>());
 
   // read validation data if any
@@ -212,26 +244,150 @@ real_t LBFGSLearner::InitWorker() {
 
   // pull w
   int t = CHECK_NOTNULL(model_store_)->Pull(
-      feaids_, Store::kWeight, &weights_, &model_lens_);
+      feaids_, Store::kWeight, &weights_, &model_offsets_);
   model_store_->Wait(t);
+  OffsetsToLens(model_offsets_, &model_lens_);
 
   return CalcGrad(weights_, model_lens_, &grads_);
 }
 
 void LBFGSLearner::LineSearch(real_t alpha, std::vector<real_t>* status) {
+  real_t l1 = GetUpdater()->param().l1;
   // w += αp
   if (directions_.empty()) {
     SArray<int> dir_lens;
     int t = CHECK_NOTNULL(model_store_)->Pull(
-        feaids_, Store::kWeight, &directions_, &model_lens_);
+        feaids_, Store::kWeight, &directions_, &model_offsets_);
     model_store_->Wait(t);
+    OffsetsToLens(model_offsets_, &model_lens_);
     alpha_ = 0;
+    linesearch_cached_ = false;
+    if (l1 > 0) {
+      weights0_.CopyFrom(weights_);
+    } else if (param_.linesearch_cache) {
+      linesearch_cached_ = InitLineSearchCache();
+    }
+  }
+  if (l1 > 0) {
+    // OWL-QN, the projection is not linear in α, so no cache is used
+    lbfgs::OrthantStep(alpha, weights0_, directions_, model_lens_, &weights_,
+                       nthreads_);
+  } else {
+    lbfgs::Add(alpha - alpha_, directions_, &weights_);
   }
-  lbfgs::Add(alpha - alpha_, directions_, &weights_);
   alpha_ = alpha;
-  status->resize(2);
-  (*status)[0] += CalcGrad(weights_, model_lens_, &grads_);
-  (*status)[1] += lbfgs::Inner(grads_, directions_, nthreads_);
+  status->resize(3);
+  if (!linesearch_cached_) {
+    (*status)[0] += CalcGrad(weights_, model_lens_, &grads_);
+    if (l1 > 0) {
+      // along the projected step
+      (*status)[1] += lbfgs::InnerStep(grads_, weights_, weights0_, alpha,
+                                       nthreads_);
+    } else {
+      (*status)[1] += lbfgs::Inner(grads_, directions_, nthreads_);
+    }
+    grads_stale_ = false;
+    return;
+  }
+
+  // f(w+αp) and <∇f(w+αp), p> from the cached predictions
+  int pool_size = nthreads_ / blk_nthreads_;
+  std::vector<real_t> objv(pool_size), pg(pool_size), auc(pool_size);
+  auto linesearch_blk = [this, alpha, &objv, &pg, &auc](int i, int tid) {
+    size_t n = pred_[i].size();
+    SArray<real_t> dpred(n);
+    real_t const* p0 = pred0_[i].data();
+    real_t const* p1 = pred1_[i].data();
+    real_t const* p2 = pred2_[i].empty() ? nullptr : pred2_[i].data();
+    real_t* p = pred_[i].data();
+    for (size_t j = 0; j < n; ++j) {
+      p[j] = p0[j] + alpha * p1[j];
+      dpred[j] = p1[j];
+      if (p2) {
+        p[j] += alpha * alpha * p2[j];
+        dpred[j] += 2 * alpha * p2[j];
+      }
+    }
+    Tile tile; tile_store_->Fetch(i, 0, &tile);
+    auto label = tile.data.GetBlock().label;
+    auto loss = loss_[tid];
+    objv[tid] += loss->Evaluate(label, pred_[i]);
+    pg[tid] += loss->EvaluateDirection(label, pred_[i], dpred);
+    BinClassMetric metric(label, p, n, blk_nthreads_);
+    auc[tid] += metric.AUC();
+  };
+  ParallelFor(ntrain_blks_, pool_size, linesearch_blk);
+  for (int i = 1; i < pool_size; ++i) {
+    objv[0] += objv[i]; pg[0] += pg[i]; auc[0] += auc[i];
+  }
+  prog_.auc = auc[0];
+  grads_stale_ = true;
+  (*status)[0] += objv[0];
+  (*status)[1] += pg[0];
+}
+
+bool LBFGSLearner::InitLineSearchCache() {
+  // pred_ is the prediction of the current weights_, which is computed by
+  // the last CalcGrad
+  bool quadratic = !model_lens_.empty();
+  SArray<real_t> w_pos_dir, w_neg_dir;
+  w_pos_dir.CopyFrom(weights_);
+  lbfgs::Add(1, directions_, &w_pos_dir, nthreads_);
+  if (quadratic) {
+    w_neg_dir.CopyFrom(weights_);
+    lbfgs::Add(-1, directions_, &w_neg_dir, nthreads_);
+  }
+  pred0_.resize(ntrain_blks_);
+  pred1_.resize(ntrain_blks_);
+  pred2_.resize(ntrain_blks_);
+
+  int pool_size = nthreads_ / blk_nthreads_;
+  // the predictions with V are clipped, then they are no longer quadratic in α
+  auto is_clipped = [](const SArray<real_t>& pred) {
+    for (real_t p : pred) if (fabs(p) >= FMLoss::kMaxPred) return true;
+    return false;
+  };
+  std::vector<int> clipped(pool_size, 0);
+  auto cache_blk = [this, quadratic, &w_pos_dir, &w_neg_dir, &is_clipped,
+                    &clipped](int i, int tid) {
+    if (clipped[tid]) return;
+    Tile tile; tile_store_->Fetch(i, 0, &tile);
+    auto data = tile.data.GetBlock();
+    SArray<int> w_pos, V_pos;
+    GetPos(model_lens_, tile.colmap, &w_pos, &V_pos);
+    size_t n = pred_[i].size();
+    auto loss = loss_[tid];
+
+    pred0_[i].CopyFrom(pred_[i]);
+    // f(1)
+    pred1_[i] = SArray<real_t>(n);
+    loss->Predict(data, {SArray<char>(w_pos_dir), SArray<char>(w_pos),
+            SArray<char>(V_pos)}, &pred1_[i]);
+    if (!quadratic) {
+      // pred1 = f(1) - f(0)
+      for (size_t j = 0; j < n; ++j) pred1_[i][j] -= pred0_[i][j];
+      pred2_[i].clear();
+      return;
+    }
+    // f(-1)
+    pred2_[i] = SArray<real_t>(n);
+    loss->Predict(data, {SArray<char>(w_neg_dir), SArray<char>(w_pos),
+            SArray<char>(V_pos)}, &pred2_[i]);
+    if (is_clipped(pred0_[i]) || is_clipped(pred1_[i]) ||
+        is_clipped(pred2_[i])) {
+      clipped[tid] = 1;
+      return;
+    }
+    // pred1 = (f(1) - f(-1)) / 2, pred2 = (f(1) + f(-1)) / 2 - f(0)
+    for (size_t j = 0; j < n; ++j) {
+      real_t f1 = pred1_[i][j], fm1 = pred2_[i][j];
+      pred1_[i][j] = (f1 - fm1) / 2;
+      pred2_[i][j] = (f1 + fm1) / 2 - pred0_[i][j];
+    }
+  };
+  ParallelFor(ntrain_blks_, pool_size, cache_blk);
+  for (int c : clipped) if (c) return false;
+  return true;
 }
 
 real_t LBFGSLearner::CalcGrad(const SArray<real_t>& w_val,
@@ -242,74 +398,166 @@ real_t LBFGSLearner::CalcGrad(const SArray<real_t>& w_val,
     tile_store_->Prefetch(i, 0);
   }
   int pool_size = nthreads_ / blk_nthreads_;
-  ThreadPool pool(pool_size, pool_size);
-  std::vector<SArray<real_t>> grads(pool_size);
   size_t n = w_val.size();
   grad->resize(n); memset(grad->data(), 0, sizeof(real_t)*n);
-  grads[0] = *grad;
-  for (int p = 1; p < pool_size; ++p) grads[p].resize(n);
   std::vector<real_t> objv(pool_size), auc(pool_size);
 
-  // two-level parallel
-  for (int i = 0; i < ntrain_blks_; ++i) {
-    pool.Add([this, i, &w_len, &w_val, &grads, &objv, &auc](int tid) {
-        // prepare data
-        Tile tile; tile_store_->Fetch(i, 0, &tile);
-        auto data = tile.data.GetBlock();
-        SArray<int> w_pos, V_pos;
-        GetPos(w_len, tile.colmap, &w_pos, &V_pos);
-        memset(pred_[i].data(), 0, pred_[i].size()*sizeof(real_t));
-        std::vector<SArray<char>> param = {
-          SArray<char>(w_val), SArray<char>(w_pos), SArray<char>(V_pos)};
-
-        // calc
-        auto loss = loss_[tid];
-        loss->Predict(data, param, &pred_[i]);
-        param.push_back(SArray<char>(pred_[i]));
-        loss->CalcGrad(data, param, &(grads[tid]));
-        objv[tid] += loss->Evaluate(data.label, pred_[i]);
-        BinClassMetric metric(data.label, pred_[i].data(), pred_[i].size(), blk_nthreads_);
-        auc[tid] += metric.AUC();
-      });
+  // the replicas are kept between calls, and are reset to 0 when merging
+  bool sharded = param_.grad_shards > 0;
+  std::vector<SArray<real_t>> grads(pool_size);
+  grads[0] = *grad;
+  if (sharded) {
+    if (grad_mu_.size() != static_cast<size_t>(param_.grad_shards)) {
+      std::vector<std::mutex> mu(param_.grad_shards);
+      grad_mu_.swap(mu);
+    }
+  } else {
+    grad_bufs_.resize(pool_size);
+    for (int p = 1; p < pool_size; ++p) {
+      if (grad_bufs_[p].size() != n) grad_bufs_[p] = SArray<real_t>(n);
+      grads[p] = grad_bufs_[p];
+    }
   }
-  pool.Wait();
+
+  // two-level parallel
+  auto grad_blk = [this, sharded, pool_size, &w_len, &w_val, &grads, &objv,
+                   &auc](int i, int tid) {
+    // prepare data
+    Tile tile; tile_store_->Fetch(i, 0, &tile);
+    auto data = tile.data.GetBlock();
+    SArray<int> w_pos, V_pos;
+    GetPos(w_len, tile.colmap, &w_pos, &V_pos);
+    memset(pred_[i].data(), 0, pred_[i].size()*sizeof(real_t));
+    std::vector<SArray<char>> param = {
+      SArray<char>(w_val), SArray<char>(w_pos), SArray<char>(V_pos)};
+
+    // calc
+    auto loss = loss_[tid];
+    loss->Predict(data, param, &pred_[i]);
+    if (sharded) {
+      CalcShardedGrad(data, tile.colmap, w_val, w_len, pred_[i], loss,
+                      param_.grad_shards * tid / pool_size, &grads[0]);
+    } else {
+      param.push_back(SArray<char>(pred_[i]));
+      loss->CalcGrad(data, param, &(grads[tid]));
+    }
+    objv[tid] += loss->Evaluate(data.label, pred_[i]);
+    BinClassMetric metric(data.label, pred_[i].data(), pred_[i].size(), blk_nthreads_);
+    auc[tid] += metric.AUC();
+  };
+  ParallelFor(ntrain_blks_, pool_size, grad_blk);
 
   // merge results
   for (int i = 1; i < pool_size; ++i) {
     objv[0] += objv[i];
     auc[0] += auc[i];
-    for (size_t j = 0; j < n; ++j) {
-      grads[0][j] += grads[i][j];
-    }
+  }
+  if (!sharded && pool_size > 1) {
+    real_t* g = grads[0].data();
+    const size_t kBlock = 1 << 12;
+    size_t nblk = (n + kBlock - 1) / kBlock;
+    ParallelRange(Range(0, nblk), nthreads_, [&](const Range& blks) {
+        for (size_t b = blks.begin; b < blks.end; ++b) {
+          size_t begin = b * kBlock, end = std::min(n, begin + kBlock);
+          for (int i = 1; i < pool_size; ++i) {
+            real_t* r = grads[i].data();
+            for (size_t j = begin; j < end; ++j) g[j] += r[j];
+            memset(r + begin, 0, (end - begin) * sizeof(real_t));
+          }
+        }
+      });
   }
   prog_.auc = auc[0];
   *grad = grads[0];
   return objv[0];
 }
 
+void LBFGSLearner::CalcShardedGrad(const dmlc::RowBlock<unsigned>& data,
+                                   const SArray<int>& colmap,
+                                   const SArray<real_t>& w_val,
+                                   const SArray<int>& w_len,
+                                   const SArray<real_t>& pred,
+                                   Loss* loss, int shard_begin,
+                                   SArray<real_t>* grad) {
+  // copy the model of the columns in this block into a compact buffer
+  SArray<int> w_pos, V_pos;
+  GetPos(w_len, colmap, &w_pos, &V_pos);
+  size_t m = colmap.size();
+  SArray<int> local_w_pos(m), local_V_pos(m), len(m);
+  size_t nlocal = 0;
+  for (size_t j = 0; j < m; ++j) {
+    if (w_pos[j] < 0) {
+      local_w_pos[j] = local_V_pos[j] = -1;
+      continue;
+    }
+    len[j] = w_len.empty() ? 1 : w_len[colmap[j]];
+    local_w_pos[j] = nlocal;
+    local_V_pos[j] = V_pos[j] < 0 ? -1 : nlocal + 1;
+    nlocal += len[j];
+  }
+  SArray<real_t> local_w(nlocal), local_grad(nlocal);
+  for (size_t j = 0; j < m; ++j) {
+    if (w_pos[j] < 0) continue;
+    memcpy(local_w.data() + local_w_pos[j], w_val.data() + w_pos[j],
+           len[j] * sizeof(real_t));
+  }
+
+  // calc gradient
+  std::vector<SArray<char>> param = {
+    SArray<char>(local_w), SArray<char>(local_w_pos),
+    SArray<char>(local_V_pos), SArray<char>(pred)};
+  loss->CalcGrad(data, param, &local_grad);
+
+  // split the columns into segments by shards. colmap is increasing, so are
+  // the positions
+  size_t n = grad->size();
+  size_t nshards = grad_mu_.size();
+  std::vector<std::pair<int, size_t>> segs;  // (shard, first column)
+  for (size_t j = 0; j < m; ++j) {
+    if (w_pos[j] < 0) continue;
+    int s = static_cast<size_t>(w_pos[j]) * nshards / n;
+    if (segs.empty() || segs.back().first != s) segs.push_back(std::make_pair(s, j));
+  }
+  size_t nsegs = segs.size();
+
+  // add into the shards, starting from shard_begin
+  size_t first = 0;
+  while (first < nsegs && segs[first].first < shard_begin) ++first;
+  real_t* g = grad->data();
+  for (size_t k = 0; k < nsegs; ++k) {
+    size_t i = (first + k) % nsegs;
+    size_t end = i + 1 < nsegs ? segs[i+1].second : m;
+    std::lock_guard<std::mutex> lk(grad_mu_[segs[i].first]);
+    for (size_t j = segs[i].second; j < end; ++j) {
+      if (w_pos[j] < 0) continue;
+      real_t const* lg = local_grad.data() + local_w_pos[j];
+      real_t* gg = g + w_pos[j];
+      for (int l = 0; l < len[j]; ++l) gg[l] += lg[l];
+    }
+  }
+}
+
 void LBFGSLearner::Evaluate(lbfgs::Progress* prog) {
   int pool_size = nthreads_ / blk_nthreads_;
-  ThreadPool pool(pool_size, pool_size);
   std::vector<real_t> val_auc(pool_size);
   // validation data
-  for (int i = ntrain_blks_; i < ntrain_blks_ + nval_blks_; ++i) {
-    pool.Add([this, i, &val_auc](int tid) {
-        // prepare data
-        Tile tile; tile_store_->Fetch(i, 0, &tile);
-        auto data = tile.data.GetBlock();
-        SArray<int> w_pos, V_pos;
-        GetPos(model_lens_, tile.colmap, &w_pos, &V_pos);
-        memset(pred_[i].data(), 0, pred_[i].size()*sizeof(real_t));
-        std::vector<SArray<char>> param = {
-          SArray<char>(weights_), SArray<char>(w_pos), SArray<char>(V_pos)};
-
-        // calc
-        loss_[tid]->Predict(data, param, &pred_[i]);
-        BinClassMetric metric(data.label, pred_[i].data(), pred_[i].size(), blk_nthreads_);
-        val_auc[tid] += metric.AUC();
-      });
-  }
-  pool.Wait();
+  auto eval_blk = [this, &val_auc](int k, int tid) {
+    int i = ntrain_blks_ + k;
+    // prepare data
+    Tile tile; tile_store_->Fetch(i, 0, &tile);
+    auto data = tile.data.GetBlock();
+    SArray<int> w_pos, V_pos;
+    GetPos(model_lens_, tile.colmap, &w_pos, &V_pos);
+    memset(pred_[i].data(), 0, pred_[i].size()*sizeof(real_t));
+    std::vector<SArray<char>> param = {
+      SArray<char>(weights_), SArray<char>(w_pos), SArray<char>(V_pos)};
+
+    // calc
+    loss_[tid]->Predict(data, param, &pred_[i]);
+    BinClassMetric metric(data.label, pred_[i].data(), pred_[i].size(), blk_nthreads_);
+    val_auc[tid] += metric.AUC();
+  };
+  ParallelFor(nval_blks_, pool_size, eval_blk);
 
   // merge results
   *prog = prog_;
@@ -345,11 +593,28 @@ KWArgs LBFGSLearner::Init(const KWArgs& kwargs) {
   nthreads_ = param_.num_threads <= 0 ?
               std::thread::hardware_concurrency() : param_.num_threads;
   blk_nthreads_ = std::min(nthreads_ > 20 ? 4 : 2, nthreads_);
+  if (param_.checkpoint_freq > 0) {
+    CHECK(param_.model_out.size()) << "model_out is required for checkpoints";
+  }
   // init updater
   auto updater = new LBFGSUpdater();
   remain = updater->Init(remain);
+  updater->SetSpillPrefix(param_.data_cache);
   remain.push_back(std::make_pair("V_dim", std::to_string(updater->param().V_dim)));
-  // init model store
+  // init model store. the replicas of the hot keys lag behind, which breaks
+  // the synchronous updates
+  CHECK_EQ(std::stoi(GetKWArg(remain, "num_hot_keys", "0")), 0)
+      << "num_hot_keys is only supported by sgd";
+  // topk drops most of the gradient, then s and y in the history no longer
+  // match the objective, and the line search fails
+  CHECK_NE(GetKWArg(remain, "push_codec"), "topk")
+      << "push_codec=topk is not supported by lbfgs, which needs the full gradient";
+  // the same key lists are pushed and pulled in every iteration. the
+  // direction needs the gradient of all workers
+  if (IsDistributed()) {
+    remain.insert(remain.begin(), std::make_pair("key_cache_size", "1024"));
+    remain.push_back(std::make_pair("sync_push", "1"));
+  }
   model_store_ = Store::Create();
   model_store_->SetUpdater(std::shared_ptr<Updater>(updater));
   remain = model_store_->Init(remain);
@@ -5,6 +5,7 @@
 #define DIFACTO_LBFGS_LBFGS_LEARNER_H_
 #include <string>
 #include <vector>
+#include <mutex>
 #include "difacto/learner.h"
 #include "difacto/base.h"
 #include "difacto/sarray.h"
@@ -13,6 +14,7 @@
 #include "data/tile_store.h"
 #include "data/tile_builder.h"
 #include "common/learner_utils.h"
+#include "common/sarray_pool.h"
 #include "./lbfgs_param.h"
 #include "./lbfgs_utils.h"
 #include "./lbfgs_updater.h"
@@ -77,10 +79,51 @@ class LBFGSLearner : public Learner {
                   const SArray<int>& w_len,
                   SArray<real_t>* grad);
 
+  /**
+   * \brief compute the gradient of a data block, and add it into the shards
+   * of grad
+   *
+   * @param data the data block
+   * @param colmap the column map of the data block
+   * @param w_val the model
+   * @param w_len the model lengths
+   * @param pred the prediction of the data block
+   * @param loss the loss used by the current thread
+   * @param shard_begin the first shard to add, so threads are less likely to
+   * wait for the same lock
+   * @param grad the gradient
+   */
+  void CalcShardedGrad(const dmlc::RowBlock<unsigned>& data,
+                       const SArray<int>& colmap,
+                       const SArray<real_t>& w_val,
+                       const SArray<int>& w_len,
+                       const SArray<real_t>& pred,
+                       Loss* loss, int shard_begin,
+                       SArray<real_t>* grad);
+
   void LineSearch(real_t alpha, std::vector<real_t>* status);
 
+  /**
+   * \brief cache the predictions along the direction
+   *
+   * the prediction of w + αp is pred0 + α * pred1 + α^2 * pred2, which is
+   * fitted by the predictions at α = 0, 1, -1. pred2 is 0 for linear models.
+   *
+   * @return false if a prediction at α = 0, 1 or -1 is clipped by the loss,
+   * then the fit is wrong and the line search recomputes the predictions
+   */
+  bool InitLineSearchCache();
+
   void Evaluate(lbfgs::Progress* prog);
 
+  /**
+   * \brief the checkpoint file of this node after a given number of epochs
+   */
+  std::string CheckpointName(int epoch) {
+    return param_.model_out + "_epoch-" + std::to_string(epoch) +
+        "_part-" + std::to_string(model_store_->Rank());
+  }
+
   void GetPos(const SArray<int>& len, const SArray<int>& colmap,
               SArray<int>* w_pos, SArray<int>* V_pos) const;
 
@@ -89,7 +132,18 @@ class LBFGSLearner : public Learner {
   int nthreads_, blk_nthreads_;
   SArray<feaid_t> feaids_;
   SArray<real_t> weights_, grads_, directions_;
+  /** \brief the weights before line search, used by OWL-QN */
+  SArray<real_t> weights0_;
+  /** \brief the lengths of the weights of each feature, could be empty */
   SArray<int> model_lens_;
+  /** \brief the offsets of the weights, the format used by the store */
+  SArray<int> model_offsets_;
+  /** \brief the gradient replicas of the threads, the first one is not used */
+  std::vector<SArray<real_t>> grad_bufs_;
+  /** \brief locks of the gradient shards */
+  std::vector<std::mutex> grad_mu_;
+  /** \brief the buffers of grads_, which are recycled once the store drops them */
+  SArrayPool<real_t> grad_pool_;
 
   // data
   int ntrain_blks_ = 0;
@@ -104,6 +158,12 @@ class LBFGSLearner : public Learner {
   /** \brief the loss function */
   std::vector<Loss*> loss_;
   std::vector<SArray<real_t>> pred_;
+  /** \brief the cached predictions for line search, see InitLineSearchCache */
+  std::vector<SArray<real_t>> pred0_, pred1_, pred2_;
+  /** \brief true if grads_ is not computed for the current weights_ */
+  bool grads_stale_ = false;
+  /** \brief true if the line search along directions_ uses the cache */
+  bool linesearch_cached_ = false;
 
   real_t alpha_;
   lbfgs::Progress prog_;
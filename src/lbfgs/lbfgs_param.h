@@ -34,7 +34,16 @@ struct LBFGSLearnerParam : public dmlc::Parameter<LBFGSLearnerParam> {
 
   /** \brief stop if val_auc_new - val_auc_old < threshold */
   real_t stop_val_auc;
+  /**
+   * \brief resume from the checkpoint saved after the first load_epoch
+   * epochs. default is 0, i.e. start from scratch
+   */
   int load_epoch;
+  /**
+   * \brief save a checkpoint into model_out every checkpoint_freq epochs. it
+   * is written by the servers in background. default is 0, i.e. no checkpoint
+   */
+  int checkpoint_freq;
 
   /** \brief starting alpha for epoch 0, in default determined by system */
   real_t init_alpha;
@@ -45,7 +54,30 @@ struct LBFGSLearnerParam : public dmlc::Parameter<LBFGSLearnerParam> {
   real_t rho;
   int max_num_linesearchs;
 
+  /**
+   * \brief the number of threads, default is 0, namely the number of cores.
+   * the data blocks, the losses, the sparse kernels, the vector operations of
+   * the two-loop recursion and the reductions, such as the objective and the
+   * metrics, draw them from the process-wide pool (see \ref ThreadPool::Get)
+   */
   int num_threads;
+  /**
+   * \brief the number of gradient shards. if > 0, a thread computes the
+   * gradient of a data block into a compact buffer, and then adds it into the
+   * shards of the gradient, each of them is protected by a lock. otherwise,
+   * each thread accumulates into its own dense replica of the gradient, and the
+   * replicas are merged at the end. default is 0
+   */
+  int grad_shards;
+  /**
+   * \brief if or not cache the predictions along the direction for line
+   * search. the prediction is a quadratic function of alpha for both linear
+   * and FM models, so each line search step only costs O(#examples). the
+   * gradient is then only computed for the accepted alpha. a direction along
+   * which the FM predictions are clipped is searched without the cache.
+   * default is 1
+   */
+  int linesearch_cache;
 
   DMLC_DECLARE_PARAMETER(LBFGSLearnerParam) {
     DMLC_DECLARE_FIELD(data_in);
@@ -65,9 +97,12 @@ struct LBFGSLearnerParam : public dmlc::Parameter<LBFGSLearnerParam> {
     DMLC_DECLARE_FIELD(c2).set_default(.9);
     DMLC_DECLARE_FIELD(rho).set_default(.5);
     DMLC_DECLARE_FIELD(load_epoch).set_default(0);
+    DMLC_DECLARE_FIELD(checkpoint_freq).set_default(0);
     DMLC_DECLARE_FIELD(stop_rel_objv).set_default(1e-5);
     DMLC_DECLARE_FIELD(stop_val_auc).set_default(1e-4);
     DMLC_DECLARE_FIELD(num_threads).set_default(0);
+    DMLC_DECLARE_FIELD(grad_shards).set_range(0, 100000).set_default(0);
+    DMLC_DECLARE_FIELD(linesearch_cache).set_default(1);
   }
 };
 
@@ -16,22 +16,40 @@ namespace lbfgs {
  */
 class Twoloop {
  public:
-  void CalcIncreB(const std::vector<SArray<real_t>>& s,
-                  const std::vector<SArray<real_t>>& y,
+  /**
+   * \brief compute the new entries of B, which are <s(k-1), ⋅>, <y(k-1), ⋅> and
+   * <∇f(w), ⋅>
+   *
+   * @param s [s(k-m), ..., s(k-1)], either SArray or BlockVec
+   * @param y [y(k-m), ..., y(k-m)], either SArray or BlockVec
+   * @param grad ∇f(w(k))
+   * @param incr_B the new entries
+   */
+  template <typename V>
+  void CalcIncreB(const std::vector<V>& s,
+                  const std::vector<V>& y,
                   const SArray<real_t>& grad,
                   std::vector<real_t>* incr_B) {
     CHECK_EQ(s.size(), y.size());
     int m = static_cast<int>(s.size());
+    // <a, b> for a in [s(k-1), y(k-1), ∇f(w)], b in [s, y, ∇f(w)], computed
+    // in a single pass
+    std::vector<BlockVec> a = {s.back(), y.back(), grad};
+    std::vector<BlockVec> b(s.begin(), s.end());
+    b.insert(b.end(), y.begin(), y.end());
+    b.push_back(grad);
+    std::vector<double> res;
+    MultiInner(a, b, &res, nthreads_);
+
+    int nb = 2*m+1;
     incr_B->resize(6*m+1);
-    for (int i = 0; i < m; ++i) {
-      (*incr_B)[i    ] = Inner(s.back(), s[i]);
-      (*incr_B)[i+  m] = Inner(s.back(), y[i]);
-      (*incr_B)[i+2*m] = Inner(y.back(), s[i]);
-      (*incr_B)[i+3*m] = Inner(y.back(), y[i]);
-      (*incr_B)[i+4*m] = Inner(grad,     s[i]);
-      (*incr_B)[i+5*m] = Inner(grad,     y[i]);
+    for (int i = 0; i < 2*m; ++i) {
+      (*incr_B)[i    ] = res[i];
+      (*incr_B)[i+2*m] = res[i+nb];
+    }
+    for (int i = 0; i < 2*m+1; ++i) {
+      (*incr_B)[i+4*m] = res[i+2*nb];
     }
-    (*incr_B)[6*m] = Inner(grad, grad);
   }
 
   void ApplyIncreB(const std::vector<real_t>& incr_B) {
@@ -71,13 +89,14 @@ class Twoloop {
    *
    * One need to call CalcIncreB and ApplyIncrB first
    *
-   * @param s [s(k-m), ..., s(k-1)]
-   * @param y [y(k-m), ..., y(k-m)]
+   * @param s [s(k-m), ..., s(k-1)], either SArray or BlockVec
+   * @param y [y(k-m), ..., y(k-m)], either SArray or BlockVec
    * @param grad ∇f(w(k))
    * @param p the l-bfgs direction
    */
-  void CalcDirection(const std::vector<SArray<real_t>>& s,
-                     const std::vector<SArray<real_t>>& y,
+  template <typename V>
+  void CalcDirection(const std::vector<V>& s,
+                     const std::vector<V>& y,
                      const SArray<real_t>& grad,
                      SArray<real_t>* p) {
     CHECK_EQ(s.size(), static_cast<size_t>(m_));
@@ -86,9 +105,23 @@ class Twoloop {
     p->resize(n); memset(p->data(), 0, n*sizeof(real_t));
 
     std::vector<double> delta; CalcDelta(&delta);
-    for (int i = 0; i < m_; ++i) Add(delta[i], s[i], p);
-    for (int i = 0; i < m_; ++i) Add(delta[i+m_], y[i], p);
-    Add(delta[2*m_], grad, p);
+    std::vector<BlockVec> b(s.begin(), s.end());
+    b.insert(b.end(), y.begin(), y.end());
+    b.push_back(grad);
+    MultiAdd(delta, b, p, nthreads_);
+  }
+
+  /** \brief save the state, namely B */
+  void Save(dmlc::Stream* fo) const {
+    fo->Write(m_);
+    for (const auto& b : B_) fo->Write(b);
+  }
+
+  /** \brief load the state */
+  void Load(dmlc::Stream* fi) {
+    CHECK(fi->Read(&m_)) << "invalid checkpoint";
+    B_.resize(m_ ? 2*m_+1 : 0);
+    for (auto& b : B_) CHECK(fi->Read(&b)) << "invalid checkpoint";
   }
 
  private:
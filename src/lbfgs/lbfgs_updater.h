@@ -3,9 +3,17 @@
  */
 #ifndef DIFACTO_LBFGS_LBFGS_UPDATER_H_
 #define DIFACTO_LBFGS_LBFGS_UPDATER_H_
+#include <cmath>
 #include <vector>
+#include <string>
+#include <memory>
+#include <thread>
+#include "dmlc/memory_io.h"
+#include "./lbfgs_history.h"
 #include "./lbfgs_twoloop.h"
 #include "difacto/updater.h"
+#include "common/kv_union.h"
+#include "common/offsets.h"
 namespace difacto {
 
 struct LBFGSUpdaterParam : public dmlc::Parameter<LBFGSUpdaterParam> {
@@ -18,7 +26,10 @@ struct LBFGSUpdaterParam : public dmlc::Parameter<LBFGSUpdaterParam> {
   float weight_init_range;
 
   int tail_feature_filter;
-  /** \brief the l1 regularizer for :math:`w`: :math:`\lambda_1 |w|_1` */
+  /**
+   * \brief the l1 regularizer for :math:`w`: :math:`\lambda_1 |w|_1`, which is
+   * solved by OWL-QN. default is 0
+   */
   float l1;
   /** \brief the l2 regularizer for :math:`w`: :math:`\lambda_2 \|w\|_2^2` */
   float l2;
@@ -26,14 +37,24 @@ struct LBFGSUpdaterParam : public dmlc::Parameter<LBFGSUpdaterParam> {
   float V_l2;
 
   int m;
+  /** \brief store the s and y history in bf16 to halve the memory. default is 0 */
+  int history_bf16;
+  /**
+   * \brief the number of older (s, y) pairs spilled into a mmap'd file under
+   * data_cache, the newest m - history_spill pairs are kept in memory. default
+   * is 0
+   */
+  int history_spill;
   DMLC_DECLARE_PARAMETER(LBFGSUpdaterParam) {
     DMLC_DECLARE_FIELD(tail_feature_filter).set_default(4);
-    DMLC_DECLARE_FIELD(l1).set_default(1);
+    DMLC_DECLARE_FIELD(l1).set_default(0);
     DMLC_DECLARE_FIELD(l2).set_default(.1);
     DMLC_DECLARE_FIELD(V_l2).set_default(.01);
     DMLC_DECLARE_FIELD(V_dim);
     DMLC_DECLARE_FIELD(V_threshold).set_default(0);
     DMLC_DECLARE_FIELD(m).set_default(10);
+    DMLC_DECLARE_FIELD(history_bf16).set_default(0);
+    DMLC_DECLARE_FIELD(history_spill).set_default(0);
     DMLC_DECLARE_FIELD(weight_init_range).set_default(.01);
   }
 };
@@ -41,7 +62,7 @@ struct LBFGSUpdaterParam : public dmlc::Parameter<LBFGSUpdaterParam> {
 class LBFGSUpdater : public Updater {
  public:
   LBFGSUpdater() { }
-  virtual ~LBFGSUpdater() { }
+  virtual ~LBFGSUpdater() { WaitSave(); }
 
   KWArgs Init(const KWArgs& kwargs) override {
     return param_.InitAllowUnknown(kwargs);
@@ -49,9 +70,70 @@ class LBFGSUpdater : public Updater {
 
   const LBFGSUpdaterParam& param() const { return param_; }
 
-  void Load(dmlc::Stream* fi, bool* has_aux) override { }
+  /** \brief set the file prefix for the spilled history */
+  void SetSpillPrefix(const std::string& prefix) { spill_prefix_ = prefix; }
+
+  /**
+   * \brief load the model, and also the optimizer state if has_aux
+   *
+   * the feature ids should be the same as the current ones
+   */
+  void Load(dmlc::Stream* fi, bool* has_aux) override {
+    CHECK(fi->Read(has_aux)) << "invalid checkpoint";
+    SArray<feaid_t> feaids;
+    lbfgs::LoadSArray(fi, &feaids);
+    CHECK_EQ(feaids.size(), feaids_.size()) << "mismatched features";
+    CHECK_EQ(memcmp(feaids.data(), feaids_.data(),
+                    feaids.size() * sizeof(feaid_t)), 0) << "mismatched features";
+    lbfgs::LoadSArray(fi, &weight_lens_);
+    lbfgs::LoadSArray(fi, &weights_);
+    if (!*has_aux) return;
+    CHECK(fi->Read(&alpha_)) << "invalid checkpoint";
+    lbfgs::LoadSArray(fi, &grads_);
+    lbfgs::LoadSArray(fi, &dir_);
+    lbfgs::LoadSArray(fi, &weights0_);
+    history_.Load(fi);
+    twoloop_.Load(fi);
+  }
+
+  /**
+   * \brief save the model, and also the optimizer state if save_aux, namely
+   * the s/y history, B, the last gradient and direction
+   */
+  void Save(bool save_aux, dmlc::Stream *fo) const override {
+    fo->Write(save_aux);
+    lbfgs::SaveSArray(feaids_, fo);
+    lbfgs::SaveSArray(weight_lens_, fo);
+    lbfgs::SaveSArray(weights_, fo);
+    if (!save_aux) return;
+    fo->Write(alpha_);
+    lbfgs::SaveSArray(grads_, fo);
+    lbfgs::SaveSArray(dir_, fo);
+    lbfgs::SaveSArray(weights0_, fo);
+    history_.Save(fo);
+    twoloop_.Save(fo);
+  }
+
+  /**
+   * \brief save into a file in background
+   *
+   * it is first serialized into memory, so the state can be changed right
+   * after this function returns
+   */
+  void SaveAsync(bool save_aux, const std::string& filename) {
+    WaitSave();
+    auto buf = std::make_shared<std::string>();
+    dmlc::MemoryStringStream ss(buf.get());
+    Save(save_aux, &ss);
+    saver_ = std::thread([buf, filename]() {
+        std::unique_ptr<dmlc::Stream> fo(
+            CHECK_NOTNULL(dmlc::Stream::Create(filename.c_str(), "w")));
+        fo->Write(buf->data(), buf->size());
+      });
+  }
 
-  void Save(bool save_aux, dmlc::Stream *fo) const override { }
+  /** \brief wait until the previous \ref SaveAsync is finished */
+  void WaitSave() { if (saver_.joinable()) saver_.join(); }
 
   typedef std::function<void(
       const SArray<int>& weight_lens, SArray<real_t>* weights)> WeightInitializer;
@@ -60,7 +142,15 @@ class LBFGSUpdater : public Updater {
     weight_initializer_ = initer;
   }
 
-  void InitWeight(std::vector<real_t>* rets) {
+  /**
+   * \brief init the weights
+   *
+   * @param rets {r(w), the model size}
+   * @param checkpoint if not null, load the weights and the optimizer state
+   * from it
+   */
+  void InitWeight(std::vector<real_t>* rets,
+                  dmlc::Stream* checkpoint = nullptr) {
     if (param_.tail_feature_filter > 0) {
       SArray<feaid_t> filtered_ids;
       SArray<real_t> filtered_cnts;
@@ -82,6 +172,8 @@ class LBFGSUpdater : public Updater {
       n = feaids_.size();
     }
     weights_.resize(n);
+    history_.Init(param_.m, n, param_.history_bf16, param_.history_spill,
+                  spill_prefix_);
 
     if (weight_initializer_) {
       weight_initializer_(weight_lens_, &weights_);
@@ -99,6 +191,12 @@ class LBFGSUpdater : public Updater {
       }
     }
 
+    if (checkpoint) {
+      bool has_aux;
+      Load(checkpoint, &has_aux);
+      CHECK(has_aux) << "the optimizer state is not found in the checkpoint";
+    }
+
     rets->resize(2);
     (*rets)[0] = Evaluate();
     (*rets)[1] = weights_.size();
@@ -112,68 +210,134 @@ class LBFGSUpdater : public Updater {
   void PrepareCalcDirection(std::vector<real_t>* aux) {
     // add regularizer
     AddRegularizerGrad(&new_grads_);
+    if (param_.l1 > 0) {
+      pseudo_grads_.CopyFrom(new_grads_);
+      lbfgs::PseudoGradient(param_.l1, weights_, weight_lens_, &pseudo_grads_);
+    } else {
+      pseudo_grads_ = new_grads_;
+    }
     // it's epoch 0, no need to update s, y
-    if (grads_.empty()) { grads_ = new_grads_; return; }
-    // add new_grad - old_grad to y
-    if (static_cast<int>(y_.size()) == param_.m) y_.erase(y_.begin());
-    y_.resize(y_.size()+1);
-    y_.back().CopyFrom(new_grads_);
-    lbfgs::Add(-1, grads_, &y_.back(), nthreads_);
+    if (grads_.empty()) {
+      grads_ = new_grads_;
+      new_grads_.clear();
+      return;
+    }
+    // s = αp, computed in place
+    if (param_.l1 > 0) {
+      // the actual step, which may be projected
+      real_t* s = dir_.data();
+      real_t const* w = weights_.data();
+      real_t const* w0 = weights0_.data();
+      CHECK_EQ(dir_.size(), weights_.size());
+      ParallelRange(Range(0, dir_.size()), nthreads_, [=](const Range& rg) {
+          for (size_t i = rg.begin; i < rg.end; ++i) s[i] = w[i] - w0[i];
+        });
+    } else {
+      lbfgs::Times(alpha_, &dir_, nthreads_);
+    }
+    // push s and y = new_grad - old_grad
+    history_.Push(dir_, new_grads_, grads_, nthreads_);
     grads_ = new_grads_;
-    // update s
-    lbfgs::Times(alpha_, &s_.back(), nthreads_);
+    new_grads_.clear();
     alpha_ = 0;
-    twoloop_.CalcIncreB(s_, y_, grads_, aux);
+    std::vector<lbfgs::BlockVec> s, y;
+    history_.Get(&s, &y);
+    twoloop_.CalcIncreB(s, y, pseudo_grads_, aux);
   }
 
   /**
    * \brief return <∇f(w), p>
+   *
+   * if l1 > 0, ∇f(w) is the pseudo-gradient, and p is constrained to have the
+   * same signs as the negative pseudo-gradient on the linear weights
    * @return
    */
   real_t CalcDirection(const std::vector<real_t>& aux) {
-    // calc direction
-    SArray<real_t> dir;
-    if (y_.size()) {
+    // calc direction, reuse the buffer of the last one
+    auto& dir = dir_;
+    if (history_.size()) {
+      std::vector<lbfgs::BlockVec> s, y;
+      history_.Get(&s, &y);
       twoloop_.ApplyIncreB(aux);
-      twoloop_.CalcDirection(s_, y_, grads_, &dir);
+      twoloop_.CalcDirection(s, y, pseudo_grads_, &dir);
     } else {
-      dir.CopyFrom(grads_);
+      dir.CopyFrom(pseudo_grads_);
       lbfgs::Times(-1, &dir, nthreads_);
     }
+    if (param_.l1 > 0) {
+      real_t* p = dir.data();
+      real_t const* pg = pseudo_grads_.data();
+      lbfgs::ForEachW(weight_lens_, dir.size(), [p, pg](size_t i) {
+          if (p[i] * pg[i] >= 0) p[i] = 0;
+        });
+      weights0_.CopyFrom(weights_);
+    }
+    send_dir_ = true;
     for (auto& p : dir) p = p > 5 ? 5 : (p < -5 ? -5 : p);
-    // push into s_
-    if (static_cast<int>(s_.size()) == param_.m) s_.erase(s_.begin());
-    s_.push_back(dir);
     // return <p, g>
-    return lbfgs::Inner(grads_, dir, nthreads_);
+    dir_pg_ = lbfgs::Inner(pseudo_grads_, dir, nthreads_);
+    return dir_pg_;
   }
 
-
+  /**
+   * \brief take the step of size α
+   *
+   * @param alpha the step size
+   * @param status add the regularizer parts of {f(w+αp), <∇f(w+αp), s>/α}
+   * and <∇f(w), s>/α, where s is the actual step. s = αp if l1 = 0,
+   * otherwise it is the projected step of OWL-QN, see \ref
+   * lbfgs::OrthantStep
+   */
   void LineSearch(real_t alpha, std::vector<real_t>* status) {
-    lbfgs::Add(alpha - alpha_, s_.back(), &weights_, nthreads_);
+    if (param_.l1 > 0) {
+      lbfgs::OrthantStep(alpha, weights0_, dir_, weight_lens_,
+                         &weights_, nthreads_);
+    } else {
+      lbfgs::Add(alpha - alpha_, dir_, &weights_, nthreads_);
+    }
     alpha_ = alpha;
     SArray<real_t> grads(weights_.size(), 0);
     AddRegularizerGrad(&grads);
-    status->resize(2);
+    if (param_.l1 > 0) {
+      // the directional derivative of l1 * |w|_1
+      real_t* g = grads.data();
+      real_t l1 = param_.l1;
+      const auto& w = weights_;
+      lbfgs::ForEachW(weight_lens_, w.size(), [g, l1, &w](size_t i) {
+          if (w[i] > 0) g[i] += l1;
+          if (w[i] < 0) g[i] -= l1;
+        });
+    }
+    status->resize(3);
     (*status)[0] += Evaluate();
-    (*status)[1] += lbfgs::Inner(grads, s_.back(), nthreads_);
+    if (param_.l1 > 0) {
+      (*status)[1] += lbfgs::InnerStep(grads, weights_, weights0_, alpha,
+                                       nthreads_);
+      (*status)[2] += lbfgs::InnerStep(pseudo_grads_, weights_, weights0_,
+                                       alpha, nthreads_);
+    } else {
+      (*status)[1] += lbfgs::Inner(grads, dir_, nthreads_);
+      (*status)[2] += dir_pg_;
+    }
   }
 
   void Get(const SArray<feaid_t>& feaids,
            int value_type,
            SArray<real_t>* values,
-           SArray<int>* lengths) override {
+           SArray<int>* offsets) override {
     if (value_type == Store::kFeaCount) {
       KVMatch(feaids_, feacnts_, feaids, values, ASSIGN, nthreads_);
     } else if (value_type == Store::kWeight) {
       feacnts_.clear();
-      if (s_.size()) {
-        KVMatch(feaids_, s_.back(), weight_lens_, feaids, values, lengths,
+      SArray<int> lens;
+      if (send_dir_) {
+        KVMatch(feaids_, dir_, weight_lens_, feaids, values, &lens,
                 ASSIGN, nthreads_);
       } else {
-        KVMatch(feaids_, weights_, weight_lens_, feaids, values, lengths,
+        KVMatch(feaids_, weights_, weight_lens_, feaids, values, &lens,
                 ASSIGN, nthreads_);
       }
+      if (offsets) LensToOffsets(lens, offsets);
     } else {
       LOG(FATAL) << "...";
     }
@@ -182,18 +346,51 @@ class LBFGSUpdater : public Updater {
   void Update(const SArray<feaid_t>& feaids,
               int value_type,
               const SArray<real_t>& values,
-              const SArray<int>& lengths) override {
+              const SArray<int>& offsets) override {
     if (value_type == Store::kFeaCount) {
-      feaids_ = feaids; feacnts_ = values;
+      // every worker pushes the counts of its own features
+      KVUnion(feaids, values, &feaids_, &feacnts_, PLUS, nthreads_);
     } else if (value_type == Store::kGradient) {
-      CHECK_EQ(feaids_.size(), feaids.size());
-      new_grads_ = values;
+      // the gradients of all workers are summed until the next direction
+      if (new_grads_.empty() && feaids.size() == feaids_.size()) {
+        // all features, no copy
+        CHECK_EQ(values.size(), weights_.size());
+        new_grads_ = values;
+      } else {
+        AddGrads(feaids, values, offsets);
+      }
     } else {
       LOG(FATAL) << "...";
     }
   }
 
  private:
+  /**
+   * \brief add the gradients of a subset of the features into new_grads_
+   */
+  void AddGrads(const SArray<feaid_t>& feaids,
+                const SArray<real_t>& values,
+                const SArray<int>& offsets) {
+    if (new_grads_.empty()) new_grads_ = SArray<real_t>(weights_.size(), 0);
+    CHECK(offsets.empty() || offsets.size() == feaids.size() + 1);
+    // the length of every value if no offsets
+    size_t k = offsets.empty() && feaids.size() ? values.size() / feaids.size() : 0;
+    real_t* g = new_grads_.data();
+    size_t j = 0, pos = 0;
+    for (size_t i = 0; i < feaids.size(); ++i) {
+      for (; j < feaids_.size() && feaids_[j] < feaids[i]; ++j) {
+        pos += weight_lens_.empty() ? 1 : weight_lens_[j];
+      }
+      CHECK(j < feaids_.size() && feaids_[j] == feaids[i])
+          << "unknown feature " << feaids[i];
+      int len = weight_lens_.empty() ? 1 : weight_lens_[j];
+      int begin = offsets.empty() ? i * k : offsets[i];
+      int n = offsets.empty() ? static_cast<int>(k) : offsets[i+1] - begin;
+      CHECK_EQ(n, len);
+      for (int l = 0; l < len; ++l) g[pos + l] += values[begin + l];
+    }
+  }
+
   void AddRegularizerGrad(SArray<real_t>* grads) {
     CHECK_EQ(grads->size(), weights_.size());
     if (weight_lens_.empty()) {
@@ -215,6 +412,13 @@ class LBFGSUpdater : public Updater {
    */
   real_t Evaluate() {
     real_t objv = 0;
+    if (param_.l1 > 0) {
+      const auto& w = weights_;
+      real_t l1 = param_.l1;
+      lbfgs::ForEachW(weight_lens_, w.size(), [&objv, &w, l1](size_t i) {
+          objv += l1 * fabs(w[i]);
+        });
+    }
     if (weight_lens_.empty()) {
       for (real_t w : weights_)  objv += .5 * param_.l2 * w * w;
     } else {
@@ -234,17 +438,31 @@ class LBFGSUpdater : public Updater {
   SArray<feaid_t> feaids_;
   SArray<real_t> feacnts_;
 
-  std::vector<SArray<real_t>> s_, y_;
+  /** \brief the (s, y) pairs */
+  lbfgs::History history_;
+  std::string spill_prefix_;
+  /** \brief the current direction p, which becomes s = αp after line search */
+  SArray<real_t> dir_;
+  /** \brief pulling weights returns the direction, it is true once p is computed */
+  bool send_dir_ = false;
+  /** \brief the thread writing the checkpoint */
+  std::thread saver_;
 
   SArray<real_t> weights_;
   SArray<int> weight_lens_;
   SArray<real_t> grads_, new_grads_;
+  /** \brief the pseudo-gradient if l1 > 0, otherwise the same as grads_ */
+  SArray<real_t> pseudo_grads_;
+  /** \brief the weights before line search, used by OWL-QN */
+  SArray<real_t> weights0_;
 
   WeightInitializer weight_initializer_ = nullptr;
   lbfgs::Twoloop twoloop_;
   int nthreads_ = DEFAULT_NTHREADS;
 
   real_t alpha_ = 0;
+  /** \brief <∇f(w), p> of the current direction */
+  real_t dir_pg_ = 0;
 };
 }  // namespace difacto
 #endif  // DIFACTO_LBFGS_LBFGS_UPDATER_H_
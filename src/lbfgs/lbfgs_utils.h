@@ -5,10 +5,12 @@
 #define DIFACTO_LBFGS_LBFGS_UTILS_H_
 #include <string>
 #include <vector>
+#include <algorithm>
+#include <functional>
 #include "dmlc/memory_io.h"
-#include "dmlc/omp.h"
 #include "difacto/base.h"
 #include "difacto/sarray.h"
+#include "common/thread_pool.h"
 namespace difacto {
 namespace lbfgs {
 
@@ -20,8 +22,8 @@ struct Job {
   static const int kPrepareCalcDirection = 5;
   static const int kCalcDirection = 6;
   static const int kLineSearch = 7;
-  static const int kSaveModel = 8;
   static const int kEvaluate = 8;
+  static const int kSaveModel = 9;
 
   int type;
   std::vector<real_t> value;
@@ -64,13 +66,15 @@ struct Progress {
 inline double Inner(const SArray<real_t>& a,
                     const SArray<real_t>& b,
                     int nthreads = DEFAULT_NTHREADS) {
-  double res = 0;
   CHECK_EQ(a.size(), b.size());
   real_t const *ap = a.data();
   real_t const *bp = b.data();
-#pragma omp parallel for reduction(+:res) num_threads(nthreads)
-  for (size_t i = 0; i < a.size(); ++i) res += ap[i] * bp[i];
-  return res;
+  Range all(0, a.size());
+  return ParallelSum<double>(all, nthreads, [ap, bp](const Range& rg) {
+      double res = 0;
+      for (size_t i = rg.begin; i < rg.end; ++i) res += ap[i] * bp[i];
+      return res;
+    });
 }
 
 /**
@@ -83,13 +87,149 @@ inline void Add(real_t x, const SArray<real_t>& a,
   if (x == 0) return;
   real_t const *ap = a.data();
   real_t *bp = b->data();
-  if (x == 1) {
-#pragma omp parallel for num_threads(nthreads)
-    for (size_t i = 0; i < a.size(); ++i) bp[i] += ap[i];
-  } else {
-#pragma omp parallel for num_threads(nthreads)
-    for (size_t i = 0; i < a.size(); ++i) bp[i] += x * ap[i];
+  ParallelRange(Range(0, a.size()), nthreads, [x, ap, bp](const Range& rg) {
+      if (x == 1) {
+        for (size_t i = rg.begin; i < rg.end; ++i) bp[i] += ap[i];
+      } else {
+        for (size_t i = rg.begin; i < rg.end; ++i) bp[i] += x * ap[i];
+      }
+    });
+}
+
+/**
+ * \brief a read-only vector which is read block by block.
+ *
+ * it is either a plain SArray, or a vector stored in a compact format or on
+ * disk, which is decoded block by block by a reader.
+ */
+class BlockVec {
+ public:
+  /**
+   * \brief return the pointer to the entries [begin, end), buf has space for
+   * end - begin entries and can be used to store the decoded entries
+   */
+  typedef std::function<const real_t*(
+      size_t begin, size_t end, real_t* buf)> Reader;
+
+  BlockVec() { }
+  BlockVec(const SArray<real_t>& vec) : size_(vec.size()), vec_(vec) { }  // NOLINT
+  BlockVec(size_t size, const Reader& reader) : size_(size), reader_(reader) { }
+
+  size_t size() const { return size_; }
+
+  const real_t* Read(size_t begin, size_t end, real_t* buf) const {
+    return reader_ ? reader_(begin, end, buf) : vec_.data() + begin;
+  }
+
+ private:
+  size_t size_ = 0;
+  SArray<real_t> vec_;
+  Reader reader_;
+};
+
+/** \brief the block size used by \ref MultiInner and \ref MultiAdd */
+static const size_t kBlockSize = 1 << 11;
+
+/**
+ * \brief res[i * b.size() + j] = <a[i], b[j]>
+ *
+ * all inner products are computed in a single pass. the vectors are processed
+ * block by block, so that the blocks of all vectors stay in cache, and each
+ * element is read from memory only once.
+ */
+inline void MultiInner(const std::vector<BlockVec>& a,
+                       const std::vector<BlockVec>& b,
+                       std::vector<double>* res,
+                       int nthreads = DEFAULT_NTHREADS) {
+  size_t na = a.size(), nb = b.size();
+  CHECK(na && nb);
+  size_t n = a[0].size();
+  for (size_t i = 0; i < na; ++i) CHECK_EQ(a[i].size(), n);
+  for (size_t j = 0; j < nb; ++j) CHECK_EQ(b[j].size(), n);
+  res->assign(na * nb, 0);
+
+  // each segment of blocks sums into its own results, which are then added in
+  // the order of the segments
+  size_t nblk = (n + kBlockSize - 1) / kBlockSize;
+  int nparts = static_cast<int>(std::max<size_t>(
+      1, std::min<size_t>(std::max(nthreads, 1), nblk)));
+  std::vector<std::vector<double>> locals(nparts);
+  ParallelFor(nparts, nparts, [&](int part, int tid) {
+      auto& local = locals[part];
+      local.resize(na * nb);
+      std::vector<real_t> buf((na + nb) * kBlockSize);
+      std::vector<real_t const*> ap(na), bp(nb);
+      Range blks = Range(0, nblk).Segment(part, nparts);
+      for (size_t k = blks.begin; k < blks.end; ++k) {
+        size_t begin = k * kBlockSize, end = std::min(n, begin + kBlockSize);
+        size_t len = end - begin;
+        for (size_t i = 0; i < na; ++i) {
+          ap[i] = a[i].Read(begin, end, buf.data() + i * kBlockSize);
+        }
+        for (size_t j = 0; j < nb; ++j) {
+          bp[j] = b[j].Read(begin, end, buf.data() + (na + j) * kBlockSize);
+        }
+        // a is usually short, so read each b[j] once for all a[i]
+        for (size_t j = 0; j < nb; ++j) {
+          real_t const* y = bp[j];
+          size_t i = 0;
+          for (; i + 2 < na; i += 3) {
+            real_t const *x0 = ap[i], *x1 = ap[i+1], *x2 = ap[i+2];
+            double s0 = 0, s1 = 0, s2 = 0;
+            for (size_t l = 0; l < len; ++l) {
+              s0 += x0[l] * y[l]; s1 += x1[l] * y[l]; s2 += x2[l] * y[l];
+            }
+            local[i * nb + j] += s0;
+            local[(i+1) * nb + j] += s1;
+            local[(i+2) * nb + j] += s2;
+          }
+          for (; i < na; ++i) {
+            real_t const* x = ap[i];
+            double s = 0;
+            for (size_t l = 0; l < len; ++l) s += x[l] * y[l];
+            local[i * nb + j] += s;
+          }
+        }
+      }
+    });
+  for (const auto& local : locals) {
+    for (size_t i = 0; i < local.size(); ++i) (*res)[i] += local[i];
+  }
+}
+
+/**
+ * \brief b += sum_i x[i] * a[i]
+ *
+ * a blocked version of calling \ref Add for each i, so b is read and written
+ * only once.
+ */
+inline void MultiAdd(const std::vector<double>& x,
+                     const std::vector<BlockVec>& a,
+                     SArray<real_t>* b,
+                     int nthreads = DEFAULT_NTHREADS) {
+  CHECK_EQ(x.size(), a.size());
+  size_t n = b->size();
+  std::vector<BlockVec const*> ap;
+  std::vector<real_t> xs;
+  for (size_t i = 0; i < a.size(); ++i) {
+    CHECK_EQ(a[i].size(), n);
+    if (x[i] == 0) continue;
+    ap.push_back(&a[i]);
+    xs.push_back(x[i]);
   }
+  real_t* bp = b->data();
+  size_t nblk = (n + kBlockSize - 1) / kBlockSize;
+  ParallelRange(Range(0, nblk), nthreads, [&](const Range& blks) {
+      std::vector<real_t> buf(kBlockSize);
+      for (size_t k = blks.begin; k < blks.end; ++k) {
+        size_t begin = k * kBlockSize, end = std::min(n, begin + kBlockSize);
+        for (size_t i = 0; i < ap.size(); ++i) {
+          real_t const* y = ap[i]->Read(begin, end, buf.data()) - begin;
+          real_t v = xs[i];
+          for (size_t l = begin; l < end; ++l) bp[l] += v * y[l];
+        }
+      }
+    });
 }
 
 /**
@@ -98,10 +238,133 @@ inline void Add(real_t x, const SArray<real_t>& a,
 inline void Times(real_t x, SArray<real_t>* a, int nthreads = DEFAULT_NTHREADS) {
   if (x == 1) return;
   real_t *ap = a->data();
-#pragma omp parallel for num_threads(nthreads)
-  for (size_t i = 0; i < a->size(); ++i) ap[i] *= x;
+  ParallelRange(Range(0, a->size()), nthreads, [x, ap](const Range& rg) {
+      for (size_t i = rg.begin; i < rg.end; ++i) ap[i] *= x;
+    });
+}
+
+
+/**
+ * \brief calls fn(i) for each i such that w[i] is the linear weight of a
+ * feature rather than its embedding
+ *
+ * @param lens the model length of each feature, empty means all are 1
+ * @param n the total model length
+ */
+template <typename Fn>
+inline void ForEachW(const SArray<int>& lens, size_t n, const Fn& fn) {
+  if (lens.empty()) {
+    for (size_t i = 0; i < n; ++i) fn(i);
+  } else {
+    size_t i = 0;
+    for (int l : lens) { fn(i); i += l; }
+    CHECK_EQ(i, n);
+  }
+}
+
+/**
+ * \brief the pseudo-gradient of f(w) + l1 * |w|_1 used by OWL-QN
+ *
+ * only the linear weights are l1 regularized
+ *
+ * @param l1 the l1 regularizer
+ * @param w the weights
+ * @param lens the model lengths, see \ref ForEachW
+ * @param grad the gradient of f(w), will be changed into the pseudo-gradient
+ */
+inline void PseudoGradient(real_t l1, const SArray<real_t>& w,
+                           const SArray<int>& lens, SArray<real_t>* grad) {
+  CHECK_EQ(w.size(), grad->size());
+  real_t* g = grad->data();
+  ForEachW(lens, w.size(), [l1, &w, g](size_t i) {
+      if (w[i] > 0) {
+        g[i] += l1;
+      } else if (w[i] < 0) {
+        g[i] -= l1;
+      } else if (g[i] + l1 < 0) {
+        g[i] += l1;
+      } else if (g[i] - l1 > 0) {
+        g[i] -= l1;
+      } else {
+        g[i] = 0;
+      }
+    });
+}
+
+/**
+ * \brief w = π(w0 + α * p), the OWL-QN step
+ *
+ * a linear weight is set to 0 if it leaves the orthant of w0. if w0[i] = 0,
+ * the orthant is given by the sign of p[i], which is already constrained to
+ * be the one of the negative pseudo-gradient.
+ *
+ * @param alpha the step size
+ * @param w0 the weights before this step
+ * @param p the direction
+ * @param lens the model lengths, see \ref ForEachW
+ * @param w the new weights
+ */
+inline void OrthantStep(real_t alpha, const SArray<real_t>& w0,
+                        const SArray<real_t>& p, const SArray<int>& lens,
+                        SArray<real_t>* w, int nthreads = DEFAULT_NTHREADS) {
+  CHECK_EQ(w0.size(), p.size());
+  w->CopyFrom(w0);
+  Add(alpha, p, w, nthreads);
+  real_t* v = w->data();
+  ForEachW(lens, w0.size(), [&w0, v](size_t i) {
+      if (w0[i] * v[i] < 0) v[i] = 0;
+    });
 }
 
+/**
+ * \brief return <g, w - w0> / α
+ *
+ * the directional derivative along the actual step of \ref OrthantStep, which
+ * differs from <g, p> once a weight is projected
+ */
+inline double InnerStep(const SArray<real_t>& g, const SArray<real_t>& w,
+                        const SArray<real_t>& w0, real_t alpha,
+                        int nthreads = DEFAULT_NTHREADS) {
+  CHECK_EQ(g.size(), w.size());
+  CHECK_EQ(w0.size(), w.size());
+  CHECK_GT(alpha, 0);
+  real_t const *gp = g.data();
+  real_t const *wp = w.data();
+  real_t const *w0p = w0.data();
+  Range all(0, g.size());
+  double res = ParallelSum<double>(all, nthreads, [&](const Range& rg) {
+      double s = 0;
+      for (size_t i = rg.begin; i < rg.end; ++i) {
+        s += gp[i] * (wp[i] - w0p[i]);
+      }
+      return s;
+    });
+  return res / alpha;
+}
+
+/**
+ * \brief write an array into a stream
+ */
+template <typename T>
+inline void SaveSArray(const SArray<T>& a, dmlc::Stream* fo) {
+  uint64_t n = a.size();
+  fo->Write(&n, sizeof(n));
+  if (n) fo->Write(a.data(), n * sizeof(T));
+}
+
+/**
+ * \brief read an array from a stream
+ */
+template <typename T>
+inline void LoadSArray(dmlc::Stream* fi, SArray<T>* a) {
+  uint64_t n;
+  CHECK_EQ(fi->Read(&n, sizeof(n)), sizeof(n)) << "invalid checkpoint";
+  a->resize(n);
+  if (n) {
+    CHECK_EQ(fi->Read(a->data(), n * sizeof(T)), n * sizeof(T))
+        << "invalid checkpoint";
+  }
+}
 
 inline void RemoveTailFeatures(const SArray<feaid_t>& feaids,
                                const SArray<real_t>& feacnts,
@@ -7,8 +7,8 @@
 #include <vector>
 #include "difacto/base.h"
 #include "dmlc/logging.h"
-#include "dmlc/omp.h"
 #include "difacto/sarray.h"
+#include "common/thread_pool.h"
 namespace difacto {
 
 /**
@@ -56,38 +56,44 @@ class BinClassMetric {
   }
 
   real_t Accuracy(real_t threshold) {
-    real_t correct = 0;
     size_t n = size_;
-#pragma omp parallel for reduction(+:correct) num_threads(nt_)
-    for (size_t i = 0; i < n; ++i) {
-      if ((label_[i] > 0 && predict_[i] > threshold) ||
-          (label_[i] <= 0 && predict_[i] <= threshold))
-        correct += 1;
-    }
+    Range all(0, n);
+    real_t correct = ParallelSum<real_t>(all, nt_, [&](const Range& rg) {
+        real_t c = 0;
+        for (size_t i = rg.begin; i < rg.end; ++i) {
+          if ((label_[i] > 0 && predict_[i] > threshold) ||
+              (label_[i] <= 0 && predict_[i] <= threshold))
+            c += 1;
+        }
+        return c;
+      });
     return correct > 0.5 * n ? correct : n - correct;
   }
 
   real_t LogLoss() {
-    real_t loss = 0;
-    size_t n = size_;
-#pragma omp parallel for reduction(+:loss) num_threads(nt_)
-    for (size_t i = 0; i < n; ++i) {
-      real_t y = label_[i] > 0;
-      real_t p = 1 / (1 + exp(- predict_[i]));
-      p = p < 1e-10 ? 1e-10 : p;
-      loss += y * log(p) + (1 - y) * log(1 - p);
-    }
+    Range all(0, size_);
+    real_t loss = ParallelSum<real_t>(all, nt_, [&](const Range& rg) {
+        real_t l = 0;
+        for (size_t i = rg.begin; i < rg.end; ++i) {
+          real_t y = label_[i] > 0;
+          real_t p = 1 / (1 + exp(- predict_[i]));
+          p = p < 1e-10 ? 1e-10 : p;
+          l += y * log(p) + (1 - y) * log(1 - p);
+        }
+        return l;
+      });
     return - loss;
   }
 
   real_t LogitObjv() {
-    real_t objv = 0;
-#pragma omp parallel for reduction(+:objv) num_threads(nt_)
-    for (size_t i = 0; i < size_; ++i) {
-      real_t y = label_[i] > 0 ? 1 : -1;
-      objv += log(1 + exp(- y * predict_[i]));
-    }
-    return objv;
+    return ParallelSum<real_t>(Range(0, size_), nt_, [&](const Range& rg) {
+        real_t objv = 0;
+        for (size_t i = rg.begin; i < rg.end; ++i) {
+          real_t y = label_[i] > 0 ? 1 : -1;
+          objv += log(1 + exp(- y * predict_[i]));
+        }
+        return objv;
+      });
   }
 
  private:
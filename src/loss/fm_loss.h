@@ -11,6 +11,7 @@
 #include "difacto/loss.h"
 #include "common/spmv.h"
 #include "common/spmm.h"
+#include "common/thread_pool.h"
 #include "./logit_loss.h"
 namespace difacto {
 /**
@@ -47,6 +48,9 @@ struct FMLossParam : public dmlc::Parameter<FMLossParam> {
  */
 class FMLoss : public Loss {
  public:
+  /** \brief the bound of the predictions of a model with V */
+  static constexpr real_t kMaxPred = 20;
+
   FMLoss() {}
   virtual ~FMLoss() {}
 
@@ -109,29 +113,32 @@ class FMLoss : public Loss {
 
     // VV = V*V
     SArray<real_t> VV(V.size());
-#pragma omp parallel for num_threads(nthreads_)
-    for (size_t i = 0; i < V_pos.size(); ++i) {
-      int p = V_pos[i];
-      if (p < 0) continue;
-      for (int j = 0; j < V_dim; ++j) VV[p+j] = V[p+j] * V[p+j];
-    }
+    ParallelRange(Range(0, V_pos.size()), nthreads_, [&](const Range& rg) {
+        for (size_t i = rg.begin; i < rg.end; ++i) {
+          int p = V_pos[i];
+          if (p < 0) continue;
+          for (int j = 0; j < V_dim; ++j) VV[p+j] = V[p+j] * V[p+j];
+        }
+      });
 
     // XXVV = XX*VV
     SArray<real_t> XXVV(XV_.size());
     SpMM::Times(XX, VV, V_dim, &XXVV, nthreads_, V_pos);
 
     // py += .5 * sum((V.XV).^2 - xxvv)
-#pragma omp parallel for num_threads(nthreads_)
-    for (size_t i = 0; i < pred->size(); ++i) {
-      real_t* t = XV_.data() + i * V_dim;
-      real_t* tt = XXVV.data() + i * V_dim;
-      real_t s = 0;
-      for (int j = 0; j < V_dim; ++j) s += t[j] * t[j] - tt[j];
-      (*pred)[i] += .5 * s;
-    }
+    ParallelRange(Range(0, pred->size()), nthreads_, [&](const Range& rg) {
+        for (size_t i = rg.begin; i < rg.end; ++i) {
+          real_t* t = XV_.data() + i * V_dim;
+          real_t* tt = XXVV.data() + i * V_dim;
+          real_t s = 0;
+          for (int j = 0; j < V_dim; ++j) s += t[j] * t[j] - tt[j];
+          (*pred)[i] += .5 * s;
+        }
+      });
 
     // projection
-    for (auto& p : *pred) p = p > 20 ? 20 : (p < -20 ? -20 : p);
+    real_t m = kMaxPred;
+    for (auto& p : *pred) p = p > m ? m : (p < -m ? -m : p);
   }
 
   /*!
@@ -170,11 +177,12 @@ class FMLoss : public Loss {
     // p = ...
     SArray<real_t> p; p.CopyFrom(pred);
     CHECK_EQ(p.size(), data.size);
-#pragma omp parallel for num_threads(nthreads_)
-    for (size_t i = 0; i < p.size(); ++i) {
-      real_t y = data.label[i] > 0 ? 1 : -1;
-      p[i] = - y / (1 + std::exp(y * p[i]));
-    }
+    ParallelRange(Range(0, p.size()), nthreads_, [&](const Range& rg) {
+        for (size_t i = rg.begin; i < rg.end; ++i) {
+          real_t y = data.label[i] > 0 ? 1 : -1;
+          p[i] = - y / (1 + std::exp(y * p[i]));
+        }
+      });
 
     // grad_w = ...
     SpMV::TransTimes(data, p, grad, nthreads_, {}, w_pos);
@@ -194,21 +202,23 @@ class FMLoss : public Loss {
     SpMV::TransTimes(XX, p, &XXp, nthreads_);
 
     // grad_u -= diag(XXp) * V,
-#pragma omp parallel for num_threads(nthreads_)
-    for (size_t i = 0; i < V_pos.size(); ++i) {
-      int p = V_pos[i];
-      if (p < 0) continue;
-      for (int j = 0; j < V_dim; ++j) {
-        (*grad)[p+j] -= V[p+j] * XXp[i];
-      }
-    }
+    ParallelRange(Range(0, V_pos.size()), nthreads_, [&](const Range& rg) {
+        for (size_t i = rg.begin; i < rg.end; ++i) {
+          int p = V_pos[i];
+          if (p < 0) continue;
+          for (int j = 0; j < V_dim; ++j) {
+            (*grad)[p+j] -= V[p+j] * XXp[i];
+          }
+        }
+      });
 
     // XV_ = diag(p) * X * V
     CHECK_EQ(XV_.size(), data.size * V_dim);
-#pragma omp parallel for num_threads(nthreads_)
-    for (size_t i = 0; i < p.size(); ++i) {
-      for (int j = 0; j < V_dim; ++j) XV_[i*V_dim+j] *= p[i];
-    }
+    ParallelRange(Range(0, p.size()), nthreads_, [&](const Range& rg) {
+        for (size_t i = rg.begin; i < rg.end; ++i) {
+          for (int j = 0; j < V_dim; ++j) XV_[i*V_dim+j] *= p[i];
+        }
+      });
 
     // grad_u += X' * diag(p) * X * V
     SpMM::TransTimes(data, XV_, V_dim, grad, nthreads_, {}, V_pos);
@@ -5,14 +5,26 @@
 #define DIFACTO_LOSS_FM_LOSS_DELTA_H_
 #include <vector>
 #include "difacto/sarray.h"
+#include "common/spmv.h"
+#include "common/spmm.h"
+#include "common/thread_pool.h"
 #include "./fm_loss.h"
+#include "./logit_loss_delta.h"
 namespace difacto {
 
 /**
- * \brief the FM loss, different to \ref FMLoss, \ref FMLossDelta is feeded with
- * delta weight, and tranpose of X, each time
+ * \brief the FM loss, specialized for block coordinate descent
+ *
+ * different to \ref FMLoss, \ref FMLossDelta is feeded with X' (the transpose
+ * of X, in row-major format) and delta weight each time. Besides pred, it
+ * maintains XV = X * V for the rows, which is provided by the caller and
+ * updated in place by \ref Predict.
+ *
+ * The linear part is handled by \ref LogitLossDelta. All positions are the
+ * positions in the model vector of this block, where the embedding of a
+ * feature is stored continuously.
  */
-class FMLossDelta : public FMLoss {
+class FMLossDelta : public LogitLossDelta {
  public:
   /** \brief constructor */
   FMLossDelta() { }
@@ -20,39 +32,189 @@ class FMLossDelta : public FMLoss {
   virtual ~FMLossDelta() { }
 
   KWArgs Init(const KWArgs& kwargs) override {
-    return kwargs;
+    auto remain = LogitLossDelta::Init(kwargs);
+    return fm_param_.InitAllowUnknown(remain);
   }
 
   /**
+   * \brief pred += X * delta_w + .5 * sum(XV_new.^2 - XV.^2 - (X.*X)*(V_new.^2 - V.^2), 2)
+   *
    * @param data X', the transpose of X
    * @param param parameters
-   * - param[0], real_t, previous predict
-   * - param[1], int, param[1][i] is the length of the gradient on the i-th feature
-   *   and sum(param[2]) = length(grad)
-   * - param[2], real_t, the prediction (results of \ref Predict)
-   * @param grad output gradient
+   * - param[0], real_t, delta weight, namely new_w - old_w
+   * - param[1], int, the positions of w
+   * - param[2], optional int, the positions of V, -1 means no embedding
+   * - param[3], optional real_t, the old model, with the same layout as param[0]
+   * - param[4], optional real_t, XV, will be updated into X * V_new
+   * @param pred the prediction, should be pre-allocated
    */
-  void CalcGrad(const dmlc::RowBlock<unsigned>& data,
-                const std::vector<SArray<char>>& param,
-                SArray<real_t>* grad) override {
-    // TODO(mli)
+  void Predict(const dmlc::RowBlock<unsigned>& data,
+               const std::vector<SArray<char>>& param,
+               SArray<real_t>* pred) override {
+    int psize = param.size();
+    CHECK(psize == 2 || psize == 5);
+    LogitLossDelta::Predict(data, {param[0], param[1]}, pred);
+    int V_dim = fm_param_.V_dim;
+    if (V_dim == 0 || psize == 2) return;
+
+    SArray<real_t> delta_w(param[0]);
+    SArray<int> V_pos(param[2]);
+    SArray<real_t> model(param[3]);
+    SArray<real_t> XV(param[4]);
+    CHECK_EQ(V_pos.size(), data.size);
+    CHECK_EQ(XV.size(), pred->size() * V_dim);
+    CHECK_EQ(model.size(), delta_w.size());
+
+    // dXV = X * delta_V
+    SArray<real_t> dXV(XV.size());
+    SpMM::TransTimes(data, delta_w, V_dim, &dXV, nthreads_, V_pos, {});
+
+    // dVV = sum(V_new.^2 - V.^2, 2)
+    SArray<real_t> dVV(data.size);
+    for (size_t i = 0; i < data.size; ++i) {
+      int p = V_pos[i];
+      if (p < 0) continue;
+      for (int k = 0; k < V_dim; ++k) {
+        real_t v = model[p+k], v_new = v + delta_w[p+k];
+        dVV[i] += v_new * v_new - v * v;
+      }
+    }
+
+    // XXdVV = (X.*X) * dVV
+    auto XX = data;
+    SArray<dmlc::real_t> xx_value;
+    if (data.value) {
+      xx_value.resize(data.offset[data.size]);
+      for (size_t i = data.offset[0]; i < data.offset[data.size]; ++i) {
+        xx_value[i] = data.value[i] * data.value[i];
+      }
+      XX.value = xx_value.data();
+    }
+    SArray<real_t> XXdVV(pred->size());
+    SpMV::TransTimes(XX, dVV, &XXdVV, nthreads_);
+
+    // pred += ..., XV += dXV
+    ParallelRange(Range(0, pred->size()), nthreads_, [&](const Range& rg) {
+        for (size_t i = rg.begin; i < rg.end; ++i) {
+          real_t* t = XV.data() + i * V_dim;
+          real_t* dt = dXV.data() + i * V_dim;
+          real_t s = 0;
+          for (int k = 0; k < V_dim; ++k) {
+            real_t t_new = t[k] + dt[k];
+            s += t_new * t_new - t[k] * t[k];
+            t[k] = t_new;
+          }
+          (*pred)[i] += .5 * (s - XXdVV[i]);
+        }
+      });
+  }
+
+  /**
+   * \brief add the changes computed by \ref Predict with a zero XV
+   *
+   * given XV = 0, Predict returns dXV = X * delta_V in XV, and misses the term
+   * sum(XV .* dXV, 2) of the prediction, which needs the current XV. it is
+   * added here together with dpred, and XV += dXV. it runs in the calling
+   * thread only, so the caller can hold a lock.
+   *
+   * @param dpred the prediction changes returned by Predict
+   * @param dXV the XV returned by Predict
+   * @param V_dim the embedding dimension
+   * @param pred the prediction to update
+   * @param XV the current XV to update
+   */
+  static void AddDelta(const SArray<real_t>& dpred,
+                       const SArray<real_t>& dXV,
+                       int V_dim,
+                       SArray<real_t>* pred,
+                       SArray<real_t>* XV) {
+    CHECK_EQ(dpred.size(), pred->size());
+    CHECK_EQ(dXV.size(), XV->size());
+    CHECK_EQ(XV->size(), pred->size() * V_dim);
+    for (size_t i = 0; i < pred->size(); ++i) {
+      real_t* t = XV->data() + i * V_dim;
+      real_t const* dt = dXV.data() + i * V_dim;
+      real_t s = 0;
+      for (int k = 0; k < V_dim; ++k) {
+        s += t[k] * dt[k];
+        t[k] += dt[k];
+      }
+      (*pred)[i] += dpred[i] + s;
+    }
   }
 
   /**
+   * \brief compute the gradients and the diagonal hessians
+   *
+   * p = - y ./ (1 + exp(y .* pred)), tau = 1 ./ (1 + exp(y .* pred))
+   * for V_jk, denote by u_ij = x_ij * (XV_ik - x_ij * V_jk), then
+   *    f'(V_jk) = sum_i p_i * u_ij
+   *    f''(V_jk) = sum_i tau_i * (1 - tau_i) * u_ij^2
+   *
+   * the first order and second order gradients are stored in pairs, namely
+   * the gradient of model[p] is at grad[2*p], the hessian is at grad[2*p+1]
+   *
    * @param data X', the transpose of X
-   * @param param parameters
-   * - param[0], real_t, previous predict
-   * - param[1], real_t, delta weight, namely new_w - old_w
-   * - param[2], int, param[2][i] is the length of delta_w[i].
-   *   and sum(param[2]) = length(delta_w)
-   * @param pred output prediction, it may overwrite param[0]
+   * @param param input parameters
+   * - param[0:3], see \ref LogitLossDelta::CalcGrad
+   * - param[3], optional int, the positions of V, -1 means no embedding
+   * - param[4], optional real_t, the model
+   * - param[5], optional real_t, XV
+   * @param grad gradient output, should be preallocated
    */
-  void Predict(const dmlc::RowBlock<unsigned>& data,
-               const std::vector<SArray<char>>& param,
-               SArray<real_t>* pred) override {
-    *CHECK_NOTNULL(pred) = param[0];
-    FMLoss::Predict(data, {param[1], param[2]}, pred);
+  void CalcGrad(const dmlc::RowBlock<unsigned>& data,
+                const std::vector<SArray<char>>& param,
+                SArray<real_t>* grad) override {
+    int psize = param.size();
+    CHECK(psize <= 3 || psize == 6);
+    LogitLossDelta::CalcGrad(
+        data, std::vector<SArray<char>>(
+            param.begin(), param.begin() + std::min(psize, 3)), grad);
+    int V_dim = fm_param_.V_dim;
+    if (V_dim == 0 || psize <= 3 || grad->empty()) return;
+
+    SArray<real_t> pred(param[0]);
+    SArray<int> V_pos(param[3]);
+    SArray<real_t> V(param[4]);
+    SArray<real_t> XV(param[5]);
+    CHECK_EQ(V_pos.size(), data.size);
+    CHECK_EQ(XV.size(), pred.size() * V_dim);
+
+    // p = ..., h = tau .* (1 - tau)
+    SArray<real_t> p(pred.size()), h(pred.size());
+    CHECK_NOTNULL(data.label);
+    ParallelRange(Range(0, p.size()), nthreads_, [&](const Range& rg) {
+        for (size_t i = rg.begin; i < rg.end; ++i) {
+          real_t y = data.label[i] > 0 ? 1 : -1;
+          real_t tau = 1 / (1 + std::exp(y * pred[i]));
+          p[i] = - y * tau;
+          h[i] = tau * (1 - tau);
+        }
+      });
+
+    // each row of X' is a feature, so no write conflict
+    ParallelRange(Range(0, data.size), nthreads_, [&](const Range& rg) {
+        for (size_t j = rg.begin; j < rg.end; ++j) {
+          int pos = V_pos[j];
+          if (pos < 0) continue;
+          real_t* g = grad->data() + pos * 2;
+          real_t const* v = V.data() + pos;
+          for (size_t o = data.offset[j]; o < data.offset[j+1]; ++o) {
+            unsigned i = data.index[o];
+            real_t x = data.value ? data.value[o] : 1;
+            real_t const* xv = XV.data() + i * V_dim;
+            for (int k = 0; k < V_dim; ++k) {
+              real_t u = x * (xv[k] - x * v[k]);
+              g[2*k] += p[i] * u;
+              g[2*k+1] += h[i] * u * u;
+            }
+          }
+        }
+      });
   }
+
+ private:
+  FMLossParam fm_param_;
 };
 }  // namespace difacto
 
@@ -8,7 +8,7 @@
 #include "difacto/base.h"
 #include "difacto/loss.h"
 #include "dmlc/data.h"
-#include "dmlc/omp.h"
+#include "common/thread_pool.h"
 #include "common/spmv.h"
 namespace difacto {
 
@@ -70,11 +70,12 @@ class LogitLoss : public Loss {
     SArray<int> grad_pos = psize == 2 ? SArray<int>(param[1]) : SArray<int>();
     // p = ...
     CHECK_NOTNULL(data.label);
-#pragma omp parallel for num_threads(nthreads_)
-    for (size_t i = 0; i < p.size(); ++i) {
-      real_t y = data.label[i] > 0 ? 1 : -1;
-      p[i] = - y / (1 + std::exp(y * p[i]));
-    }
+    ParallelRange(Range(0, p.size()), nthreads_, [&](const Range& rg) {
+        for (size_t i = rg.begin; i < rg.end; ++i) {
+          real_t y = data.label[i] > 0 ? 1 : -1;
+          p[i] = - y / (1 + std::exp(y * p[i]));
+        }
+      });
 
     // grad += ...
     SpMV::TransTimes(data, p, grad, nthreads_, {}, grad_pos);
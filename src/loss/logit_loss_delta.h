@@ -4,12 +4,13 @@
 #ifndef DIFACTO_LOSS_LOGIT_LOSS_DELTA_H_
 #define DIFACTO_LOSS_LOGIT_LOSS_DELTA_H_
 #include <cmath>
+#include <algorithm>
 #include <vector>
 #include "difacto/loss.h"
 #include "difacto/sarray.h"
 #include "common/range.h"
 #include "common/spmv.h"
-#include "dmlc/omp.h"
+#include "common/thread_pool.h"
 #include "dmlc/logging.h"
 namespace difacto {
 
@@ -78,6 +79,13 @@ class LogitLossDelta : public Loss {
    *    f'(w) =  - X' * (tau .* y)
    * diagnal second order grad :
    *    f''(w) = (X.*X)' * (tau .* (1-tau))
+   * the upper bound of the diagnal second order grad within the trust region
+   * |w_j - w_j^old| <= delta_j, used if compute_hession == 2:
+   *    u(w_j) = sum_i x_ij^2 * min(.25, exp(|x_ij| delta_j) * tau_i * (1-tau_i))
+   * which follows from that the log of the logistic function's second
+   * derivative is 1-Lipschitz.
+   *
+   * the gradient and the hessian are computed in a single pass over the data
    *
    * @param data X', the transpose of X
    * @param param input parameters
@@ -98,52 +106,58 @@ class LogitLossDelta : public Loss {
     // p = ...
     SArray<real_t> p; p.CopyFrom(SArray<real_t>(param[0]));
     CHECK_NOTNULL(data.label);
-#pragma omp parallel for num_threads(nthreads_)
-    for (size_t i = 0; i < p.size(); ++i) {
-      real_t y = data.label[i] > 0 ? 1 : -1;
-      p[i] = - y / (1 + std::exp(y * p[i]));
-    }
+    ParallelRange(Range(0, p.size()), nthreads_, [&](const Range& rg) {
+        for (size_t i = rg.begin; i < rg.end; ++i) {
+          real_t y = data.label[i] > 0 ? 1 : -1;
+          p[i] = - y / (1 + std::exp(y * p[i]));
+        }
+      });
 
     // grad = ...
     SArray<int> grad_pos = psize > 1 ? SArray<int>(param[1]) : SArray<int>();
-    if (param_.compute_hession != 0) CHECK(!grad_pos.empty());
-    SpMV::Times(data, p, grad, nthreads_, {}, grad_pos);
-    if (param_.compute_hession == 0) return;
-
-    // h = ...
-    SArray<int> h_pos; h_pos.CopyFrom(grad_pos);
-    for (size_t i = 0; i < h_pos.size(); ++i) {
-      if (h_pos[i] >= 0) ++h_pos[i];
+    if (param_.compute_hession == 0) {
+      SpMV::Times(data, p, grad, nthreads_, {}, grad_pos);
+      return;
     }
-
-    // compute X .* X
-    dmlc::RowBlock<unsigned> XX = data;
-    SArray<dmlc::real_t> xx_value;
-    if (data.value) {
-      xx_value.resize(data.offset[data.size]);
-      for (size_t i = data.offset[0]; i < data.offset[data.size]; ++i) {
-        xx_value[i] = data.value[i] * data.value[i];
-      }
-      XX.value = xx_value.data();
+    CHECK_EQ(grad_pos.size(), data.size);
+    SArray<real_t> delta;
+    if (param_.compute_hession == 2) {
+      CHECK_EQ(psize, 3);
+      delta = SArray<real_t>(param[2]);
+      CHECK_EQ(delta.size(), data.size);
     }
 
-    // p = tau * (1 - tau)
-#pragma omp parallel for num_threads(nthreads_)
-    for (size_t i = 0; i < p.size(); ++i) {
-      real_t y = data.label[i] > 0 ? 1 : -1;
-      p[i] = - p[i] * (y + p[i]);
-    }
+    // q = tau * (1 - tau)
+    SArray<real_t> q(p.size());
+    ParallelRange(Range(0, p.size()), nthreads_, [&](const Range& rg) {
+        for (size_t i = rg.begin; i < rg.end; ++i) {
+          real_t y = data.label[i] > 0 ? 1 : -1;
+          q[i] = - p[i] * (y + p[i]);
+        }
+      });
 
-    if (param_.compute_hession == 1) {
-      SpMV::Times(XX, p, grad, nthreads_, {}, h_pos);
-    } else if (param_.compute_hession == 2) {
-      LOG(FATAL) << "...";
-      CHECK_EQ(psize, 3);
-      SArray<real_t> delta(param[2]);
-      // TODO(mli)
-    } else {
-      LOG(FATAL) << "...";
-    }
+    // grad and hessian, each row of X' is a feature, so no write conflict
+    ParallelRange(Range(0, data.size), nthreads_, [&](const Range& rg) {
+        for (size_t j = rg.begin; j < rg.end; ++j) {
+          int pos = grad_pos[j];
+          if (pos < 0) continue;
+          real_t g = 0, h = 0;
+          real_t d = delta.empty() ? 0 : delta[j];
+          for (size_t o = data.offset[j]; o < data.offset[j+1]; ++o) {
+            unsigned i = data.index[o];
+            real_t x = data.value ? data.value[o] : 1;
+            g += p[i] * x;
+            if (delta.empty()) {
+              h += q[i] * x * x;
+            } else {
+              h += std::min(static_cast<real_t>(.25),
+                            std::exp(std::fabs(x) * d) * q[i]) * x * x;
+            }
+          }
+          (*grad)[pos] += g;
+          (*grad)[pos+1] += h;
+        }
+      });
   }
 
  private:
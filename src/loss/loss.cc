@@ -2,8 +2,11 @@
  * Copyright (c) 2015 by Contributors
  */
 #include "difacto/loss.h"
+#include <cmath>
+#include "common/thread_pool.h"
 #include "./fm_loss.h"
 #include "./logit_loss_delta.h"
+#include "./fm_loss_delta.h"
 #include "./logit_loss.h"
 namespace difacto {
 
@@ -18,6 +21,8 @@ Loss* Loss::Create(const std::string& type, int nthreads) {
     loss = new LogitLoss();
   } else if (type == "logit_delta") {
     loss = new LogitLossDelta();
+  } else if (type == "fm_delta") {
+    loss = new FMLossDelta();
   } else {
     LOG(FATAL) << "unknown loss type";
   }
@@ -25,4 +30,31 @@ Loss* Loss::Create(const std::string& type, int nthreads) {
   return loss;
 }
 
+real_t Loss::Evaluate(dmlc::real_t const* label, const SArray<real_t>& pred) {
+  Range all(0, pred.size());
+  return ParallelSum<real_t>(all, nthreads_, [&](const Range& rg) {
+      real_t objv = 0;
+      for (size_t i = rg.begin; i < rg.end; ++i) {
+        real_t y = label[i] > 0 ? 1 : -1;
+        objv += log(1 + exp(- y * pred[i]));
+      }
+      return objv;
+    });
+}
+
+real_t Loss::EvaluateDirection(dmlc::real_t const* label,
+                               const SArray<real_t>& pred,
+                               const SArray<real_t>& dpred) {
+  CHECK_EQ(pred.size(), dpred.size());
+  Range all(0, pred.size());
+  return ParallelSum<real_t>(all, nthreads_, [&](const Range& rg) {
+      real_t res = 0;
+      for (size_t i = rg.begin; i < rg.end; ++i) {
+        real_t y = label[i] > 0 ? 1 : -1;
+        res += - y / (1 + exp(y * pred[i])) * dpred[i];
+      }
+      return res;
+    });
+}
+
 }  // namespace difacto
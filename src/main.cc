@@ -5,6 +5,7 @@
 #include "common/arg_parser.h"
 #include "dmlc/parameter.h"
 #include "reader/converter.h"
+#include "ps/ps.h"
 namespace difacto {
 struct DifactoParam : public dmlc::Parameter<DifactoParam> {
   /**
@@ -50,10 +51,12 @@ int main(int argc, char *argv[]) {
 
   // run
   if (param.task == "train") {
+    if (IsDistributed()) ps::Start();
     Learner* learner = Learner::Create(param.learner);
     WarnUnknownKWArgs(param, learner->Init(kwargs_remain));
     learner->Run();
     delete learner;
+    if (IsDistributed()) ps::Finalize();
   } else if (param.task == "convert") {
     Converter converter;
     WarnUnknownKWArgs(param, converter.Init(kwargs_remain));
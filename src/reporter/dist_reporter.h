@@ -0,0 +1,50 @@
+/**
+ * Copyright (c) 2015 by Contributors
+ */
+#ifndef DIFACTO_REPORTER_DIST_REPORTER_H_
+#define DIFACTO_REPORTER_DIST_REPORTER_H_
+#include <string>
+#include <functional>
+#include "difacto/reporter.h"
+#include "common/ps_utils.h"
+#include "ps/ps.h"
+namespace difacto {
+/**
+ * \brief sends the reports to the scheduler by ps-lite requests
+ */
+class DistReporter : public Reporter {
+ public:
+  /** \brief the ps-lite app id used by the reporter */
+  static const int kAppID = 2;
+
+  DistReporter() {
+    using namespace std::placeholders;
+    app_ = new ps::SimpleApp(kAppID);
+    app_->set_request_handle(
+        std::bind(&DistReporter::Process, this, _1, _2));
+  }
+  virtual ~DistReporter() { delete app_; }
+
+  KWArgs Init(const KWArgs& kwargs) override { return kwargs; }
+
+  void SetMonitor(const Monitor& monitor) override {
+    monitor_ = monitor;
+  }
+
+  int Report(const std::string& report) override {
+    return app_->Request(0, report, ps::kScheduler);
+  }
+
+  void Wait(int timestamp) override { app_->Wait(timestamp); }
+
+ private:
+  void Process(const ps::SimpleData& req, ps::SimpleApp* app) {
+    if (monitor_) monitor_(DifactoNodeID(req.sender), req.body);
+    app->Response(req);
+  }
+
+  ps::SimpleApp* app_;
+  Monitor monitor_;
+};
+}  // namespace difacto
+#endif  // DIFACTO_REPORTER_DIST_REPORTER_H_
@@ -0,0 +1,146 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#ifndef DIFACTO_SGD_SGD_GRAD_ACCUMULATOR_H_
+#define DIFACTO_SGD_SGD_GRAD_ACCUMULATOR_H_
+#include <algorithm>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "dmlc/logging.h"
+#include "difacto/base.h"
+#include "difacto/sarray.h"
+namespace difacto {
+namespace sgd {
+
+/**
+ * \brief merges the gradients of several minibatches on a worker, so that a
+ * feature is pushed once rather than once per minibatch
+ *
+ * the gradients are in the format produced by Loss::CalcGrad, namely the
+ * gradient of w followed by the optional gradient of V for each feature, and
+ * offsets which is either empty (each feature has only w) or the offsets of
+ * the features in the gradients.
+ *
+ * the merged gradient of a feature is either the sum of its gradients, which
+ * equals the gradient of a minibatch containing all the accumulated examples,
+ * or the average over the minibatches containing it, which keeps the step
+ * size of a single minibatch.
+ *
+ * it is thread-safe
+ */
+class GradAccumulator {
+ public:
+  /**
+   * @param max_batches the accumulator is full after adding this number of
+   * minibatches
+   * @param max_bytes the accumulator is full after the merged gradients
+   * exceed this size, 0 means no limit
+   * @param average average the gradients rather than summing them
+   */
+  GradAccumulator(int max_batches, size_t max_bytes, bool average)
+      : max_batches_(max_batches), max_bytes_(max_bytes), average_(average) { }
+  ~GradAccumulator() { }
+
+  /**
+   * \brief add the gradients of a minibatch
+   *
+   * @param feaids the feature ids
+   * @param grads the gradients
+   * @param offsets the offsets of the gradients, could be empty
+   * @return true if the accumulator is full and should be flushed
+   */
+  bool Add(const SArray<feaid_t>& feaids,
+           const SArray<real_t>& grads,
+           const SArray<int>& offsets) {
+    bool w_only = offsets.empty();
+    if (w_only) {
+      CHECK_EQ(grads.size(), feaids.size());
+    } else {
+      CHECK_EQ(offsets.size(), feaids.size() + 1);
+    }
+    std::lock_guard<std::mutex> lk(mu_);
+    w_only_ = w_only_ && w_only;
+    for (size_t i = 0; i < feaids.size(); ++i) {
+      const real_t* g = grads.data() + (w_only ? i : offsets[i]);
+      size_t len = w_only ? 1 : offsets[i+1] - offsets[i];
+      auto& e = map_[feaids[i]];
+      if (e.grad.empty()) bytes_ += sizeof(feaid_t);
+      if (e.grad.size() < len) {
+        // V is initialized by the server after previous pushes
+        bytes_ += (len - e.grad.size()) * sizeof(real_t);
+        e.grad.resize(len, 0);
+      }
+      for (size_t j = 0; j < len; ++j) e.grad[j] += g[j];
+      ++e.cnt;
+    }
+    ++num_batches_;
+    return Full();
+  }
+
+  /**
+   * \brief move the merged gradients out and reset the accumulator
+   *
+   * @param feaids output, the sorted feature ids
+   * @param grads output, the merged gradients
+   * @param offsets output, the offsets of the gradients, empty if every
+   * feature has only w
+   * @return false if nothing has been accumulated
+   */
+  bool Flush(SArray<feaid_t>* feaids,
+             SArray<real_t>* grads,
+             SArray<int>* offsets) {
+    std::lock_guard<std::mutex> lk(mu_);
+    if (map_.empty()) return false;
+    feaids->resize(map_.size());
+    size_t k = 0, n = 0;
+    for (const auto& e : map_) {
+      (*feaids)[k++] = e.first;
+      n += e.second.grad.size();
+    }
+    std::sort(feaids->begin(), feaids->end());
+    grads->resize(n);
+    offsets->resize(w_only_ ? 0 : feaids->size() + 1);
+    if (!w_only_) (*offsets)[0] = 0;
+    size_t p = 0;
+    for (size_t i = 0; i < feaids->size(); ++i) {
+      const auto& e = map_[(*feaids)[i]];
+      real_t scale = average_ ? 1.0 / e.cnt : 1;
+      for (real_t g : e.grad) (*grads)[p++] = g * scale;
+      if (!w_only_) (*offsets)[i+1] = p;
+    }
+    map_.clear();
+    num_batches_ = 0;
+    bytes_ = 0;
+    w_only_ = true;
+    return true;
+  }
+
+ private:
+  /**
+   * \brief return true if the accumulator is full, must hold mu_
+   */
+  bool Full() const {
+    return num_batches_ >= max_batches_ || (max_bytes_ && bytes_ >= max_bytes_);
+  }
+
+  struct Entry {
+    std::vector<real_t> grad;
+    /** \brief the number of minibatches containing this feature */
+    int cnt = 0;
+  };
+  int max_batches_;
+  size_t max_bytes_;
+  bool average_;
+
+  int num_batches_ = 0;
+  size_t bytes_ = 0;
+  /** \brief whether all the added gradients have only w */
+  bool w_only_ = true;
+  std::unordered_map<feaid_t, Entry> map_;
+  std::mutex mu_;
+};
+
+}  // namespace sgd
+}  // namespace difacto
+#endif  // DIFACTO_SGD_SGD_GRAD_ACCUMULATOR_H_
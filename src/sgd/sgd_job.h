@@ -33,9 +33,24 @@ struct Job {
     ParseFromString(str);
   }
   void SerializeToString(std::string* str) const {
+    dmlc::Stream* ss = new dmlc::MemoryStringStream(str);
+    ss->Write(type);
+    ss->Write(filename);
+    ss->Write(num_parts);
+    ss->Write(part_idx);
+    ss->Write(epoch);
+    delete ss;
   }
 
   void ParseFromString(const std::string& str) {
+    auto pstr = str;
+    dmlc::Stream* ss = new dmlc::MemoryStringStream(&pstr);
+    ss->Read(&type);
+    ss->Read(&filename);
+    ss->Read(&num_parts);
+    ss->Read(&part_idx);
+    ss->Read(&epoch);
+    delete ss;
   }
 };
 
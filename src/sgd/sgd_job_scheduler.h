@@ -0,0 +1,213 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#ifndef DIFACTO_SGD_SGD_JOB_SCHEDULER_H_
+#define DIFACTO_SGD_SGD_JOB_SCHEDULER_H_
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "dmlc/logging.h"
+#include "difacto/base.h"
+namespace difacto {
+namespace sgd {
+
+/**
+ * \brief hands out the data parts of an epoch to the workers on demand, and
+ * tracks the progress of each part
+ *
+ * a worker gets a new part only when it has finished the previous one, so a
+ * fast worker processes more parts than a slow one. once no part is pending,
+ * an idle worker may run a backup copy of a straggler, namely a part which has
+ * been running longer than straggler_factor times the median running time of
+ * the finished parts. a part is finished by the copy which finishes first, and
+ * the other copy is ignored.
+ *
+ * it is thread-safe
+ */
+class JobScheduler {
+ public:
+  /**
+   * @param straggler_factor the threshold of the stragglers, 0 means never
+   * running backup copies
+   */
+  explicit JobScheduler(real_t straggler_factor)
+      : straggler_factor_(straggler_factor) { }
+  ~JobScheduler() { }
+
+  /** \brief a part assigned to a worker */
+  struct Task {
+    int node_id;
+    int part_idx;
+    /** \brief whether it is a backup copy of a straggler */
+    bool backup;
+  };
+
+  /**
+   * \brief add a worker
+   */
+  void AddNode(int node_id) {
+    std::lock_guard<std::mutex> lk(mu_);
+    nodes_.push_back(node_id);
+  }
+
+  /**
+   * \brief start an epoch
+   *
+   * the copies still running from the previous epoch keep their workers busy,
+   * but their results are ignored
+   *
+   * @param num_parts the number of parts
+   * @param speculate whether backup copies of stragglers are allowed
+   */
+  void Start(int num_parts, bool speculate) {
+    std::lock_guard<std::mutex> lk(mu_);
+    parts_.clear();
+    parts_.resize(num_parts);
+    pending_.clear();
+    for (int i = 0; i < num_parts; ++i) pending_.push_back(i);
+    for (auto& r : running_) r.second = -1;
+    times_.clear();
+    num_finished_ = 0;
+    speculate_ = speculate && straggler_factor_ > 0;
+  }
+
+  /**
+   * \brief assign parts to the idle workers
+   *
+   * @param now the current time in sec
+   * @param tasks output, the assigned parts
+   */
+  void Assign(double now, std::vector<Task>* tasks) {
+    tasks->clear();
+    std::lock_guard<std::mutex> lk(mu_);
+    for (int node_id : nodes_) {
+      if (running_.find(node_id) != running_.end()) continue;
+      int part = -1;
+      bool backup = false;
+      if (pending_.size()) {
+        part = pending_.front();
+        pending_.pop_front();
+        parts_[part].start = now;
+      } else if (speculate_) {
+        part = FindStraggler(now);
+        backup = true;
+      }
+      if (part < 0) break;
+      ++parts_[part].num_copies;
+      running_[node_id] = part;
+      tasks->push_back(Task{node_id, part, backup});
+    }
+  }
+
+  /**
+   * \brief a worker finished its part
+   *
+   * @param node_id the worker
+   * @param now the current time in sec
+   * @return true if it is the first finished copy of a part of this epoch
+   */
+  bool Finish(int node_id, double now) {
+    bool first = false;
+    {
+      std::lock_guard<std::mutex> lk(mu_);
+      auto it = running_.find(node_id);
+      CHECK(it != running_.end()) << "node " << node_id << " has no part";
+      int part = it->second;
+      running_.erase(it);
+      notified_ = true;
+      if (part >= 0 && !parts_[part].finished) {
+        parts_[part].finished = true;
+        times_.push_back(now - parts_[part].start);
+        ++num_finished_;
+        first = true;
+      }
+    }
+    cond_.notify_all();
+    return first;
+  }
+
+  /**
+   * \brief block until a worker finished a part since the last call, or the
+   * timeout
+   *
+   * @param ms the timeout in millisecond
+   */
+  void Wait(int ms) {
+    std::unique_lock<std::mutex> lk(mu_);
+    cond_.wait_for(lk, std::chrono::milliseconds(ms), [this]() { return notified_; });
+    notified_ = false;
+  }
+
+  /** \brief return true if all parts of the current epoch are finished */
+  bool Done() {
+    std::lock_guard<std::mutex> lk(mu_);
+    return num_finished_ == static_cast<int>(parts_.size());
+  }
+
+  /** \brief return the number of finished parts of the current epoch */
+  int NumFinished() {
+    std::lock_guard<std::mutex> lk(mu_);
+    return num_finished_;
+  }
+
+  /**
+   * \brief return the running time in sec of a part, or -1 if not started
+   */
+  double Time(int part_idx, double now) {
+    std::lock_guard<std::mutex> lk(mu_);
+    const auto& p = parts_[part_idx];
+    return p.num_copies == 0 ? -1 : now - p.start;
+  }
+
+ private:
+  /**
+   * \brief return the longest running straggler with a single copy, or -1 if
+   * there is none. must hold mu_
+   */
+  int FindStraggler(double now) {
+    if (times_.empty()) return -1;
+    std::vector<double> t = times_;
+    std::nth_element(t.begin(), t.begin() + t.size() / 2, t.end());
+    double threshold = straggler_factor_ * t[t.size() / 2];
+    int part = -1;
+    double longest = threshold;
+    for (const auto& r : running_) {
+      if (r.second < 0) continue;
+      const auto& p = parts_[r.second];
+      if (p.finished || p.num_copies > 1) continue;
+      if (now - p.start > longest) {
+        longest = now - p.start;
+        part = r.second;
+      }
+    }
+    return part;
+  }
+
+  struct Part {
+    /** \brief the time when the first copy started */
+    double start = 0;
+    int num_copies = 0;
+    bool finished = false;
+  };
+  real_t straggler_factor_;
+  bool speculate_ = false;
+  bool notified_ = false;
+  int num_finished_ = 0;
+  std::vector<int> nodes_;
+  std::vector<Part> parts_;
+  std::deque<int> pending_;
+  /** \brief the running times of the finished parts */
+  std::vector<double> times_;
+  /** \brief the part each busy worker runs, -1 if from a previous epoch */
+  std::unordered_map<int, int> running_;
+  std::mutex mu_;
+  std::condition_variable cond_;
+};
+
+}  // namespace sgd
+}  // namespace difacto
+#endif  // DIFACTO_SGD_SGD_JOB_SCHEDULER_H_
@@ -6,6 +6,7 @@
 #include <stdlib.h>
 #include <chrono>
 #include <memory>
+#include <mutex>
 #include <thread>
 #include <vector>
 #include <string>
@@ -21,7 +22,11 @@
 #include "difacto/node_id.h"
 #include "difacto/reporter.h"
 #include "./sgd_param.h"
+#include "./sgd_updater.h"
 #include "./sgd_job.h"
+#include "./sgd_pull_cache.h"
+#include "./sgd_grad_accumulator.h"
+#include "./sgd_job_scheduler.h"
 #include "data/shared_row_block_container.h"
 #include "tracker/async_local_tracker.h"
 namespace difacto {
@@ -30,24 +35,43 @@ class SGDLearner : public Learner {
  public:
   SGDLearner() {
     store_ = nullptr;
-    loss_ = nullptr;
   }
 
   virtual ~SGDLearner() {
-    delete loss_;
+    for (auto l : loss_) delete l;
     delete store_;
+    delete pull_cache_;
+    delete grad_accum_;
+    delete scheduler_;
   }
 
   KWArgs Init(const KWArgs& kwargs) override {
     auto remain = Learner::Init(kwargs);
     // init param
     remain = param_.InitAllowUnknown(remain);
+    if (param_.pull_cache_size > 0) {
+      pull_cache_ = new sgd::PullCache(param_.pull_cache_size,
+                                       param_.pull_cache_max_updates,
+                                       param_.pull_cache_max_delay);
+    }
+    CHECK_GE(param_.grad_accum_batches, 1);
+    if (param_.grad_accum_batches > 1 || param_.grad_accum_bytes > 0) {
+      grad_accum_ = new sgd::GradAccumulator(param_.grad_accum_batches,
+                                             param_.grad_accum_bytes,
+                                             param_.grad_accum_average);
+    }
+    // init updater
+    auto updater = std::make_shared<SGDUpdater>();
+    remain = updater->Init(remain);
     // init store
     store_ = Store::Create();
+    store_->SetUpdater(updater);
     remain = store_->Init(remain);
-    // init loss
-    loss_ = Loss::Create(param_.loss);
-    remain = loss_->Init(remain);
+    // init loss, more are created by GetLoss with the same arguments
+    loss_args_ = remain;
+    loss_.push_back(Loss::Create(param_.loss));
+    remain = loss_.back()->Init(remain);
+    idle_loss_ = loss_;
     // init reporter
     reporter_ = Reporter::Create();
     using namespace std::placeholders;
@@ -69,8 +93,21 @@ class SGDLearner : public Learner {
     return remain;
   }
 
+  SGDUpdater* GetUpdater() {
+    return CHECK_NOTNULL(std::static_pointer_cast<SGDUpdater>(
+        CHECK_NOTNULL(store_)->updater()).get());
+  }
+
  protected:
   void RunScheduler() override {
+    auto workers = tracker_->NodeIDs(NodeID::kWorkerGroup);
+    if (workers.size() != 1 || workers[0] != NodeID::kWorkerGroup) {
+      scheduler_ = new sgd::JobScheduler(param_.straggler_factor);
+      for (int id : workers) scheduler_->AddNode(id);
+    }
+    using namespace std::placeholders;
+    tracker_->SetMonitor(std::bind(&SGDLearner::JobMonitor, this, _1, _2));
+
     epoch_ = 0;
     // train
     for (; epoch_ < param_.max_num_epochs; ++epoch_) {
@@ -83,7 +120,9 @@ class SGDLearner : public Learner {
     sgd::Job job(args);
     if (job.type == sgd::Job::kTraining ||
         job.type == sgd::Job::kValidation) {
-      IterateData(job);
+      sgd::Progress prog;
+      IterateData(job, job.type == sgd::Job::kValidation ? &prog : nullptr);
+      if (job.type == sgd::Job::kValidation) prog.SerializeToString(rets);
     }
   }
 
@@ -107,22 +146,95 @@ class SGDLearner : public Learner {
     job.num_parts = store_->NumWorkers() * param_.job_size;
     if (job.filename.empty()) return;
 
-    std::vector<std::pair<int, std::string>> jobs(job.num_parts);
-    for (int i = 0; i < job.num_parts; ++i) {
-      jobs[i].first = NodeID::kWorkerGroup;
-      job.part_idx = i;
-      job.SerializeToString(&jobs[i].second);
-    }
-    tracker_->Issue(jobs);
+    if (scheduler_) {
+      RunParts(&job);
+    } else {
+      // the local tracker queues the parts for its own executors
+      std::vector<std::pair<int, std::string>> jobs(job.num_parts);
+      for (int i = 0; i < job.num_parts; ++i) {
+        jobs[i].first = NodeID::kWorkerGroup;
+        job.part_idx = i;
+        job.SerializeToString(&jobs[i].second);
+      }
+      tracker_->Issue(jobs);
 
-    // wait until finished
-    while (tracker_->NumRemains() != 0) {
-      Sleep();
-      for (auto& cb : cont_callbacks_) cb();
+      // wait until finished
+      while (tracker_->NumRemains() != 0) {
+        Sleep();
+        for (auto& cb : cont_callbacks_) cb();
+      }
     }
     for (auto& cb : epoch_callbacks_) cb();
   }
 
+  /**
+   * \brief hand out the parts of an epoch to the workers whenever they become
+   * idle, and run backup copies of the stragglers at the end of the epoch
+   */
+  void RunParts(sgd::Job* job) {
+    bool speculate = job->type == sgd::Job::kValidation || param_.straggler_training;
+    scheduler_->Start(job->num_parts, speculate);
+    double last = dmlc::GetTime();
+    std::vector<sgd::JobScheduler::Task> tasks;
+    while (true) {
+      double now = dmlc::GetTime();
+      scheduler_->Assign(now, &tasks);
+      std::vector<std::pair<int, std::string>> jobs(tasks.size());
+      for (size_t i = 0; i < tasks.size(); ++i) {
+        const auto& t = tasks[i];
+        if (t.backup) {
+          LOG(INFO) << "part " << t.part_idx << " has run "
+                    << scheduler_->Time(t.part_idx, now)
+                    << " sec, run a backup copy on node " << t.node_id;
+        }
+        jobs[i].first = t.node_id;
+        job->part_idx = t.part_idx;
+        job->SerializeToString(&jobs[i].second);
+      }
+      if (jobs.size()) tracker_->Issue(jobs);
+      if (scheduler_->Done()) break;
+
+      // wake up once a part is finished
+      scheduler_->Wait(1000);
+      if (dmlc::GetTime() - last >= 1) {
+        for (auto& cb : cont_callbacks_) cb();
+        last = dmlc::GetTime();
+      }
+    }
+  }
+
+  /**
+   * \brief pull the weights of a minibatch. if the pull cache is enabled, only
+   * the features which are not cached or expired are pulled from the servers
+   */
+  void PullWeight(const SArray<feaid_t>& feaids,
+                  SArray<real_t>* values,
+                  SArray<int>* offsets,
+                  const std::function<void()>& on_complete) {
+    if (!pull_cache_) {
+      store_->Pull(feaids, Store::kWeight, values, offsets, on_complete);
+      return;
+    }
+    struct Buffer {
+      SArray<real_t> hit_vals, missed_vals;
+      SArray<int> hit_lens, missed_offsets;
+      SArray<feaid_t> missed;
+    };
+    auto buf = std::make_shared<Buffer>();
+    pull_cache_->Find(feaids, &buf->hit_vals, &buf->hit_lens, &buf->missed);
+    auto merge = [this, feaids, buf, values, offsets, on_complete]() {
+      pull_cache_->Merge(feaids, buf->hit_vals, buf->hit_lens, buf->missed,
+                         buf->missed_vals, buf->missed_offsets, values, offsets);
+      on_complete();
+    };
+    if (buf->missed.empty()) {
+      merge();
+    } else {
+      store_->Pull(buf->missed, Store::kWeight, &buf->missed_vals,
+                   &buf->missed_offsets, merge);
+    }
+  }
+
   /** \brief struct to hold info for a batch job */
   struct BatchJob {
     int type;
@@ -136,9 +248,11 @@ class SGDLearner : public Learner {
    *
    * 1. read batch_size examples
    * 2. preprogress data (map from uint64 feature index into continous ones)
-   * 3. pull the newest model for this batch from the servers
+   * 3. pull the newest model for this batch from the servers, the weights
+   *    cached by \ref sgd::PullCache are used if it is enabled
    * 4. compute the gradients on this batch
-   * 5. push the gradients to the servers to update the model
+   * 5. push the gradients to the servers to update the model, or merge them
+   *    into \ref sgd::GradAccumulator and push them every few minibatches
    *
    * to maximize the parallelization of i/o and computation, we uses three
    * threads here. they are asynchronized by callbacks
@@ -146,37 +260,70 @@ class SGDLearner : public Learner {
    * a. main thread does 1 and 2
    * b. batch_tracker's thread does 3 once a batch is preprocessed
    * c. store_'s threads does 4 and 5 when the weight is pulled back
+   *
+   * @param job the part
+   * @param val_prog if not nullptr, the progress is merged into it rather than
+   * reported
    */
-  void IterateData(const sgd::Job& job) {
+  void IterateData(const sgd::Job& job, sgd::Progress* val_prog) {
     AsyncLocalTracker<BatchJob> batch_tracker;
-    batch_tracker.SetExecutor([this](const BatchJob& batch,
-                                     const std::function<void()>& on_complete,
-                                     std::string* rets) {
+    batch_tracker.SetExecutor([this, val_prog](
+        const BatchJob& batch,
+        const std::function<void()>& on_complete,
+        std::string* rets) {
         // use potiners here in order to copy into the callback
         auto values = new SArray<real_t>();
         auto offsets = new SArray<int>();
-        auto pull_callback = [this, batch, values, offsets, on_complete]() {
-          // eval the objective,
-          SArray<real_t> pred;
-          CHECK_NOTNULL(loss_)->Predict(
-              batch.data.GetBlock(),
-              {SArray<char>(*values), SArray<char>(*offsets)},
-              &pred);
-          Evaluate(batch.data.label, pred);
+        auto pull_callback = [this, batch, values, offsets, on_complete,
+                              val_prog]() {
+          // eval the objective. the loss keeps states between Predict and
+          // CalcGrad, so every minibatch in flight takes its own one. no lock
+          // is held meanwhile, since the loss runs on the shared pool
+          Loss* loss = GetLoss();
+          auto data = batch.data.GetBlock();
+          bool fm = param_.loss == "fm";
+          SArray<int> w_pos, V_pos;
+          GetPos(*offsets, batch.feaids.size(), &w_pos, &V_pos);
+          std::vector<SArray<char>> param = {
+            SArray<char>(*values), SArray<char>(w_pos)};
+          if (fm) param.push_back(SArray<char>(V_pos));
+          SArray<real_t> pred(data.size);
+          loss->Predict(data, param, &pred);
+          SArray<real_t> grad;
+          if (batch.type == sgd::Job::kTraining) {
+            // calculate the gradients, which have the same layout as values
+            grad.resize(values->size(), 0);
+            if (fm) {
+              param.push_back(SArray<char>(pred));
+            } else {
+              param = {SArray<char>(pred), SArray<char>(w_pos)};
+            }
+            loss->CalcGrad(data, param, &grad);
+          }
+          ReturnLoss(loss);
+          Evaluate(batch.data.label, pred, val_prog);
 
           if (batch.type == sgd::Job::kTraining) {
-            // calculate the gradients, reuse values to store the gradients
-            loss_->CalcGrad(
-                batch.data.GetBlock(),
-                {SArray<char>(pred), SArray<char>(*offsets), SArray<char>(*values)},
-                values);
-
-            // push the gradient, this task is done only if the push is complete
-            store_->Push(batch.feaids,
-                         Store::kGradient,
-                         *values,
-                         *offsets,
-                         [on_complete]() { on_complete(); });
+
+            if (grad_accum_) {
+              // merge the gradient, and push the merged ones once the
+              // accumulator is full
+              if (grad_accum_->Add(batch.feaids, grad, *offsets)) {
+                PushAccumulatedGrad(on_complete);
+              } else {
+                on_complete();
+              }
+            } else {
+              // push the gradient, this task is done only if the push is
+              // complete. grad is not used anymore, so hand it over to the
+              // store
+              if (pull_cache_) pull_cache_->Update(batch.feaids);
+              store_->ZPush(batch.feaids,
+                            Store::kGradient,
+                            grad,
+                            *offsets,
+                            [on_complete]() { on_complete(); });
+            }
           } else {
             // a validation job
             on_complete();
@@ -185,7 +332,7 @@ class SGDLearner : public Learner {
           delete offsets;
         };
         // pull the weight back
-        store_->Pull(batch.feaids, Store::kWeight, values, offsets, pull_callback);
+        PullWeight(batch.feaids, values, offsets, pull_callback);
       });
 
     int batch_size = 100;
@@ -213,7 +360,7 @@ class SGDLearner : public Learner {
 
       // push feature count into the servers
       if (push_cnt) {
-        store_->Wait(store_->Push(
+        store_->Wait(store_->ZPush(
             batch.feaids, Store::kFeaCount, SArray<real_t>(feacnt), {}));
       }
 
@@ -223,12 +370,90 @@ class SGDLearner : public Learner {
       batch_tracker.Issue({batch});
     }
     batch_tracker.Wait();
+    if (grad_accum_) {
+      // push the remaining gradients
+      int time = PushAccumulatedGrad(nullptr);
+      if (time >= 0) store_->Wait(time);
+    }
+  }
+
+  /**
+   * \brief push the gradients merged by the accumulator
+   *
+   * @param on_complete called when the push is finished
+   * @return the timestamp of the push, or -1 if there is nothing to push
+   */
+  int PushAccumulatedGrad(const std::function<void()>& on_complete) {
+    SArray<feaid_t> feaids;
+    SArray<real_t> grads;
+    SArray<int> offsets;
+    if (!grad_accum_->Flush(&feaids, &grads, &offsets)) {
+      // flushed by another minibatch
+      if (on_complete) on_complete();
+      return -1;
+    }
+    if (pull_cache_) pull_cache_->Update(feaids);
+    return store_->ZPush(feaids, Store::kGradient, grads, offsets, on_complete);
   }
 
  private:
-  void Evaluate(const SArray<dmlc::real_t>& label, const SArray<real_t>& pred) {
+  /**
+   * \brief take an idle loss, or create a new one if there is none
+   */
+  Loss* GetLoss() {
+    std::lock_guard<std::mutex> lk(loss_mu_);
+    if (idle_loss_.empty()) {
+      loss_.push_back(Loss::Create(param_.loss));
+      loss_.back()->Init(loss_args_);
+      return loss_.back();
+    }
+    Loss* loss = idle_loss_.back();
+    idle_loss_.pop_back();
+    return loss;
+  }
+
+  /** \brief return a loss taken by \ref GetLoss */
+  void ReturnLoss(Loss* loss) {
+    std::lock_guard<std::mutex> lk(loss_mu_);
+    idle_loss_.push_back(loss);
+  }
+
+  /**
+   * \brief the positions of w and V of each feature in the pulled weights
+   *
+   * @param offsets the offsets of the pulled weights, empty if only w is
+   * pulled
+   * @param n the number of features
+   * @param w_pos output, empty if offsets is empty
+   * @param V_pos output, -1 means no embedding
+   */
+  void GetPos(const SArray<int>& offsets, size_t n,
+              SArray<int>* w_pos, SArray<int>* V_pos) {
+    V_pos->resize(n, -1);
+    if (offsets.empty()) return;
+    CHECK_EQ(offsets.size(), n + 1);
+    w_pos->resize(n);
+    for (size_t i = 0; i < n; ++i) {
+      (*w_pos)[i] = offsets[i];
+      (*V_pos)[i] = offsets[i+1] - offsets[i] > 1 ? offsets[i] + 1 : -1;
+    }
+  }
+
+  /**
+   * \brief evaluate a minibatch
+   *
+   * the progress of a validation part is returned with the job rather than
+   * reported, so that only the first finished copy of a part is counted
+   */
+  void Evaluate(const SArray<dmlc::real_t>& label, const SArray<real_t>& pred,
+                sgd::Progress* val_prog) {
     sgd::Progress prog;
     // TODO(mli)
+    if (val_prog) {
+      std::lock_guard<std::mutex> lk(val_mu_);
+      val_prog->Merge(0, prog);
+      return;
+    }
     std::string report; prog.SerializeToString(&report);
     reporter_->Report(report);
   }
@@ -238,10 +463,30 @@ class SGDLearner : public Learner {
     progress_.Merge(node_id, prog);
   }
 
+  void JobMonitor(int node_id, const std::string& rets) {
+    if (scheduler_ && !scheduler_->Finish(node_id, dmlc::GetTime())) return;
+    // the progress of a validation part
+    if (rets.size()) ProgressMonitor(node_id, rets);
+  }
+
   /** \brief the model store*/
   Store* store_;
-  /** \brief the loss*/
-  Loss* loss_;
+  /** \brief the losses, each minibatch in flight uses its own one */
+  std::vector<Loss*> loss_;
+  /** \brief the losses not in use */
+  std::vector<Loss*> idle_loss_;
+  /** \brief the arguments to init a loss */
+  KWArgs loss_args_;
+  /** \brief protects loss_ and idle_loss_ */
+  std::mutex loss_mu_;
+  /** \brief the cache of pulled weights, nullptr if disabled */
+  sgd::PullCache* pull_cache_ = nullptr;
+  /** \brief merges the gradients before pushing, nullptr if disabled */
+  sgd::GradAccumulator* grad_accum_ = nullptr;
+  /** \brief hands out the parts to the workers, nullptr if running locally */
+  sgd::JobScheduler* scheduler_ = nullptr;
+  /** \brief protects the progress of a validation part */
+  std::mutex val_mu_;
   /** \brief parameters */
   SGDLearnerParam param_;
   // ProgressPrinter pprinter_;
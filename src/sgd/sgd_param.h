@@ -38,6 +38,47 @@ struct SGDLearnerParam : public dmlc::Parameter<SGDLearnerParam> {
   float neg_sampling;
 
   int job_size;
+  /**
+   * \brief the maximal number of features whose weights are cached on a
+   * worker, 0 means no cache, see \ref sgd::PullCache
+   */
+  int pull_cache_size;
+  /**
+   * \brief a cached weight expires after its gradient has been pushed by
+   * this number of times
+   */
+  int pull_cache_max_updates;
+  /**
+   * \brief a cached weight expires after this number of milliseconds
+   */
+  int pull_cache_max_delay;
+  /**
+   * \brief merge the gradients of this number of minibatches on a worker
+   * before pushing them, 1 means pushing every minibatch, see \ref
+   * sgd::GradAccumulator
+   */
+  int grad_accum_batches;
+  /**
+   * \brief push the merged gradients once they exceed this number of bytes,
+   * 0 means no limit
+   */
+  int grad_accum_bytes;
+  /**
+   * \brief average the merged gradients over the minibatches rather than
+   * summing them
+   */
+  int grad_accum_average;
+  /**
+   * \brief run a backup copy of a data part on an idle worker if the part has
+   * been running longer than this factor times the median running time of the
+   * finished parts, 0 means no backup copies, see \ref sgd::JobScheduler
+   */
+  float straggler_factor;
+  /**
+   * \brief also run backup copies for training parts. the gradients of such a
+   * part are pushed by both copies
+   */
+  int straggler_training;
 
   DMLC_DECLARE_PARAMETER(SGDLearnerParam) {
     DMLC_DECLARE_FIELD(data_format).set_default("libsvm");
@@ -48,6 +89,14 @@ struct SGDLearnerParam : public dmlc::Parameter<SGDLearnerParam> {
     DMLC_DECLARE_FIELD(loss).set_default("fm");
     DMLC_DECLARE_FIELD(max_num_epochs).set_default(20);
     DMLC_DECLARE_FIELD(job_size).set_default(4);
+    DMLC_DECLARE_FIELD(pull_cache_size).set_default(0);
+    DMLC_DECLARE_FIELD(pull_cache_max_updates).set_default(10);
+    DMLC_DECLARE_FIELD(pull_cache_max_delay).set_default(1000);
+    DMLC_DECLARE_FIELD(grad_accum_batches).set_default(1);
+    DMLC_DECLARE_FIELD(grad_accum_bytes).set_default(0);
+    DMLC_DECLARE_FIELD(grad_accum_average).set_default(0);
+    DMLC_DECLARE_FIELD(straggler_factor).set_default(0);
+    DMLC_DECLARE_FIELD(straggler_training).set_default(0);
   }
 };
 }  // namespace difacto
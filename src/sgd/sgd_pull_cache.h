@@ -0,0 +1,231 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#ifndef DIFACTO_SGD_SGD_PULL_CACHE_H_
+#define DIFACTO_SGD_SGD_PULL_CACHE_H_
+#include <string.h>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "dmlc/logging.h"
+#include "dmlc/timer.h"
+#include "difacto/base.h"
+#include "difacto/sarray.h"
+namespace difacto {
+namespace sgd {
+
+/**
+ * \brief a worker-side cache of the pulled weights, indexed by feature id
+ *
+ * the weights are in the format returned by SGDUpdater::Get, namely w followed
+ * by the optional V for each feature, and offsets which is either empty (each
+ * feature has only w) or the offsets of the features in the weights.
+ *
+ * a cached entry expires if the gradients of its feature have been pushed by
+ * this worker max_updates times, or if it was pulled more than max_delay
+ * milliseconds ago, which bounds the updates made by the other workers.
+ *
+ * it is thread-safe
+ *
+ * \code
+ * SArray<real_t> hit_vals; SArray<int> hit_lens; SArray<feaid_t> missed;
+ * cache.Find(feaids, &hit_vals, &hit_lens, &missed);
+ * // pull missed into missed_vals and missed_offsets
+ * cache.Merge(feaids, hit_vals, hit_lens, missed, missed_vals, missed_offsets,
+ *             &vals, &offsets);
+ * \endcode
+ */
+class PullCache {
+ public:
+  /**
+   * @param capacity the maximal number of cached features
+   * @param max_updates the maximal number of pushes of an entry
+   * @param max_delay the maximal age of an entry in millisecond
+   */
+  PullCache(size_t capacity, int max_updates, int max_delay)
+      : capacity_(capacity), max_updates_(max_updates),
+        max_delay_(max_delay * 1e-3) { }
+  ~PullCache() { }
+
+  /**
+   * \brief find the cached weights of a list of features
+   *
+   * the weights are copied out, so they are not affected by a later
+   * invalidation
+   *
+   * @param feaids the feature ids
+   * @param hit_vals output, the weights of the cached features
+   * @param hit_lens output, the length of the weights of each feature, 0
+   * means not cached
+   * @param missed output, the features need to be pulled
+   */
+  void Find(const SArray<feaid_t>& feaids,
+            SArray<real_t>* hit_vals,
+            SArray<int>* hit_lens,
+            SArray<feaid_t>* missed) {
+    double now = dmlc::GetTime();
+    hit_vals->clear();
+    hit_lens->resize(feaids.size());
+    missed->clear();
+    std::lock_guard<std::mutex> lk(mu_);
+    for (size_t i = 0; i < feaids.size(); ++i) {
+      auto it = map_.find(feaids[i]);
+      if (it != map_.end() && !Expired(it->second, now)) {
+        const auto& w = it->second.weight;
+        (*hit_lens)[i] = w.size();
+        for (real_t v : w) hit_vals->push_back(v);
+        ++num_hits_;
+      } else {
+        if (it != map_.end()) map_.erase(it);
+        (*hit_lens)[i] = 0;
+        missed->push_back(feaids[i]);
+      }
+    }
+  }
+
+  /**
+   * \brief merge the cached and the pulled weights, and cache the pulled ones
+   *
+   * @param feaids the feature ids passed to \ref Find
+   * @param hit_vals the cached weights returned by \ref Find
+   * @param hit_lens the lengths returned by \ref Find
+   * @param missed the missed features returned by \ref Find
+   * @param missed_vals the pulled weights of missed
+   * @param missed_offsets the pulled offsets of missed
+   * @param vals output, the weights of feaids
+   * @param offsets output, the offsets of feaids. it is empty if every feature
+   * has only w, as a pull returns
+   */
+  void Merge(const SArray<feaid_t>& feaids,
+             const SArray<real_t>& hit_vals,
+             const SArray<int>& hit_lens,
+             const SArray<feaid_t>& missed,
+             const SArray<real_t>& missed_vals,
+             const SArray<int>& missed_offsets,
+             SArray<real_t>* vals,
+             SArray<int>* offsets) {
+    CHECK_EQ(hit_lens.size(), feaids.size());
+    bool missed_w_only = missed_offsets.empty();
+    if (missed_w_only) {
+      CHECK_EQ(missed_vals.size(), missed.size());
+    } else {
+      CHECK_EQ(missed_offsets.size(), missed.size() + 1);
+    }
+    // the lengths of this call, a cached entry may have V while the pulled
+    // ones have only w, or the other way around
+    bool w_only = true;
+    size_t m = 0;
+    for (size_t i = 0; i < feaids.size(); ++i) {
+      int len = hit_lens[i];
+      if (len == 0) {
+        CHECK_LT(m, missed.size());
+        len = missed_w_only ? 1 : missed_offsets[m+1] - missed_offsets[m];
+        ++m;
+      }
+      if (len != 1) { w_only = false; break; }
+    }
+    vals->resize(hit_vals.size() + missed_vals.size());
+    offsets->resize(w_only ? 0 : feaids.size() + 1);
+    if (!w_only) (*offsets)[0] = 0;
+
+    std::lock_guard<std::mutex> lk(mu_);
+    if (map_.size() + missed.size() > capacity_) Sweep();
+    double now = dmlc::GetTime();
+    size_t p = 0, h = 0;
+    m = 0;
+    for (size_t i = 0; i < feaids.size(); ++i) {
+      int len = hit_lens[i];
+      const real_t* src = hit_vals.data() + h;
+      if (len == 0) {
+        CHECK_LT(m, missed.size());
+        CHECK_EQ(missed[m], feaids[i]);
+        size_t begin = missed_w_only ? m : missed_offsets[m];
+        len = missed_w_only ? 1 : missed_offsets[m+1] - missed_offsets[m];
+        src = missed_vals.data() + begin;
+        if (map_.size() < capacity_) {
+          auto& e = map_[feaids[i]];
+          e.weight.assign(src, src + len);
+          e.time = now;
+          e.num_updates = 0;
+        }
+        ++m;
+      } else {
+        h += len;
+      }
+      memcpy(vals->data() + p, src, len * sizeof(real_t));
+      p += len;
+      if (!w_only) (*offsets)[i+1] = p;
+    }
+    CHECK_EQ(m, missed.size());
+    CHECK_EQ(p, vals->size());
+  }
+
+  /**
+   * \brief count a push of the gradients of a list of features, an entry is
+   * invalidated once it expires
+   */
+  void Update(const SArray<feaid_t>& feaids) {
+    std::lock_guard<std::mutex> lk(mu_);
+    for (feaid_t f : feaids) {
+      auto it = map_.find(f);
+      if (it == map_.end()) continue;
+      if (++it->second.num_updates >= max_updates_) map_.erase(it);
+    }
+  }
+
+  /** \brief remove all entries */
+  void Clear() {
+    std::lock_guard<std::mutex> lk(mu_);
+    map_.clear();
+  }
+
+  /** \brief return the number of cached features */
+  size_t size() {
+    std::lock_guard<std::mutex> lk(mu_);
+    return map_.size();
+  }
+
+  /** \brief return the number of features found in the cache so far */
+  size_t num_hits() {
+    std::lock_guard<std::mutex> lk(mu_);
+    return num_hits_;
+  }
+
+ private:
+  struct Entry {
+    std::vector<real_t> weight;
+    /** \brief the time when it is pulled */
+    double time;
+    /** \brief the number of pushes since it is pulled */
+    int num_updates;
+  };
+
+  bool Expired(const Entry& e, double now) const {
+    return e.num_updates >= max_updates_ || now - e.time > max_delay_;
+  }
+
+  /**
+   * \brief remove the expired entries, must hold mu_
+   */
+  void Sweep() {
+    double now = dmlc::GetTime();
+    for (auto it = map_.begin(); it != map_.end(); ) {
+      if (Expired(it->second, now)) {
+        it = map_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  size_t capacity_;
+  int max_updates_;
+  double max_delay_;
+  size_t num_hits_ = 0;
+  std::unordered_map<feaid_t, Entry> map_;
+  std::mutex mu_;
+};
+
+}  // namespace sgd
+}  // namespace difacto
+#endif  // DIFACTO_SGD_SGD_PULL_CACHE_H_
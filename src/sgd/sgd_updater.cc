@@ -122,7 +122,7 @@ void SGDUpdater::Get(const SArray<feaid_t>& fea_ids,
   size_t size = fea_ids.size();
   weights->resize(size * (1 + V_dim));
   offsets->resize(V_dim == 0 ? 0 : size+1);
-  (*offsets)[0] = 0;
+  if (V_dim != 0) (*offsets)[0] = 0;
   int p = 0;
   for (size_t i = 0; i < size; ++i) {
     auto& e = model_[fea_ids[i]];
@@ -161,9 +161,9 @@ void SGDUpdater::Update(const SArray<feaid_t>& fea_ids,
     }
     for (size_t i = 0; i < size; ++i) {
       auto& e = model_[fea_ids[i]];
-      UpdateW(values[offsets[i]], &e);
+      UpdateW(values[w_only ? i : offsets[i]], &e);
       if (!w_only && offsets[i+1] > offsets[i]+1) {
-        CHECK_EQ(offsets[i+1], offsets[i]+1);
+        CHECK_EQ(offsets[i+1], offsets[i]+1+param_.V_dim);
         UpdateV(values.data() + offsets[i] + 1, &e);
       }
     }
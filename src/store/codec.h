@@ -0,0 +1,364 @@
+/**
+ * Copyright (c) 2015 by Contributors
+ */
+#ifndef DIFACTO_STORE_CODEC_H_
+#define DIFACTO_STORE_CODEC_H_
+#include <string.h>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+#include "difacto/base.h"
+#include "difacto/sarray.h"
+#include "dmlc/logging.h"
+#include "dmlc/parameter.h"
+namespace difacto {
+
+struct CodecParam : public dmlc::Parameter<CodecParam> {
+  /** \brief the number of values sharing a scale in the int8 codec */
+  int codec_chunk;
+  /** \brief the ratio of values kept by the topk codec */
+  float topk_ratio;
+  DMLC_DECLARE_PARAMETER(CodecParam) {
+    DMLC_DECLARE_FIELD(codec_chunk).set_range(1, 1<<20).set_default(256);
+    DMLC_DECLARE_FIELD(topk_ratio).set_range(0, 1).set_default(.01);
+  }
+};
+
+/**
+ * \brief compresses the values of a push or a pull
+ *
+ * an encoded block starts with a header of the codec type, the number of
+ * values and the payload length in bytes, and is padded to 4 bytes, so it can
+ * be carried by an SArray<real_t>. blocks encoded by the same codec can be
+ * concatenated, such as the pull responses of several servers, and are decoded
+ * together.
+ *
+ * supported codecs:
+ * - fp16: IEEE half precision
+ * - bf16: the upper 16 bits of fp32
+ * - int8: a per-chunk fp32 scale followed by 8-bit integers
+ * - topk: only the values with the largest magnitudes and their positions,
+ *   the rest are accumulated and added to the next push of the same feature
+ *   (error feedback), so it only fits gradients
+ */
+class Codec {
+ public:
+  /**
+   * \brief the factory function
+   * \param type one of "fp16", "bf16", "int8" and "topk"
+   */
+  static Codec* Create(const std::string& type, const CodecParam& param);
+  virtual ~Codec() { }
+
+  /**
+   * \brief encode values
+   *
+   * @param keys the feature ids, only used by codecs with per feature states
+   * @param vals the values
+   * @param lens the number of values of each feature, could be empty
+   * @param data the encoded block
+   */
+  void Encode(const SArray<feaid_t>& keys,
+              const SArray<real_t>& vals,
+              const SArray<int>& lens,
+              SArray<real_t>* data) {
+    size_t nbytes = PayloadSize(vals.size());
+    size_t nwords = kHeaderSize + (nbytes + sizeof(real_t) - 1) / sizeof(real_t);
+    data->resize(nwords);
+    int32_t* head = reinterpret_cast<int32_t*>(data->data());
+    head[0] = type_;
+    head[1] = static_cast<int32_t>(vals.size());
+    char* payload = reinterpret_cast<char*>(head + kHeaderSize);
+    head[2] = static_cast<int32_t>(EncodePayload(keys, vals, lens, payload));
+    CHECK_LE(static_cast<size_t>(head[2]), nbytes);
+    data->resize(kHeaderSize + (head[2] + sizeof(real_t) - 1) / sizeof(real_t));
+  }
+
+  /**
+   * \brief decode one or more concatenated blocks
+   */
+  void Decode(const SArray<real_t>& data, SArray<real_t>* vals) const {
+    size_t n = 0;
+    for (size_t p = 0; p < data.size(); p += BlockSize(data, p)) {
+      n += reinterpret_cast<const int32_t*>(data.data() + p)[1];
+    }
+    vals->resize(n);
+    real_t* out = vals->data();
+    for (size_t p = 0; p < data.size(); p += BlockSize(data, p)) {
+      const int32_t* head = reinterpret_cast<const int32_t*>(data.data() + p);
+      CHECK_EQ(head[0], type_) << "data is encoded by another codec";
+      DecodePayload(reinterpret_cast<const char*>(head + kHeaderSize),
+                    head[1], out);
+      out += head[1];
+    }
+  }
+
+ protected:
+  explicit Codec(int type) : type_(type) { }
+
+  /** \brief an upper bound of the payload length of n values */
+  virtual size_t PayloadSize(size_t n) const = 0;
+  /** \brief encode into payload, return the payload length */
+  virtual size_t EncodePayload(const SArray<feaid_t>& keys,
+                               const SArray<real_t>& vals,
+                               const SArray<int>& lens,
+                               char* payload) = 0;
+  /** \brief decode n values from payload */
+  virtual void DecodePayload(const char* payload, size_t n,
+                             real_t* vals) const = 0;
+
+ private:
+  static const int kHeaderSize = 3;
+  static size_t BlockSize(const SArray<real_t>& data, size_t p) {
+    CHECK_LE(p + kHeaderSize, data.size()) << "broken data";
+    int32_t nbytes = reinterpret_cast<const int32_t*>(data.data() + p)[2];
+    return kHeaderSize + (nbytes + sizeof(real_t) - 1) / sizeof(real_t);
+  }
+  int type_;
+};
+
+/**
+ * \brief IEEE half precision, rounds to the nearest even
+ */
+class FP16Codec : public Codec {
+ public:
+  FP16Codec() : Codec(1) { }
+
+  static uint16_t ToHalf(real_t v) {
+    uint32_t x; memcpy(&x, &v, 4);
+    uint32_t sign = (x >> 16) & 0x8000;
+    uint32_t absx = x & 0x7fffffff;
+    if (absx >= 0x7f800000) {  // inf or nan
+      return sign | 0x7c00 | (absx > 0x7f800000 ? 0x200 : 0);
+    }
+    if (absx >= 0x477ff000) return sign | 0x7c00;  // overflow
+    if (absx < 0x38800000) {  // subnormal or zero
+      if (absx < 0x33000000) return sign;
+      uint32_t m = (absx & 0x7fffff) | 0x800000;
+      int shift = 113 - (absx >> 23) + 13;
+      uint32_t h = m >> shift;
+      uint32_t rem = m & ((1u << shift) - 1), half = 1u << (shift - 1);
+      if (rem > half || (rem == half && (h & 1))) ++h;
+      return sign | h;
+    }
+    uint32_t h = ((absx - 0x38000000) >> 13);
+    uint32_t rem = absx & 0x1fff;
+    if (rem > 0x1000 || (rem == 0x1000 && (h & 1))) ++h;
+    return sign | h;
+  }
+
+  static real_t FromHalf(uint16_t h) {
+    uint32_t sign = (h & 0x8000) << 16;
+    uint32_t e = (h >> 10) & 0x1f, m = h & 0x3ff, x;
+    if (e == 0) {
+      if (m == 0) {
+        x = sign;
+      } else {  // subnormal
+        e = 113;
+        while (!(m & 0x400)) { m <<= 1; --e; }
+        x = sign | (e << 23) | ((m & 0x3ff) << 13);
+      }
+    } else if (e == 31) {
+      x = sign | 0x7f800000 | (m << 13);
+    } else {
+      x = sign | ((e + 112) << 23) | (m << 13);
+    }
+    real_t v; memcpy(&v, &x, 4);
+    return v;
+  }
+
+ protected:
+  size_t PayloadSize(size_t n) const override { return n * 2; }
+  size_t EncodePayload(const SArray<feaid_t>& keys,
+                       const SArray<real_t>& vals,
+                       const SArray<int>& lens,
+                       char* payload) override {
+    uint16_t* h = reinterpret_cast<uint16_t*>(payload);
+    for (size_t i = 0; i < vals.size(); ++i) h[i] = ToHalf(vals[i]);
+    return vals.size() * 2;
+  }
+  void DecodePayload(const char* payload, size_t n,
+                     real_t* vals) const override {
+    const uint16_t* h = reinterpret_cast<const uint16_t*>(payload);
+    for (size_t i = 0; i < n; ++i) vals[i] = FromHalf(h[i]);
+  }
+};
+
+/**
+ * \brief bfloat16, keeps the range of fp32 with 8 bits mantissa
+ */
+class BF16Codec : public Codec {
+ public:
+  BF16Codec() : Codec(2) { }
+
+ protected:
+  size_t PayloadSize(size_t n) const override { return n * 2; }
+  size_t EncodePayload(const SArray<feaid_t>& keys,
+                       const SArray<real_t>& vals,
+                       const SArray<int>& lens,
+                       char* payload) override {
+    uint16_t* h = reinterpret_cast<uint16_t*>(payload);
+    for (size_t i = 0; i < vals.size(); ++i) {
+      uint32_t x; memcpy(&x, &vals[i], 4);
+      if ((x & 0x7fffffff) > 0x7f800000) {
+        h[i] = (x >> 16) | 0x40;  // keep nan
+      } else {
+        h[i] = (x + 0x7fff + ((x >> 16) & 1)) >> 16;  // round to nearest even
+      }
+    }
+    return vals.size() * 2;
+  }
+  void DecodePayload(const char* payload, size_t n,
+                     real_t* vals) const override {
+    const uint16_t* h = reinterpret_cast<const uint16_t*>(payload);
+    for (size_t i = 0; i < n; ++i) {
+      uint32_t x = static_cast<uint32_t>(h[i]) << 16;
+      memcpy(vals + i, &x, 4);
+    }
+  }
+};
+
+/**
+ * \brief 8-bit integers, each chunk of values shares a fp32 scale
+ */
+class Int8Codec : public Codec {
+ public:
+  explicit Int8Codec(int chunk) : Codec(3), chunk_(chunk) { }
+
+ protected:
+  size_t PayloadSize(size_t n) const override {
+    return NumChunks(n) * sizeof(real_t) + n;
+  }
+  size_t EncodePayload(const SArray<feaid_t>& keys,
+                       const SArray<real_t>& vals,
+                       const SArray<int>& lens,
+                       char* payload) override {
+    size_t n = vals.size(), nchunks = NumChunks(n);
+    real_t* scale = reinterpret_cast<real_t*>(payload);
+    int8_t* q = reinterpret_cast<int8_t*>(scale + nchunks);
+    for (size_t c = 0; c < nchunks; ++c) {
+      size_t begin = c * chunk_, end = std::min(n, begin + chunk_);
+      real_t vmax = 0;
+      for (size_t i = begin; i < end; ++i) vmax = std::max(vmax, std::fabs(vals[i]));
+      scale[c] = vmax / 127;
+      real_t inv = vmax > 0 ? 127 / vmax : 0;
+      for (size_t i = begin; i < end; ++i) {
+        q[i] = static_cast<int8_t>(std::lround(vals[i] * inv));
+      }
+    }
+    return PayloadSize(n);
+  }
+  void DecodePayload(const char* payload, size_t n,
+                     real_t* vals) const override {
+    const real_t* scale = reinterpret_cast<const real_t*>(payload);
+    const int8_t* q = reinterpret_cast<const int8_t*>(scale + NumChunks(n));
+    for (size_t i = 0; i < n; ++i) vals[i] = q[i] * scale[i / chunk_];
+  }
+
+ private:
+  size_t NumChunks(size_t n) const { return (n + chunk_ - 1) / chunk_; }
+  size_t chunk_;
+};
+
+/**
+ * \brief sends the values with the largest magnitudes
+ *
+ * the values not sent are accumulated for each feature, and added to the
+ * values of the next push of that feature. it is not thread-safe
+ */
+class TopKCodec : public Codec {
+ public:
+  explicit TopKCodec(real_t ratio) : Codec(4), ratio_(ratio) { }
+
+  /** \brief the number of features with accumulated values */
+  size_t num_residuals() const { return residual_.size(); }
+
+ protected:
+  size_t PayloadSize(size_t n) const override {
+    return NumKept(n) * (sizeof(uint32_t) + sizeof(real_t));
+  }
+  size_t EncodePayload(const SArray<feaid_t>& keys,
+                       const SArray<real_t>& vals,
+                       const SArray<int>& lens,
+                       char* payload) override {
+    size_t n = vals.size();
+    if (n == 0) return 0;
+    CHECK(keys.size()) << "the keys are required";
+    CHECK(lens.empty() || lens.size() == keys.size());
+    CHECK(lens.size() || n % keys.size() == 0);
+    // add the residuals
+    std::vector<real_t> acc(vals.begin(), vals.end());
+    std::vector<real_t*> res(keys.size());
+    size_t p = 0;
+    for (size_t i = 0; i < keys.size(); ++i) {
+      size_t len = lens.empty() ? n / keys.size() : lens[i];
+      auto& r = residual_[keys[i]];
+      r.resize(std::max(r.size(), len), 0);
+      for (size_t j = 0; j < len; ++j) acc[p + j] += r[j];
+      res[i] = r.data();
+      p += len;
+    }
+    CHECK_EQ(p, n);
+
+    // find the k largest
+    size_t k = NumKept(n);
+    std::vector<uint32_t> idx(n);
+    for (size_t i = 0; i < n; ++i) idx[i] = i;
+    std::nth_element(idx.begin(), idx.begin() + k - 1, idx.end(),
+                     [&acc](uint32_t a, uint32_t b) {
+                       return std::fabs(acc[a]) > std::fabs(acc[b]);
+                     });
+    idx.resize(k);
+    std::sort(idx.begin(), idx.end());
+    uint32_t* pos = reinterpret_cast<uint32_t*>(payload);
+    real_t* val = reinterpret_cast<real_t*>(pos + k);
+    for (size_t i = 0; i < k; ++i) {
+      pos[i] = idx[i]; val[i] = acc[idx[i]]; acc[idx[i]] = 0;
+    }
+
+    // keep the rest
+    p = 0;
+    for (size_t i = 0; i < keys.size(); ++i) {
+      size_t len = lens.empty() ? n / keys.size() : lens[i];
+      for (size_t j = 0; j < len; ++j) res[i][j] = acc[p + j];
+      p += len;
+    }
+    return PayloadSize(n);
+  }
+  void DecodePayload(const char* payload, size_t n,
+                     real_t* vals) const override {
+    size_t k = NumKept(n);
+    const uint32_t* pos = reinterpret_cast<const uint32_t*>(payload);
+    const real_t* val = reinterpret_cast<const real_t*>(pos + k);
+    memset(vals, 0, n * sizeof(real_t));
+    for (size_t i = 0; i < k; ++i) vals[pos[i]] = val[i];
+  }
+
+ private:
+  size_t NumKept(size_t n) const {
+    if (n == 0) return 0;
+    return std::min(n, std::max<size_t>(1, std::ceil(n * ratio_)));
+  }
+  real_t ratio_;
+  std::unordered_map<feaid_t, std::vector<real_t>> residual_;
+};
+
+inline Codec* Codec::Create(const std::string& type, const CodecParam& param) {
+  if (type == "fp16") {
+    return new FP16Codec();
+  } else if (type == "bf16") {
+    return new BF16Codec();
+  } else if (type == "int8") {
+    return new Int8Codec(param.codec_chunk);
+  } else if (type == "topk") {
+    return new TopKCodec(param.topk_ratio);
+  } else {
+    LOG(FATAL) << "unknown codec: " << type;
+  }
+  return nullptr;
+}
+
+}  // namespace difacto
+#endif  // DIFACTO_STORE_CODEC_H_
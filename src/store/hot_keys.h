@@ -0,0 +1,230 @@
+/**
+ * Copyright (c) 2015 by Contributors
+ */
+#ifndef DIFACTO_STORE_HOT_KEYS_H_
+#define DIFACTO_STORE_HOT_KEYS_H_
+#include <string.h>
+#include <algorithm>
+#include <functional>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "dmlc/logging.h"
+#include "dmlc/memory_io.h"
+#include "difacto/base.h"
+#include "difacto/sarray.h"
+#include "ps/ps.h"
+namespace difacto {
+
+/**
+ * \brief tracks the most frequent keys with bounded memory by the
+ * space-saving algorithm.
+ *
+ * at most capacity keys are counted. a new key replaces the key with the
+ * smallest count, and inherits its count, so a count is never underestimated,
+ * and a key with a count above the total / capacity is always tracked.
+ *
+ * it is not thread-safe
+ */
+class HotKeyCounter {
+ public:
+  explicit HotKeyCounter(size_t capacity) : capacity_(capacity) {
+    CHECK_GT(capacity_, 0);
+  }
+  ~HotKeyCounter() { }
+
+  /**
+   * \brief add the counts of a list of keys
+   */
+  void Add(const SArray<feaid_t>& keys, const SArray<real_t>& cnts) {
+    CHECK_EQ(keys.size(), cnts.size());
+    for (size_t i = 0; i < keys.size(); ++i) {
+      real_t c = cnts[i];
+      auto it = cnts_.find(keys[i]);
+      if (it != cnts_.end()) {
+        order_.erase(std::make_pair(it->second, it->first));
+      } else {
+        if (cnts_.size() >= capacity_) {
+          auto min = order_.begin();
+          c += min->first;
+          cnts_.erase(min->second);
+          order_.erase(min);
+        }
+        it = cnts_.insert(std::make_pair(keys[i], 0)).first;
+      }
+      it->second += c;
+      order_.insert(std::make_pair(it->second, it->first));
+    }
+  }
+
+  /**
+   * \brief return the k most frequent keys, sorted by the keys
+   */
+  void TopK(size_t k, std::vector<feaid_t>* keys) const {
+    keys->clear();
+    for (auto it = order_.rbegin(); it != order_.rend() && keys->size() < k; ++it) {
+      keys->push_back(it->second);
+    }
+    std::sort(keys->begin(), keys->end());
+  }
+
+  /** \brief return the count of a key, 0 if not tracked */
+  real_t Count(feaid_t key) const {
+    auto it = cnts_.find(key);
+    return it == cnts_.end() ? 0 : it->second;
+  }
+
+ private:
+  size_t capacity_;
+  std::unordered_map<feaid_t, real_t> cnts_;
+  /** \brief (count, key) in ascending order */
+  std::set<std::pair<real_t, feaid_t>> order_;
+};
+
+/**
+ * \brief split a list of key-value pairs into two by a predicate on the keys
+ *
+ * @param kv the key-value pairs, lens can be empty if all values have the same
+ * length, vals can be empty if only the keys are split
+ * @param pred a key goes to yes if pred is true, otherwise to no
+ */
+inline void SplitKV(const ps::KVPairs<real_t>& kv,
+                    const std::function<bool(feaid_t)>& pred,
+                    ps::KVPairs<real_t>* yes,
+                    ps::KVPairs<real_t>* no) {
+  size_t k = kv.lens.empty() && kv.keys.size() ?
+             kv.vals.size() / kv.keys.size() : 0;
+  size_t pos = 0;
+  for (size_t i = 0; i < kv.keys.size(); ++i) {
+    size_t len = kv.lens.empty() ? k : kv.lens[i];
+    auto out = pred(kv.keys[i]) ? yes : no;
+    out->keys.push_back(kv.keys[i]);
+    for (size_t j = 0; j < len; ++j) out->vals.push_back(kv.vals[pos + j]);
+    if (kv.lens.size()) out->lens.push_back(len);
+    pos += len;
+  }
+}
+
+/**
+ * \brief merge two lists of key-value pairs split by \ref SplitKV
+ *
+ * @param keys the keys before splitting
+ * @param parts the two lists
+ * @param vals output, the values of keys
+ * @param lens output, the lengths of the values. it is empty if both lists
+ * have no lens. could be nullptr
+ */
+inline void MergeKV(const SArray<feaid_t>& keys,
+                    const ps::KVPairs<real_t> parts[2],
+                    SArray<real_t>* vals,
+                    SArray<int>* lens) {
+  size_t k[2];
+  for (int j = 0; j < 2; ++j) {
+    k[j] = parts[j].lens.empty() && parts[j].keys.size() ?
+           parts[j].vals.size() / parts[j].keys.size() : 0;
+  }
+  bool has_lens = parts[0].lens.size() || parts[1].lens.size();
+  vals->resize(parts[0].vals.size() + parts[1].vals.size());
+  if (lens) lens->resize(has_lens ? keys.size() : 0);
+  size_t i[2] = {0, 0}, pos[2] = {0, 0}, p = 0;
+  for (size_t n = 0; n < keys.size(); ++n) {
+    int j = i[0] < parts[0].keys.size() && parts[0].keys[i[0]] == keys[n] ? 0 : 1;
+    CHECK(i[j] < parts[j].keys.size() && parts[j].keys[i[j]] == keys[n])
+        << "key " << keys[n] << " is missing";
+    size_t len = parts[j].lens.empty() ? k[j] : parts[j].lens[i[j]];
+    memcpy(vals->data() + p, parts[j].vals.data() + pos[j], len * sizeof(real_t));
+    if (lens && has_lens) (*lens)[n] = len;
+    p += len; pos[j] += len; ++i[j];
+  }
+  CHECK_EQ(p, vals->size());
+}
+
+/**
+ * \brief sum two lists of key-value pairs with sorted keys
+ *
+ * the keys of sum are the union of both, the values of a key in both lists
+ * are added, so it must have the same length in both.
+ *
+ * @param a the first list, lens can be empty if all values have the same
+ * length
+ * @param b the second list, the same as a
+ * @param sum output, its lens are empty if both lists have no lens. it can be
+ * the same as a or b
+ */
+inline void SumKV(const ps::KVPairs<real_t>& a,
+                  const ps::KVPairs<real_t>& b,
+                  ps::KVPairs<real_t>* sum) {
+  if (a.keys.empty()) { *sum = b; return; }
+  if (b.keys.empty()) { *sum = a; return; }
+  const ps::KVPairs<real_t>* in[2] = {&a, &b};
+  size_t k[2];
+  for (int j = 0; j < 2; ++j) {
+    k[j] = in[j]->lens.empty() ? in[j]->vals.size() / in[j]->keys.size() : 0;
+  }
+  bool has_lens = a.lens.size() || b.lens.size();
+  ps::KVPairs<real_t> res;
+  res.keys.reserve(a.keys.size() + b.keys.size());
+  res.vals.reserve(a.vals.size() + b.vals.size());
+  if (has_lens) res.lens.reserve(a.keys.size() + b.keys.size());
+  size_t i[2] = {0, 0}, pos[2] = {0, 0}, n[2] = {a.keys.size(), b.keys.size()};
+  while (i[0] < n[0] || i[1] < n[1]) {
+    // take the smaller key, from both lists if they have it
+    bool take[2] = {
+      i[0] < n[0] && (i[1] == n[1] || a.keys[i[0]] <= b.keys[i[1]]),
+      i[1] < n[1] && (i[0] == n[0] || b.keys[i[1]] <= a.keys[i[0]])};
+    int first = take[0] ? 0 : 1;
+    size_t l = in[first]->lens.empty() ? k[first] : in[first]->lens[i[first]];
+    res.keys.push_back(in[first]->keys[i[first]]);
+    if (has_lens) res.lens.push_back(l);
+    size_t p = res.vals.size();
+    res.vals.resize(p + l, 0);
+    for (int j = 0; j < 2; ++j) {
+      if (!take[j]) continue;
+      size_t lj = in[j]->lens.empty() ? k[j] : in[j]->lens[i[j]];
+      CHECK_EQ(lj, l) << "key " << res.keys.back() << " has different lengths";
+      const real_t* v = in[j]->vals.data() + pos[j];
+      for (size_t t = 0; t < l; ++t) res.vals[p + t] += v[t];
+      pos[j] += l; ++i[j];
+    }
+  }
+  *sum = res;
+}
+
+/**
+ * \brief serialize a list of key-value pairs into a string
+ */
+inline void PackKV(const ps::KVPairs<real_t>& kv, std::string* str) {
+  str->clear();
+  dmlc::MemoryStringStream ss(str);
+  auto write = [&ss](const void* data, size_t n, size_t size) {
+    ss.Write(&n, sizeof(n));
+    if (n) ss.Write(data, n * size);
+  };
+  write(kv.keys.data(), kv.keys.size(), sizeof(feaid_t));
+  write(kv.vals.data(), kv.vals.size(), sizeof(real_t));
+  write(kv.lens.data(), kv.lens.size(), sizeof(int));
+}
+
+template <typename V>
+inline void ReadSArray(dmlc::Stream* ss, SArray<V>* arr) {
+  size_t n = 0;
+  CHECK_EQ(ss->Read(&n, sizeof(n)), sizeof(n));
+  arr->resize(n);
+  if (n) CHECK_EQ(ss->Read(arr->data(), n * sizeof(V)), n * sizeof(V));
+}
+
+/**
+ * \brief deserialize a list of key-value pairs packed by \ref PackKV
+ */
+inline void UnpackKV(const std::string& str, ps::KVPairs<real_t>* kv) {
+  std::string copy = str;
+  dmlc::MemoryStringStream ss(&copy);
+  ReadSArray(&ss, &kv->keys);
+  ReadSArray(&ss, &kv->vals);
+  ReadSArray(&ss, &kv->lens);
+}
+
+}  // namespace difacto
+#endif  // DIFACTO_STORE_HOT_KEYS_H_
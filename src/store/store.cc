@@ -3,12 +3,16 @@
  */
 #include "difacto/store.h"
 #include "./store_local.h"
+#include "./store_dist.h"
 namespace difacto {
 
+DMLC_REGISTER_PARAMETER(StoreLocalParam);
+DMLC_REGISTER_PARAMETER(StoreDistParam);
+DMLC_REGISTER_PARAMETER(CodecParam);
+
 Store* Store::Create() {
   if (IsDistributed()) {
-    LOG(FATAL) << "not implemented";
-    return nullptr;
+    return new StoreDist();
   } else {
     return new StoreLocal();
   }
@@ -0,0 +1,1022 @@
+/**
+ * Copyright (c) 2015 by Contributors
+ */
+#ifndef DIFACTO_STORE_STORE_DIST_H_
+#define DIFACTO_STORE_STORE_DIST_H_
+#include <string>
+#include <vector>
+#include <unordered_set>
+#include <unordered_map>
+#include <map>
+#include <deque>
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <condition_variable>
+#include "difacto/store.h"
+#include "difacto/updater.h"
+#include "dmlc/parameter.h"
+#include "dmlc/timer.h"
+#include "common/thread_pool.h"
+#include "common/key_cache.h"
+#include "common/offsets.h"
+#include "./codec.h"
+#include "./hot_keys.h"
+#include "ps/ps.h"
+namespace difacto {
+
+struct StoreDistParam : public dmlc::Parameter<StoreDistParam> {
+  /**
+   * \brief the maximal number of key lists cached by a worker. a cached key
+   * list is sent to the servers only on its first use, the following pushes
+   * and pulls only send a signature. 0 means disabled, which is the default,
+   * because sgd sends a new key list in every minibatch. bcd and lbfgs set it
+   * to 1024 unless it is given
+   */
+  int key_cache_size;
+  /**
+   * \brief the codec compressing the gradients pushed to the servers, can be
+   * fp16, bf16, int8 or topk, see \ref Codec. empty means no compression.
+   * it only fits first-order gradients, so bcd rejects it. lbfgs rejects
+   * topk, which drops most of the gradient
+   */
+  std::string push_codec;
+  /**
+   * \brief the codec compressing the weights pulled from the servers, can be
+   * fp16, bf16 or int8. empty means no compression
+   */
+  std::string pull_codec;
+  /**
+   * \brief the number of the most frequent keys of a server which are
+   * replicated on all servers. 0 means disabled. the replicas serve the pulls
+   * of weights with bounded staleness, so it only fits asynchronous SGD. bcd
+   * and lbfgs reject it
+   */
+  int num_hot_keys;
+  /**
+   * \brief the period in millisecond a server reconciles its replicas with the
+   * owners of the hot keys. default is 100
+   */
+  int hot_key_sync;
+  /**
+   * \brief the period in millisecond a worker refreshes the list of hot keys.
+   * default is 1000
+   */
+  int hot_key_refresh;
+  /**
+   * \brief if nonzero, a server sums the gradients pushed by all workers and
+   * calls the updater once with the sum, then it answers the pushes. the i-th
+   * gradient push of every worker are summed together, so every worker must
+   * push the same number of times. bcd and lbfgs set it, whose updaters take
+   * a step from the full gradient. default is 0, which fits sgd
+   */
+  int sync_push;
+  DMLC_DECLARE_PARAMETER(StoreDistParam) {
+    DMLC_DECLARE_FIELD(key_cache_size).set_range(0, 1<<20).set_default(0);
+    DMLC_DECLARE_FIELD(push_codec).set_default("");
+    DMLC_DECLARE_FIELD(pull_codec).set_default("");
+    DMLC_DECLARE_FIELD(num_hot_keys).set_default(0);
+    DMLC_DECLARE_FIELD(hot_key_sync).set_default(100);
+    DMLC_DECLARE_FIELD(hot_key_refresh).set_default(1000);
+    DMLC_DECLARE_FIELD(sync_push).set_default(0);
+  }
+};
+
+/**
+ * \brief model sync over multiple machines by ps-lite
+ *
+ * the keys are range-partitioned over the servers, namely server i owns the
+ * i-th segment of [0, max_key) with the same size. it balances well because the
+ * feature ids are byte-reversed (see \ref ReverseBytes). each server hosts an
+ * updater, which processes the pushes and pulls on its key range. a push or a
+ * pull of a worker is sliced and sent to the servers, and it is finished once
+ * all servers have responded.
+ *
+ * as \ref StoreLocal, the callbacks run on the shared thread pool, so that the
+ * receiving thread of ps-lite is never blocked by a learner.
+ *
+ * BCD and L-BFGS push and pull the same key lists in every iteration, so they
+ * set key_cache_size. a worker then caches the key lists it has sent (see
+ * \ref KeyCache) and the servers keep their slices. a later request of a
+ * cached list carries the signature and only the first key of each slice. a
+ * server then passes the kept slice to the updater, which is the same array
+ * every time, so the updater can cache what it derived from the keys as well.
+ * the requests with lens still send all keys, because ps-lite requires one
+ * len per key, and pull responses always carry the keys.
+ *
+ * the pushed gradients and the pulled weights can be compressed by a \ref
+ * Codec. a worker encodes the slice of each server, and the server decodes it
+ * before calling the updater. a pull response is encoded by the server, and
+ * decoded by the worker before the callback. the feature counts are never
+ * compressed.
+ *
+ * with range partitioning, a few extremely frequent features make their
+ * servers hot spots. if num_hot_keys > 0, a server tracks the most frequent
+ * keys in its range from the pushed feature counts (see \ref HotKeyCounter),
+ * and the workers fetch the hot keys periodically. a worker sends the hot keys
+ * of a gradient push or a weight pull as a separate request to a single
+ * server, which rotates over all servers. a server updates the hot keys it
+ * owns, and buffers the gradients of the others. it answers a pull from the
+ * replicas of the weights. every hot_key_sync milliseconds, a server sends the
+ * buffered gradients to their owners, which reply the current hot keys and
+ * their weights to refresh the replicas. the servers talk to each other by
+ * a ps-lite SimpleApp.
+ *
+ * the store and the updater describe the values of the keys by offsets, while
+ * ps-lite slices them by one length per key. a worker converts the offsets of
+ * a push into lengths, and the server converts them back before calling the
+ * updater. a pull asking for offsets is answered with lengths, which the
+ * worker converts into offsets before the callback.
+ *
+ * BCD and L-BFGS update the model from the gradient of all data, so they set
+ * sync_push. a worker then sends a gradient push to every server, even if it
+ * has no key on some of them, and a server counts the pushes of each worker.
+ * once the i-th push of every worker has arrived, the server calls the updater
+ * with their sum (see \ref SumKV), and then answers them, so a following pull
+ * sees the update.
+ */
+class StoreDist : public Store {
+ public:
+  /** \brief the ps-lite app id used by the store */
+  static const int kAppID = 0;
+  /** \brief the ps-lite app id used by the servers to reconcile the replicas */
+  static const int kReplicaAppID = 3;
+
+  StoreDist() { }
+  virtual ~StoreDist() {
+    WaitAll();
+    if (sync_thread_) {
+      {
+        std::lock_guard<std::mutex> lk(sync_mu_);
+        stop_sync_ = true;
+      }
+      sync_cond_.notify_all();
+      sync_thread_->join();
+      delete sync_thread_;
+      // no server sends a reconciliation request after this barrier
+      ps::Postoffice::Get()->Barrier(ps::kServerGroup);
+    }
+    delete replica_app_;
+    delete worker_;
+    delete server_;
+    delete push_codec_;
+    delete pull_codec_;
+    delete hot_counter_;
+  }
+
+  KWArgs Init(const KWArgs& kwargs) override {
+    auto remain = param_.InitAllowUnknown(kwargs);
+    remain = codec_param_.InitAllowUnknown(remain);
+    if (param_.push_codec.size()) {
+      push_codec_ = Codec::Create(param_.push_codec, codec_param_);
+    }
+    if (param_.pull_codec.size()) {
+      CHECK_NE(param_.pull_codec, "topk") << "topk only fits gradients";
+      pull_codec_ = Codec::Create(param_.pull_codec, codec_param_);
+    }
+    ranges_ = ps::Postoffice::Get()->GetServerKeyRanges();
+    rank_ = ps::MyRank();
+    if (ps::IsWorker()) {
+      using namespace std::placeholders;
+      worker_ = new ps::KVWorker<real_t>(kAppID);
+      worker_->set_slicer(std::bind(&StoreDist::Slice, this, _1, _2, _3));
+      key_cache_ = KeyCache<KeyList>(param_.key_cache_size);
+      // one key per server to fetch the hot keys
+      for (const auto& r : ranges_) hot_list_keys_.push_back(r.begin());
+    } else if (ps::IsServer()) {
+      using namespace std::placeholders;
+      server_ = new ps::KVServer<real_t>(kAppID);
+      server_->set_request_handle(
+          std::bind(&StoreDist::Process, this, _1, _2, _3));
+      if (param_.num_hot_keys > 0) {
+        hot_counter_ = new HotKeyCounter(param_.num_hot_keys * 10);
+        replica_app_ = new ps::SimpleApp(kReplicaAppID);
+        replica_app_->set_request_handle(
+            std::bind(&StoreDist::ProcessReplicaRequest, this, _1, _2));
+        replica_app_->set_response_handle(
+            std::bind(&StoreDist::ProcessReplicaResponse, this, _1, _2));
+      }
+    }
+    // make sure all stores are ready before any request is sent
+    ps::Postoffice::Get()->Barrier(
+        ps::kScheduler + ps::kServerGroup + ps::kWorkerGroup);
+    if (replica_app_) {
+      sync_thread_ = new std::thread(&StoreDist::SyncReplicas, this);
+    }
+    return remain;
+  }
+
+  int Push(const SArray<feaid_t>& fea_ids,
+           int val_type,
+           const SArray<real_t>& vals,
+           const SArray<int>& offsets,
+           const std::function<void()>& on_complete) override {
+    // ps-lite sends the data without copying, so the caller cannot modify
+    // them before the push is finished. the offsets are converted into a new
+    // array by ZPush
+    SArray<real_t> vals_copy; vals_copy.CopyFrom(vals);
+    return ZPush(fea_ids, val_type, vals_copy, offsets, on_complete);
+  }
+
+  int ZPush(const SArray<feaid_t>& fea_ids,
+            int val_type,
+            const SArray<real_t>& vals,
+            const SArray<int>& offsets,
+            const std::function<void()>& on_complete) override {
+    CHECK_NOTNULL(worker_);
+    int time = NewRequest();
+    RefreshHotKeys();
+    ps::KVPairs<real_t> kv, parts[2];
+    kv.keys = fea_ids; kv.vals = vals;
+    CHECK(offsets.empty() || offsets.size() == fea_ids.size() + 1);
+    OffsetsToLens(offsets, &kv.lens);
+    int route = val_type == kGradient ? SplitHotKeys(kv, parts) : -1;
+    if (route < 0) {
+      Send(true, val_type, kv, nullptr, nullptr, -1, Callback(time, on_complete));
+    } else {
+      auto done = JoinCallbacks(parts, Callback(time, on_complete));
+      if (parts[0].keys.size()) {
+        Send(true, val_type, parts[0], nullptr, nullptr, -1, done);
+      }
+      Send(true, val_type, parts[1], nullptr, nullptr, route, done);
+    }
+    return time;
+  }
+
+  int Pull(const SArray<feaid_t>& fea_ids,
+           int val_type,
+           SArray<real_t>* vals,
+           SArray<int>* offsets,
+           const std::function<void()>& on_complete) override {
+    CHECK_NOTNULL(worker_);
+    int time = NewRequest();
+    RefreshHotKeys();
+    Codec* codec = val_type == kWeight ? pull_codec_ : nullptr;
+    // ps-lite pulls one length per key, which is converted into the offsets.
+    // the offsets are empty if every key has a single value, as the updaters
+    // return them
+    SArray<int>* lens = nullptr;
+    auto callback = on_complete;
+    if (offsets) {
+      auto buf = std::make_shared<SArray<int>>();
+      lens = buf.get();
+      callback = [buf, offsets, on_complete]() {
+        bool w_only = std::all_of(buf->begin(), buf->end(),
+                                  [](int len) { return len == 1; });
+        LensToOffsets(w_only ? SArray<int>() : *buf, offsets);
+        if (on_complete) on_complete();
+      };
+    }
+    ps::KVPairs<real_t> kv;
+    kv.keys = fea_ids;
+    auto parts = std::make_shared<std::vector<ps::KVPairs<real_t>>>(2);
+    int route = val_type == kWeight ? SplitHotKeys(kv, parts->data()) : -1;
+    if (route >= 0) {
+      // pull the cold and hot keys separately, then merge them
+      auto merge = [parts, codec, fea_ids, vals, lens, callback]() {
+        for (auto& part : *parts) {
+          if (codec == nullptr || part.keys.empty()) continue;
+          SArray<real_t> decoded;
+          codec->Decode(part.vals, &decoded);
+          part.vals = decoded;
+        }
+        MergeKV(fea_ids, parts->data(), vals, lens);
+        if (callback) callback();
+      };
+      auto done = JoinCallbacks(parts->data(), Callback(time, merge));
+      for (int i = 0; i < 2; ++i) {
+        auto& part = (*parts)[i];
+        if (part.keys.empty()) continue;
+        Send(false, val_type, part, &part.vals, lens ? &part.lens : nullptr,
+             i ? route : -1, done);
+      }
+    } else if (codec) {
+      // pull the encoded values into a buffer, and decode before on_complete
+      auto data = std::make_shared<SArray<real_t>>();
+      auto decode = [data, codec, vals, callback]() {
+        codec->Decode(*data, vals);
+        if (callback) callback();
+      };
+      Send(false, val_type, kv, data.get(), lens, -1, Callback(time, decode));
+    } else {
+      Send(false, val_type, kv, vals, lens, -1, Callback(time, callback));
+    }
+    return time;
+  }
+
+  /**
+   * \brief wait until a request and its callback are finished. the calling
+   * thread runs the pending jobs of the thread pool meanwhile, in case it is a
+   * thread of the pool
+   */
+  void Wait(int time) override {
+    ThreadPool::Get()->WaitUntil([this, time]() {
+        std::lock_guard<std::mutex> lk(mu_);
+        return pending_.count(time) == 0;
+      });
+  }
+
+  int Rank() override { return ps::MyRank(); }
+  int NumWorkers() override { return ps::NumWorkers(); }
+  int NumServers() override { return ps::NumServers(); }
+
+ private:
+  /**
+   * \brief a cached key list of a worker
+   */
+  struct KeyList {
+    /** \brief the signature, starts from 1 */
+    int sig;
+    /** \brief the keys in [pos[i], pos[i+1]) go to server i */
+    std::vector<size_t> pos;
+  };
+
+  /**
+   * \brief the key lists of a worker kept by a server
+   */
+  struct ServerKeyLists {
+    std::unordered_map<int, SArray<feaid_t>> keys;
+    std::deque<int> order;
+  };
+
+  /**
+   * \brief the gradient pushes of a round of sync_push
+   */
+  struct PushRound {
+    /** \brief the sum of the received pushes */
+    ps::KVPairs<real_t> sum;
+    /** \brief the received pushes, answered once all workers have pushed */
+    std::vector<ps::KVMeta> reqs;
+  };
+
+  static const int kMaxSig = (1 << 24) - 1;
+  /** \brief the value type of a request fetching the hot keys */
+  static const int kHotKeyList = 15;
+  /** \brief the heads of the requests between servers */
+  static const int kSyncReplicas = 1;
+  static const int kFetchReplicas = 2;
+
+  /**
+   * \brief the cmd of a request, which contains the value type, whether or not
+   * the keys are sent to be kept by the servers, whether or not it is a
+   * request of hot keys, whether or not a pull asks for the lengths, and the
+   * signature of the key list, 0 means not cached
+   */
+  static int EncodeCmd(int val_type, int sig, bool keep_keys, bool hot,
+                       bool want_lens) {
+    return val_type | (keep_keys << 4) | (hot << 5) | (want_lens << 6) |
+        (sig << 7);
+  }
+
+  /**
+   * \brief send a request by ps-lite
+   *
+   * @param push a push or a pull
+   * @param kv the keys, and the values and lens for a push
+   * @param vals the pulled values
+   * @param lens the pulled lens, could be nullptr
+   * @param route -1 means slicing the request by the key ranges, otherwise the
+   * rank of the server the whole request is sent to
+   * @param cb the callback of ps-lite
+   */
+  void Send(bool push, int val_type, const ps::KVPairs<real_t>& kv,
+            SArray<real_t>* vals, SArray<int>* lens, int route,
+            const std::function<void()>& cb) {
+    // hold the lock until sent, so the servers receive the keys of a
+    // signature before the signature only requests
+    std::lock_guard<std::mutex> lk(key_mu_);
+    int cmd;
+    bool want_lens = !push && lens;
+    if (route < 0) {
+      cmd = Prepare(kv.keys, val_type, want_lens);
+    } else {
+      sending_ = nullptr;
+      cmd = EncodeCmd(val_type, 0, false, true, want_lens);
+    }
+    route_ = route;
+    encoding_ = push && val_type == kGradient ? push_codec_ : nullptr;
+    send_all_ = push && val_type == kGradient && route < 0 && param_.sync_push;
+    if (push) {
+      worker_->ZPush(kv.keys, kv.vals, kv.lens, cmd, cb);
+    } else {
+      worker_->ZPull(kv.keys, vals, lens, cmd, cb);
+    }
+  }
+
+  /**
+   * \brief returns a callback which calls done once called by every non-empty
+   * part
+   */
+  static std::function<void()> JoinCallbacks(
+      const ps::KVPairs<real_t>* parts, const std::function<void()>& done) {
+    auto remain = std::make_shared<std::atomic<int>>(
+        (parts[0].keys.size() > 0) + (parts[1].keys.size() > 0));
+    return [remain, done]() { if (--*remain == 0) done(); };
+  }
+
+  /**
+   * \brief split the hot keys from a request, runs on the worker side
+   *
+   * @param kv the request
+   * @param parts output, the cold keys and the hot keys
+   * @return the rank of the server the hot keys are sent to, or -1 if there is
+   * no hot key
+   */
+  int SplitHotKeys(const ps::KVPairs<real_t>& kv, ps::KVPairs<real_t>* parts) {
+    if (param_.num_hot_keys == 0) return -1;
+    std::lock_guard<std::mutex> lk(hot_mu_);
+    if (hot_keys_.empty()) return -1;
+    SplitKV(kv, [this](feaid_t key) { return hot_keys_.count(key) != 0; },
+            &parts[1], &parts[0]);
+    if (parts[1].keys.empty()) return -1;
+    // rotate the servers, so the hot keys are spread over all of them
+    return (rank_ + hot_seq_++) % ranges_.size();
+  }
+
+  /**
+   * \brief fetch the hot keys from the servers if the list is older than
+   * hot_key_refresh, runs on the worker side
+   */
+  void RefreshHotKeys() {
+    if (param_.num_hot_keys == 0) return;
+    {
+      std::lock_guard<std::mutex> lk(hot_mu_);
+      double now = dmlc::GetTime();
+      if (refreshing_ || now - refresh_time_ < param_.hot_key_refresh * 1e-3) {
+        return;
+      }
+      refreshing_ = true;
+      refresh_time_ = now;
+    }
+    ps::KVPairs<real_t> kv;
+    kv.keys = hot_list_keys_;
+    auto res = std::make_shared<ps::KVPairs<real_t>>();
+    auto on_complete = [this, res]() {
+      // the keys are packed into the values by the servers
+      std::vector<feaid_t> keys(res->vals.size() * sizeof(real_t) / sizeof(feaid_t));
+      memcpy(keys.data(), res->vals.data(), keys.size() * sizeof(feaid_t));
+      std::lock_guard<std::mutex> lk(hot_mu_);
+      hot_keys_ = std::unordered_set<feaid_t>(keys.begin(), keys.end());
+      refreshing_ = false;
+    };
+    Send(false, kHotKeyList, kv, &res->vals, &res->lens, -1,
+         Callback(NewRequest(), on_complete));
+  }
+
+  /**
+   * \brief find or add the key list into the cache, must hold key_mu_
+   * \return the cmd of the request
+   */
+  int Prepare(const SArray<feaid_t>& keys, int val_type, bool want_lens) {
+    sending_ = nullptr;
+    if (param_.key_cache_size == 0 || keys.empty()) {
+      return EncodeCmd(val_type, 0, false, false, want_lens);
+    }
+    KeyList* list = key_cache_.Find(keys);
+    send_keys_ = list == nullptr;
+    if (send_keys_) {
+      KeyList new_list;
+      new_list.sig = next_sig_;
+      next_sig_ = next_sig_ % kMaxSig + 1;
+      SlicePosition(keys, ps::Postoffice::Get()->GetServerKeyRanges(),
+                    &new_list.pos);
+      list = key_cache_.Insert(keys, new_list);
+    }
+    sending_ = list;
+    return EncodeCmd(val_type, list->sig, send_keys_, false, want_lens);
+  }
+
+  /**
+   * \brief the positions of the keys for each server range
+   */
+  static void SlicePosition(const SArray<feaid_t>& keys,
+                            const std::vector<ps::Range>& ranges,
+                            std::vector<size_t>* pos) {
+    size_t n = ranges.size();
+    pos->resize(n + 1);
+    (*pos)[0] = 0;
+    for (size_t i = 0; i < n; ++i) {
+      (*pos)[i+1] = std::lower_bound(
+          keys.begin() + (*pos)[i], keys.end(), ranges[i].end()) - keys.begin();
+    }
+    (*pos)[n] = keys.size();
+  }
+
+  /**
+   * \brief slice a request for the servers and encode the slices, called by
+   * ps-lite within ZPush and ZPull, so key_mu_ is held
+   */
+  void Slice(const ps::KVPairs<real_t>& send,
+             const std::vector<ps::Range>& ranges,
+             ps::KVWorker<real_t>::SlicedKVs* sliced) {
+    std::vector<size_t> tmp;
+    if (route_ >= 0) {
+      // send all keys to a single server
+      tmp.resize(ranges.size() + 1);
+      for (size_t i = 0; i <= ranges.size(); ++i) {
+        tmp[i] = static_cast<int>(i) > route_ ? send.keys.size() : 0;
+      }
+    } else if (sending_ == nullptr) {
+      SlicePosition(send.keys, ranges, &tmp);
+    }
+    const std::vector<size_t>& pos = sending_ ? sending_->pos : tmp;
+    CHECK_EQ(pos.size(), ranges.size() + 1);
+    bool sig_only = sending_ && !send_keys_ && send.lens.empty();
+    size_t k = send.lens.empty() && send.keys.size() ?
+               send.vals.size() / send.keys.size() : 0;
+    size_t val_begin = 0, val_end = 0;
+    sliced->resize(ranges.size());
+    for (size_t i = 0; i < ranges.size(); ++i) {
+      if (pos[i+1] == pos[i]) {
+        // an empty slice of a synchronous push is sent without keys
+        (*sliced)[i].first = send_all_;
+        continue;
+      }
+      (*sliced)[i].first = true;
+      auto& kv = (*sliced)[i].second;
+      kv.keys = send.keys.segment(pos[i], sig_only ? pos[i] + 1 : pos[i+1]);
+      if (send.lens.size()) {
+        kv.lens = send.lens.segment(pos[i], pos[i+1]);
+        for (int l : kv.lens) val_end += l;
+      } else {
+        val_end = pos[i+1] * k;
+      }
+      kv.vals = send.vals.segment(val_begin, val_end);
+      val_begin = val_end;
+      if (encoding_) {
+        SArray<real_t> data;
+        encoding_->Encode(send.keys.segment(pos[i], pos[i+1]),
+                          kv.vals, kv.lens, &data);
+        kv.vals = data;
+      }
+    }
+  }
+
+  /**
+   * \brief process a request from a worker, runs on the server side
+   */
+  void Process(const ps::KVMeta& req_meta,
+               const ps::KVPairs<real_t>& req_data,
+               ps::KVServer<real_t>* server) {
+    CHECK(updater_) << "set the updater first";
+    int val_type = req_meta.cmd & 15;
+    bool hot = (req_meta.cmd >> 5) & 1;
+    bool want_lens = (req_meta.cmd >> 6) & 1;
+    int sig = req_meta.cmd >> 7;
+    SArray<feaid_t> keys = req_data.keys;
+    // an empty slice carries no key, even if its key list is cached
+    if (sig && keys.size()) {
+      bool keep_keys = (req_meta.cmd >> 4) & 1;
+      keys = GetKeys(req_meta.sender, sig, keep_keys, req_data.keys);
+    }
+    if (req_meta.push) {
+      ps::KVPairs<real_t> kv;
+      kv.keys = keys; kv.vals = req_data.vals; kv.lens = req_data.lens;
+      if (val_type == kGradient && push_codec_ && keys.size()) {
+        push_codec_->Decode(req_data.vals, &kv.vals);
+      }
+      if (val_type == kFeaCount && hot_counter_) {
+        std::lock_guard<std::mutex> lk(hot_mu_);
+        hot_counter_->Add(keys, kv.vals);
+      }
+      if (hot) {
+        UpdateHot(val_type, kv);
+      } else if (val_type == kGradient && param_.sync_push) {
+        SyncPush(req_meta, kv, server);
+        return;
+      } else {
+        Update(keys, val_type, kv.vals, kv.lens);
+      }
+      server->Response(req_meta);
+    } else if (val_type == kHotKeyList) {
+      // reply the hot keys packed into the values
+      std::vector<feaid_t> hot_keys;
+      if (hot_counter_) {
+        std::lock_guard<std::mutex> lk(hot_mu_);
+        hot_counter_->TopK(param_.num_hot_keys, &hot_keys);
+      }
+      ps::KVPairs<real_t> res;
+      res.keys = keys;
+      res.vals.resize(hot_keys.size() * sizeof(feaid_t) / sizeof(real_t));
+      memcpy(res.vals.data(), hot_keys.data(), hot_keys.size() * sizeof(feaid_t));
+      res.lens = SArray<int>(1, res.vals.size());
+      server->Response(req_meta, res);
+    } else {
+      ps::KVPairs<real_t> res;
+      res.keys = keys;
+      if (hot) {
+        GetHot(val_type, keys, &res.vals, &res.lens);
+      } else {
+        Get(keys, val_type, &res.vals, &res.lens);
+      }
+      if (!want_lens) {
+        res.lens.clear();
+      } else if (res.lens.empty() && keys.size()) {
+        // ps-lite requires one length per key
+        res.lens.resize(keys.size(), res.vals.size() / keys.size());
+      }
+      if (val_type == kWeight && pull_codec_) {
+        SArray<real_t> data;
+        pull_codec_->Encode(keys, res.vals, res.lens, &data);
+        res.vals = data;
+      }
+      server->Response(req_meta, res);
+    }
+  }
+
+  /**
+   * \brief call the updater with the lengths of the values converted into the
+   * offsets, runs on the server side
+   */
+  void Update(const SArray<feaid_t>& keys, int val_type,
+              const SArray<real_t>& vals, const SArray<int>& lens) {
+    SArray<int> offsets;
+    LensToOffsets(lens, &offsets);
+    std::lock_guard<std::mutex> lk(updater_mu_);
+    updater_->Update(keys, val_type, vals, offsets);
+  }
+
+  /**
+   * \brief add a gradient push into its round, runs on the server side
+   *
+   * the updater is called once the round has the pushes of all workers, and
+   * then they are answered. it only runs on the receiving thread of ps-lite,
+   * so the rounds need no lock
+   */
+  void SyncPush(const ps::KVMeta& req_meta, const ps::KVPairs<real_t>& kv,
+                ps::KVServer<real_t>* server) {
+    int round = num_pushes_[req_meta.sender]++;
+    auto& pushes = rounds_[round];
+    SumKV(pushes.sum, kv, &pushes.sum);
+    pushes.reqs.push_back(req_meta);
+    if (static_cast<int>(pushes.reqs.size()) < NumWorkers()) return;
+    const auto& sum = pushes.sum;
+    if (sum.keys.size()) Update(sum.keys, kGradient, sum.vals, sum.lens);
+    for (const auto& req : pushes.reqs) server->Response(req);
+    rounds_.erase(round);
+  }
+
+  /**
+   * \brief get the values from the updater with the offsets converted into the
+   * lengths, runs on the server side
+   */
+  void Get(const SArray<feaid_t>& keys, int val_type,
+           SArray<real_t>* vals, SArray<int>* lens) {
+    SArray<int> offsets;
+    {
+      std::lock_guard<std::mutex> lk(updater_mu_);
+      updater_->Get(keys, val_type, vals, &offsets);
+    }
+    OffsetsToLens(offsets, lens);
+  }
+
+  /**
+   * \brief return the rank of the server owning a key
+   */
+  int Owner(feaid_t key) const {
+    for (size_t i = 0; i + 1 < ranges_.size(); ++i) {
+      if (key < ranges_[i].end()) return i;
+    }
+    return ranges_.size() - 1;
+  }
+
+  bool IsMine(feaid_t key) const { return Owner(key) == rank_; }
+
+  /**
+   * \brief process a push of hot keys, runs on the server side. the keys owned
+   * by this server are updated, the gradients of the others are buffered until
+   * the next reconciliation
+   */
+  void UpdateHot(int val_type, const ps::KVPairs<real_t>& kv) {
+    ps::KVPairs<real_t> mine, others;
+    SplitKV(kv, [this](feaid_t key) { return IsMine(key); }, &mine, &others);
+    if (mine.keys.size()) Update(mine.keys, val_type, mine.vals, mine.lens);
+    size_t k = others.lens.empty() && others.keys.size() ?
+               others.vals.size() / others.keys.size() : 0;
+    std::lock_guard<std::mutex> lk(replica_mu_);
+    buf_lens_ = buf_lens_ || others.lens.size();
+    const real_t* val = others.vals.data();
+    for (size_t i = 0; i < others.keys.size(); ++i) {
+      size_t len = others.lens.empty() ? k : others.lens[i];
+      auto& grad = grad_buf_[others.keys[i]];
+      if (grad.size() < len) grad.resize(len, 0);
+      for (size_t j = 0; j < len; ++j) grad[j] += val[j];
+      val += len;
+    }
+  }
+
+  /**
+   * \brief process a pull of hot keys, runs on the server side. the weights
+   * owned by other servers are read from the replicas, the missing replicas
+   * are fetched from their owners
+   */
+  void GetHot(int val_type, const SArray<feaid_t>& keys,
+              SArray<real_t>* vals, SArray<int>* lens) {
+    ps::KVPairs<real_t> kv, parts[2];
+    kv.keys = keys;
+    SplitKV(kv, [this](feaid_t key) { return IsMine(key); }, &parts[0], &parts[1]);
+    if (parts[0].keys.size()) {
+      Get(parts[0].keys, val_type, &parts[0].vals, &parts[0].lens);
+    }
+    if (parts[1].keys.size()) {
+      // copy the replicas out, a reconciliation may replace them meanwhile
+      std::unordered_map<feaid_t, std::vector<real_t>> found;
+      std::vector<feaid_t> missed;
+      bool has_lens;
+      {
+        std::lock_guard<std::mutex> lk(replica_mu_);
+        for (feaid_t key : parts[1].keys) {
+          auto it = replicas_.find(key);
+          if (it == replicas_.end()) {
+            missed.push_back(key);
+          } else {
+            found[key] = it->second;
+          }
+        }
+        has_lens = replica_lens_;
+      }
+      if (missed.size()) has_lens = FetchReplicas(missed, &found) || has_lens;
+      auto& part = parts[1];
+      for (feaid_t key : part.keys) {
+        const auto& w = found[key];
+        for (real_t v : w) part.vals.push_back(v);
+        if (has_lens) part.lens.push_back(w.size());
+      }
+    }
+    MergeKV(keys, parts, vals, lens);
+  }
+
+  /**
+   * \brief fetch the weights of keys from their owners, and add them into the
+   * replicas, runs on the server side
+   *
+   * @return whether the owners reply lens
+   */
+  bool FetchReplicas(const std::vector<feaid_t>& keys,
+                     std::unordered_map<feaid_t, std::vector<real_t>>* weights) {
+    std::vector<ps::KVPairs<real_t>> reqs(ranges_.size());
+    for (feaid_t key : keys) reqs[Owner(key)].keys.push_back(key);
+    std::vector<int> ts;
+    for (size_t i = 0; i < reqs.size(); ++i) {
+      if (reqs[i].keys.empty()) continue;
+      std::string body; PackKV(reqs[i], &body);
+      ts.push_back(replica_app_->Request(
+          kFetchReplicas, body, ps::Postoffice::ServerRankToID(i)));
+    }
+    bool has_lens = false;
+    for (int t : ts) {
+      replica_app_->Wait(t);
+      std::lock_guard<std::mutex> lk(replica_mu_);
+      auto it = fetched_.find(t);
+      CHECK(it != fetched_.end());
+      has_lens = has_lens || it->second.lens.size();
+      AddReplicas(it->second, weights);
+      fetched_.erase(it);
+    }
+    return has_lens;
+  }
+
+  /**
+   * \brief add the weights replied by an owner into the replicas, must hold
+   * replica_mu_
+   */
+  void AddReplicas(const ps::KVPairs<real_t>& kv,
+                   std::unordered_map<feaid_t, std::vector<real_t>>* weights) {
+    size_t k = kv.lens.empty() && kv.keys.size() ?
+               kv.vals.size() / kv.keys.size() : 0;
+    replica_lens_ = replica_lens_ || kv.lens.size();
+    const real_t* val = kv.vals.data();
+    for (size_t i = 0; i < kv.keys.size(); ++i) {
+      size_t len = kv.lens.empty() ? k : kv.lens[i];
+      std::vector<real_t> w(val, val + len);
+      if (weights) (*weights)[kv.keys[i]] = w;
+      replicas_[kv.keys[i]] = std::move(w);
+      val += len;
+    }
+  }
+
+  /**
+   * \brief reconcile the replicas every hot_key_sync milliseconds, runs on a
+   * thread of a server
+   */
+  void SyncReplicas() {
+    std::unique_lock<std::mutex> lk(sync_mu_);
+    while (!sync_cond_.wait_for(
+        lk, std::chrono::milliseconds(param_.hot_key_sync),
+        [this] { return stop_sync_; })) {
+      lk.unlock();
+      // send the buffered gradients to their owners
+      std::map<feaid_t, std::vector<real_t>> grads;
+      bool has_lens;
+      {
+        std::lock_guard<std::mutex> lk2(replica_mu_);
+        grads.swap(grad_buf_);
+        has_lens = buf_lens_;
+        buf_lens_ = false;
+      }
+      std::vector<ps::KVPairs<real_t>> reqs(ranges_.size());
+      for (const auto& g : grads) {
+        auto& req = reqs[Owner(g.first)];
+        req.keys.push_back(g.first);
+        for (real_t v : g.second) req.vals.push_back(v);
+        req.lens.push_back(g.second.size());
+      }
+      std::vector<int> ts;
+      for (size_t i = 0; i < reqs.size(); ++i) {
+        if (static_cast<int>(i) == rank_) continue;
+        if (!has_lens) reqs[i].lens.clear();
+        std::string body; PackKV(reqs[i], &body);
+        ts.push_back(replica_app_->Request(
+            kSyncReplicas, body, ps::Postoffice::ServerRankToID(i)));
+      }
+      for (int t : ts) replica_app_->Wait(t);
+      lk.lock();
+    }
+  }
+
+  /**
+   * \brief process a request from another server, runs on the owner of the
+   * keys
+   */
+  void ProcessReplicaRequest(const ps::SimpleData& req, ps::SimpleApp* app) {
+    ps::KVPairs<real_t> kv, res;
+    UnpackKV(req.body, &kv);
+    if (req.head == kSyncReplicas) {
+      // apply the buffered gradients, and reply the current hot keys
+      if (kv.keys.size()) Update(kv.keys, kGradient, kv.vals, kv.lens);
+      std::vector<feaid_t> hot_keys;
+      {
+        std::lock_guard<std::mutex> lk(hot_mu_);
+        hot_counter_->TopK(param_.num_hot_keys, &hot_keys);
+      }
+      res.keys.CopyFrom(hot_keys.data(), hot_keys.size());
+    } else {
+      CHECK_EQ(req.head, kFetchReplicas);
+      res.keys = kv.keys;
+    }
+    if (res.keys.size()) Get(res.keys, kWeight, &res.vals, &res.lens);
+    std::string body; PackKV(res, &body);
+    app->Response(req, body);
+  }
+
+  /**
+   * \brief process the reply of an owner, runs on the server side
+   */
+  void ProcessReplicaResponse(const ps::SimpleData& res, ps::SimpleApp* app) {
+    ps::KVPairs<real_t> kv;
+    UnpackKV(res.body, &kv);
+    std::lock_guard<std::mutex> lk(replica_mu_);
+    if (res.head == kSyncReplicas) {
+      // replace the replicas of this owner
+      int owner = ps::Postoffice::IDtoRank(res.sender);
+      for (auto it = replicas_.begin(); it != replicas_.end(); ) {
+        if (Owner(it->first) == owner) {
+          it = replicas_.erase(it);
+        } else {
+          ++it;
+        }
+      }
+      AddReplicas(kv, nullptr);
+    } else {
+      fetched_[res.timestamp] = kv;
+    }
+  }
+
+  /**
+   * \brief return the kept key list of a signature, runs on the server side
+   *
+   * the servers evict the key lists in the same order as the worker, so a
+   * signature is kept as long as the worker caches it
+   */
+  SArray<feaid_t> GetKeys(int sender, int sig, bool keep_keys,
+                          const SArray<feaid_t>& keys) {
+    auto& lists = server_keys_[sender];
+    if (keep_keys) {
+      lists.keys[sig] = keys;
+      lists.order.push_back(sig);
+      if (lists.order.size() > static_cast<size_t>(param_.key_cache_size)) {
+        lists.keys.erase(lists.order.front());
+        lists.order.pop_front();
+      }
+      return keys;
+    }
+    auto it = lists.keys.find(sig);
+    CHECK(it != lists.keys.end())
+        << "unknown key signature " << sig << " from node " << sender;
+    return it->second;
+  }
+
+  int NewRequest() {
+    std::lock_guard<std::mutex> lk(mu_);
+    int time = time_++;
+    pending_.insert(time);
+    return time;
+  }
+
+  /**
+   * \brief returns the callback for ps-lite, it passes on_complete to the
+   * thread pool
+   */
+  std::function<void()> Callback(int time,
+                                 const std::function<void()>& on_complete) {
+    return [this, time, on_complete]() {
+      if (on_complete) {
+        ThreadPool::Get()->Add([this, time, on_complete](int tid) {
+            on_complete();
+            Finish(time);
+          });
+      } else {
+        Finish(time);
+      }
+    };
+  }
+
+  void Finish(int time) {
+    {
+      std::lock_guard<std::mutex> lk(mu_);
+      pending_.erase(time);
+    }
+    ThreadPool::Get()->Notify();
+  }
+
+  /** \brief wait until all requests are finished */
+  void WaitAll() {
+    ThreadPool::Get()->WaitUntil([this]() {
+        std::lock_guard<std::mutex> lk(mu_);
+        return pending_.empty();
+      });
+  }
+
+  StoreDistParam param_;
+  CodecParam codec_param_;
+  Codec* push_codec_ = nullptr;
+  Codec* pull_codec_ = nullptr;
+  int time_ = 0;
+  /** \brief the unfinished requests */
+  std::unordered_set<int> pending_;
+  std::mutex mu_;
+  /** \brief only available on a worker node */
+  ps::KVWorker<real_t>* worker_ = nullptr;
+  /** \brief only available on a server node */
+  ps::KVServer<real_t>* server_ = nullptr;
+
+  /** \brief the key lists sent by this worker */
+  KeyCache<KeyList> key_cache_;
+  int next_sig_ = 1;
+  /** \brief the key list being sent, and whether or not its keys are sent */
+  KeyList* sending_ = nullptr;
+  bool send_keys_ = false;
+  /** \brief the codec of the request being sent, nullptr means no encoding */
+  Codec* encoding_ = nullptr;
+  /** \brief the server the request being sent goes to, -1 means all */
+  int route_ = -1;
+  /** \brief whether the request being sent goes to every server, see sync_push */
+  bool send_all_ = false;
+  std::mutex key_mu_;
+  /** \brief the key lists kept for each worker, indexed by the node id */
+  std::unordered_map<int, ServerKeyLists> server_keys_;
+  /** \brief the key ranges of the servers */
+  std::vector<ps::Range> ranges_;
+  /** \brief the rank of this node, also used by the reconciliation thread */
+  int rank_ = 0;
+  /** \brief serializes the updater on a server */
+  std::mutex updater_mu_;
+  /** \brief the number of gradient pushes received from each worker */
+  std::unordered_map<int, int> num_pushes_;
+  /** \brief the unfinished rounds of sync_push, indexed by the round */
+  std::unordered_map<int, PushRound> rounds_;
+
+  /** \brief the hot keys known by a worker */
+  std::unordered_set<feaid_t> hot_keys_;
+  /** \brief the keys of the requests fetching the hot keys */
+  SArray<feaid_t> hot_list_keys_;
+  double refresh_time_ = 0;
+  bool refreshing_ = false;
+  int hot_seq_ = 0;
+  /** \brief counts the keys of a server */
+  HotKeyCounter* hot_counter_ = nullptr;
+  std::mutex hot_mu_;
+
+  /** \brief talks to the other servers */
+  ps::SimpleApp* replica_app_ = nullptr;
+  /** \brief the replicas of the hot keys owned by the other servers */
+  std::unordered_map<feaid_t, std::vector<real_t>> replicas_;
+  bool replica_lens_ = false;
+  /** \brief the gradients of the replicas, sent at the next reconciliation */
+  std::map<feaid_t, std::vector<real_t>> grad_buf_;
+  bool buf_lens_ = false;
+  /** \brief the weights fetched by FetchReplicas, indexed by the timestamp */
+  std::unordered_map<int, ps::KVPairs<real_t>> fetched_;
+  std::mutex replica_mu_;
+
+  std::thread* sync_thread_ = nullptr;
+  bool stop_sync_ = false;
+  std::mutex sync_mu_;
+  std::condition_variable sync_cond_;
+};
+}  // namespace difacto
+#endif  // DIFACTO_STORE_STORE_DIST_H_
@@ -5,51 +5,186 @@
 #define DIFACTO_STORE_STORE_LOCAL_H_
 #include <string>
 #include <vector>
+#include <queue>
+#include <unordered_set>
 #include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 #include "difacto/store.h"
 #include "difacto/updater.h"
 #include "dmlc/parameter.h"
+#include "common/thread_pool.h"
 namespace difacto {
 
+struct StoreLocalParam : public dmlc::Parameter<StoreLocalParam> {
+  /**
+   * \brief run the updater on a separate thread, so push and pull return
+   * immediately. default is 1
+   */
+  int store_async;
+  DMLC_DECLARE_PARAMETER(StoreLocalParam) {
+    DMLC_DECLARE_FIELD(store_async).set_default(1);
+  }
+};
+
 /**
  * \brief model sync within a machine
+ *
+ * in the asynchronous mode, the requests are queued and run by the updater
+ * thread one by one in the order they are issued, so a pull always sees the
+ * pushes issued before it. the callbacks run on the shared thread pool, so
+ * a long callback does not block the following requests.
  */
 class StoreLocal : public Store {
  public:
   StoreLocal() { }
-  virtual ~StoreLocal() { }
+  virtual ~StoreLocal() {
+    if (!executor_.joinable()) return;
+    WaitAll();
+    {
+      std::lock_guard<std::mutex> lk(mu_);
+      done_ = true;
+    }
+    run_cond_.notify_one();
+    executor_.join();
+  }
 
-  KWArgs Init(const KWArgs& kwargs) { return kwargs; }
+  KWArgs Init(const KWArgs& kwargs) override {
+    auto remain = param_.InitAllowUnknown(kwargs);
+    if (param_.store_async && !executor_.joinable()) {
+      executor_ = std::thread(&StoreLocal::RunExecutor, this);
+    }
+    return remain;
+  }
 
   int Push(const SArray<feaid_t>& fea_ids,
            int val_type,
            const SArray<real_t>& vals,
-           const SArray<int>& lens,
+           const SArray<int>& offsets,
            const std::function<void()>& on_complete) override {
     SArray<real_t> vals_copy; vals_copy.CopyFrom(vals);
-    SArray<int> lens_copy; lens_copy.CopyFrom(lens);
-    updater_->Update(fea_ids, val_type, vals_copy, lens_copy);
-    if (on_complete) on_complete();
-    return time_++;
+    SArray<int> offsets_copy; offsets_copy.CopyFrom(offsets);
+    return Issue([this, fea_ids, val_type, vals_copy, offsets_copy]() {
+        updater_->Update(fea_ids, val_type, vals_copy, offsets_copy);
+      }, on_complete);
+  }
+
+  int ZPush(const SArray<feaid_t>& fea_ids,
+            int val_type,
+            const SArray<real_t>& vals,
+            const SArray<int>& offsets,
+            const std::function<void()>& on_complete) override {
+    return Issue([this, fea_ids, val_type, vals, offsets]() {
+        updater_->Update(fea_ids, val_type, vals, offsets);
+      }, on_complete);
   }
 
   int Pull(const SArray<feaid_t>& fea_ids,
            int val_type,
            SArray<real_t>* vals,
-           SArray<int>* lens,
+           SArray<int>* offsets,
            const std::function<void()>& on_complete) override {
-    updater_->Get(fea_ids, val_type, vals, lens);
-    if (on_complete) on_complete();
-    return time_++;
+    return Issue([this, fea_ids, val_type, vals, offsets]() {
+        updater_->Get(fea_ids, val_type, vals, offsets);
+      }, on_complete);
+  }
+
+  /**
+   * \brief wait until a request and its callback are finished. the calling
+   * thread runs the pending jobs of the thread pool meanwhile, in case it is a
+   * thread of the pool
+   */
+  void Wait(int time) override {
+    CHECK(std::this_thread::get_id() != executor_.get_id())
+        << "cannot wait in the updater thread";
+    ThreadPool::Get()->WaitUntil([this, time]() {
+        std::lock_guard<std::mutex> lk(mu_);
+        return pending_.count(time) == 0;
+      });
   }
 
-  void Wait(int time) override { }
   int Rank() override { return 0; }
   int NumWorkers() override { return 1; }
   int NumServers() override { return 1; }
 
  private:
-  int time_;
+  struct Request {
+    int time;
+    std::function<void()> job;
+    std::function<void()> on_complete;
+  };
+
+  int Issue(const std::function<void()>& job,
+            const std::function<void()>& on_complete) {
+    CHECK(updater_) << "set the updater first";
+    if (!executor_.joinable()) {
+      job();
+      if (on_complete) on_complete();
+      std::lock_guard<std::mutex> lk(mu_);
+      return time_++;
+    }
+    int time;
+    {
+      std::lock_guard<std::mutex> lk(mu_);
+      time = time_++;
+      pending_.insert(time);
+      queue_.push(Request{time, job, on_complete});
+    }
+    run_cond_.notify_one();
+    return time;
+  }
+
+  void RunExecutor() {
+    while (true) {
+      Request req;
+      {
+        std::unique_lock<std::mutex> lk(mu_);
+        run_cond_.wait(lk, [this] { return done_ || !queue_.empty(); });
+        if (queue_.empty()) break;
+        req = std::move(queue_.front());
+        queue_.pop();
+      }
+      req.job();
+      if (req.on_complete) {
+        int time = req.time;
+        auto on_complete = req.on_complete;
+        ThreadPool::Get()->Add([this, time, on_complete](int tid) {
+            on_complete();
+            Finish(time);
+          });
+      } else {
+        Finish(req.time);
+      }
+    }
+  }
+
+  void Finish(int time) {
+    {
+      std::lock_guard<std::mutex> lk(mu_);
+      pending_.erase(time);
+    }
+    ThreadPool::Get()->Notify();
+  }
+
+  /** \brief wait until all requests are finished */
+  void WaitAll() {
+    ThreadPool::Get()->WaitUntil([this]() {
+        std::lock_guard<std::mutex> lk(mu_);
+        return pending_.empty();
+      });
+  }
+
+  StoreLocalParam param_;
+  int time_ = 0;
+  bool done_ = false;
+  /** \brief the unfinished requests */
+  std::unordered_set<int> pending_;
+  std::queue<Request> queue_;
+  std::mutex mu_;
+  std::condition_variable run_cond_;
+  /** \brief the updater thread */
+  std::thread executor_;
 };
 }  // namespace difacto
 #endif  // DIFACTO_STORE_STORE_LOCAL_H_
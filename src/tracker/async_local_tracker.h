@@ -12,6 +12,7 @@
 #include <thread>
 #include <mutex>
 #include <condition_variable>
+#include "dmlc/logging.h"
 namespace difacto {
 /**
  * \brief a thread-safe asynchronous workload tracker
@@ -22,21 +23,37 @@ namespace difacto {
  * 3. no node_id is required
  * 4. The executor can be asynchronous, it calls on_complete when actually finished.
  *
+ * jobs are started in the order they are issued by a configurable number of
+ * executor threads, so up to num_threads executors run concurrently. every
+ * started job is tracked until its on_complete is called, so \ref NumRemains
+ * and \ref Wait count the jobs both queued and running.
+ *
  * \tparam JobArgs the type of the job arguments
  * \parram JobRets the type of the job returns
  */
 template<typename JobArgs, typename JobRets = std::string>
 class AsyncLocalTracker {
  public:
-  AsyncLocalTracker() {
-    thread_ = new std::thread(&AsyncLocalTracker::RunExecutor, this);
+  /**
+   * @param num_threads the number of executor threads
+   */
+  explicit AsyncLocalTracker(int num_threads = 1) {
+    CHECK_GT(num_threads, 0);
+    for (int i = 0; i < num_threads; ++i) {
+      threads_.push_back(new std::thread(&AsyncLocalTracker::RunExecutor, this));
+    }
   }
   ~AsyncLocalTracker() {
     Wait();
-    done_ = true;
-    run_cond_.notify_one();
-    thread_->join();
-    delete thread_;
+    {
+      std::lock_guard<std::mutex> lk(mu_);
+      done_ = true;
+    }
+    run_cond_.notify_all();
+    for (auto t : threads_) {
+      t->join();
+      delete t;
+    }
   }
 
   /**
@@ -118,13 +135,16 @@ class AsyncLocalTracker {
       auto it = running_.insert(std::make_pair(
           cur_id_++, std::make_pair(std::move(pending_.front()), JobRets())));
       pending_.pop();
+      // other executors may rehash running_, which invalidates the iterator
+      // but not the reference
+      int id = it.first->first;
+      auto& job = it.first->second;
       lk.unlock();
 
       // run the job
       CHECK(executor_);
-      int id = it.first->first;
       auto on_complete = [this, id]() { Remove(id); };
-      executor_(it.first->second.first, on_complete, &(it.first->second.second));
+      executor_(job.first, on_complete, &job.second);
     }
   }
 
@@ -136,14 +156,14 @@ class AsyncLocalTracker {
       if (monitor_) monitor_(it->second.second);
       running_.erase(it);
     }
-    fin_cond_.notify_one();
+    fin_cond_.notify_all();
   }
 
   bool done_ = false;
   int cur_id_ = 0;
   std::mutex mu_;
   std::condition_variable run_cond_, fin_cond_;
-  std::thread* thread_;
+  std::vector<std::thread*> threads_;
   Executor executor_;
   Monitor monitor_;
   std::queue<JobArgs> pending_;
@@ -3,11 +3,165 @@
  */
 #ifndef DIFACTO_TRACKER_DIST_TRACKER_H_
 #define DIFACTO_TRACKER_DIST_TRACKER_H_
+#include <vector>
+#include <utility>
+#include <string>
+#include <list>
+#include <unordered_map>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include "difacto/tracker.h"
+#include "common/ps_utils.h"
+#include "ps/ps.h"
 namespace difacto {
 /**
  * \brief a tracker which runs over mutliple machines
+ *
+ * the scheduler sends a job to an executor by a ps-lite request, and the
+ * executor returns the results by the response. the jobs are queued on the
+ * scheduler, and a job is sent only if the executor has no running job. a job
+ * issued to a node group goes to the first idle node of that group.
  */
 class DistTracker : public Tracker {
+ public:
+  typedef std::pair<int, std::string> Job;
+  /** \brief the ps-lite app id used by the tracker */
+  static const int kAppID = 1;
+
+  DistTracker() {
+    using namespace std::placeholders;
+    app_ = new ps::SimpleApp(kAppID);
+    app_->set_request_handle(
+        std::bind(&DistTracker::ProcessRequest, this, _1, _2));
+    app_->set_response_handle(
+        std::bind(&DistTracker::ProcessResponse, this, _1, _2));
+  }
+  virtual ~DistTracker() { delete app_; }
+
+  KWArgs Init(const KWArgs& kwargs) override {
+    // make sure all trackers are ready before any job is issued
+    ps::Postoffice::Get()->Barrier(
+        ps::kScheduler + ps::kServerGroup + ps::kWorkerGroup);
+    return kwargs;
+  }
+
+  void Issue(const std::vector<Job>& jobs) override {
+    std::lock_guard<std::mutex> lk(mu_);
+    for (const auto& job : jobs) pending_.push_back(job);
+    Dispatch();
+  }
+
+  std::vector<int> NodeIDs(int node_group) override {
+    std::vector<int> ids;
+    for (int id : ps::Postoffice::Get()->GetNodeIDs(PSNodeID(node_group))) {
+      ids.push_back(DifactoNodeID(id));
+    }
+    return ids;
+  }
+
+  int NumRemains() override {
+    std::lock_guard<std::mutex> lk(mu_);
+    return pending_.size() + running_.size();
+  }
+
+  void Clear() override {
+    std::lock_guard<std::mutex> lk(mu_);
+    pending_.clear();
+  }
+
+  void Stop() override {
+    {
+      std::unique_lock<std::mutex> lk(mu_);
+      if (stopped_) return;
+      fin_cond_.wait(lk, [this] { return pending_.empty() && running_.empty(); });
+      stopped_ = true;
+    }
+    app_->Wait(app_->Request(kStop, "", ps::kServerGroup + ps::kWorkerGroup));
+  }
+
+  void SetMonitor(const Monitor& monitor) override {
+    std::lock_guard<std::mutex> lk(mu_);
+    monitor_ = monitor;
+  }
+
+  void SetExecutor(const Executor& executor) override {
+    CHECK_NOTNULL(executor);
+    executor_ = executor;
+  }
+
+  void Wait() override {
+    std::unique_lock<std::mutex> lk(mu_);
+    fin_cond_.wait(lk, [this] { return stopped_; });
+  }
+
+ private:
+  static const int kJob = 1;
+  static const int kStop = 2;
+
+  /**
+   * \brief send the pending jobs to the idle executors, must hold mu_
+   */
+  void Dispatch() {
+    for (auto it = pending_.begin(); it != pending_.end(); ) {
+      int recver = -1;
+      for (int id : ps::Postoffice::Get()->GetNodeIDs(PSNodeID(it->first))) {
+        if (running_.find(id) == running_.end()) { recver = id; break; }
+      }
+      if (recver < 0) { ++it; continue; }
+      app_->Request(kJob, it->second, recver);
+      running_[recver] = *it;
+      it = pending_.erase(it);
+    }
+  }
+
+  /**
+   * \brief runs on the scheduler, receives the results of a job
+   */
+  void ProcessResponse(const ps::SimpleData& res, ps::SimpleApp* app) {
+    if (res.head != kJob) return;
+    {
+      std::lock_guard<std::mutex> lk(mu_);
+      auto it = running_.find(res.sender);
+      CHECK(it != running_.end()) << "unknown job from node " << res.sender;
+      if (monitor_) monitor_(DifactoNodeID(res.sender), res.body);
+      running_.erase(it);
+      Dispatch();
+    }
+    fin_cond_.notify_all();
+  }
+
+  /**
+   * \brief runs on a server or a worker, executes a job
+   */
+  void ProcessRequest(const ps::SimpleData& req, ps::SimpleApp* app) {
+    if (req.head == kJob) {
+      std::string rets;
+      CHECK(executor_) << "set executor first";
+      executor_(req.body, &rets);
+      app->Response(req, rets);
+    } else if (req.head == kStop) {
+      app->Response(req);
+      {
+        std::lock_guard<std::mutex> lk(mu_);
+        stopped_ = true;
+      }
+      fin_cond_.notify_all();
+    } else {
+      LOG(FATAL) << "unknown request head " << req.head;
+    }
+  }
+
+  ps::SimpleApp* app_;
+  bool stopped_ = false;
+  std::mutex mu_;
+  std::condition_variable fin_cond_;
+  Executor executor_;
+  Monitor monitor_;
+  /** \brief the jobs have not been sent */
+  std::list<Job> pending_;
+  /** \brief the running jobs, indexed by the ps-lite node id of the executor */
+  std::unordered_map<int, Job> running_;
 };
 }  // namespace difacto
 #endif  // DIFACTO_TRACKER_DIST_TRACKER_H_
@@ -7,8 +7,22 @@
 #include <utility>
 #include <string>
 #include "difacto/tracker.h"
+#include "dmlc/parameter.h"
 #include "./async_local_tracker.h"
 namespace difacto {
+
+struct LocalTrackerParam : public dmlc::Parameter<LocalTrackerParam> {
+  /**
+   * \brief the number of jobs run concurrently. a learner should use more than
+   * one only if its jobs are independent, such as the data parts of sgd.
+   * default is 1
+   */
+  int num_executors;
+  DMLC_DECLARE_PARAMETER(LocalTrackerParam) {
+    DMLC_DECLARE_FIELD(num_executors).set_range(1, 1024).set_default(1);
+  }
+};
+
 /**
  * \brief an implementation of the tracker which only runs within a local
  * process
@@ -18,15 +32,28 @@ class LocalTracker : public Tracker {
   typedef std::pair<int, std::string> Job;
 
   LocalTracker() {
+    param_.Init(KWArgs());
     tracker_ = new AsyncLocalTracker<Job, Job>();
   }
   virtual ~LocalTracker() { delete tracker_; }
 
-  KWArgs Init(const KWArgs& kwargs) override { return kwargs; }
-
+  /**
+   * \brief init the tracker, it should be called before setting the executor
+   * and the monitor
+   */
+  KWArgs Init(const KWArgs& kwargs) override {
+    auto remain = param_.InitAllowUnknown(kwargs);
+    if (param_.num_executors != 1) {
+      delete tracker_;
+      tracker_ = new AsyncLocalTracker<Job, Job>(param_.num_executors);
+    }
+    return remain;
+  }
 
   void Issue(const std::vector<Job>& jobs) override {
-    if (!tracker_) tracker_ = new AsyncLocalTracker<Job, Job>();
+    if (!tracker_) {
+      tracker_ = new AsyncLocalTracker<Job, Job>(param_.num_executors);
+    }
     tracker_->Issue(jobs);
   }
 
@@ -70,6 +97,7 @@ class LocalTracker : public Tracker {
 
  private:
   AsyncLocalTracker<Job, Job>* tracker_ = nullptr;
+  LocalTrackerParam param_;
 };
 
 }  // namespace difacto
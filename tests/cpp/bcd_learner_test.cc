@@ -37,6 +37,34 @@ TEST(BCDLearer, DiagNewton) {
   learner.Run();
 }
 
+TEST(BCDLearer, Threads) {
+  // the per-thread gradients are merged on the shared pool, one thread should
+  // give the same results as several
+  std::vector<std::vector<real_t>> objv(2);
+  std::vector<int> nthreads = {1, 8};
+  for (int i = 0; i < 2; ++i) {
+    BCDLearner learner;
+    KWArgs args = {{"data_in", "../tests/data"},
+                   {"l1", ".1"},
+                   {"lr", ".8"},
+                   {"block_ratio", "4"},
+                   {"num_threads", std::to_string(nthreads[i])},
+                   {"tail_feature_filter", "0"},
+                   {"max_num_epochs", "10"}};
+    auto remain = learner.Init(args);
+    EXPECT_EQ(remain.size(), 0);
+    auto callback = [&objv, i](int epoch, const std::vector<real_t>& prog) {
+      objv[i].push_back(prog[1]);
+    };
+    learner.AddEpochEndCallback(callback);
+    learner.Run();
+  }
+  ASSERT_EQ(objv[0].size(), objv[1].size());
+  for (size_t k = 0; k < objv[0].size(); ++k) {
+    EXPECT_LT(fabs(objv[0][k] - objv[1][k]) / objv[0][k], 1e-5);
+  }
+}
+
 // the optimal solution with ../tests/data and l1 = .1 is objv = 15.884923, nnz
 // w = 47
 
@@ -64,3 +92,203 @@ TEST(BCDLearer, Convergence) {
     EXPECT_LT(fabs(objv - 15.884923)/objv, 1e-3);
   }
 }
+
+TEST(BCDLearer, BoundedDelay) {
+  std::vector<int> taus = {1, 4};
+
+  for (int tau : taus) {
+    real_t objv;
+    BCDLearner learner;
+    KWArgs args = {{"data_in", "../tests/data"},
+                   {"l1", ".1"},
+                   {"lr", ".8"},
+                   {"block_ratio", "4"},
+                   {"tau", std::to_string(tau)},
+                   {"tail_feature_filter", "0"},
+                   {"max_num_epochs", "50"}};
+    auto remain = learner.Init(args);
+    EXPECT_EQ(remain.size(), 0);
+
+    auto callback = [&objv](int epoch, const std::vector<real_t>& prog) {
+      objv = prog[1];
+    };
+    learner.AddEpochEndCallback(callback);
+    learner.Run();
+
+    EXPECT_LT(fabs(objv - 15.884923)/objv, 1e-3);
+  }
+}
+
+TEST(BCDLearer, BoundedDelayThreads) {
+  // the blocks in flight update the predictions of the same row blocks, while
+  // the waiting threads run the jobs of the other blocks
+  std::vector<int> V_dims = {0, 5};
+  for (int V_dim : V_dims) {
+    std::vector<real_t> objv;
+    BCDLearner learner;
+    KWArgs args = {{"data_in", "../tests/data"},
+                   {"l1", ".1"},
+                   {"lr", ".8"},
+                   {"block_ratio", "4"},
+                   {"tau", "4"},
+                   {"num_threads", "8"},
+                   {"V_dim", std::to_string(V_dim)},
+                   {"tail_feature_filter", "0"},
+                   {"max_num_epochs", "50"}};
+    auto remain = learner.Init(args);
+    EXPECT_EQ(remain.size(), 0);
+
+    auto callback = [&objv](int epoch, const std::vector<real_t>& prog) {
+      objv.push_back(prog[1]);
+    };
+    learner.AddEpochEndCallback(callback);
+    learner.Run();
+
+    ASSERT_EQ(objv.size(), 50);
+    if (V_dim == 0) {
+      EXPECT_LT(fabs(objv.back() - 15.884923)/objv.back(), 1e-3);
+    } else {
+      EXPECT_LT(objv.back(), 15.884923);
+    }
+  }
+}
+
+TEST(BCDLearer, HessienBound) {
+  real_t objv;
+  BCDLearner learner;
+  KWArgs args = {{"data_in", "../tests/data"},
+                 {"l1", ".1"},
+                 {"lr", "1"},
+                 {"compute_hession", "2"},
+                 {"block_ratio", "4"},
+                 {"tail_feature_filter", "0"},
+                 {"max_num_epochs", "30"}};
+  auto remain = learner.Init(args);
+  EXPECT_EQ(remain.size(), 0);
+
+  auto callback = [&objv](int epoch, const std::vector<real_t>& prog) {
+    objv = prog[1];
+  };
+  learner.AddEpochEndCallback(callback);
+  learner.Run();
+
+  EXPECT_LT(fabs(objv - 15.884923)/objv, 1e-3);
+}
+
+TEST(BCDLearer, Shrinking) {
+  std::vector<int> freqs = {2, 5};
+
+  for (int freq : freqs) {
+    real_t objv;
+    std::vector<real_t> pushed;
+    BCDLearner learner;
+    KWArgs args = {{"data_in", "../tests/data"},
+                   {"l1", ".1"},
+                   {"lr", ".8"},
+                   {"block_ratio", "4"},
+                   {"full_pass_freq", std::to_string(freq)},
+                   {"tail_feature_filter", "0"},
+                   {"max_num_epochs", "50"}};
+    auto remain = learner.Init(args);
+    EXPECT_EQ(remain.size(), 0);
+
+    auto callback = [&objv, &pushed](int epoch,
+                                     const std::vector<real_t>& prog) {
+      objv = prog[1];
+      pushed.push_back(prog[4]);
+    };
+    learner.AddEpochEndCallback(callback);
+    learner.Run();
+
+    EXPECT_LT(fabs(objv - 15.884923)/objv, 1e-3);
+
+    // a full pass pushes all features, the other epochs skip the inactive ones
+    bool skipped = false;
+    for (size_t e = 0; e < pushed.size(); ++e) {
+      if (e % freq == 0) {
+        EXPECT_EQ(pushed[e], pushed[0]);
+      } else {
+        EXPECT_LE(pushed[e], pushed[0]);
+        if (pushed[e] < pushed[0]) skipped = true;
+      }
+    }
+    EXPECT_TRUE(skipped);
+  }
+}
+
+TEST(BCDLearer, FM) {
+  std::vector<real_t> objv;
+  BCDLearner learner;
+  KWArgs args = {{"data_in", "../tests/data"},
+                 {"l1", ".1"},
+                 {"lr", ".8"},
+                 {"V_dim", "5"},
+                 {"block_ratio", "1"},
+                 {"tail_feature_filter", "0"},
+                 {"max_num_epochs", "20"}};
+  auto remain = learner.Init(args);
+  EXPECT_EQ(remain.size(), 0);
+
+  // the workers start with a zero model, and only get the initial V by the
+  // changes pulled in the first epoch. check their local copy against the
+  // servers, and that V is not zero, otherwise it would never be updated
+  auto callback = [&objv, &learner](int epoch,
+                                    const std::vector<real_t>& prog) {
+    objv.push_back(prog[1]);
+    if (epoch != 0) return;
+    SArray<feaid_t> feaids;
+    SArray<real_t> model, weights;
+    SArray<int> offsets, w_offsets;
+    learner.GetModel(&feaids, &model, &offsets);
+    learner.GetUpdater()->GetWeights(feaids, &weights, &w_offsets);
+    ASSERT_GT(feaids.size(), 0);
+    ASSERT_EQ(offsets.size(), feaids.size() + 1);
+    ASSERT_EQ(model.size(), weights.size());
+    for (size_t i = 0; i < offsets.size(); ++i) {
+      EXPECT_EQ(offsets[i], w_offsets[i]);
+    }
+    size_t nnz_V = 0;
+    for (size_t i = 0; i < feaids.size(); ++i) {
+      EXPECT_EQ(offsets[i+1] - offsets[i], 6);
+      for (int j = offsets[i]; j < offsets[i+1]; ++j) {
+        EXPECT_NEAR(model[j], weights[j], 1e-6);
+        if (j > offsets[i] && model[j] != 0) ++nnz_V;
+      }
+    }
+    EXPECT_GT(nnz_V, feaids.size() * 5 / 2);
+  };
+  learner.AddEpochEndCallback(callback);
+  learner.Run();
+
+  // the embedding fits the training data better than the linear model
+  EXPECT_EQ(objv.size(), 20);
+  EXPECT_LT(objv.back(), objv.front());
+  EXPECT_LT(objv.back(), 15.884923);
+}
+
+TEST(BCDLearer, NUMA) {
+  // placing the row blocks on NUMA nodes should give the same results
+  std::vector<std::vector<real_t>> objv(2);
+  for (int i = 0; i < 2; ++i) {
+    BCDLearner learner;
+    KWArgs args = {{"data_in", "../tests/data"},
+                   {"l1", ".1"},
+                   {"lr", ".05"},
+                   {"block_ratio", "0.001"},
+                   {"num_threads", "4"},
+                   {"numa", std::to_string(i)},
+                   {"tail_feature_filter", "0"},
+                   {"max_num_epochs", "10"}};
+    auto remain = learner.Init(args);
+    EXPECT_EQ(remain.size(), 0);
+    auto callback = [&objv, i](int epoch, const std::vector<real_t>& prog) {
+      objv[i].push_back(prog[1]);
+    };
+    learner.AddEpochEndCallback(callback);
+    learner.Run();
+  }
+  ASSERT_EQ(objv[0].size(), objv[1].size());
+  for (size_t k = 0; k < objv[0].size(); ++k) {
+    EXPECT_LT(fabs(objv[0][k] - objv[1][k]) / objv[0][k], 1e-5);
+  }
+}
@@ -0,0 +1,84 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+#include "bcd/bcd_utils.h"
+
+using namespace difacto;
+
+TEST(BCDUtils, PartitionFeature) {
+  // the bins of a group cover all its IDs, including the largest one
+  int nbits = 4;
+  std::vector<Range> bins;
+  bcd::PartitionFeature(nbits, {std::make_pair(3, 10), std::make_pair(1, 5)},
+                        &bins);
+  ASSERT_EQ(bins.size(), 15);
+  for (size_t i = 1; i < bins.size(); ++i) {
+    if (i == 5) continue;  // the first bin of the second group
+    EXPECT_EQ(bins[i-1].end, bins[i].begin);
+  }
+  feaid_t max = std::numeric_limits<feaid_t>::max();
+  for (int gid : {1, 3}) {
+    feaid_t first = ReverseBytes(EncodeFeaGrpID(0, gid, nbits));
+    feaid_t last = ReverseBytes(EncodeFeaGrpID(max, gid, nbits));
+    int n = 0;
+    for (const auto& b : bins) n += b.Has(first) + b.Has(last);
+    EXPECT_EQ(n, 2);
+  }
+
+  // the nnz of the bins
+  SArray<feaid_t> feaids;
+  for (int gid : {1, 3}) {
+    feaids.push_back(ReverseBytes(EncodeFeaGrpID(0, gid, nbits)));
+    feaids.push_back(ReverseBytes(EncodeFeaGrpID(12345, gid, nbits)));
+    feaids.push_back(ReverseBytes(EncodeFeaGrpID(max, gid, nbits)));
+  }
+  std::sort(feaids.begin(), feaids.end());
+  SArray<real_t> cnts(feaids.size(), 1);
+  std::vector<real_t> nnz;
+  bcd::CountBins(feaids, cnts, bins, &nnz);
+  real_t total = 0;
+  for (real_t c : nnz) total += c;
+  EXPECT_EQ(total, feaids.size());
+}
+
+TEST(BCDUtils, MergeBins) {
+  // 100 bins, the first 10 are 100 times heavier than the others
+  int nbins = 100, nblk = 4;
+  std::vector<Range> bins;
+  std::vector<real_t> nnz;
+  real_t total = 0;
+  for (int i = 0; i < nbins; ++i) {
+    bins.push_back(Range(i * 10, i * 10 + 10));
+    nnz.push_back(i < 10 ? 100 : 1);
+    total += nnz.back();
+  }
+  std::vector<Range> blks;
+  bcd::MergeBins(bins, nnz.data(), nblk, &blks);
+  ASSERT_EQ(blks.size(), nblk);
+
+  // every bin is in exactly one block
+  EXPECT_EQ(blks.front().begin, bins.front().begin);
+  EXPECT_EQ(blks.back().end, bins.back().end);
+  for (size_t i = 1; i < blks.size(); ++i) {
+    EXPECT_EQ(blks[i-1].end, blks[i].begin);
+  }
+  for (feaid_t f = 0; f < bins.back().end; ++f) {
+    int n = 0;
+    for (const auto& b : blks) n += b.Has(f);
+    EXPECT_EQ(n, 1);
+  }
+
+  // a block differs from the average nnz by less than a bin
+  for (const auto& b : blks) {
+    real_t s = 0;
+    for (int i = 0; i < nbins; ++i) {
+      if (b.Has(bins[i].begin)) s += nnz[i];
+    }
+    EXPECT_LT(fabs(s - total / nblk), 100);
+  }
+}
@@ -0,0 +1,102 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#include <random>
+#include <memory>
+#include "common/arg_parser.h"
+#include "store/codec.h"
+#include "dmlc/config.h"
+#include "dmlc/parameter.h"
+#include "dmlc/timer.h"
+
+using namespace difacto;
+using namespace dmlc;
+
+struct Param : public Parameter<Param> {
+  int num_features;
+  int V_dim;
+  int repeat;
+  float bandwidth;
+  DMLC_DECLARE_PARAMETER(Param) {
+    DMLC_DECLARE_FIELD(num_features).set_default(100000).describe(
+        "number of features pushed at a time");
+    DMLC_DECLARE_FIELD(V_dim).set_default(32).describe("the embedding dimension");
+    DMLC_DECLARE_FIELD(repeat).set_default(10).describe("number of pushes");
+    DMLC_DECLARE_FIELD(bandwidth).set_default(10).describe(
+        "network bandwidth in Gbit/s, used to estimate the end-to-end time");
+  }
+};
+
+DMLC_REGISTER_PARAMETER(Param);
+DMLC_REGISTER_PARAMETER(CodecParam);
+
+/**
+ * \brief generate FM gradients, one w and V_dim embeddings for each feature.
+ * the gradients of w are larger than the ones of V
+ */
+void GenGrads(const Param& param, std::mt19937* gen,
+              SArray<real_t>* grads) {
+  std::normal_distribution<real_t> w(0, 1), v(0, .1);
+  size_t len = param.V_dim + 1;
+  grads->resize(param.num_features * len);
+  for (int i = 0; i < param.num_features; ++i) {
+    (*grads)[i * len] = w(*gen);
+    for (size_t j = 1; j < len; ++j) (*grads)[i * len + j] = v(*gen);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  Param param;
+  if (argc < 2) {
+    LOG(ERROR) << "usage: ./codec_perf key1=val1 key2=val2 ...\n\n"
+               << param.__DOC__();
+  }
+  ArgParser parser;
+  for (int i = 1; i < argc; ++i) parser.AddArg(argv[i]);
+  auto remain = param.InitAllowUnknown(parser.GetKWArgs());
+  CodecParam codec_param;
+  codec_param.Init(remain);
+
+  SArray<feaid_t> keys(param.num_features);
+  for (int i = 0; i < param.num_features; ++i) keys[i] = i;
+  SArray<int> lens(param.num_features, param.V_dim + 1);
+
+  for (std::string type : {"none", "fp16", "bf16", "int8", "topk"}) {
+    std::unique_ptr<Codec> codec(
+        type == "none" ? nullptr : Codec::Create(type, codec_param));
+    std::mt19937 gen(0);
+    double enc_time = 0, dec_time = 0, raw_bytes = 0, bytes = 0;
+    double err = 0, norm = 0;
+    for (int r = 0; r < param.repeat; ++r) {
+      SArray<real_t> grads, data, decoded;
+      GenGrads(param, &gen, &grads);
+      raw_bytes += grads.size() * sizeof(real_t);
+      if (!codec) {
+        bytes += grads.size() * sizeof(real_t);
+        continue;
+      }
+      double start = GetTime();
+      codec->Encode(keys, grads, lens, &data);
+      enc_time += GetTime() - start;
+      bytes += data.size() * sizeof(real_t);
+      start = GetTime();
+      codec->Decode(data, &decoded);
+      dec_time += GetTime() - start;
+      CHECK_EQ(decoded.size(), grads.size());
+      for (size_t i = 0; i < grads.size(); ++i) {
+        err += (grads[i] - decoded[i]) * (grads[i] - decoded[i]);
+        norm += grads[i] * grads[i];
+      }
+    }
+    double net_time = bytes * 8 / (param.bandwidth * 1e9);
+    double mb = raw_bytes / 1e6;
+    LOG(INFO) << type << ":\t bytes " << bytes / 1e6 << " MB ("
+              << bytes / raw_bytes * 100 << "%),"
+              << "\t encode " << (enc_time > 0 ? mb / enc_time : 0) << " MB/s,"
+              << "\t decode " << (dec_time > 0 ? mb / dec_time : 0) << " MB/s,"
+              << "\t rel l2 error " << (norm > 0 ? sqrt(err / norm) : 0) << ","
+              << "\t end-to-end " << mb / (enc_time + net_time + dec_time)
+              << " MB/s";
+  }
+  return 0;
+}
@@ -0,0 +1,140 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#include <gtest/gtest.h>
+#include <memory>
+#include "store/codec.h"
+#include "./utils.h"
+
+using namespace difacto;
+
+namespace {
+std::shared_ptr<Codec> CreateCodec(const std::string& type) {
+  CodecParam param;
+  param.Init(KWArgs{{"codec_chunk", "100"}, {"topk_ratio", ".1"}});
+  return std::shared_ptr<Codec>(Codec::Create(type, param));
+}
+
+/** \brief |x - y|_inf / |x|_inf */
+real_t RelErr(const SArray<real_t>& x, const SArray<real_t>& y) {
+  CHECK_EQ(x.size(), y.size());
+  real_t err = 0, xmax = 0;
+  for (size_t i = 0; i < x.size(); ++i) {
+    err = std::max(err, std::fabs(x[i] - y[i]));
+    xmax = std::max(xmax, std::fabs(x[i]));
+  }
+  return err / xmax;
+}
+}  // namespace
+
+TEST(Codec, FP16) {
+  SArray<real_t> x = {0, 1, -2, .5, 65504, 6e-8, -1e-5, 1e10};
+  SArray<real_t> y;
+  auto codec = CreateCodec("fp16");
+  SArray<real_t> data;
+  codec->Encode({}, x, {}, &data);
+  EXPECT_LT(data.size(), x.size());
+  codec->Decode(data, &y);
+  ASSERT_EQ(y.size(), x.size());
+  for (int i = 0; i < 5; ++i) EXPECT_EQ(x[i], y[i]);
+  EXPECT_NEAR(y[5], 5.96e-8, 1e-10);  // the smallest subnormal
+  EXPECT_NEAR(y[6], -1e-5, 3e-8);
+  EXPECT_TRUE(std::isinf(y[7]));
+
+  x.resize(1000);
+  gen_vals(x.size(), -10, 10, &x);
+  codec->Encode({}, x, {}, &data);
+  codec->Decode(data, &y);
+  for (size_t i = 0; i < x.size(); ++i) {
+    EXPECT_LE(std::fabs(x[i] - y[i]), std::fabs(x[i]) / 2048 + 1e-7);
+  }
+}
+
+TEST(Codec, BF16Int8) {
+  SArray<real_t> x;
+  gen_vals(1000, -10, 10, &x);
+  x[10] = 1e20;  // only affects its own chunk in int8
+  for (auto type : {"bf16", "int8"}) {
+    auto codec = CreateCodec(type);
+    SArray<real_t> data, y;
+    codec->Encode({}, x, {}, &data);
+    codec->Decode(data, &y);
+    ASSERT_EQ(y.size(), x.size());
+    EXPECT_LT(RelErr(x, y), .01) << type;
+    EXPECT_LT(RelErr(x.segment(100, 1000), y.segment(100, 1000)), .01) << type;
+  }
+}
+
+TEST(Codec, Concat) {
+  // the pull responses of several servers are decoded together
+  auto codec = CreateCodec("int8");
+  SArray<real_t> x, data, y;
+  gen_vals(250, -1, 1, &x);
+  SArray<real_t> d1, d2;
+  codec->Encode({}, x.segment(0, 90), {}, &d1);
+  codec->Encode({}, x.segment(90, 250), {}, &d2);
+  data.append(d1); data.append(d2);
+  codec->Decode(data, &y);
+  ASSERT_EQ(y.size(), x.size());
+  EXPECT_LT(RelErr(x, y), .01);
+}
+
+TEST(Codec, TopK) {
+  auto codec = CreateCodec("topk");
+  int n = 100, len = 3, rounds = 50;
+  SArray<feaid_t> keys(n);
+  for (int i = 0; i < n; ++i) keys[i] = i;
+  SArray<real_t> x, sum(n * len, 0), decoded_sum(n * len, 0);
+  for (int r = 0; r < rounds; ++r) {
+    gen_vals(n * len, -1, 1, &x);
+    SArray<real_t> data, y;
+    codec->Encode(keys, x, SArray<int>(n, len), &data);
+    // 10% values with their positions
+    EXPECT_LT(data.size(), x.size() / 4);
+    codec->Decode(data, &y);
+    ASSERT_EQ(y.size(), x.size());
+    int nnz = 0;
+    for (size_t i = 0; i < x.size(); ++i) {
+      sum[i] += x[i];
+      decoded_sum[i] += y[i];
+      nnz += y[i] != 0;
+    }
+    EXPECT_EQ(nnz, n * len / 10);
+  }
+  // with error feedback, the values not sent are delayed rather than lost, so
+  // the difference is bounded by the residual rather than growing with rounds
+  for (size_t i = 0; i < sum.size(); ++i) {
+    EXPECT_LT(std::fabs(sum[i] - decoded_sum[i]), 10);
+  }
+}
+
+TEST(Codec, TopKLens) {
+  // the keys have different numbers of values, such as w and V of fm
+  auto codec = CreateCodec("topk");
+  int n = 100, rounds = 50;
+  SArray<feaid_t> keys(n);
+  SArray<int> lens(n);
+  size_t m = 0;
+  for (int i = 0; i < n; ++i) {
+    keys[i] = i; lens[i] = 1 + i % 3; m += lens[i];
+  }
+  SArray<real_t> x, sum(m, 0), decoded_sum(m, 0);
+  for (int r = 0; r < rounds; ++r) {
+    gen_vals(m, -1, 1, &x);
+    // the last value of the last key is always sent
+    x[m-1] = 100;
+    SArray<real_t> data, y;
+    codec->Encode(keys, x, lens, &data);
+    codec->Decode(data, &y);
+    ASSERT_EQ(y.size(), m);
+    EXPECT_EQ(y[m-1], 100);
+    for (size_t i = 0; i < m; ++i) {
+      sum[i] += x[i];
+      decoded_sum[i] += y[i];
+    }
+  }
+  EXPECT_EQ(dynamic_cast<TopKCodec*>(codec.get())->num_residuals(), n);
+  for (size_t i = 0; i < m; ++i) {
+    EXPECT_LT(std::fabs(sum[i] - decoded_sum[i]), 10);
+  }
+}
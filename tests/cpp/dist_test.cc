@@ -0,0 +1,434 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <unordered_map>
+#include "bcd/bcd_learner.h"
+#include "lbfgs/lbfgs_learner.h"
+#include "store/store_dist.h"
+#include "tracker/dist_tracker.h"
+#include "reporter/dist_reporter.h"
+
+using namespace difacto;
+
+/**
+ * \brief w += data for gradients
+ */
+class DistSumUpdater : public Updater {
+ public:
+  KWArgs Init(const KWArgs& kwargs) override { return kwargs; }
+  void Load(dmlc::Stream* fi, bool* has_aux) override { }
+  void Save(bool save_aux, dmlc::Stream *fo) const override { }
+  void Get(const SArray<feaid_t>& fea_ids, int data_type,
+           SArray<real_t>* data, SArray<int>* data_offset) override {
+    data->resize(fea_ids.size());
+    for (size_t i = 0; i < fea_ids.size(); ++i) (*data)[i] = model_[fea_ids[i]];
+  }
+  void Update(const SArray<feaid_t>& fea_ids, int data_type,
+              const SArray<real_t>& data,
+              const SArray<int>& data_offset) override {
+    if (data_type != Store::kGradient) return;
+    for (size_t i = 0; i < fea_ids.size(); ++i) model_[fea_ids[i]] += data[i];
+  }
+ private:
+  std::unordered_map<feaid_t, real_t> model_;
+};
+
+/**
+ * \brief w += data for gradients, where key k has 1 + k % 3 values, which
+ * are described by offsets
+ */
+class DistOffsetUpdater : public Updater {
+ public:
+  static int Len(feaid_t key) { return 1 + key % 3; }
+  KWArgs Init(const KWArgs& kwargs) override { return kwargs; }
+  void Load(dmlc::Stream* fi, bool* has_aux) override { }
+  void Save(bool save_aux, dmlc::Stream *fo) const override { }
+  void Get(const SArray<feaid_t>& fea_ids, int data_type,
+           SArray<real_t>* data, SArray<int>* data_offset) override {
+    data->clear();
+    if (data_type == Store::kFeaCount) {
+      // a single value per key without offsets
+      data->resize(fea_ids.size(), 1);
+      if (data_offset) data_offset->clear();
+      return;
+    }
+    data_offset->resize(fea_ids.size() + 1);
+    (*data_offset)[0] = 0;
+    for (size_t i = 0; i < fea_ids.size(); ++i) {
+      auto& w = model_[fea_ids[i]];
+      w.resize(Len(fea_ids[i]), 0);
+      for (real_t v : w) data->push_back(v);
+      (*data_offset)[i+1] = data->size();
+    }
+  }
+  void Update(const SArray<feaid_t>& fea_ids, int data_type,
+              const SArray<real_t>& data,
+              const SArray<int>& data_offset) override {
+    if (data_type != Store::kGradient) return;
+    CHECK_EQ(data_offset.size(), fea_ids.size() + 1);
+    CHECK_EQ(data_offset.back(), static_cast<int>(data.size()));
+    for (size_t i = 0; i < fea_ids.size(); ++i) {
+      int len = data_offset[i+1] - data_offset[i];
+      CHECK_EQ(len, Len(fea_ids[i]));
+      auto& w = model_[fea_ids[i]];
+      w.resize(len, 0);
+      for (int j = 0; j < len; ++j) w[j] += data[data_offset[i] + j];
+    }
+  }
+ private:
+  std::unordered_map<feaid_t, std::vector<real_t>> model_;
+};
+
+/**
+ * \brief a scheduler, servers and workers run it together, it does nothing if
+ * not in the distributed mode. use tests/local.sh to launch, such as
+ *
+ * \code
+ * tests/local.sh 2 3 build/difacto_tests --gtest_filter=Dist.*
+ * \endcode
+ */
+TEST(Dist, StoreTrackerReporter) {
+  if (!IsDistributed()) return;
+  ps::Start();
+  {
+    DistReporter reporter;
+    std::atomic<int> nreports{0};
+    reporter.SetMonitor([&nreports](int node_id, const std::string& report) {
+        EXPECT_TRUE(NodeID::GetGroup(node_id) == NodeID::kWorkerGroup);
+        EXPECT_EQ(report, "done");
+        ++nreports;
+      });
+
+    DistTracker tracker;
+    tracker.Init({});
+
+    StoreDist store;
+    store.SetUpdater(std::make_shared<DistSumUpdater>());
+
+    // keys spread over all servers
+    int n = 1000;
+    SArray<feaid_t> keys(n);
+    for (int i = 0; i < n; ++i) keys[i] = ReverseBytes(i);
+    std::sort(keys.begin(), keys.end());
+
+    tracker.SetExecutor([&](const std::string& args, std::string* rets) {
+        if (args == "push") {
+          // the keys are only sent by the first push
+          for (int i = 0; i < 2; ++i) {
+            SArray<real_t> vals(n, 1);
+            store.Wait(store.ZPush(keys, Store::kGradient, vals, {}, nullptr));
+          }
+          reporter.Wait(reporter.Report("done"));
+        } else if (args == "pull") {
+          SArray<real_t> vals;
+          store.Wait(store.Pull(keys, Store::kWeight, &vals, nullptr, nullptr));
+          ASSERT_EQ(vals.size(), keys.size());
+          for (int i = 0; i < n; ++i) EXPECT_EQ(vals[i], 2 * store.NumWorkers());
+        }
+        *rets = std::to_string(store.Rank());
+      });
+    // the executor must be set before the barrier in store.Init. the values
+    // are exact in both fp16 and bf16
+    store.Init({{"push_codec", "fp16"}, {"pull_codec", "bf16"},
+                {"key_cache_size", "16"}});
+
+    if (ps::IsScheduler()) {
+      EXPECT_EQ(tracker.NodeIDs(NodeID::kWorkerGroup).size(), store.NumWorkers());
+      std::atomic<int> nrets{0};
+      tracker.SetMonitor([&nrets](int node_id, const std::string& rets) {
+          EXPECT_EQ(NodeID::Encode(NodeID::kWorkerGroup, std::stoi(rets)), node_id);
+          ++nrets;
+        });
+      // run on every worker
+      for (const std::string job : {"push", "pull"}) {
+        for (int id : tracker.NodeIDs(NodeID::kWorkerGroup)) {
+          tracker.Issue({std::make_pair(id, job)});
+        }
+        while (tracker.NumRemains() != 0) {
+          std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+      }
+      EXPECT_EQ(nrets, 2 * store.NumWorkers());
+      EXPECT_EQ(nreports, store.NumWorkers());
+
+      // run on any worker
+      std::vector<std::pair<int, std::string>> jobs(10 * store.NumWorkers());
+      for (auto& job : jobs) job = std::make_pair(NodeID::kWorkerGroup, "noop");
+      tracker.Issue(jobs);
+      tracker.Stop();
+      EXPECT_EQ(tracker.NumRemains(), 0);
+      EXPECT_EQ(nrets, 2 * store.NumWorkers() + jobs.size());
+    } else {
+      tracker.Wait();
+    }
+  }
+  ps::Finalize();
+}
+
+namespace {
+/**
+ * \brief the hot keys are pushed and pulled through the replicas
+ *
+ * @param with_offsets if true, use \ref DistOffsetUpdater, otherwise every key
+ * has a single value
+ */
+void TestHotKeys(bool with_offsets) {
+  if (!IsDistributed()) return;
+  ps::Start();
+  {
+    DistTracker tracker;
+    tracker.Init({});
+
+    StoreDist store;
+    if (with_offsets) {
+      store.SetUpdater(std::make_shared<DistOffsetUpdater>());
+    } else {
+      store.SetUpdater(std::make_shared<DistSumUpdater>());
+    }
+
+    int n = 1000;
+    SArray<feaid_t> keys(n);
+    for (int i = 0; i < n; ++i) keys[i] = ReverseBytes(i);
+    std::sort(keys.begin(), keys.end());
+    SArray<int> offsets;
+    if (with_offsets) {
+      offsets.resize(n + 1);
+      offsets[0] = 0;
+      for (int i = 0; i < n; ++i) {
+        offsets[i+1] = offsets[i] + DistOffsetUpdater::Len(keys[i]);
+      }
+    }
+    int m = with_offsets ? offsets.back() : n;
+    // every 100-th key is hot
+    SArray<real_t> cnts(n, 1);
+    for (int i = 0; i < n; i += 100) cnts[i] = 100;
+
+    tracker.SetExecutor([&](const std::string& args, std::string* rets) {
+        if (args == "count") {
+          store.Wait(store.ZPush(keys, Store::kFeaCount, cnts, {}, nullptr));
+        } else if (args == "push") {
+          for (int i = 0; i < 2; ++i) {
+            SArray<real_t> vals(m, 1);
+            store.Wait(store.Push(keys, Store::kGradient, vals, offsets, nullptr));
+          }
+        } else if (args == "pull") {
+          // wait until the replicas are reconciled twice
+          std::this_thread::sleep_for(std::chrono::milliseconds(100));
+          SArray<real_t> vals;
+          SArray<int> pulled;
+          store.Wait(store.Pull(keys, Store::kWeight, &vals, &pulled, nullptr));
+          ASSERT_EQ(pulled.size(), offsets.size());
+          for (size_t i = 0; i < offsets.size(); ++i) {
+            EXPECT_EQ(pulled[i], offsets[i]);
+          }
+          ASSERT_EQ(vals.size(), m);
+          for (int i = 0; i < m; ++i) EXPECT_EQ(vals[i], 2 * store.NumWorkers());
+        }
+      });
+    store.Init({{"num_hot_keys", "5"}, {"hot_key_sync", "10"},
+                {"hot_key_refresh", "0"}});
+
+    if (ps::IsScheduler()) {
+      for (const std::string job : {"count", "push", "pull"}) {
+        for (int id : tracker.NodeIDs(NodeID::kWorkerGroup)) {
+          tracker.Issue({std::make_pair(id, job)});
+        }
+        while (tracker.NumRemains() != 0) {
+          std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+      }
+      tracker.Stop();
+    } else {
+      tracker.Wait();
+    }
+  }
+  ps::Finalize();
+}
+}  // namespace
+
+TEST(Dist, HotKeys) {
+  TestHotKeys(false);
+}
+
+TEST(Dist, HotKeysOffsets) {
+  TestHotKeys(true);
+}
+
+/**
+ * \brief the values are pushed and pulled with offsets
+ */
+TEST(Dist, Offsets) {
+  if (!IsDistributed()) return;
+  ps::Start();
+  {
+    DistTracker tracker;
+    tracker.Init({});
+
+    StoreDist store;
+    store.SetUpdater(std::make_shared<DistOffsetUpdater>());
+
+    int n = 1000;
+    SArray<feaid_t> keys(n);
+    for (int i = 0; i < n; ++i) keys[i] = ReverseBytes(i);
+    std::sort(keys.begin(), keys.end());
+    SArray<int> offsets(n + 1);
+    offsets[0] = 0;
+    for (int i = 0; i < n; ++i) {
+      offsets[i+1] = offsets[i] + DistOffsetUpdater::Len(keys[i]);
+    }
+
+    tracker.SetExecutor([&](const std::string& args, std::string* rets) {
+        if (args == "push") {
+          for (int i = 0; i < 2; ++i) {
+            SArray<real_t> vals(offsets.back(), 1);
+            store.Wait(store.Push(keys, Store::kGradient, vals, offsets, nullptr));
+          }
+        } else if (args == "pull") {
+          SArray<real_t> vals;
+          SArray<int> pulled;
+          store.Wait(store.Pull(keys, Store::kWeight, &vals, &pulled, nullptr));
+          ASSERT_EQ(pulled.size(), offsets.size());
+          for (int i = 0; i <= n; ++i) EXPECT_EQ(pulled[i], offsets[i]);
+          ASSERT_EQ(vals.size(), offsets.back());
+          for (real_t v : vals) EXPECT_EQ(v, 2 * store.NumWorkers());
+
+          // a single value per key gives empty offsets
+          store.Wait(store.Pull(keys, Store::kFeaCount, &vals, &pulled, nullptr));
+          EXPECT_EQ(vals.size(), n);
+          EXPECT_TRUE(pulled.empty());
+        }
+      });
+    store.Init({});
+
+    if (ps::IsScheduler()) {
+      for (const std::string job : {"push", "pull"}) {
+        for (int id : tracker.NodeIDs(NodeID::kWorkerGroup)) {
+          tracker.Issue({std::make_pair(id, job)});
+        }
+        while (tracker.NumRemains() != 0) {
+          std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+      }
+      tracker.Stop();
+    } else {
+      tracker.Wait();
+    }
+  }
+  ps::Finalize();
+}
+
+/**
+ * \brief with sync_push, a push is answered once the pushes of all workers are
+ * applied, even if the workers push different keys
+ */
+TEST(Dist, SyncPush) {
+  if (!IsDistributed()) return;
+  ps::Start();
+  {
+    DistTracker tracker;
+    tracker.Init({});
+
+    StoreDist store;
+    store.SetUpdater(std::make_shared<DistSumUpdater>());
+
+    int n = 1000;
+    SArray<feaid_t> keys(n);
+    for (int i = 0; i < n; ++i) keys[i] = ReverseBytes(i);
+    std::sort(keys.begin(), keys.end());
+
+    tracker.SetExecutor([&](const std::string& args, std::string* rets) {
+        int nworkers = store.NumWorkers(), rank = store.Rank();
+        // worker r pushes 1 to every key i with i % nworkers != r, and an
+        // empty list, where every server gets a push without keys
+        SArray<feaid_t> mine;
+        for (int i = 0; i < n; ++i) if (i % nworkers != rank) mine.push_back(keys[i]);
+        for (int k = 0; k < 2; ++k) {
+          const auto& ks = k ? SArray<feaid_t>() : mine;
+          SArray<real_t> vals(ks.size(), 1);
+          store.Wait(store.Push(ks, Store::kGradient, vals, {}, nullptr));
+        }
+        // no barrier is needed before pulling
+        SArray<real_t> vals;
+        store.Wait(store.Pull(keys, Store::kWeight, &vals, nullptr, nullptr));
+        ASSERT_EQ(vals.size(), keys.size());
+        for (int i = 0; i < n; ++i) EXPECT_EQ(vals[i], nworkers - 1);
+      });
+    store.Init({{"sync_push", "1"}, {"key_cache_size", "16"}});
+
+    if (ps::IsScheduler()) {
+      for (int id : tracker.NodeIDs(NodeID::kWorkerGroup)) {
+        tracker.Issue({std::make_pair(id, "push")});
+      }
+      while (tracker.NumRemains() != 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      }
+      tracker.Stop();
+    } else {
+      tracker.Wait();
+    }
+  }
+  ps::Finalize();
+}
+
+/**
+ * \brief train by BCD, each worker reads a part of the data. it reaches the
+ * same optimum as on a single machine, see bcd_learner_test.cc
+ */
+TEST(Dist, BCDLearner) {
+  if (!IsDistributed()) return;
+  ps::Start();
+  {
+    real_t objv = 0;
+    BCDLearner learner;
+    KWArgs args = {{"data_in", "tests/data"},
+                   {"l1", ".1"},
+                   {"lr", ".8"},
+                   {"block_ratio", "4"},
+                   {"tau", "1"},
+                   {"tail_feature_filter", "0"},
+                   {"max_num_epochs", "50"}};
+    auto remain = learner.Init(args);
+    EXPECT_EQ(remain.size(), 0);
+    learner.AddEpochEndCallback(
+        [&objv](int epoch, const std::vector<real_t>& prog) { objv = prog[1]; });
+    learner.Run();
+    if (ps::IsScheduler()) EXPECT_LT(fabs(objv - 15.884923) / objv, 1e-3);
+  }
+  ps::Finalize();
+}
+
+/**
+ * \brief train by L-BFGS, the objectives follow the single machine ones, see
+ * LBFGSLearner.Basic
+ */
+TEST(Dist, LBFGSLearner) {
+  if (!IsDistributed()) return;
+  ps::Start();
+  {
+    std::vector<real_t> objv = {
+      34.603421, 12.655075, 5.224232, 2.713903, 1.290586};
+    int nepochs = 0;
+    LBFGSLearner learner;
+    KWArgs args = {{"data_in", "tests/data"},
+                   {"m", "5"},
+                   {"V_dim", "0"},
+                   {"l2", "0"},
+                   {"init_alpha", "1"},
+                   {"tail_feature_filter", "0"},
+                   {"max_num_epochs", std::to_string(objv.size())}};
+    auto remain = learner.Init(args);
+    EXPECT_EQ(remain.size(), 0);
+    learner.AddEpochEndCallback(
+        [&objv, &nepochs](int epoch, const lbfgs::Progress& prog) {
+          EXPECT_LT(fabs(objv[epoch] - prog.objv) / objv[epoch], 1e-3);
+          ++nepochs;
+        });
+    learner.Run();
+    if (ps::IsScheduler()) EXPECT_EQ(nepochs, objv.size());
+  }
+  ps::Finalize();
+}
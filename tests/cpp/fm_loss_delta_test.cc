@@ -0,0 +1,75 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#include <gtest/gtest.h>
+#include "common/spmt.h"
+#include "loss/fm_loss_delta.h"
+#include "loss/fm_loss.h"
+#include "./utils.h"
+
+using namespace difacto;
+
+TEST(FMLossDelta, Grad) {
+  // load and tranpose data
+  dmlc::data::RowBlockContainer<unsigned> rowblk, transposed;
+  std::vector<feaid_t> uidx;
+  load_data(&rowblk, &uidx);
+  SpMT::Transpose(rowblk.GetBlock(), &transposed, uidx.size());
+  size_t n = uidx.size();
+
+  // init loss
+  int V_dim = 5, k = V_dim + 1;
+  KWArgs args = {{"V_dim", std::to_string(V_dim)}, {"compute_hession", "1"}};
+  FMLossDelta loss; loss.Init(args);
+  FMLoss ref_loss; ref_loss.Init(args);
+
+  // w_i is followed by V_i
+  SArray<int> w_pos(n), V_pos(n);
+  for (size_t i = 0; i < n; ++i) {
+    w_pos[i] = i * k;
+    V_pos[i] = i * k + 1;
+  }
+
+  for (int t = 0; t < 5; ++t) {
+    SArray<real_t> w;
+    gen_vals(n * k, -.1, .1, &w);
+
+    SArray<real_t> ref_pred(100), ref_grad(w.size());
+    ref_loss.Predict(rowblk.GetBlock(), w, w_pos, V_pos, &ref_pred);
+    ref_loss.CalcGrad(rowblk.GetBlock(), w, w_pos, V_pos, ref_pred, &ref_grad);
+
+    // add the model block by block, starting from 0
+    int nblk = 10;
+    SArray<real_t> pred(100), XV(100 * V_dim), grad(w.size() * 2);
+    for (int b = 0; b < nblk; ++b) {
+      auto rg = Range(0, n).Segment(b, nblk);
+      auto data = transposed.GetBlock().Slice(rg.begin, rg.end);
+      data.label = rowblk.GetBlock().label;
+      SArray<real_t> old_w(rg.Size() * k);
+      auto param = {SArray<char>(w.segment(rg.begin * k, rg.end * k)),
+                    SArray<char>(w_pos.segment(0, rg.Size())),
+                    SArray<char>(V_pos.segment(0, rg.Size())),
+                    SArray<char>(old_w), SArray<char>(XV)};
+      loss.Predict(data, param, &pred);
+    }
+    EXPECT_LE(fabs(norm2(pred) - norm2(ref_pred)) / norm2(ref_pred), 1e-5);
+
+    for (int b = 0; b < nblk; ++b) {
+      auto rg = Range(0, n).Segment(b, nblk);
+      auto data = transposed.GetBlock().Slice(rg.begin, rg.end);
+      data.label = rowblk.GetBlock().label;
+      SArray<int> grad_pos(rg.Size());
+      for (size_t i = 0; i < rg.Size(); ++i) grad_pos[i] = i * k * 2;
+      auto grad_seg = grad.segment(rg.begin * k * 2, rg.end * k * 2);
+      auto param = {SArray<char>(pred), SArray<char>(grad_pos), {},
+                    SArray<char>(V_pos.segment(0, rg.Size())),
+                    SArray<char>(w.segment(rg.begin * k, rg.end * k)),
+                    SArray<char>(XV)};
+      loss.CalcGrad(data, param, &grad_seg);
+    }
+
+    SArray<real_t> G(w.size());
+    for (size_t i = 0; i < w.size(); ++i) G[i] = grad[i*2];
+    EXPECT_LE(fabs(norm2(G) - norm2(ref_grad)) / norm2(ref_grad), 1e-5);
+  }
+}
@@ -0,0 +1,110 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#include <gtest/gtest.h>
+#include <vector>
+#include "store/hot_keys.h"
+
+using namespace difacto;
+
+namespace {
+template <typename V>
+std::vector<V> Vec(const SArray<V>& a) { return std::vector<V>(a.begin(), a.end()); }
+}  // namespace
+
+TEST(HotKeyCounter, TopK) {
+  HotKeyCounter counter(4);
+  counter.Add({1, 2, 3}, {10, 1, 5});
+  counter.Add({2, 4}, {1, 20});
+  std::vector<feaid_t> top;
+  counter.TopK(2, &top);
+  EXPECT_EQ(top, std::vector<feaid_t>({1, 4}));
+
+  // 5 replaces 2, the smallest one, and inherits its count
+  counter.Add({5}, {1});
+  EXPECT_EQ(counter.Count(2), 0);
+  EXPECT_EQ(counter.Count(5), 3);
+
+  // a frequent key is always tracked
+  for (feaid_t k = 100; k < 200; ++k) counter.Add({k, 6}, {1, 2});
+  counter.TopK(1, &top);
+  EXPECT_EQ(top, std::vector<feaid_t>({6}));
+}
+
+TEST(HotKeys, SplitMerge) {
+  ps::KVPairs<real_t> kv, parts[2];
+  kv.keys = {1, 2, 3, 4};
+  kv.vals = {1, 2, 2, 3, 4, 4, 4};
+  kv.lens = {1, 2, 1, 3};
+  SplitKV(kv, [](feaid_t k) { return k % 2 == 0; }, &parts[1], &parts[0]);
+  EXPECT_EQ(Vec(parts[0].keys), std::vector<feaid_t>({1, 3}));
+  EXPECT_EQ(Vec(parts[0].vals), std::vector<real_t>({1, 3}));
+  EXPECT_EQ(Vec(parts[1].keys), std::vector<feaid_t>({2, 4}));
+  EXPECT_EQ(Vec(parts[1].lens), std::vector<int>({2, 3}));
+
+  SArray<real_t> vals;
+  SArray<int> lens;
+  MergeKV(kv.keys, parts, &vals, &lens);
+  EXPECT_EQ(Vec(vals), Vec(kv.vals));
+  EXPECT_EQ(Vec(lens), Vec(kv.lens));
+
+  // one part without lens
+  parts[0].lens.clear();
+  MergeKV(kv.keys, parts, &vals, &lens);
+  EXPECT_EQ(Vec(vals), Vec(kv.vals));
+  EXPECT_EQ(Vec(lens), Vec(kv.lens));
+
+  // split the keys only
+  ps::KVPairs<real_t> keys, kparts[2];
+  keys.keys = kv.keys;
+  SplitKV(keys, [](feaid_t k) { return k > 2; }, &kparts[1], &kparts[0]);
+  EXPECT_EQ(Vec(kparts[1].keys), std::vector<feaid_t>({3, 4}));
+  EXPECT_TRUE(kparts[1].vals.empty());
+}
+
+TEST(HotKeys, Sum) {
+  ps::KVPairs<real_t> a, b, sum;
+  a.keys = {1, 3, 4};
+  a.vals = {1, 3, 3, 4};
+  a.lens = {1, 2, 1};
+  b.keys = {2, 3, 5};
+  b.vals = {2, 2, 1, 1, 5, 5};
+  b.lens = {2, 2, 2};
+  SumKV(a, b, &sum);
+  EXPECT_EQ(Vec(sum.keys), std::vector<feaid_t>({1, 2, 3, 4, 5}));
+  EXPECT_EQ(Vec(sum.vals), std::vector<real_t>({1, 2, 2, 4, 4, 4, 5, 5}));
+  EXPECT_EQ(Vec(sum.lens), std::vector<int>({1, 2, 2, 1, 2}));
+
+  // without lens, and the output is one of the inputs
+  ps::KVPairs<real_t> c, d;
+  c.keys = {1, 2};
+  c.vals = {1, 2};
+  d.keys = {2, 3};
+  d.vals = {2, 3};
+  SumKV(c, d, &c);
+  EXPECT_EQ(Vec(c.keys), std::vector<feaid_t>({1, 2, 3}));
+  EXPECT_EQ(Vec(c.vals), std::vector<real_t>({1, 4, 3}));
+  EXPECT_TRUE(c.lens.empty());
+
+  // an empty list
+  SumKV(ps::KVPairs<real_t>(), d, &sum);
+  EXPECT_EQ(Vec(sum.keys), Vec(d.keys));
+  EXPECT_EQ(Vec(sum.vals), Vec(d.vals));
+}
+
+TEST(HotKeys, Pack) {
+  ps::KVPairs<real_t> kv, res;
+  kv.keys = {1, 3};
+  kv.vals = {.5, 1, 2};
+  kv.lens = {2, 1};
+  std::string str;
+  PackKV(kv, &str);
+  UnpackKV(str, &res);
+  EXPECT_EQ(Vec(res.keys), Vec(kv.keys));
+  EXPECT_EQ(Vec(res.vals), Vec(kv.vals));
+  EXPECT_EQ(Vec(res.lens), Vec(kv.lens));
+
+  PackKV(ps::KVPairs<real_t>(), &str);
+  UnpackKV(str, &res);
+  EXPECT_TRUE(res.keys.empty() && res.vals.empty() && res.lens.empty());
+}
@@ -0,0 +1,53 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#include <gtest/gtest.h>
+#include "common/key_cache.h"
+
+using namespace difacto;
+
+TEST(KeyCache, FindInsert) {
+  KeyCache<int> cache;
+  SArray<feaid_t> a = {1, 2, 3};
+  EXPECT_TRUE(cache.Find(a) == nullptr);
+  *cache.Insert(a, 1) += 1;
+  // the same list, including its copies
+  auto b = a;
+  ASSERT_TRUE(cache.Find(b) != nullptr);
+  EXPECT_EQ(*cache.Find(b), 2);
+  // the same keys but a different list
+  SArray<feaid_t> c = {1, 2, 3};
+  EXPECT_TRUE(cache.Find(c) == nullptr);
+  // a segment is a different list
+  EXPECT_TRUE(cache.Find(a.segment(0, 2)) == nullptr);
+  cache.Clear();
+  EXPECT_TRUE(cache.Find(a) == nullptr);
+}
+
+TEST(KeyCache, Evict) {
+  KeyCache<int> cache(2);
+  std::vector<SArray<feaid_t>> keys;
+  for (int i = 0; i < 3; ++i) {
+    keys.push_back(SArray<feaid_t>(10, i));
+    cache.Insert(keys.back(), i);
+  }
+  EXPECT_EQ(cache.size(), 2);
+  EXPECT_TRUE(cache.Find(keys[0]) == nullptr);
+  EXPECT_EQ(*cache.Find(keys[1]), 1);
+  EXPECT_EQ(*cache.Find(keys[2]), 2);
+}
+
+TEST(KeyCache, HoldKeys) {
+  // a cached list is kept alive, so its memory cannot be reused by another
+  // list with different keys
+  KeyCache<int> cache;
+  const feaid_t* data;
+  {
+    SArray<feaid_t> a(100, 1);
+    data = a.data();
+    cache.Insert(a, 1);
+  }
+  SArray<feaid_t> b(100, 2);
+  EXPECT_NE(b.data(), data);
+  EXPECT_TRUE(cache.Find(b) == nullptr);
+}
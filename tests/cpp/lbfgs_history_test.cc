@@ -0,0 +1,69 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#include <gtest/gtest.h>
+#include "lbfgs/lbfgs_history.h"
+#include "./utils.h"
+
+using namespace difacto;
+using namespace difacto::lbfgs;
+
+namespace {
+/** \brief decode a vector */
+void Decode(const BlockVec& vec, SArray<real_t>* res) {
+  res->resize(vec.size());
+  std::vector<real_t> buf(vec.size());
+  real_t const* v = vec.Read(0, vec.size(), buf.data());
+  memcpy(res->data(), v, vec.size() * sizeof(real_t));
+}
+}  // namespace
+
+TEST(History, BF16) {
+  EXPECT_EQ(History::FromBF16(History::ToBF16(1.5)), 1.5);
+  EXPECT_EQ(History::FromBF16(History::ToBF16(-0.25)), -0.25);
+  real_t v = 3.14159;
+  EXPECT_LT(fabs(History::FromBF16(History::ToBF16(v)) - v), v / 128);
+}
+
+TEST(History, RingAndSpill) {
+  int m = 4, n = 5000;
+  // fp32, bf16, fp32 with spill, bf16 with spill
+  for (int k = 0; k < 4; ++k) {
+    bool bf16 = k % 2;
+    int spill = k < 2 ? 0 : 3;
+    History hist;
+    hist.Init(m, n, bf16, spill, "/tmp/difacto_test_");
+    std::vector<SArray<real_t>> s, y;
+    SArray<real_t> old_grad;
+    gen_vals(n, -1, 1, &old_grad);
+    for (int t = 0; t < 7; ++t) {
+      SArray<real_t> a, g;
+      gen_vals(n, -1, 1, &a);
+      gen_vals(n, -1, 1, &g);
+      hist.Push(a, g, old_grad);
+      if (static_cast<int>(s.size()) == m) {
+        s.erase(s.begin()); y.erase(y.begin());
+      }
+      s.push_back(a);
+      y.push_back(SArray<real_t>());
+      y.back().CopyFrom(g);
+      Add(-1, old_grad, &y.back());
+      old_grad = g;
+
+      std::vector<BlockVec> hs, hy;
+      hist.Get(&hs, &hy);
+      ASSERT_EQ(hist.size(), static_cast<int>(s.size()));
+      ASSERT_EQ(hs.size(), s.size());
+      for (size_t i = 0; i < s.size(); ++i) {
+        SArray<real_t> a1, b1;
+        Decode(hs[i], &a1);
+        Decode(hy[i], &b1);
+        real_t eps = bf16 ? 1e-2 : 1e-6;
+        for (int j = 0; j < n; ++j) {
+          EXPECT_LE(fabs(a1[j] - s[i][j]), eps * (1 + fabs(s[i][j])));
+          EXPECT_LE(fabs(b1[j] - y[i][j]), eps * (1 + fabs(y[i][j])));
+        }
+      }
+    }
+  }
+}
@@ -144,3 +144,186 @@ TEST(LBFGSLearner, WithV) {
   learner.AddEpochEndCallback(callback);
   learner.Run();
 }
+
+TEST(LBFGSLearner, ShardedGrad) {
+  // the sharded gradient should give the same results as the replicas
+  std::vector<std::vector<real_t>> objv(2);
+  for (int i = 0; i < 2; ++i) {
+    LBFGSLearner learner;
+    KWArgs args = {{"data_in", "../tests/data"},
+                   {"m", "5"},
+                   {"V_dim", "5"},
+                   {"l2", ".1"},
+                   {"init_alpha", "1"},
+                   {"V_l2", ".01"},
+                   {"V_threshold", "2"},
+                   {"num_threads", "4"},
+                   {"grad_shards", i == 0 ? "0" : "7"},
+                   {"tail_feature_filter", "0"},
+                   {"max_num_epochs", "10"}};
+    auto remain = learner.Init(args);
+    EXPECT_EQ(remain.size(), 0);
+    auto callback = [&objv, i](int epoch, const lbfgs::Progress& prog) {
+      objv[i].push_back(prog.objv);
+    };
+    learner.AddEpochEndCallback(callback);
+    learner.Run();
+  }
+  EXPECT_EQ(objv[0].size(), objv[1].size());
+  for (size_t k = 0; k < objv[0].size(); ++k) {
+    EXPECT_LT(fabs(objv[0][k] - objv[1][k]) / objv[0][k], 1e-4);
+  }
+}
+
+TEST(LBFGSLearner, LineSearchCache) {
+  // the cached predictions should give the same results
+  std::vector<std::vector<real_t>> objv(2);
+  for (int i = 0; i < 2; ++i) {
+    LBFGSLearner learner;
+    KWArgs args = {{"data_in", "../tests/data"},
+                   {"m", "5"},
+                   {"V_dim", "5"},
+                   {"l2", ".1"},
+                   {"init_alpha", "1"},
+                   {"V_l2", ".01"},
+                   {"V_threshold", "2"},
+                   {"linesearch_cache", std::to_string(i)},
+                   {"tail_feature_filter", "0"},
+                   {"max_num_epochs", "10"}};
+    auto remain = learner.Init(args);
+    EXPECT_EQ(remain.size(), 0);
+    auto callback = [&objv, i](int epoch, const lbfgs::Progress& prog) {
+      objv[i].push_back(prog.objv);
+    };
+    learner.AddEpochEndCallback(callback);
+    learner.Run();
+  }
+  EXPECT_EQ(objv[0].size(), objv[1].size());
+  for (size_t k = 0; k < objv[0].size(); ++k) {
+    EXPECT_LT(fabs(objv[0][k] - objv[1][k]) / objv[0][k], 1e-4);
+  }
+}
+
+TEST(LBFGSLearner, LineSearchCacheClipped) {
+  // a large V clips the FM predictions, which then are not quadratic in
+  // alpha, so the cache must not be used
+  std::vector<std::vector<real_t>> objv(2);
+  for (int i = 0; i < 2; ++i) {
+    LBFGSLearner learner;
+    KWArgs args = {{"data_in", "../tests/data"},
+                   {"m", "5"},
+                   {"V_dim", "5"},
+                   {"l2", ".1"},
+                   {"init_alpha", "1"},
+                   {"V_l2", ".01"},
+                   {"weight_init_range", "10"},
+                   {"linesearch_cache", std::to_string(i)},
+                   {"tail_feature_filter", "0"},
+                   {"max_num_epochs", "5"}};
+    auto remain = learner.Init(args);
+    EXPECT_EQ(remain.size(), 0);
+    auto callback = [&objv, i](int epoch, const lbfgs::Progress& prog) {
+      objv[i].push_back(prog.objv);
+    };
+    learner.AddEpochEndCallback(callback);
+    learner.Run();
+  }
+  EXPECT_EQ(objv[0].size(), objv[1].size());
+  for (size_t k = 0; k < objv[0].size(); ++k) {
+    EXPECT_LT(fabs(objv[0][k] - objv[1][k]) / objv[0][k], 1e-4);
+  }
+}
+
+TEST(LBFGSLearner, L1) {
+  // OWL-QN should decrease the objective and give a sparse model
+  std::vector<std::vector<real_t>> objv(2), nnz_w(2);
+  for (int i = 0; i < 2; ++i) {
+    LBFGSLearner learner;
+    KWArgs args = {{"data_in", "../tests/data"},
+                   {"m", "5"},
+                   {"V_dim", "0"},
+                   {"l1", i == 0 ? "0" : ".1"},
+                   {"l2", "0"},
+                   {"init_alpha", "1"},
+                   {"tail_feature_filter", "0"},
+                   {"max_num_epochs", "20"}};
+    auto remain = learner.Init(args);
+    EXPECT_EQ(remain.size(), 0);
+    auto callback = [&objv, &nnz_w, i](int epoch, const lbfgs::Progress& prog) {
+      objv[i].push_back(prog.objv);
+      nnz_w[i].push_back(prog.nnz_w);
+    };
+    learner.AddEpochEndCallback(callback);
+    learner.Run();
+  }
+  ASSERT_GT(objv[1].size(), 2);
+  for (size_t k = 1; k < objv[1].size(); ++k) {
+    EXPECT_LE(objv[1][k], objv[1][k-1] + 1e-5);
+  }
+  EXPECT_GT(nnz_w[1].back(), 0);
+  EXPECT_LT(nnz_w[1].back(), nnz_w[0].back() / 2);
+}
+
+TEST(LBFGSLearner, CompactHistory) {
+  // bf16 and spilled history should give similar results
+  std::vector<std::vector<real_t>> objv(3);
+  for (int i = 0; i < 3; ++i) {
+    LBFGSLearner learner;
+    KWArgs args = {{"data_in", "../tests/data"},
+                   {"m", "5"},
+                   {"V_dim", "5"},
+                   {"l2", ".1"},
+                   {"init_alpha", "1"},
+                   {"V_l2", ".01"},
+                   {"V_threshold", "2"},
+                   {"history_bf16", i == 1 ? "1" : "0"},
+                   {"history_spill", i == 2 ? "3" : "0"},
+                   {"tail_feature_filter", "0"},
+                   {"max_num_epochs", "10"}};
+    auto remain = learner.Init(args);
+    EXPECT_EQ(remain.size(), 0);
+    auto callback = [&objv, i](int epoch, const lbfgs::Progress& prog) {
+      objv[i].push_back(prog.objv);
+    };
+    learner.AddEpochEndCallback(callback);
+    learner.Run();
+  }
+  ASSERT_EQ(objv[0].size(), objv[2].size());
+  for (size_t k = 0; k < objv[0].size(); ++k) {
+    EXPECT_LT(fabs(objv[0][k] - objv[2][k]) / objv[0][k], 1e-5);
+  }
+  // bf16 only changes the direction slightly
+  EXPECT_LT(fabs(objv[0].back() - objv[1].back()) / objv[0].back(), 5e-2);
+}
+
+TEST(LBFGSLearner, Checkpoint) {
+  // resuming from a checkpoint should give the same results
+  std::vector<std::vector<real_t>> objv(2);
+  for (int i = 0; i < 2; ++i) {
+    LBFGSLearner learner;
+    KWArgs args = {{"data_in", "../tests/data"},
+                   {"m", "3"},
+                   {"V_dim", "5"},
+                   {"l2", ".1"},
+                   {"init_alpha", "1"},
+                   {"V_l2", ".01"},
+                   {"V_threshold", "2"},
+                   {"model_out", "/tmp/difacto_test_lbfgs"},
+                   {"checkpoint_freq", "5"},
+                   {"load_epoch", i == 0 ? "0" : "5"},
+                   {"tail_feature_filter", "0"},
+                   {"max_num_epochs", "10"}};
+    auto remain = learner.Init(args);
+    EXPECT_EQ(remain.size(), 0);
+    auto callback = [&objv, i](int epoch, const lbfgs::Progress& prog) {
+      objv[i].push_back(prog.objv);
+    };
+    learner.AddEpochEndCallback(callback);
+    learner.Run();
+  }
+  ASSERT_EQ(objv[0].size(), 10);
+  ASSERT_EQ(objv[1].size(), 5);
+  for (size_t k = 0; k < objv[1].size(); ++k) {
+    EXPECT_LT(fabs(objv[0][k+5] - objv[1][k]) / objv[1][k], 1e-5);
+  }
+}
@@ -0,0 +1,89 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#include <gtest/gtest.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include "tracker/async_local_tracker.h"
+#include "tracker/local_tracker.h"
+
+using namespace difacto;
+
+TEST(AsyncLocalTracker, Concurrent) {
+  AsyncLocalTracker<int, int> tracker(4);
+  std::atomic<int> running(0), max_running(0);
+  tracker.SetExecutor([&](int job, const std::function<void()>& on_complete,
+                          int* rets) {
+      int n = ++running;
+      int m = max_running;
+      while (n > m && !max_running.compare_exchange_weak(m, n)) { }
+      std::this_thread::sleep_for(std::chrono::milliseconds(20));
+      --running;
+      *rets = job;
+      on_complete();
+    });
+  std::atomic<int> sum(0);
+  tracker.SetMonitor([&sum](int rets) { sum += rets; });
+
+  std::vector<int> jobs;
+  for (int i = 0; i < 16; ++i) jobs.push_back(i);
+  tracker.Issue(jobs);
+  tracker.Wait();
+  EXPECT_EQ(tracker.NumRemains(), 0);
+  EXPECT_EQ(sum, 120);
+  EXPECT_GT(max_running, 1);
+  EXPECT_LE(max_running, 4);
+}
+
+TEST(AsyncLocalTracker, AsyncComplete) {
+  AsyncLocalTracker<int, int> tracker(2);
+  std::vector<std::function<void()>> callbacks;
+  std::mutex mu;
+  tracker.SetExecutor([&](int job, const std::function<void()>& on_complete,
+                          int* rets) {
+      std::lock_guard<std::mutex> lk(mu);
+      callbacks.push_back(on_complete);
+    });
+
+  tracker.Issue({1, 2, 3});
+  // a started job remains until its on_complete is called
+  while (true) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    std::lock_guard<std::mutex> lk(mu);
+    if (callbacks.size() == 3) break;
+  }
+  EXPECT_EQ(tracker.NumRemains(), 3);
+  callbacks[1]();
+  EXPECT_EQ(tracker.NumRemains(), 2);
+  callbacks[0]();
+  callbacks[2]();
+  tracker.Wait();
+  EXPECT_EQ(tracker.NumRemains(), 0);
+}
+
+TEST(LocalTracker, NumExecutors) {
+  LocalTracker tracker;
+  auto remain = tracker.Init({{"num_executors", "3"}, {"foo", "bar"}});
+  EXPECT_EQ(remain.size(), 1);
+
+  std::atomic<int> running(0), max_running(0);
+  tracker.SetExecutor([&](const std::string& args, std::string* rets) {
+      int n = ++running;
+      int m = max_running;
+      while (n > m && !max_running.compare_exchange_weak(m, n)) { }
+      std::this_thread::sleep_for(std::chrono::milliseconds(20));
+      --running;
+      *rets = args;
+    });
+  std::atomic<int> num(0);
+  tracker.SetMonitor([&num](int node_id, const std::string& rets) { ++num; });
+
+  std::vector<std::pair<int, std::string>> jobs;
+  for (int i = 0; i < 9; ++i) jobs.push_back(std::make_pair(0, "job"));
+  tracker.Issue(jobs);
+  tracker.Wait();
+  EXPECT_EQ(num, 9);
+  EXPECT_GT(max_running, 1);
+  EXPECT_LE(max_running, 3);
+}
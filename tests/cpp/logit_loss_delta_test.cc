@@ -105,3 +105,42 @@ TEST(LogitLossDelta, Hessien) {
   EXPECT_LT(fabs(norm2(G) - 90.5817), 1e-4);
   EXPECT_LT(fabs(norm2(H) - 0.0424518), 1e-6);
 }
+
+TEST(LogitLossDelta, HessienBound) {
+  // load and tranpose data
+  dmlc::data::RowBlockContainer<unsigned> rowblk, transposed;
+  std::vector<feaid_t> uidx;
+  load_data(&rowblk, &uidx);
+  SpMT::Transpose(rowblk.GetBlock(), &transposed, uidx.size());
+  auto data = transposed.GetBlock();
+  data.label = rowblk.GetBlock().label;
+
+  SArray<real_t> w;
+  gen_vals(uidx.size(), -.1, .1, &w);
+  SArray<real_t> pred(100);
+  LogitLossDelta loss; loss.Init({{"compute_hession", "1"}});
+  loss.Predict(data, {SArray<char>(w)}, &pred);
+
+  SArray<int> grad_pos(w.size());
+  for (size_t i = 0; i < w.size(); ++i) grad_pos[i] = 2*i;
+  SArray<real_t> grad(w.size()*2);
+  loss.CalcGrad(data, {SArray<char>(pred), SArray<char>(grad_pos)}, &grad);
+
+  // the bound is exact if delta = 0, and is at least the hessian otherwise
+  LogitLossDelta bound_loss; bound_loss.Init({{"compute_hession", "2"}});
+  std::vector<real_t> deltas = {0, .1, 1, 100};
+  for (real_t d : deltas) {
+    SArray<real_t> delta(w.size()), bound(w.size()*2);
+    for (auto& v : delta) v = d;
+    bound_loss.CalcGrad(data, {SArray<char>(pred), SArray<char>(grad_pos),
+            SArray<char>(delta)}, &bound);
+    for (size_t i = 0; i < w.size(); ++i) {
+      EXPECT_EQ(grad[2*i], bound[2*i]);
+      if (d == 0) {
+        EXPECT_LT(fabs(grad[2*i+1] - bound[2*i+1]), 1e-6);
+      } else {
+        EXPECT_GE(bound[2*i+1], grad[2*i+1]);
+      }
+    }
+  }
+}
@@ -0,0 +1,43 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#include <gtest/gtest.h>
+#include "common/sarray_pool.h"
+
+using namespace difacto;
+
+TEST(SArrayPool, Reuse) {
+  SArrayPool<float> pool(2);
+  float* data;
+  {
+    auto a = pool.Get(100);
+    EXPECT_EQ(a.size(), 100);
+    for (float v : a) EXPECT_EQ(v, 0);
+    a[0] = 1;
+    data = a.data();
+    auto b = a;  // the buffer is returned after all copies are released
+    EXPECT_EQ(pool.num_free(), 0);
+  }
+  EXPECT_EQ(pool.num_free(), 1);
+  // a smaller one reuses the buffer, and it is zeroed
+  auto c = pool.Get(50);
+  EXPECT_EQ(c.data(), data);
+  EXPECT_EQ(c[0], 0);
+  // a larger one is allocated
+  auto d = pool.Get(200);
+  EXPECT_NE(d.data(), data);
+  EXPECT_EQ(pool.num_free(), 0);
+}
+
+TEST(SArrayPool, OutlivePool) {
+  SArray<int> a;
+  {
+    SArrayPool<int> pool(1);
+    a = pool.Get(10);
+    auto b = pool.Get(10);
+    auto c = pool.Get(10);
+  }
+  // the pool is destroyed, but a is still valid
+  a[9] = 1;
+  EXPECT_EQ(a[9], 1);
+}
@@ -0,0 +1,59 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#include <gtest/gtest.h>
+#include <vector>
+#include "sgd/sgd_grad_accumulator.h"
+
+using namespace difacto;
+using sgd::GradAccumulator;
+
+namespace {
+template <typename V>
+std::vector<V> Vec(const SArray<V>& a) { return std::vector<V>(a.begin(), a.end()); }
+}  // namespace
+
+TEST(GradAccumulator, Sum) {
+  GradAccumulator accum(2, 0, false);
+  SArray<feaid_t> feaids;
+  SArray<real_t> grads;
+  SArray<int> offsets;
+  EXPECT_FALSE(accum.Flush(&feaids, &grads, &offsets));
+
+  EXPECT_FALSE(accum.Add({3, 5}, {1, 2}, {}));
+  EXPECT_TRUE(accum.Add({1, 3}, {4, 8}, {}));
+  EXPECT_TRUE(accum.Flush(&feaids, &grads, &offsets));
+  EXPECT_EQ(Vec(feaids), std::vector<feaid_t>({1, 3, 5}));
+  EXPECT_EQ(Vec(grads), std::vector<real_t>({4, 9, 2}));
+  EXPECT_TRUE(offsets.empty());
+
+  // reset after flush
+  EXPECT_FALSE(accum.Add({2}, {1}, {}));
+  EXPECT_TRUE(accum.Flush(&feaids, &grads, &offsets));
+  EXPECT_EQ(Vec(feaids), std::vector<feaid_t>({2}));
+}
+
+TEST(GradAccumulator, AverageWithV) {
+  GradAccumulator accum(10, 0, true);
+  SArray<feaid_t> feaids;
+  SArray<real_t> grads;
+  SArray<int> offsets;
+  // feature 1 has V, feature 2 has only w
+  accum.Add({1, 2}, {2, 2, 4, 6}, {0, 3, 4});
+  // then V of feature 2 is initialized
+  accum.Add({2}, {2, 4, 4}, {0, 3});
+  accum.Add({2}, {2}, {});
+  EXPECT_TRUE(accum.Flush(&feaids, &grads, &offsets));
+  EXPECT_EQ(Vec(feaids), std::vector<feaid_t>({1, 2}));
+  EXPECT_EQ(Vec(offsets), std::vector<int>({0, 3, 6}));
+  std::vector<real_t> res = {2, 2, 4, 10.0/3, 4.0/3, 4.0/3};
+  ASSERT_EQ(grads.size(), res.size());
+  for (size_t i = 0; i < res.size(); ++i) EXPECT_FLOAT_EQ(grads[i], res[i]);
+}
+
+TEST(GradAccumulator, Bytes) {
+  GradAccumulator accum(100, sizeof(feaid_t) * 4 + sizeof(real_t) * 4, false);
+  EXPECT_FALSE(accum.Add({1, 2}, {1, 1}, {}));
+  EXPECT_FALSE(accum.Add({1, 2}, {1, 1}, {}));
+  EXPECT_TRUE(accum.Add({3, 4}, {1, 1}, {}));
+}
@@ -0,0 +1,104 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#include <gtest/gtest.h>
+#include "sgd/sgd_job_scheduler.h"
+
+using namespace difacto;
+using sgd::JobScheduler;
+
+TEST(JobScheduler, OnDemand) {
+  JobScheduler sched(0);
+  sched.AddNode(9);
+  sched.AddNode(11);
+  sched.Start(5, true);
+
+  std::vector<JobScheduler::Task> tasks;
+  sched.Assign(0, &tasks);
+  ASSERT_EQ(tasks.size(), 2);
+  EXPECT_EQ(tasks[0].node_id, 9);
+  EXPECT_EQ(tasks[0].part_idx, 0);
+  EXPECT_EQ(tasks[1].node_id, 11);
+  EXPECT_EQ(tasks[1].part_idx, 1);
+
+  // busy workers get nothing
+  sched.Assign(1, &tasks);
+  EXPECT_TRUE(tasks.empty());
+
+  // node 11 is fast, it gets the remaining parts one by one
+  for (int i = 2; i < 5; ++i) {
+    EXPECT_TRUE(sched.Finish(11, i));
+    sched.Assign(i, &tasks);
+    ASSERT_EQ(tasks.size(), 1);
+    EXPECT_EQ(tasks[0].node_id, 11);
+    EXPECT_EQ(tasks[0].part_idx, i);
+    EXPECT_FALSE(tasks[0].backup);
+  }
+  EXPECT_TRUE(sched.Finish(11, 5));
+
+  // no backup copies with straggler_factor = 0
+  sched.Assign(100, &tasks);
+  EXPECT_TRUE(tasks.empty());
+  EXPECT_EQ(sched.NumFinished(), 4);
+  EXPECT_FALSE(sched.Done());
+  EXPECT_TRUE(sched.Finish(9, 100));
+  EXPECT_TRUE(sched.Done());
+}
+
+TEST(JobScheduler, Backup) {
+  JobScheduler sched(2);
+  sched.AddNode(9);
+  sched.AddNode(11);
+  sched.AddNode(13);
+  sched.Start(3, true);
+
+  std::vector<JobScheduler::Task> tasks;
+  sched.Assign(0, &tasks);
+  ASSERT_EQ(tasks.size(), 3);
+  EXPECT_TRUE(sched.Finish(9, 1));
+  EXPECT_TRUE(sched.Finish(11, 1));
+
+  // part 2 is not a straggler yet
+  sched.Assign(1.5, &tasks);
+  EXPECT_TRUE(tasks.empty());
+  EXPECT_DOUBLE_EQ(sched.Time(2, 1.5), 1.5);
+
+  // a backup copy runs on a single idle worker
+  sched.Assign(3, &tasks);
+  ASSERT_EQ(tasks.size(), 1);
+  EXPECT_EQ(tasks[0].node_id, 9);
+  EXPECT_EQ(tasks[0].part_idx, 2);
+  EXPECT_TRUE(tasks[0].backup);
+  sched.Assign(4, &tasks);
+  EXPECT_TRUE(tasks.empty());
+
+  // the first finished copy wins
+  EXPECT_TRUE(sched.Finish(9, 4));
+  EXPECT_TRUE(sched.Done());
+
+  // the other copy keeps its worker busy in the next epoch
+  sched.Start(2, false);
+  sched.Assign(5, &tasks);
+  ASSERT_EQ(tasks.size(), 2);
+  EXPECT_EQ(tasks[0].node_id, 9);
+  EXPECT_EQ(tasks[1].node_id, 11);
+  EXPECT_FALSE(sched.Finish(13, 6));
+  EXPECT_EQ(sched.NumFinished(), 0);
+
+  // no backup copies if not allowed
+  EXPECT_TRUE(sched.Finish(9, 6));
+  sched.Assign(100, &tasks);
+  EXPECT_TRUE(tasks.empty());
+}
+
+TEST(JobScheduler, Wait) {
+  JobScheduler sched(0);
+  sched.AddNode(9);
+  sched.Start(1, false);
+  std::vector<JobScheduler::Task> tasks;
+  sched.Assign(0, &tasks);
+  sched.Finish(9, 1);
+  // returns at once since a part has been finished
+  sched.Wait(100000);
+  EXPECT_TRUE(sched.Done());
+}
@@ -0,0 +1,32 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#include <gtest/gtest.h>
+#include <string>
+#include "dmlc/memory_io.h"
+#include "sgd/sgd_learner.h"
+
+using namespace difacto;
+
+TEST(SGDLearner, NumExecutors) {
+  // several parts run concurrently, and each of them has two minibatches in
+  // flight, whose losses run on the shared pool
+  SGDLearner learner;
+  KWArgs args = {{"data_in", "../tests/data"},
+                 {"V_dim", "2"},
+                 {"V_threshold", "0"},
+                 {"l1", ".1"},
+                 {"lr", ".1"},
+                 {"job_size", "8"},
+                 {"num_executors", "4"},
+                 {"max_num_epochs", "2"}};
+  auto remain = learner.Init(args);
+  EXPECT_EQ(remain.size(), 0);
+  learner.Run();
+
+  // the model is trained, so it has nonzero entries
+  std::string model;
+  dmlc::MemoryStringStream ss(&model);
+  learner.GetUpdater()->Save(false, &ss);
+  EXPECT_GT(model.size(), 0);
+}
@@ -0,0 +1,137 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#include <gtest/gtest.h>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "sgd/sgd_pull_cache.h"
+
+using namespace difacto;
+using sgd::PullCache;
+
+namespace {
+template <typename V>
+std::vector<V> Vec(const SArray<V>& a) { return std::vector<V>(a.begin(), a.end()); }
+
+/**
+ * \brief pull through the cache, the store is emulated by the weight w[f] =
+ * f with an embedding of length f % 2 filled by -f
+ */
+void Pull(const SArray<feaid_t>& feaids, PullCache* cache,
+          SArray<real_t>* vals, SArray<int>* offsets,
+          SArray<feaid_t>* missed) {
+  SArray<real_t> hit_vals, missed_vals;
+  SArray<int> hit_lens, missed_offsets(1, 0);
+  cache->Find(feaids, &hit_vals, &hit_lens, missed);
+  for (feaid_t f : *missed) {
+    missed_vals.push_back(f);
+    if (f % 2) missed_vals.push_back(-static_cast<real_t>(f));
+    missed_offsets.push_back(missed_vals.size());
+  }
+  cache->Merge(feaids, hit_vals, hit_lens, *missed, missed_vals,
+               missed_offsets, vals, offsets);
+}
+
+void Check(const SArray<feaid_t>& feaids, const SArray<real_t>& vals,
+           const SArray<int>& offsets) {
+  ASSERT_EQ(offsets.size(), feaids.size() + 1);
+  for (size_t i = 0; i < feaids.size(); ++i) {
+    feaid_t f = feaids[i];
+    ASSERT_EQ(offsets[i+1] - offsets[i], 1 + static_cast<int>(f % 2));
+    EXPECT_EQ(vals[offsets[i]], f);
+    if (f % 2) EXPECT_EQ(vals[offsets[i]+1], -static_cast<real_t>(f));
+  }
+}
+}  // namespace
+
+TEST(PullCache, FindMerge) {
+  PullCache cache(100, 10, 100000);
+  SArray<real_t> vals; SArray<int> offsets; SArray<feaid_t> missed;
+  SArray<feaid_t> a = {1, 2, 3, 4};
+  Pull(a, &cache, &vals, &offsets, &missed);
+  EXPECT_EQ(missed.size(), 4);
+  Check(a, vals, offsets);
+  EXPECT_EQ(cache.size(), 4);
+
+  SArray<feaid_t> b = {0, 2, 3, 5, 8};
+  Pull(b, &cache, &vals, &offsets, &missed);
+  SArray<feaid_t> c = {0, 5, 8};
+  EXPECT_EQ(Vec(missed), Vec(c));
+  Check(b, vals, offsets);
+  EXPECT_EQ(cache.num_hits(), 2);
+
+  Pull(b, &cache, &vals, &offsets, &missed);
+  EXPECT_EQ(missed.size(), 0);
+  Check(b, vals, offsets);
+}
+
+TEST(PullCache, WeightOnly) {
+  PullCache cache(100, 10, 100000);
+  SArray<feaid_t> a = {1, 2, 3}, b = {2, 4}, missed;
+  SArray<real_t> hit_vals, vals;
+  SArray<int> hit_lens, offsets;
+  cache.Find(a, &hit_vals, &hit_lens, &missed);
+  cache.Merge(a, hit_vals, hit_lens, missed, {1, 2, 3}, {}, &vals, &offsets);
+  cache.Find(b, &hit_vals, &hit_lens, &missed);
+  EXPECT_EQ(missed.size(), 1);
+  cache.Merge(b, hit_vals, hit_lens, missed, {4}, {}, &vals, &offsets);
+  EXPECT_TRUE(offsets.empty());
+  SArray<real_t> res = {2, 4};
+  EXPECT_EQ(Vec(vals), Vec(res));
+}
+
+TEST(PullCache, MixedLengths) {
+  // the pulled features have only w, while the cached ones have V
+  PullCache cache(100, 10, 100000);
+  SArray<real_t> hit_vals, vals;
+  SArray<int> hit_lens, offsets;
+  SArray<feaid_t> a = {1, 3}, b = {1, 2, 3, 4}, missed;
+  Pull(a, &cache, &vals, &offsets, &missed);
+  cache.Find(b, &hit_vals, &hit_lens, &missed);
+  SArray<feaid_t> c = {2, 4};
+  EXPECT_EQ(Vec(missed), Vec(c));
+  cache.Merge(b, hit_vals, hit_lens, missed, {2, 4}, {}, &vals, &offsets);
+  Check(b, vals, offsets);
+
+  // the cached features have only w, while the pulled ones have V
+  PullCache cache2(100, 10, 100000);
+  cache2.Find(c, &hit_vals, &hit_lens, &missed);
+  cache2.Merge(c, hit_vals, hit_lens, missed, {2, 4}, {}, &vals, &offsets);
+  EXPECT_TRUE(offsets.empty());
+  Pull(b, &cache2, &vals, &offsets, &missed);
+  EXPECT_EQ(Vec(missed), Vec(a));
+  Check(b, vals, offsets);
+}
+
+TEST(PullCache, Expire) {
+  PullCache cache(100, 2, 50);
+  SArray<real_t> vals; SArray<int> offsets; SArray<feaid_t> missed;
+  SArray<feaid_t> a = {1, 2, 3};
+  Pull(a, &cache, &vals, &offsets, &missed);
+
+  // expired by the pushes
+  cache.Update({1, 2});
+  cache.Update({1});
+  Pull(a, &cache, &vals, &offsets, &missed);
+  SArray<feaid_t> b = {1};
+  EXPECT_EQ(Vec(missed), Vec(b));
+  Check(a, vals, offsets);
+
+  // expired by the time
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  Pull(a, &cache, &vals, &offsets, &missed);
+  EXPECT_EQ(Vec(missed), Vec(a));
+  Check(a, vals, offsets);
+}
+
+TEST(PullCache, Capacity) {
+  PullCache cache(2, 10, 100000);
+  SArray<real_t> vals; SArray<int> offsets; SArray<feaid_t> missed;
+  SArray<feaid_t> a = {1, 2, 3};
+  Pull(a, &cache, &vals, &offsets, &missed);
+  EXPECT_EQ(cache.size(), 2);
+  Pull(a, &cache, &vals, &offsets, &missed);
+  EXPECT_EQ(missed.size(), 1);
+  Check(a, vals, offsets);
+}
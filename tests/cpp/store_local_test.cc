@@ -0,0 +1,78 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#include <gtest/gtest.h>
+#include <atomic>
+#include <unordered_map>
+#include "store/store_local.h"
+
+using namespace difacto;
+
+/** \brief w += data, and an update is slow */
+class SumUpdater : public Updater {
+ public:
+  KWArgs Init(const KWArgs& kwargs) override { return kwargs; }
+  void Load(dmlc::Stream* fi, bool* has_aux) override { }
+  void Save(bool save_aux, dmlc::Stream *fo) const override { }
+  void Get(const SArray<feaid_t>& fea_ids, int data_type,
+           SArray<real_t>* data, SArray<int>* data_offset) override {
+    data->resize(fea_ids.size());
+    for (size_t i = 0; i < fea_ids.size(); ++i) (*data)[i] = model_[fea_ids[i]];
+  }
+  void Update(const SArray<feaid_t>& fea_ids, int data_type,
+              const SArray<real_t>& data,
+              const SArray<int>& data_offset) override {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    for (size_t i = 0; i < fea_ids.size(); ++i) model_[fea_ids[i]] += data[i];
+  }
+ private:
+  std::unordered_map<feaid_t, real_t> model_;
+};
+
+TEST(StoreLocal, PushPull) {
+  for (int async = 0; async < 2; ++async) {
+    StoreLocal store;
+    store.SetUpdater(std::make_shared<SumUpdater>());
+    auto remain = store.Init({{"store_async", std::to_string(async)}});
+    EXPECT_EQ(remain.size(), 0);
+
+    SArray<feaid_t> keys = {1, 3, 5};
+    SArray<real_t> vals = {1, 2, 3};
+    std::atomic<int> ncalls{0};
+    int n = 20;
+    for (int i = 0; i < n; ++i) {
+      store.Push(keys, Store::kGradient, vals, {}, [&ncalls]() { ++ncalls; });
+    }
+    // a pull sees all pushes issued before it
+    SArray<real_t> pulled;
+    int t = store.Pull(keys, Store::kWeight, &pulled, nullptr,
+                       [&ncalls]() { ++ncalls; });
+    store.Wait(t);
+    EXPECT_EQ(ncalls, n + 1);
+    ASSERT_EQ(pulled.size(), keys.size());
+    for (size_t i = 0; i < keys.size(); ++i) EXPECT_EQ(pulled[i], vals[i] * n);
+  }
+}
+
+TEST(StoreLocal, Async) {
+  // push returns before the update is done, and a pull can be issued in a
+  // callback
+  StoreLocal store;
+  store.SetUpdater(std::make_shared<SumUpdater>());
+  store.Init({});
+  SArray<feaid_t> keys = {1};
+  SArray<real_t> vals = {1};
+  std::atomic<int> t_pull{-1};
+  SArray<real_t> pulled;
+  std::atomic<bool> pushed{false};
+  int t = store.Push(keys, Store::kGradient, vals, {}, [&]() {
+      t_pull = store.Pull(keys, Store::kWeight, &pulled, nullptr, nullptr);
+      pushed = true;
+    });
+  EXPECT_FALSE(pushed);
+  store.Wait(t);
+  EXPECT_TRUE(pushed);
+  store.Wait(t_pull);
+  ASSERT_EQ(pulled.size(), 1);
+  EXPECT_EQ(pulled[0], 1);
+}
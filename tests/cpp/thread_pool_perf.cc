@@ -0,0 +1,141 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#include <list>
+#include "common/arg_parser.h"
+#include "common/thread_pool.h"
+#include "dmlc/config.h"
+#include "dmlc/parameter.h"
+#include "dmlc/timer.h"
+
+using namespace difacto;
+using namespace dmlc;
+
+struct Param : public Parameter<Param> {
+  int nthreads;
+  int num_jobs;
+  int job_size;
+  DMLC_DECLARE_PARAMETER(Param) {
+    DMLC_DECLARE_FIELD(nthreads).set_default(2).describe("number of threads");
+    DMLC_DECLARE_FIELD(num_jobs).set_default(1000000).describe("number of jobs");
+    DMLC_DECLARE_FIELD(job_size).set_default(100).describe(
+        "the number of flops of a job");
+  }
+};
+
+DMLC_REGISTER_PARAMETER(Param);
+
+/**
+ * \brief the previous pool, a single queue protected by a mutex
+ */
+class MutexThreadPool {
+ public:
+  explicit MutexThreadPool(int num_workers, size_t max_capacity = 1000000)
+      : capacity_(max_capacity) {
+    for (int i = 0; i < num_workers; ++i) {
+      workers_.push_back(std::thread([this, i](){ RunWorker(i); }));
+    }
+  }
+  ~MutexThreadPool() {
+    Wait();
+    {
+      std::lock_guard<std::mutex> lk(mu_);
+      done_ = true;
+    }
+    add_cond_.notify_all();
+    for (auto& w : workers_) w.join();
+  }
+  void Add(const std::function<void(int tid)>& job) {
+    std::unique_lock<std::mutex> lk(mu_);
+    fin_cond_.wait(lk, [this]{ return tasks_.size() < capacity_; });
+    tasks_.push_back(job);
+    add_cond_.notify_one();
+  }
+  void Wait() {
+    std::unique_lock<std::mutex> lk(mu_);
+    fin_cond_.wait(lk, [this]{ return num_running_ == 0 && tasks_.empty(); });
+  }
+
+ private:
+  void RunWorker(int tid) {
+    std::unique_lock<std::mutex> lk(mu_);
+    while (true) {
+      add_cond_.wait(lk, [this]{ return done_ || !tasks_.empty(); });
+      if (done_) break;
+      auto task = std::move(tasks_.front());
+      tasks_.pop_front();
+      ++num_running_;
+      lk.unlock();
+      task(tid);
+      lk.lock();
+      --num_running_;
+      fin_cond_.notify_all();
+    }
+  }
+  int num_running_ = 0;
+  bool done_ = false;
+  size_t capacity_;
+  std::mutex mu_;
+  std::condition_variable fin_cond_, add_cond_;
+  std::vector<std::thread> workers_;
+  std::list<std::function<void(int tid)>> tasks_;
+};
+
+/** \brief a job doing n flops, the result is kept to avoid being optimized */
+void Job(int n, std::atomic<int64_t>* res) {
+  double x = 1;
+  for (int i = 0; i < n; ++i) x = x * 1.000001 + 1e-9;
+  *res += static_cast<int64_t>(x);
+}
+
+/**
+ * \brief return the jobs per second, when the jobs are added by the main
+ * thread (flat) or by a few root jobs (nested)
+ */
+template <typename Pool>
+double Throughput(Pool* pool, const Param& param, bool nested) {
+  std::atomic<int64_t> res{0};
+  int n = param.num_jobs, size = param.job_size;
+  double start = GetTime();
+  if (nested) {
+    int nroots = 100;
+    for (int r = 0; r < nroots; ++r) {
+      pool->Add([pool, &res, n, size, nroots](int tid) {
+          for (int i = 0; i < n / nroots; ++i) {
+            pool->Add([&res, size](int tid) { Job(size, &res); });
+          }
+        });
+    }
+  } else {
+    for (int i = 0; i < n; ++i) pool->Add([&res, size](int tid) { Job(size, &res); });
+  }
+  pool->Wait();
+  CHECK_GT(res, 0);
+  return n / (GetTime() - start);
+}
+
+int main(int argc, char *argv[]) {
+  Param param;
+  if (argc < 2) {
+    LOG(ERROR) << "usage: ./thread_pool_perf key1=val1 key2=val2 ...\n\n"
+               << param.__DOC__();
+  }
+  ArgParser parser;
+  for (int i = 1; i < argc; ++i) parser.AddArg(argv[i]);
+  param.Init(parser.GetKWArgs());
+
+  for (int nested = 0; nested < 2; ++nested) {
+    double t1, t2;
+    {
+      MutexThreadPool pool(param.nthreads);
+      t1 = Throughput(&pool, param, nested);
+    }
+    {
+      ThreadPool pool(param.nthreads);
+      t2 = Throughput(&pool, param, nested);
+    }
+    LOG(INFO) << (nested ? "nested" : "flat") << " jobs/sec, mutex pool: " << t1
+              << ",\t work-stealing pool: " << t2;
+  }
+  return 0;
+}
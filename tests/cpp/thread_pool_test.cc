@@ -0,0 +1,158 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#include <gtest/gtest.h>
+#include <chrono>
+#include "dmlc/logging.h"
+#include "common/thread_pool.h"
+
+using namespace difacto;
+
+TEST(WorkStealingDeque, PushPopSteal) {
+  WorkStealingDeque<int> deque(1);
+  std::vector<int> data(100);
+  for (size_t i = 0; i < data.size(); ++i) {
+    data[i] = i; deque.Push(&data[i]);
+  }
+  // the owner pops the newest, while thieves steal the oldest
+  EXPECT_EQ(*deque.Pop(), 99);
+  EXPECT_EQ(*deque.Steal(), 0);
+  for (int i = 1; i < 99; ++i) EXPECT_EQ(*deque.Steal(), i);
+  EXPECT_TRUE(deque.Empty());
+  EXPECT_TRUE(deque.Pop() == nullptr);
+  EXPECT_TRUE(deque.Steal() == nullptr);
+}
+
+TEST(WorkStealingDeque, ConcurrentSteal) {
+  // every item is taken exactly once
+  int n = 100000, nthieves = 3;
+  std::vector<int> data(n);
+  std::vector<std::atomic<int>> taken(n);
+  for (auto& t : taken) t = 0;
+  WorkStealingDeque<int> deque;
+  std::atomic<bool> done{false};
+  std::vector<std::thread> thieves;
+  for (int k = 0; k < nthieves; ++k) {
+    thieves.push_back(std::thread([&]() {
+          while (!done || !deque.Empty()) {
+            int* x = deque.Steal();
+            if (x) ++taken[x - data.data()];
+          }
+        }));
+  }
+  for (int i = 0; i < n; ++i) {
+    deque.Push(&data[i]);
+    if (i % 3 == 0) {
+      int* x = deque.Pop();
+      if (x) ++taken[x - data.data()];
+    }
+  }
+  done = true;
+  for (auto& t : thieves) t.join();
+  for (int i = 0; i < n; ++i) EXPECT_EQ(taken[i], 1) << i;
+}
+
+TEST(ThreadPool, AddAndWait) {
+  ThreadPool pool(3, 10);
+  std::atomic<int> sum{0};
+  for (int i = 0; i < 1000; ++i) {
+    pool.Add([&sum, i](int tid) {
+        EXPECT_GE(tid, -1); EXPECT_LT(tid, 3);
+        sum += i;
+      });
+  }
+  pool.Wait();
+  EXPECT_EQ(sum, 999 * 1000 / 2);
+}
+
+TEST(ThreadPool, NestedAdd) {
+  // jobs added by the pool threads go to their own deques
+  ThreadPool pool(2);
+  std::atomic<int> cnt{0};
+  for (int i = 0; i < 10; ++i) {
+    pool.Add([&pool, &cnt](int tid) {
+        for (int j = 0; j < 100; ++j) pool.Add([&cnt](int tid) { ++cnt; });
+      });
+  }
+  pool.Wait();
+  EXPECT_EQ(cnt, 1000);
+}
+
+TEST(ThreadPool, WaitNewJobs) {
+  // the only thread is blocked until the job it added is finished, which is
+  // left to the waiting thread
+  ThreadPool pool(1);
+  std::atomic<bool> done{false};
+  pool.Add([&pool, &done](int tid) {
+      pool.Add([&done](int tid) { done = true; });
+      while (!done) std::this_thread::yield();
+    });
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  pool.Wait();
+  EXPECT_TRUE(done);
+}
+
+TEST(ThreadPool, ParallelFor) {
+  int n = 1000, max_par = 4;
+  std::vector<int> cnt(n);
+  std::vector<std::atomic<int>> busy(max_par);
+  for (auto& b : busy) b = 0;
+  ParallelFor(n, max_par, [&](int i, int tid) {
+      // a tid is used by only one thread at a time
+      EXPECT_EQ(busy[tid]++, 0);
+      // nested
+      std::atomic<int> inner{0};
+      ParallelFor(10, 2, [&inner](int j, int tid) { ++inner; });
+      cnt[i] = inner;
+      --busy[tid];
+    });
+  for (int i = 0; i < n; ++i) EXPECT_EQ(cnt[i], 10);
+}
+
+TEST(ThreadPool, ParallelSum) {
+  uint64_t n = 12345;
+  for (int nparts : {1, 3, 16}) {
+    double sum = ParallelSum<double>(Range(0, n), nparts, [](const Range& rg) {
+        double s = 0;
+        for (uint64_t i = rg.begin; i < rg.end; ++i) s += i;
+        return s;
+      });
+    EXPECT_EQ(sum, n * (n - 1) / 2);
+  }
+  EXPECT_EQ(ParallelSum<int>(Range(), 4, [](const Range& rg) { return 1; }), 0);
+}
+
+TEST(TaskGroup, MaxPending) {
+  TaskGroup group(2);
+  std::atomic<int> running{0}, cnt{0};
+  for (int i = 0; i < 100; ++i) {
+    group.Run([&]() {
+        EXPECT_LE(++running, 2);
+        ++cnt;
+        --running;
+      });
+  }
+  group.Wait();
+  EXPECT_EQ(cnt, 100);
+}
+
+TEST(ThreadPool, Numa) {
+  ThreadPool pool(4);
+  pool.BindNodes();
+  int nnodes = pool.num_nodes();
+  EXPECT_GE(nnodes, 1);
+  std::atomic<int> cnt{0};
+  for (int i = 0; i < 100; ++i) {
+    pool.Add([&cnt](int tid) { ++cnt; }, i % (nnodes + 1) - 1);
+  }
+  pool.Wait();
+  EXPECT_EQ(cnt, 100);
+
+  // every call runs once with the home nodes
+  ThreadPool::Get()->BindNodes();
+  int n = 1000;
+  std::vector<int> calls(n);
+  ParallelFor(n, 4, [&calls](int i, int tid) { ++calls[i]; },
+              [](int i) { return i % 3; });
+  for (int i = 0; i < n; ++i) EXPECT_EQ(calls[i], 1);
+}
@@ -0,0 +1,45 @@
+#!/bin/bash
+# launch a scheduler, servers and workers on the local machine, returns
+# nonzero if any of them failed
+#
+# usage: tests/local.sh num_servers num_workers bin [args...]
+# e.g.   tests/local.sh 2 3 build/difacto_tests --gtest_filter=Dist.*
+
+if [ $# -lt 3 ]; then
+    echo "usage: $0 num_servers num_workers bin [args...]"
+    exit -1
+fi
+
+export DMLC_NUM_SERVER=$1
+shift
+export DMLC_NUM_WORKER=$1
+shift
+bin=$1
+shift
+arg="$@"
+
+export DMLC_PS_ROOT_URI='127.0.0.1'
+export DMLC_PS_ROOT_PORT=${DMLC_PS_ROOT_PORT:-8000}
+
+pids=""
+export DMLC_ROLE='scheduler'
+${bin} ${arg} &
+pids="${pids} $!"
+
+export DMLC_ROLE='server'
+for ((i=0; i<${DMLC_NUM_SERVER}; ++i)); do
+    ${bin} ${arg} &
+    pids="${pids} $!"
+done
+
+export DMLC_ROLE='worker'
+for ((i=0; i<${DMLC_NUM_WORKER}; ++i)); do
+    ${bin} ${arg} &
+    pids="${pids} $!"
+done
+
+ret=0
+for pid in ${pids}; do
+    wait ${pid} || ret=1
+done
+exit ${ret}
@@ -7,6 +7,7 @@ fi
 
 if [ ${TASK} == "cpp-test" ]; then
     make -j4 test CXX=g++-4.8 ADD_CFLAGS=-coverage
-    cd build; ./difacto_tests
+    cd build; ./difacto_tests || exit $?
+    cd ..; tests/local.sh 2 3 build/difacto_tests --gtest_filter=Dist.*
     exit $?
 fi